@@ -0,0 +1,80 @@
+#!/bin/sh
+#
+# Checks the tables' results on a fixture tree: fs_du against du -b, fs_dupes
+# against files known to be copies, and the filesystem table's own handling
+# of constraints, order by ... limit, threads, snapshots and watch against
+# what SQLite makes of the same walk (see check.sql). Then checks that the
+# memory a walk takes goes with the depth of the tree, not its size.
+#
+#   sh check.sh [libvtable.so [sqlite3]]
+#
+# Linux only (du -b, watch, /proc). Exits non-zero if any check fails.
+
+LIB=${1:-./libvtable.so}
+SQLITE=${2:-sqlite3}
+
+FIXTURE=$(mktemp -d) || exit 1
+export FIXTURE
+OUTSIDE=$(mktemp -d) || exit 1
+trap 'rm -rf "$FIXTURE" "$OUTSIDE"' EXIT
+
+# The fixture: one and two are the same, link is one, big1 and big2 are the
+# same, big3 is big1 but for its last byte. huge and mid are the biggest.
+mkdir -p "$FIXTURE/a/b/deep" "$FIXTURE/c"
+printf 'hello\n' > "$FIXTURE/a/one"
+printf 'hello\n' > "$FIXTURE/c/two"
+ln "$FIXTURE/a/one" "$FIXTURE/a/link"
+: > "$FIXTURE/a/empty"
+: > "$FIXTURE/c/empty2"
+head -c 10000 /dev/zero > "$FIXTURE/a/b/big1"
+head -c 10000 /dev/zero > "$FIXTURE/c/big2"
+{ head -c 9999 /dev/zero; printf 'x'; } > "$FIXTURE/c/big3"
+head -c 30000 /dev/zero > "$FIXTURE/c/huge"
+head -c 20000 /dev/urandom > "$FIXTURE/a/b/mid"
+
+# A file no query on the fixture walks past, for an inode lookup.
+: > "$OUTSIDE/elsewhere"
+
+out=$( {
+    echo ".load $LIB fs_register"
+    echo ".parameter init"
+    echo "insert into temp.sqlite_parameters values (':root', '$FIXTURE');"
+    echo "insert into temp.sqlite_parameters values" \
+         "(':outside', $(stat -c %i "$OUTSIDE/elsewhere"));"
+    echo "create temp table du_expected(path text, size int);"
+    du -b "$FIXTURE" | while read size path; do
+        echo "insert into du_expected values ('$path', $size);"
+    done
+    cat "$(dirname "$0")/check.sql"
+} | "$SQLITE" :memory: 2>&1 )
+
+echo "$out"
+
+# Peak memory of a walk of a tree of n directories, in kB.
+walk_peak()
+{
+    rm -rf "$FIXTURE/tree"
+    mkdir "$FIXTURE/tree"
+    (cd "$FIXTURE/tree" && seq 1 "$1" | sed 's,^,d/,' | xargs mkdir -p d)
+
+    {
+        echo ".load $LIB fs_register"
+        echo "create virtual table temp.fs using filesystem;"
+        echo "select count(*) from fs where path match '$FIXTURE/tree' and size < 0;"
+        echo ".system grep VmHWM /proc/\$PPID/status"
+    } | "$SQLITE" :memory: | sed -n 's/^VmHWM:[[:space:]]*\([0-9]*\).*/\1/p'
+}
+
+small=$(walk_peak 1000)
+large=$(walk_peak 20000)
+
+if [ -n "$small" ] && [ -n "$large" ] && [ $((large - small)) -lt 4096 ]; then
+    echo "ok: walk memory (1000 directories: ${small} kB, 20000: ${large} kB)"
+else
+    echo "FAIL: walk memory (1000 directories: ${small} kB, 20000: ${large} kB)"
+    out="$out FAIL"
+fi
+
+case "$out" in
+    *FAIL*|*Error*|*error*) exit 1 ;;
+esac
@@ -0,0 +1,146 @@
+-- Checks of the tables' results against the fixture tree check.sh makes. It
+-- loads the extension and sets up what this needs before it runs:
+--
+--   :root                    parameter: the fixture tree
+--   :outside                 parameter: the inode of a file outside it
+--   du_expected(path, size)  what du -b says of every directory in it
+--
+-- Every check prints a line, ok or FAIL, and its name.
+
+-- The filesystem table: serial, with threads, and with a snapshot.
+create virtual table temp.fs using filesystem;
+create virtual table temp.fs4 using filesystem('threads=4');
+create virtual table temp.snap using filesystem('cache=:memory:');
+
+-- fs_du, against du -b.
+
+select case when count(*) = (select count(*) from du_expected)
+            then 'ok' else 'FAIL' end || ': fs_du has a row for every directory'
+from fs_du(:root);
+
+select case when count(*) = 0 then 'ok' else 'FAIL' end
+       || ': fs_du size matches du -b'
+from du_expected e left join fs_du(:root) d on d.path = e.path
+where d.size is not e.size;
+
+-- one and its hard link are counted once.
+select case when files = 9 and dirs = 4 then 'ok' else 'FAIL' end
+       || ': fs_du files and dirs of the root'
+from fs_du(:root)
+where depth = 0;
+
+select case when count(*) = 2 then 'ok' else 'FAIL' end || ': fs_du maxdepth'
+from fs_du(:root, 1)
+where depth > 0;
+
+-- fs_dupes: one (and its link) and two are the same, and so are big1 and
+-- big2. big3 differs from them in its last byte only. Empty files are left
+-- out.
+
+select case when group_concat(name, ' ') = 'big1 big2 link two'
+            then 'ok' else 'FAIL' end || ': fs_dupes finds the copies'
+from ( select substr(path, length(rtrim(path, replace(path, '/', ''))) + 1)
+              as name
+       from fs_dupes(:root)
+       order by name );
+
+select case when count(*) = 4 and min(copies) = 2 and max(copies) = 2
+                 and count(distinct hash) = 2
+            then 'ok' else 'FAIL' end || ': fs_dupes copies and hashes'
+from fs_dupes(:root);
+
+select case when d.hash = f.hash_xxh3 then 'ok' else 'FAIL' end
+       || ': fs_dupes hash is the hash_xxh3 column'
+from fs_dupes(:root) d, fs f
+where f.path match :root || '/c' and f.name = 'two'
+      and d.path = f.path || '/two';
+
+-- Constraints the walk checks itself give the rows SQLite would.
+
+select case when (select group_concat(path || '/' || name) from fs
+                  where path match :root and name = 'one')
+                 = (select group_concat(path || '/' || name) from fs
+                    where path match :root and name || '' = 'one')
+            then 'ok' else 'FAIL' end || ': name = pushed down';
+
+select case when (select count(*) from fs
+                  where path match :root and name like 'big%')
+                 = (select count(*) from fs
+                    where path match :root and substr(name, 1, 3) = 'big')
+            then 'ok' else 'FAIL' end || ': name like pushed down';
+
+select case when (select count(*) from fs
+                  where path match :root and size > 100)
+                 = (select count(*) from fs
+                    where path match :root and size + 0 > 100)
+            then 'ok' else 'FAIL' end || ': size > pushed down';
+
+select case when (select count(*) from fs
+                  where path match :root and depth <= 1)
+                 = (select count(*) from fs
+                    where path match :root and depth + 0 <= 1)
+            then 'ok' else 'FAIL' end || ': depth <= pushed down';
+
+select case when count(*) = 3 then 'ok' else 'FAIL' end || ': limit pushed down'
+from (select * from fs where path match :root limit 3);
+
+select case when group_concat(name) = 'two' then 'ok' else 'FAIL' end
+       || ': inode lookup'
+from fs
+where inode = (select inode from fs where path match :root and name = 'two');
+
+-- Without a path, an inode is looked for under /, not just where the table
+-- has been.
+select case when group_concat(name) = 'elsewhere' then 'ok' else 'FAIL' end
+       || ': inode lookup outside the trees walked'
+from (select name from fs where inode = :outside limit 1);
+
+-- order by ... limit (top-K), against SQLite's sort of the whole walk. The
+-- table only takes a single column, and huge and mid are the two biggest,
+-- with sizes nothing else has.
+
+select case when (select group_concat(name) from
+                    (select name from fs where path match :root
+                     order by size desc limit 2))
+                 = 'huge,mid'
+                 and (select group_concat(name) from
+                      (select name from fs where path match :root
+                       order by size + 0 desc limit 2))
+                 = 'huge,mid'
+            then 'ok' else 'FAIL' end || ': order by size desc limit';
+
+-- The threaded walk and the snapshot give the same rows as the serial walk,
+-- in whatever order they come: the rows are sorted by SQLite, on an
+-- expression, so that neither table is asked for an order of its own.
+
+select case when (select group_concat(row) from
+                    (select path || '/' || name || ' ' || size as row
+                     from fs where path match :root order by row))
+                 = (select group_concat(row) from
+                    (select path || '/' || name || ' ' || size as row
+                     from fs4 where path match :root order by row))
+            then 'ok' else 'FAIL' end || ': threads=4 walk';
+
+insert into snap(refresh) values (:root);
+
+select case when (select group_concat(row) from
+                    (select path || '/' || name || ' ' || size as row
+                     from fs where path match :root order by row))
+                 = (select group_concat(row) from
+                    (select path || '/' || name || ' ' || size as row
+                     from snap where path match :root order by row))
+            then 'ok' else 'FAIL' end || ': snapshot rows';
+
+-- A watched table sees a file made after its first query (check.sh exports
+-- the fixture tree as FIXTURE, for the shell).
+create virtual table temp.w using filesystem('watch=true');
+
+select case when count(*) > 0 then 'ok' else 'FAIL' end
+       || ': watch walks the tree'
+from w where path match :root;
+
+.system touch "$FIXTURE/c/new"
+
+select case when count(*) = 1 then 'ok' else 'FAIL' end
+       || ': watch sees a new file'
+from w where path match :root and name = 'new';
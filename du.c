@@ -0,0 +1,707 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Apache Portable Runtime file info and threads, as in fs.c. */
+#include <apr-1.0/apr_file_io.h>
+#include <apr-1.0/apr_strings.h>
+#include <apr-1.0/apr_hash.h>
+#include <apr-1.0/apr_thread_proc.h>
+#include <apr-1.0/apr_thread_mutex.h>
+#include <apr-1.0/apr_thread_cond.h>
+#include <apr-1.0/apr_atomic.h>
+
+#ifdef UNIX
+/* POSIX regular expressions, which the walk's query keeps. */
+#include <regex.h>
+#endif
+
+#include <sqlite3ext.h>
+SQLITE_EXTENSION_INIT3
+
+/* The filesystem table, whose walker does the adding up. */
+#include "fsvtab.h"
+#include "du.h"
+
+/** fs_du is a table-valued function that adds up what is under each directory,
+ *  as du does: 
+ *
+ *    select * from fs_du('/var', 3);
+ *
+ *  gives a row for every directory under /var, three levels down at most,
+ *  with the size, blocks, files and subdirectories of everything under it,
+ *  however deep. The rows come sorted by path.
+ *
+ *  The sums are made in the parallel walker (see du_scan()): each directory
+ *  adds up its own entries, and once its subdirectories are all done, hands
+ *  its totals to its parent. No rows are made for the files at all. A file
+ *  with more than one link is counted once.
+ *
+ *  It is also a module of its own, for other settings: 
+ *
+ *    create virtual table temp.du using fs_du(threads=16, backend=uring);
+ */
+
+static const char* du_ddl = "create table fs_du ("
+  "path   text, "           /* col 0 : path of the directory      */
+  "depth  int,  "           /* col 1 : levels below the root      */
+  "size   int,  "           /* col 2 : bytes, all the way down    */
+  "blocks int,  "           /* col 3 : 512-byte blocks allocated  */
+  "files  int,  "           /* col 4 : files (not directories)    */
+  "dirs   int,  "           /* col 5 : subdirectories             */
+  "root   text hidden, "    /* col 6 : directories to add up      */
+  "maxdepth int hidden "    /* col 7 : deepest directory reported */
+")";
+
+#define DU_COLUMN_ROOT     6
+#define DU_COLUMN_MAXDEPTH 7
+
+/* What idxNum says du_filter() was given. */
+#define DU_ROOT     1
+#define DU_MAXDEPTH 2
+
+/* Worker threads fs_du uses, unless it is told otherwise. */
+#define DU_THREADS 8
+
+/* What a directory's totals need of every entry. */
+#define DU_FIELDS (APR_FINFO_DIRENT|APR_FINFO_NAME|APR_FINFO_TYPE| \
+                   APR_FINFO_INODE|APR_FINFO_SIZE|APR_FINFO_CSIZE| \
+                   APR_FINFO_NLINK|APR_FINFO_DEV)
+
+/* The totals of a directory. */
+struct dunode
+{
+    /* The directory it is in (NULL for roots). */
+    struct dunode* parent;
+
+    /* NULL for a directory too deep to report. */
+    const char* path;
+    int depth;
+
+    /* One for the directory itself, until it has been read, and one for each
+     * subdirectory that isn't done yet. */
+    volatile apr_uint32_t pending;
+
+    sqlite3_int64 size;
+    sqlite3_int64 blocks;
+    sqlite3_int64 files;
+    sqlite3_int64 dirs;
+
+    /* Next spare node. */
+    struct dunode* next;
+};
+
+/* A walk's totals, and the rows they make. */
+struct du
+{
+    apr_pool_t* pool;
+
+    /* Guards everything but the pending counts, which the workers bump
+     * without it. Never held along with walker->lock. */
+    apr_thread_mutex_t* lock;
+
+    /* Deepest directory with a row, -1 for all. */
+    int maxdepth;
+
+    /* The (dev, inode) of every file with more than one link seen so far. */
+    apr_hash_t* links;
+
+    /* Nodes of directories that had no row, to be used again. */
+    struct dunode* spare;
+
+    /* The directories with rows, once done, and the current one. */
+    struct dunode** rows;
+    int nrows;
+    int rows_size;
+    int row;
+
+    /* Set if a row couldn't be kept for want of memory. */
+    int failed;
+};
+
+/* The key a file with more than one link is known by. */
+struct dulink
+{
+    apr_dev_t dev;
+    apr_ino_t inode;
+};
+
+/* A node for the directory at path, in parent. */
+static struct dunode* du_node( struct du* du, struct dunode* parent, 
+                               const char* path, int depth )
+{
+    struct dunode* node;
+
+    apr_thread_mutex_lock(du->lock);
+
+    if ((node = du->spare) != NULL)
+    {
+        du->spare = node->next;
+    }
+    else
+    {
+        node = apr_palloc(du->pool, sizeof(struct dunode));
+    }
+
+    node->parent  = parent;
+    node->path    = NULL;
+    node->depth   = depth;
+    node->pending = 1;
+    node->size    = 0;
+    node->blocks  = 0;
+    node->files   = 0;
+    node->dirs    = 0;
+    node->next    = NULL;
+
+    if (du->maxdepth < 0 || depth <= du->maxdepth)
+    {
+        node->path = apr_pstrdup(du->pool, path);
+    }
+
+    apr_thread_mutex_unlock(du->lock);
+
+    return node;
+}
+
+/* Add an entry to totals, unless it is a link to a file already counted. */
+static void du_add(struct du* du, struct dunode* totals, const apr_finfo_t* finfo)
+{
+    if (finfo->filetype != APR_DIR && finfo->nlink > 1)
+    {
+        struct dulink key;
+        struct dulink* seen;
+
+        memset(&key, 0, sizeof(key));
+        key.dev   = finfo->device;
+        key.inode = finfo->inode;
+
+        apr_thread_mutex_lock(du->lock);
+
+        if (apr_hash_get(du->links, &key, sizeof(key)) != NULL)
+        {
+            apr_thread_mutex_unlock(du->lock);
+
+            return;
+        }
+
+        seen  = apr_palloc(du->pool, sizeof(key));
+        *seen = key;
+        apr_hash_set(du->links, seen, sizeof(key), seen);
+
+        apr_thread_mutex_unlock(du->lock);
+    }
+
+    totals->size   += finfo->size;
+    totals->blocks += finfo->csize / 512;
+
+    if (finfo->filetype != APR_DIR)
+    {
+        totals->files += 1;
+    }
+}
+
+/** Done with node's own entries, whose totals are in own. Each directory that
+ *  this leaves with nothing pending, node and then up the tree, adds its
+ *  totals to its parent's, and goes into the rows if it has one.
+ */
+static void du_finish(struct du* du, struct dunode* node, const struct dunode* own)
+{
+    apr_thread_mutex_lock(du->lock);
+
+    node->size   += own->size;
+    node->blocks += own->blocks;
+    node->files  += own->files;
+    node->dirs   += own->dirs;
+
+    while (node != NULL && apr_atomic_dec32(&node->pending) == 0)
+    {
+        struct dunode* parent = node->parent;
+
+        if (parent != NULL)
+        {
+            parent->size   += node->size;
+            parent->blocks += node->blocks;
+            parent->files  += node->files;
+            parent->dirs   += node->dirs;
+        }
+
+        if (node->path == NULL)
+        {
+            node->next = du->spare;
+            du->spare  = node;
+        }
+        else if (du->nrows < du->rows_size)
+        {
+            du->rows[du->nrows++] = node;
+        }
+        else
+        {
+            int size = du->rows_size == 0 ? 64 : du->rows_size * 2;
+            struct dunode** rows = realloc(du->rows, size * sizeof(struct dunode*));
+
+            if (rows == NULL)
+            {
+                du->failed = 1;
+            }
+            else
+            {
+                du->rows      = rows;
+                du->rows_size = size;
+                du->rows[du->nrows++] = node;
+            }
+        }
+
+        node = parent;
+    }
+
+    apr_thread_mutex_unlock(du->lock);
+}
+
+/** The walker's task for fs_du: what walker_scan() does, but rather than make
+ *  rows, add up the directory's entries, and queue its subdirectories with
+ *  their parent's totals to add themselves to.
+ */
+void du_scan(struct walker_worker* self, struct walker_task* task)
+{
+    struct walker* w = self->w;
+    struct du* du    = w->du;
+    struct dunode own;
+    struct dunode* node;
+    apr_finfo_t dirent;
+    apr_finfo_t entry;
+    struct dirhandle dir;
+    apr_status_t rv;
+    int path_len = strlen(task->path);
+
+    memset(&own, 0, sizeof(own));
+
+    if (task->root != 0)
+    {
+        /* See note ZERO-FILL DIRENT in next_directory(). */
+        memset(&dirent, 0, sizeof(apr_finfo_t));
+
+        apr_stat(&dirent, task->path, w->wanted, self->pool);
+    }
+    else
+    {
+        dirent = task->dirent;
+    }
+
+    node = du_node(du, task->du_parent, task->path, task->depth);
+
+    /* The directory's own size counts too, as it does with du. A top-level
+     * file is a row of its own. */
+    if (dirent.filetype != APR_NOFILE)
+    {
+        du_add(du, &own, &dirent);
+    }
+
+    if (dirent.filetype != APR_DIR)
+    {
+        apr_pool_clear(self->pool);
+        du_finish(du, node, &own);
+
+        return;
+    }
+
+    if (open_directory( &dir, NULL, task->path, NULL, w->backend, self->ring,
+                        w->query, task->depth, self->pool ) != APR_SUCCESS)
+    {
+        fprintf(stderr, "Failed to open directory: %s\n", task->path);
+        apr_pool_clear(self->pool);
+        du_finish(du, node, &own);
+
+        return;
+    }
+
+    memset(&entry, 0, sizeof(apr_finfo_t));
+
+    /* See vt_next() about APR_INCOMPLETE. */
+    while ( walker_stopped(w) == 0 
+            && ( (rv = read_directory(&dir, &entry, w->wanted)) == APR_SUCCESS 
+                 || rv == APR_INCOMPLETE ) )
+    {
+        struct walker_task* child;
+
+        if (entry.filetype != APR_DIR)
+        {
+            du_add(du, &own, &entry);
+
+            continue;
+        }
+
+        /* Skip . and .. entries */
+        if ( strcmp(entry.name, ".") == 0 || strcmp(entry.name, "..") == 0 )
+        {
+            continue;
+        }
+
+        own.dirs += 1;
+
+        /* The subdirectory adds itself up, and then adds that to node. */
+        child = walker_new_task( task->path, path_len, &entry, 
+                                 dirent.inode, task->depth + 1 );
+
+        if (child != NULL)
+        {
+            child->du_parent = node;
+            apr_atomic_inc32(&node->pending);
+        }
+
+        if (child == NULL || walker_push_task(self, child) == 0)
+        {
+            fprintf(stderr, "Out of memory, skipping: %s/%s\n",
+                    task->path, entry.name);
+
+            if (child != NULL)
+            {
+                /* Can't reach zero: the directory itself still holds one. */
+                apr_atomic_dec32(&node->pending);
+
+                free(child->path);
+                free(child);
+            }
+        }
+    }
+
+    close_directory(&dir);
+    apr_pool_clear(self->pool);
+
+    du_finish(du, node, &own);
+}
+
+/* Free the cursor's totals, if it has any. */
+static void du_destroy(vtab_cursor *p_cur)
+{
+    if (p_cur->du != NULL)
+    {
+        free(p_cur->du->rows);
+        apr_pool_destroy(p_cur->du->pool);
+
+        p_cur->du = NULL;
+    }
+}
+
+/** A table that adds up a walk: fs_du, or fs_dupes (see dupes_filter()). Its
+ *  arguments are those of the filesystem table, but for the snapshot.
+ */
+int du_create( sqlite3 *db, int argc, const char *const*argv,
+               sqlite3_vtab **pp_vt, char **pzErr, const char* ddl )
+{
+    vtab* p_vt;
+
+    if ((p_vt = vt_new(db)) == NULL)
+    {
+        return SQLITE_NOMEM;
+    }
+
+    p_vt->threads = DU_THREADS;
+
+    if (parse_arguments(p_vt, argc, argv, pzErr) != SQLITE_OK)
+    {
+        vt_destructor(&p_vt->base);
+
+        return SQLITE_ERROR;
+    }
+
+    /* The sums are made by the workers: there have to be some. */
+    if (p_vt->threads < 1)
+    {
+        p_vt->threads = 1;
+    }
+
+    /* A snapshot has no blocks to add up (watch keeps one too). */
+    if (p_vt->cache != NULL)
+    {
+        *pzErr = sqlite3_mprintf("%s does not take a cache or watch", argv[0]);
+        vt_destructor(&p_vt->base);
+
+        return SQLITE_ERROR;
+    }
+
+    sqlite3_declare_vtab(db, ddl);
+
+    *pp_vt = &p_vt->base;
+
+    return SQLITE_OK;
+}
+
+static int du_connect( sqlite3 *db, void *p_aux,
+                       int argc, const char *const*argv,
+                       sqlite3_vtab **pp_vt, char **pzErr )
+{
+    return du_create(db, argc, argv, pp_vt, pzErr, du_ddl);
+}
+
+/** The root and maxdepth arguments are equality constraints on the hidden
+ *  columns. Without root, everything under / is added up. A plan that has
+ *  them, but can't use them, is no plan at all.
+ */
+static int du_best_index(sqlite3_vtab *tab, sqlite3_index_info *p_info)
+{
+    int root     = has_constraint(p_info, DU_COLUMN_ROOT, SQLITE_INDEX_CONSTRAINT_EQ);
+    int maxdepth = has_constraint(p_info, DU_COLUMN_MAXDEPTH, SQLITE_INDEX_CONSTRAINT_EQ);
+    int argc     = 0;
+    int i;
+
+    for (i = 0; i < p_info->nConstraint; i++)
+    {
+        int col = p_info->aConstraint[i].iColumn;
+
+        if ( p_info->aConstraint[i].usable == 0
+             && p_info->aConstraint[i].op == SQLITE_INDEX_CONSTRAINT_EQ
+             && ( (col == DU_COLUMN_ROOT && root < 0) 
+                  || (col == DU_COLUMN_MAXDEPTH && maxdepth < 0) ) )
+        {
+            return SQLITE_CONSTRAINT;
+        }
+    }
+
+    p_info->idxNum        = 0;
+    p_info->estimatedCost = ROWS_FILE_SYSTEM;
+
+    if (root >= 0)
+    {
+        p_info->aConstraintUsage[root].argvIndex = ++argc;
+        p_info->aConstraintUsage[root].omit      = 1;
+        p_info->idxNum       |= DU_ROOT;
+        p_info->estimatedCost = ROWS_TREE;
+    }
+
+    if (maxdepth >= 0)
+    {
+        p_info->aConstraintUsage[maxdepth].argvIndex = ++argc;
+        p_info->aConstraintUsage[maxdepth].omit      = 1;
+        p_info->idxNum |= DU_MAXDEPTH;
+    }
+
+    /* The rows come sorted by path. */
+    if ( p_info->nOrderBy == 1 && p_info->aOrderBy[0].iColumn == 0
+         && p_info->aOrderBy[0].desc == 0 )
+    {
+        p_info->orderByConsumed = 1;
+    }
+
+    return SQLITE_OK;
+}
+
+static int du_compare(const void* a, const void* b)
+{
+    return strcmp( (*(const struct dunode**)a)->path, 
+                   (*(const struct dunode**)b)->path );
+}
+
+/** Add up everything under the root paths (all at once: the first row is
+ *  the last to be done), and sort the rows by path.
+ */
+static int du_filter( sqlite3_vtab_cursor *p_vtc, 
+                      int idxNum, const char *idxStr,
+                      int argc, sqlite3_value **argv )
+{
+    vtab_cursor *p_cur = (vtab_cursor*)p_vtc;
+    vtab *p_vt         = (vtab*)p_vtc->pVtab;
+    struct du* du;
+    apr_pool_t* pool;
+    const char* root = "/";
+    int maxdepth     = p_vt->maxdepth;
+    int rc;
+
+    du_destroy(p_cur);
+
+    if (p_cur->search_paths != NULL)
+    {
+        free((void*)p_cur->search_paths);
+        p_cur->search_paths = NULL;
+    }
+
+    p_cur->eof = 0;
+
+    if ((idxNum & DU_ROOT) != 0)
+    {
+        root = (const char*)sqlite3_value_text(*argv++);
+    }
+
+    if ((idxNum & DU_MAXDEPTH) != 0)
+    {
+        maxdepth = sqlite3_value_type(*argv) == SQLITE_NULL 
+                   ? -1 : sqlite3_value_int(*argv);
+    }
+
+    /* A NULL root adds up nothing. */
+    if (root == NULL)
+    {
+        p_cur->eof = 1;
+
+        return SQLITE_OK;
+    }
+
+    if (apr_pool_create(&pool, p_cur->pool) != APR_SUCCESS)
+    {
+        return SQLITE_NOMEM;
+    }
+
+    du = apr_pcalloc(pool, sizeof(struct du));
+    du->pool     = pool;
+    du->maxdepth = maxdepth < 0 ? -1 : maxdepth;
+    du->links    = apr_hash_make(pool);
+
+    apr_thread_mutex_create(&du->lock, APR_THREAD_MUTEX_DEFAULT, pool);
+
+    p_cur->du           = du;
+    p_cur->search_paths = strdup(root);
+    p_cur->root_path    = p_cur->search_paths;
+    p_cur->wanted       = DU_FIELDS;
+    p_cur->backend      = p_vt->backend;
+    p_cur->left         = -1;
+    p_cur->count        = 0;
+
+    /* Every directory is read, however deep. Only the rows stop at maxdepth. */
+    query_reset(&p_cur->query);
+
+    /* Returns once the workers are done, as they make no rows. */
+    rc = walker_start(p_cur);
+    walker_destroy(p_cur);
+
+    if (rc != SQLITE_OK)
+    {
+        return rc;
+    }
+
+    if (du->failed != 0)
+    {
+        return SQLITE_NOMEM;
+    }
+
+    qsort(du->rows, du->nrows, sizeof(struct dunode*), du_compare);
+
+    du->row    = 0;
+    p_cur->eof = du->nrows == 0;
+
+    return SQLITE_OK;
+}
+
+static int du_next(sqlite3_vtab_cursor *cur)
+{
+    vtab_cursor *p_cur = (vtab_cursor*)cur;
+
+    if (++p_cur->du->row >= p_cur->du->nrows)
+    {
+        p_cur->eof = 1;
+    }
+
+    return SQLITE_OK;
+}
+
+static int du_column(sqlite3_vtab_cursor *cur, sqlite3_context *ctx, int col)
+{
+    vtab_cursor *p_cur = (vtab_cursor*)cur;
+    const struct dunode* node = p_cur->du->rows[p_cur->du->row];
+
+    switch (col)
+    {
+        case 0:
+        {
+            sqlite3_result_text(ctx, node->path, -1, SQLITE_TRANSIENT);
+            break;
+        }
+        case 1:
+        {
+            sqlite3_result_int(ctx, node->depth);
+            break;
+        }
+        case 2:
+        {
+            sqlite3_result_int64(ctx, node->size);
+            break;
+        }
+        case 3:
+        {
+            sqlite3_result_int64(ctx, node->blocks);
+            break;
+        }
+        case 4:
+        {
+            sqlite3_result_int64(ctx, node->files);
+            break;
+        }
+        case 5:
+        {
+            sqlite3_result_int64(ctx, node->dirs);
+            break;
+        }
+        case DU_COLUMN_ROOT:
+        {
+            sqlite3_result_text(ctx, p_cur->search_paths, -1, SQLITE_TRANSIENT);
+            break;
+        }
+        case DU_COLUMN_MAXDEPTH:
+        {
+            if (p_cur->du->maxdepth >= 0)
+            {
+                sqlite3_result_int(ctx, p_cur->du->maxdepth);
+            }
+            else
+            {
+                sqlite3_result_null(ctx);
+            }
+
+            break;
+        }
+    }
+
+    return SQLITE_OK;
+}
+
+/* The rows are numbered in path order. */
+static int du_rowid(sqlite3_vtab_cursor *cur, sqlite_int64 *p_rowid)
+{
+    *p_rowid = ((vtab_cursor*)cur)->du->row + 1;
+
+    return SQLITE_OK;
+}
+
+static int du_close(sqlite3_vtab_cursor *cur)
+{
+    du_destroy((vtab_cursor*)cur);
+
+    return vt_close(cur);
+}
+
+static sqlite3_module du_module = 
+{
+    0,                /* iVersion */
+    du_connect,       /* xCreate       - create a vtable */
+    du_connect,       /* xConnect      - associate a vtable with a connection */
+    du_best_index,    /* xBestIndex    - best index */
+    vt_disconnect,    /* xDisconnect   - disassociate a vtable with a connection */
+    vt_destroy,       /* xDestroy      - destroy a vtable */
+    vt_open,          /* xOpen         - open a cursor */
+    du_close,         /* xClose        - close a cursor */
+    du_filter,        /* xFilter       - configure scan constraints */
+    du_next,          /* xNext         - advance a cursor */
+    vt_eof,           /* xEof          - inidicate end of result set*/
+    du_column,        /* xColumn       - read data */
+    du_rowid,         /* xRowid        - read data */
+    NULL,             /* xUpdate       - write data */
+    NULL,             /* xBegin        - begin transaction */
+    NULL,             /* xSync         - sync transaction */
+    NULL,             /* xCommit       - commit transaction */
+    NULL,             /* xRollback     - rollback transaction */
+    NULL,             /* xFindFunction - function overloading */
+    NULL,             /* xRename       - function overloading */
+    NULL,             /* xSavepoint    - function overloading */
+    NULL,             /* xRelease      - function overloading */
+    NULL,             /* xRollbackto   - function overloading */
+#if SQLITE_VERSION_NUMBER >= 3026000
+    NULL,             /* xShadowName   - shadow table names */
+#endif
+#if SQLITE_VERSION_NUMBER >= 3044000
+    NULL,             /* xIntegrity    - integrity check */
+#endif
+};
+
+/* Register fs_du, from fs_register(). */
+int du_register(sqlite3* db)
+{
+    return sqlite3_create_module(db, "fs_du", &du_module, NULL);
+}
@@ -0,0 +1,6 @@
+#ifndef FS_DU_VTABLE_DECL
+#define FS_DU_VTABLE_DECL
+
+int du_register(sqlite3 *db);
+
+#endif
@@ -0,0 +1,724 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Apache Portable Runtime file info and threads, as in fs.c. */
+#include <apr-1.0/apr_file_io.h>
+#include <apr-1.0/apr_strings.h>
+#include <apr-1.0/apr_hash.h>
+#include <apr-1.0/apr_thread_proc.h>
+#include <apr-1.0/apr_thread_mutex.h>
+#include <apr-1.0/apr_thread_cond.h>
+#include <apr-1.0/apr_atomic.h>
+
+#ifdef UNIX
+/* POSIX regular expressions, which the walk's query keeps. */
+#include <regex.h>
+#endif
+
+#include <sqlite3ext.h>
+SQLITE_EXTENSION_INIT3
+
+/* XXH3, for the hashes of the ends of files. */
+#include "hash.h"
+
+/* The filesystem table, whose walker finds the files. */
+#include "fsvtab.h"
+#include "dupes.h"
+
+/** fs_dupes is a table-valued function that finds files with the same
+ *  content:
+ *
+ *    select * from fs_dupes('/home');
+ *
+ *  gives a row for every regular file under /home that has a copy, with the
+ *  XXH3 of its content and how many files have it, biggest files first.
+ *
+ *  It reads as little as it can, in stages:
+ *
+ *    1. The parallel walker finds the files, and they are sorted by size.
+ *       A file whose size no other file has can't have a copy. Neither can
+ *       an empty file, or another link to one already counted.
+ *
+ *    2. Of each of the rest, the first and last DUPES_PREFIX bytes are hashed
+ *       (all of it, if that's no more). Files whose size and prefix hash no
+ *       other file has are dropped.
+ *
+ *    3. The rest are hashed in full, through the table's hash cache (see
+ *       hash_file()), and those with the same size and hash are the copies.
+ *
+ *  Stages 2 and 3 read the files on a pool of threads, as many as the
+ *  table's threads argument (8 by default).
+ */
+
+static const char* dupes_ddl = "create table fs_dupes ("
+  "path   text, "       /* col 0 : path of the file              */
+  "size   int,  "       /* col 1 : size                          */
+  "hash   text, "       /* col 2 : XXH3 of the content           */
+  "copies int,  "       /* col 3 : files with the same content   */
+  "inode  int,  "       /* col 4 : inode                         */
+  "root   text hidden " /* col 5 : directories to look in        */
+")";
+
+#define DUPES_COLUMN_ROOT 5
+
+/* Bytes hashed at each end of a file in the second stage. */
+#define DUPES_PREFIX 4096
+
+/* What the first stage needs of every entry. */
+#define DUPES_FIELDS (APR_FINFO_DIRENT|APR_FINFO_NAME|APR_FINFO_TYPE| \
+                      APR_FINFO_INODE|APR_FINFO_SIZE|APR_FINFO_MTIME| \
+                      APR_FINFO_DEV)
+
+/* A file that may have a copy. */
+struct dupefile
+{
+    char* path;
+    struct hashkey key;
+
+    /* Hash of the ends (stage 2), then the content (stage 3). */
+    sqlite3_uint64 partial;
+    char hash[17];
+
+    /* Set once hash is that of the whole file. Cleared if it can't be read. */
+    int hashed;
+    int ok;
+
+    int copies;
+};
+
+/* The files, the stage they are in, and the rows they make. */
+struct dupes
+{
+    struct dupefile* files;
+    int nfiles;
+    int files_size;
+
+    /* The hash cache, for stage 3. */
+    struct hashcache* hash_cache;
+
+    /* The next file for a thread to take, and the stage it is in. */
+    volatile apr_uint32_t next;
+    int stage;
+
+    int row;
+};
+
+/* A thread reading files for a stage, and its memory for them. */
+struct dupes_worker
+{
+    struct dupes* d;
+    apr_thread_t* thread;
+    apr_pool_t* pool;
+};
+
+/* Stage 2: hash the ends of f, or all of it if it is small. */
+static void dupes_prefix(struct dupefile* f, apr_pool_t* pool)
+{
+    unsigned char buffer[2 * DUPES_PREFIX];
+    apr_pool_t* file_pool;
+    apr_file_t* file;
+    apr_size_t n = 0;
+    apr_size_t tail;
+    apr_off_t offset;
+    struct xxh3 h;
+
+    f->ok = 0;
+
+    if (apr_pool_create(&file_pool, pool) != APR_SUCCESS)
+    {
+        return;
+    }
+
+    if ( apr_file_open( &file, f->path, APR_FOPEN_READ, 
+                        APR_OS_DEFAULT, file_pool ) != APR_SUCCESS )
+    {
+        apr_pool_destroy(file_pool);
+
+        return;
+    }
+
+    if (f->key.size <= 2 * DUPES_PREFIX)
+    {
+        /* The whole file: that's the hash stage 3 would make. */
+        f->ok = apr_file_read_full(file, buffer, f->key.size, &n) == APR_SUCCESS;
+        f->hashed = 1;
+    }
+    else if (apr_file_read_full(file, buffer, DUPES_PREFIX, &n) == APR_SUCCESS)
+    {
+        offset = f->key.size - DUPES_PREFIX;
+
+        f->ok = apr_file_seek(file, APR_SET, &offset) == APR_SUCCESS
+                && apr_file_read_full( file, buffer + DUPES_PREFIX, 
+                                       DUPES_PREFIX, &tail ) == APR_SUCCESS;
+        n += tail;
+    }
+
+    apr_file_close(file);
+    apr_pool_destroy(file_pool);
+
+    if (f->ok == 0)
+    {
+        return;
+    }
+
+    xxh3_init(&h);
+    xxh3_update(&h, buffer, n);
+    f->partial = xxh3_digest(&h);
+
+    if (f->hashed != 0)
+    {
+        sprintf(f->hash, "%016llx", (unsigned long long)f->partial);
+    }
+}
+
+/* Stage 3: hash all of f. */
+static void dupes_content(struct dupes* d, struct dupefile* f, apr_pool_t* pool)
+{
+    struct filehash out;
+
+    if (f->hashed != 0)
+    {
+        return;
+    }
+
+    f->ok = hash_file(d->hash_cache, f->path, &f->key, HASH_XXH3, &out, pool);
+
+    /* A file that changed since it was found is not the file we compared. */
+    if (f->ok != 0 && out.key.size != f->key.size)
+    {
+        f->ok = 0;
+    }
+
+    memcpy(f->hash, out.xxh3, sizeof(f->hash));
+    f->hashed = 1;
+}
+
+/* Take files off the list for the stage until there are none left. */
+static void* APR_THREAD_FUNC dupes_thread(apr_thread_t* thread, void* data)
+{
+    struct dupes_worker* self = (struct dupes_worker*)data;
+    struct dupes* d = self->d;
+    apr_uint32_t i;
+
+    while ((i = apr_atomic_inc32(&d->next)) < (apr_uint32_t)d->nfiles)
+    {
+        if (d->stage == 2)
+        {
+            dupes_prefix(&d->files[i], self->pool);
+        }
+        else
+        {
+            dupes_content(d, &d->files[i], self->pool);
+        }
+
+        apr_pool_clear(self->pool);
+    }
+
+    if (thread != NULL)
+    {
+        apr_thread_exit(thread, APR_SUCCESS);
+    }
+
+    return NULL;
+}
+
+/** Run a stage over every file, on nthreads threads: the cursor's own, and
+ *  as many more as can be started.
+ */
+static void dupes_stage(vtab_cursor *p_cur, struct dupes* d, int stage, int nthreads)
+{
+    struct dupes_worker* workers;
+    apr_pool_t* pool;
+    apr_status_t rv;
+    int i;
+
+    if (apr_pool_create(&pool, p_cur->pool) != APR_SUCCESS)
+    {
+        return;
+    }
+
+    workers = apr_pcalloc(pool, nthreads * sizeof(struct dupes_worker));
+
+    d->stage = stage;
+    apr_atomic_set32(&d->next, 0);
+
+    /* Pools aren't to be made from more than one thread at a time. */
+    for (i = 0; i < nthreads; i++)
+    {
+        workers[i].d = d;
+        apr_pool_create(&workers[i].pool, pool);
+    }
+
+    for (i = 1; i < nthreads && i < d->nfiles; i++)
+    {
+        if (apr_thread_create( &workers[i].thread, NULL, dupes_thread, 
+                               &workers[i], pool ) != APR_SUCCESS)
+        {
+            workers[i].thread = NULL;
+        }
+    }
+
+    dupes_thread(NULL, &workers[0]);
+
+    for (i = 1; i < nthreads; i++)
+    {
+        if (workers[i].thread != NULL)
+        {
+            apr_thread_join(&rv, workers[i].thread);
+        }
+    }
+
+    apr_pool_destroy(pool);
+}
+
+/** Stage 1 order: by size, then by file, so links to a file are together,
+ *  then by path, so the link kept is always the same one.
+ */
+static int dupes_by_size(const void* a, const void* b)
+{
+    const struct dupefile* x = (const struct dupefile*)a;
+    const struct dupefile* y = (const struct dupefile*)b;
+
+    if (x->key.size != y->key.size)
+    {
+        return x->key.size < y->key.size ? -1 : 1;
+    }
+
+    if (x->key.dev != y->key.dev)
+    {
+        return x->key.dev < y->key.dev ? -1 : 1;
+    }
+
+    if (x->key.inode != y->key.inode)
+    {
+        return x->key.inode < y->key.inode ? -1 : 1;
+    }
+
+    return strcmp(x->path, y->path);
+}
+
+/* Stage 2 order: by size, then by prefix hash. */
+static int dupes_by_prefix(const void* a, const void* b)
+{
+    const struct dupefile* x = (const struct dupefile*)a;
+    const struct dupefile* y = (const struct dupefile*)b;
+
+    if (x->key.size != y->key.size)
+    {
+        return x->key.size < y->key.size ? -1 : 1;
+    }
+
+    return x->partial < y->partial ? -1 : x->partial > y->partial;
+}
+
+/* Stage 3 order, which is that of the rows: biggest first, by hash, by path. */
+static int dupes_by_hash(const void* a, const void* b)
+{
+    const struct dupefile* x = (const struct dupefile*)a;
+    const struct dupefile* y = (const struct dupefile*)b;
+    int c;
+
+    if (x->key.size != y->key.size)
+    {
+        return x->key.size > y->key.size ? -1 : 1;
+    }
+
+    if ((c = strcmp(x->hash, y->hash)) != 0)
+    {
+        return c;
+    }
+
+    return strcmp(x->path, y->path);
+}
+
+/** Keep only the files that compare() finds equal to another of them, and
+ *  free the rest. The files are sorted so that equal ones are together. One
+ *  that couldn't be read is no longer a candidate. copies is set to the number
+ *  of files each is equal to, itself included.
+ */
+static void dupes_keep( struct dupes* d, 
+                        int (*compare)(const void*, const void*) )
+{
+    int n = 0;
+    int i = 0;
+    int j;
+    int k;
+    int ok;
+
+    while (i < d->nfiles)
+    {
+        ok = 0;
+
+        for (j = i; j < d->nfiles && compare(&d->files[i], &d->files[j]) == 0; j++)
+        {
+            ok += d->files[j].ok != 0;
+        }
+
+        for (k = i; k < j; k++)
+        {
+            if (ok > 1 && d->files[k].ok != 0)
+            {
+                d->files[k].copies = ok;
+                d->files[n++]      = d->files[k];
+            }
+            else
+            {
+                free(d->files[k].path);
+            }
+        }
+
+        i = j;
+    }
+
+    d->nfiles = n;
+}
+
+/* Same size and prefix hash (stage 2), or same size and hash (stage 3). */
+static int dupes_same_prefix(const void* a, const void* b)
+{
+    const struct dupefile* x = (const struct dupefile*)a;
+    const struct dupefile* y = (const struct dupefile*)b;
+
+    return x->key.size != y->key.size || x->partial != y->partial;
+}
+
+static int dupes_same_hash(const void* a, const void* b)
+{
+    const struct dupefile* x = (const struct dupefile*)a;
+    const struct dupefile* y = (const struct dupefile*)b;
+
+    return x->key.size != y->key.size || strcmp(x->hash, y->hash) != 0;
+}
+
+static int dupes_same_size(const void* a, const void* b)
+{
+    return ((const struct dupefile*)a)->key.size 
+           != ((const struct dupefile*)b)->key.size;
+}
+
+/* Free the cursor's files, if it has any. */
+static void dupes_destroy(vtab_cursor *p_cur)
+{
+    struct dupes* d = p_cur->dupes;
+    int i;
+
+    if (d != NULL)
+    {
+        for (i = 0; i < d->nfiles; i++)
+        {
+            free(d->files[i].path);
+        }
+
+        free(d->files);
+        free(d);
+
+        p_cur->dupes = NULL;
+    }
+}
+
+/* Stage 1: the regular files the walker finds, but for extra links. */
+static int dupes_collect(vtab_cursor *p_cur, struct dupes* d)
+{
+    int rc;
+    int i;
+    int n = 0;
+
+    /* Returns with the first batch of rows. */
+    if ((rc = walker_start(p_cur)) != SQLITE_OK)
+    {
+        return rc;
+    }
+
+    while (p_cur->eof == 0)
+    {
+        const struct filerow* row = &p_cur->batch->rows[p_cur->row];
+        const char* text          = p_cur->batch->text;
+        struct dupefile* f;
+
+        if (ROW_VALUE(row, COLUMN_TYPE) != APR_REG || ROW_VALUE(row, 3) == 0)
+        {
+            walker_next(p_cur);
+            continue;
+        }
+
+        if (d->nfiles == d->files_size)
+        {
+            int size = d->files_size == 0 ? 1024 : d->files_size * 2;
+            struct dupefile* files = realloc(d->files, size * sizeof(struct dupefile));
+
+            if (files == NULL)
+            {
+                return SQLITE_NOMEM;
+            }
+
+            d->files      = files;
+            d->files_size = size;
+        }
+
+        f = &d->files[d->nfiles];
+        memset(f, 0, sizeof(struct dupefile));
+
+        f->key.dev   = ROW_VALUE(row, 10); /* dev   */
+        f->key.inode = ROW_VALUE(row, 12); /* inode */
+        f->key.mtime = ROW_VALUE(row, 7);  /* mtime */
+        f->key.size  = ROW_VALUE(row, 3);  /* size  */
+        f->ok        = 1;
+        f->path      = hash_path( text + row->name, row->name_len, 
+                                  text + row->path, row->path_len );
+
+        if (f->path == NULL)
+        {
+            return SQLITE_NOMEM;
+        }
+
+        d->nfiles += 1;
+
+        walker_next(p_cur);
+    }
+
+    walker_destroy(p_cur);
+
+    qsort(d->files, d->nfiles, sizeof(struct dupefile), dupes_by_size);
+
+    /* Another link to the same file is no copy of it. */
+    for (i = 0; i < d->nfiles; i++)
+    {
+        if ( n > 0 && d->files[n - 1].key.dev == d->files[i].key.dev 
+             && d->files[n - 1].key.inode == d->files[i].key.inode )
+        {
+            free(d->files[i].path);
+            continue;
+        }
+
+        d->files[n++] = d->files[i];
+    }
+
+    d->nfiles = n;
+
+    dupes_keep(d, dupes_same_size);
+
+    return SQLITE_OK;
+}
+
+/** Find the copies under the root paths, stage by stage (see the top of this
+ *  section), and sort them into rows.
+ */
+static int dupes_filter( sqlite3_vtab_cursor *p_vtc, 
+                         int idxNum, const char *idxStr,
+                         int argc, sqlite3_value **argv )
+{
+    vtab_cursor *p_cur = (vtab_cursor*)p_vtc;
+    vtab *p_vt         = (vtab*)p_vtc->pVtab;
+    const char* root   = "/";
+    struct dupes* d;
+    int rc;
+
+    dupes_destroy(p_cur);
+
+    if (p_cur->search_paths != NULL)
+    {
+        free((void*)p_cur->search_paths);
+        p_cur->search_paths = NULL;
+    }
+
+    p_cur->eof = 0;
+
+    if (argc > 0)
+    {
+        root = (const char*)sqlite3_value_text(argv[0]);
+    }
+
+    /* A NULL root has no files. */
+    if (root == NULL)
+    {
+        p_cur->eof = 1;
+
+        return SQLITE_OK;
+    }
+
+    if ((d = calloc(1, sizeof(struct dupes))) == NULL)
+    {
+        return SQLITE_NOMEM;
+    }
+
+    p_cur->dupes = d;
+
+    if ((d->hash_cache = hash_cache(p_vt)) == NULL)
+    {
+        return SQLITE_NOMEM;
+    }
+
+    p_cur->search_paths = strdup(root);
+    p_cur->root_path    = p_cur->search_paths;
+    p_cur->wanted       = DUPES_FIELDS;
+    p_cur->backend      = p_vt->backend;
+    p_cur->left         = -1;
+    p_cur->count        = 0;
+
+    query_reset(&p_cur->query);
+
+    if ((rc = dupes_collect(p_cur, d)) != SQLITE_OK)
+    {
+        walker_destroy(p_cur);
+
+        return rc;
+    }
+
+    dupes_stage(p_cur, d, 2, p_vt->threads);
+    qsort(d->files, d->nfiles, sizeof(struct dupefile), dupes_by_prefix);
+    dupes_keep(d, dupes_same_prefix);
+
+    dupes_stage(p_cur, d, 3, p_vt->threads);
+    qsort(d->files, d->nfiles, sizeof(struct dupefile), dupes_by_hash);
+    dupes_keep(d, dupes_same_hash);
+
+    d->row     = 0;
+    p_cur->eof = d->nfiles == 0;
+
+    return SQLITE_OK;
+}
+
+/* The root argument is an equality constraint on the hidden column. */
+static int dupes_best_index(sqlite3_vtab *tab, sqlite3_index_info *p_info)
+{
+    int root = has_constraint(p_info, DUPES_COLUMN_ROOT, SQLITE_INDEX_CONSTRAINT_EQ);
+    int i;
+
+    for (i = 0; i < p_info->nConstraint; i++)
+    {
+        if ( p_info->aConstraint[i].usable == 0 && root < 0
+             && p_info->aConstraint[i].op == SQLITE_INDEX_CONSTRAINT_EQ
+             && p_info->aConstraint[i].iColumn == DUPES_COLUMN_ROOT )
+        {
+            return SQLITE_CONSTRAINT;
+        }
+    }
+
+    p_info->idxNum        = 0;
+    p_info->estimatedCost = ROWS_FILE_SYSTEM;
+
+    if (root >= 0)
+    {
+        p_info->aConstraintUsage[root].argvIndex = 1;
+        p_info->aConstraintUsage[root].omit      = 1;
+        p_info->estimatedCost = ROWS_TREE;
+    }
+
+    return SQLITE_OK;
+}
+
+static int dupes_connect( sqlite3 *db, void *p_aux,
+                          int argc, const char *const*argv,
+                          sqlite3_vtab **pp_vt, char **pzErr )
+{
+    return du_create(db, argc, argv, pp_vt, pzErr, dupes_ddl);
+}
+
+static int dupes_next(sqlite3_vtab_cursor *cur)
+{
+    vtab_cursor *p_cur = (vtab_cursor*)cur;
+
+    if (++p_cur->dupes->row >= p_cur->dupes->nfiles)
+    {
+        p_cur->eof = 1;
+    }
+
+    return SQLITE_OK;
+}
+
+static int dupes_column(sqlite3_vtab_cursor *cur, sqlite3_context *ctx, int col)
+{
+    vtab_cursor *p_cur = (vtab_cursor*)cur;
+    const struct dupefile* f = &p_cur->dupes->files[p_cur->dupes->row];
+
+    switch (col)
+    {
+        case 0:
+        {
+            sqlite3_result_text(ctx, f->path, -1, SQLITE_TRANSIENT);
+            break;
+        }
+        case 1:
+        {
+            sqlite3_result_int64(ctx, f->key.size);
+            break;
+        }
+        case 2:
+        {
+            sqlite3_result_text(ctx, f->hash, -1, SQLITE_TRANSIENT);
+            break;
+        }
+        case 3:
+        {
+            sqlite3_result_int(ctx, f->copies);
+            break;
+        }
+        case 4:
+        {
+            sqlite3_result_int64(ctx, f->key.inode);
+            break;
+        }
+        case DUPES_COLUMN_ROOT:
+        {
+            sqlite3_result_text(ctx, p_cur->search_paths, -1, SQLITE_TRANSIENT);
+            break;
+        }
+    }
+
+    return SQLITE_OK;
+}
+
+/* The rows are numbered in the order they come. */
+static int dupes_rowid(sqlite3_vtab_cursor *cur, sqlite_int64 *p_rowid)
+{
+    *p_rowid = ((vtab_cursor*)cur)->dupes->row + 1;
+
+    return SQLITE_OK;
+}
+
+static int dupes_close(sqlite3_vtab_cursor *cur)
+{
+    dupes_destroy((vtab_cursor*)cur);
+
+    return vt_close(cur);
+}
+
+static sqlite3_module dupes_module = 
+{
+    0,                /* iVersion */
+    dupes_connect,    /* xCreate       - create a vtable */
+    dupes_connect,    /* xConnect      - associate a vtable with a connection */
+    dupes_best_index, /* xBestIndex    - best index */
+    vt_disconnect,    /* xDisconnect   - disassociate a vtable with a connection */
+    vt_destroy,       /* xDestroy      - destroy a vtable */
+    vt_open,          /* xOpen         - open a cursor */
+    dupes_close,      /* xClose        - close a cursor */
+    dupes_filter,     /* xFilter       - configure scan constraints */
+    dupes_next,       /* xNext         - advance a cursor */
+    vt_eof,           /* xEof          - inidicate end of result set*/
+    dupes_column,     /* xColumn       - read data */
+    dupes_rowid,      /* xRowid        - read data */
+    NULL,             /* xUpdate       - write data */
+    NULL,             /* xBegin        - begin transaction */
+    NULL,             /* xSync         - sync transaction */
+    NULL,             /* xCommit       - commit transaction */
+    NULL,             /* xRollback     - rollback transaction */
+    NULL,             /* xFindFunction - function overloading */
+    NULL,             /* xRename       - function overloading */
+    NULL,             /* xSavepoint    - function overloading */
+    NULL,             /* xRelease      - function overloading */
+    NULL,             /* xRollbackto   - function overloading */
+#if SQLITE_VERSION_NUMBER >= 3026000
+    NULL,             /* xShadowName   - shadow table names */
+#endif
+#if SQLITE_VERSION_NUMBER >= 3044000
+    NULL,             /* xIntegrity    - integrity check */
+#endif
+};
+
+/* Register fs_dupes, from fs_register(). */
+int dupes_register(sqlite3* db)
+{
+    return sqlite3_create_module(db, "fs_dupes", &dupes_module, NULL);
+}
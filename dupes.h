@@ -0,0 +1,6 @@
+#ifndef FS_DUPES_VTABLE_DECL
+#define FS_DUPES_VTABLE_DECL
+
+int dupes_register(sqlite3 *db);
+
+#endif
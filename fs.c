@@ -1,29 +1,202 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdarg.h>
 
 /* Apache Portable Runtime file info.*/
 #include <apr-1.0/apr_file_io.h>
+#include <apr-1.0/apr_strings.h>
+#include <apr-1.0/apr_hash.h>
+
+/* Apache Portable Runtime threads, used by the parallel walker. */
+#include <apr-1.0/apr_thread_proc.h>
+#include <apr-1.0/apr_thread_mutex.h>
+#include <apr-1.0/apr_thread_cond.h>
+#include <apr-1.0/apr_atomic.h>
+
+#ifdef UNIX
+/* POSIX regular expressions, for name regexp '...' */
+#include <regex.h>
+
+/* File system statistics, for the query planner. */
+#include <sys/statvfs.h>
+#endif
+
+#ifdef LINUX
+/* Native directory access: openat(), getdents64() and statx(). */
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+
+/* Directory change notification, for the watch argument. */
+#include <sys/inotify.h>
+
+/* The descriptor of an APR file, to tell the kernel how it will be read. */
+#include <apr-1.0/apr_portable.h>
+
+/* Batched statx() through io_uring, where the kernel headers have it. */
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <sys/mman.h>
+#include <linux/io_uring.h>
+/* IORING_OP_STATX is an enum; IORING_FEAT_RW_CUR_POS came in the same
+ * release (5.6). */
+#if defined(IORING_FEAT_RW_CUR_POS) && defined(__NR_io_uring_setup) && defined(STATX_BASIC_STATS)
+#define HAVE_IO_URING 1
+#endif
+#endif
+#endif
+#endif
 
 #include <sqlite3ext.h>
 SQLITE_EXTENSION_INIT3
 
+/* XXH3 and SHA-256, for the hash columns. */
+#include "hash.h"
+
+/* The table's structures, shared with du.c and dupes.c. */
+#include "fsvtab.h"
+
+/* fs_du and fs_dupes, which are registered along with the table. */
+#include "du.h"
+#include "dupes.h"
+
 /** This file implements a SQLite virtual table that can read a file
  *  system. That is, the file system looks like a single table in SQLite. It
  *  uses the Apache Portable Runtime to interface with file system and/or OS.
  */
 
-typedef struct vtab vtab;
-typedef struct vtab_cursor vtab_cursor;
-typedef struct filenode filenode;
-
 /* Utility functions. */
 static void deallocate_filenode(struct filenode* p);
 static void deallocate_dirpath(vtab_cursor *p_cur);
+static struct filenode* allocate_filenode(vtab_cursor *p_cur);
+static void release_filenode(vtab_cursor *p_cur, struct filenode* p);
+static int reserve_path(vtab_cursor *p_cur, apr_size_t len);
+static apr_size_t append_path(vtab_cursor *p_cur, apr_size_t len, const char* name);
+static struct pathtext* cursor_path_text(vtab_cursor *p_cur);
+static int walk_path_len(vtab_cursor *p_cur);
+static void walk_row_text( vtab_cursor *p_cur, const char** name, int* name_len,
+                           const char** path, int* path_len );
+static void forget_path_text(vtab_cursor *p_cur);
+static void release_path_text(void* text);
 static int next_directory(vtab_cursor *p_cur);
 static struct filenode* move_up_directory(vtab_cursor *p_cur);
+static int next_entry(vtab_cursor *p_cur);
 static int next_directory(vtab_cursor *p_cur);
 static const char* file_type_name(int type);
 
+/* Directory access functions. */
+static struct statring* statring_create();
+static void statring_destroy(struct statring* r);
+
+/* Planner statistics functions. */
+static double walk_rows(vtab* p_vt, const char* list, double* level, int* cached);
+static double shallow_rows(const double* level, int depth);
+
+/* Query constraint functions. */
+static int query_add_name(struct query* q, const char* name);
+#if SQLITE_VERSION_NUMBER >= 3010000
+static int query_add_pattern( struct query* q, int op, const char* text, 
+                              char** pzErr );
+#endif
+static void query_finish(struct query* q);
+static int query_name_ok(const struct query* q, const char* name);
+static void query_limit_depth(struct query* q, int depth);
+static int query_add_prune(struct query* q, const char* list);
+static int query_pruned(const struct query* q, const char* path, const char* name);
+static const char* path_separator(const char* dir);
+static const char* root_name(const char* path, int path_len, int* name_len);
+static int root_dir_len(const char* path, int path_len);
+static char* next_search_path(const char** list, apr_pool_t* pool);
+static int depth_bound(int op, sqlite3_value* value);
+static int query_add_predicate( struct query* q, int column, int op, 
+                                sqlite3_value* value );
+static int query_row_ok( const struct query* q, const char* name, 
+                         const apr_finfo_t* finfo, apr_ino_t dir_inode );
+static int query_values_ok( const struct query* q, const char* name, 
+                            const struct filerow* row );
+static int predicate_op(char code);
+static int query_add_inode(struct query* q, sqlite3_value* value);
+static int query_inode_ok(const struct query* q, apr_ino_t inode);
+static sqlite3_int64 column_value( const apr_finfo_t* finfo, apr_ino_t dir_inode,
+                                   int col );
+static void row_values( struct filerow* row, const apr_finfo_t* finfo, 
+                        apr_ino_t dir_inode );
+static int used_columns(sqlite3_index_info *p_info);
+static apr_int32_t wanted_fields(int columns);
+
+/* Parallel walker functions. */
+static struct rowbatch* rowbatch_create();
+static struct filerow* rowbatch_append( struct rowbatch* b, int depth, 
+                                        const char* name, int name_len,
+                                        const char* path, int path_len );
+static int rowbatch_add( struct rowbatch* b, const apr_finfo_t* dirent, 
+                         apr_ino_t dir_inode, int depth, 
+                         const char* name, int name_len,
+                         const char* path, int path_len );
+static void rowbatch_free(struct rowbatch* b);
+
+/* Sorted walk functions. */
+static int sorted_start(vtab_cursor *p_cur, int order);
+static int sorted_next(vtab_cursor *p_cur);
+static struct filerow* sorted_row(vtab_cursor *p_cur, const char** text);
+static void sorted_destroy(vtab_cursor *p_cur);
+
+/* Top rows functions. */
+static struct toprows* top_create(int column, int desc, sqlite3_int64 limit);
+static int top_collect(vtab_cursor *p_cur, struct toprows* t);
+static struct filerow* top_row(vtab_cursor *p_cur, const char** text);
+static void top_destroy(vtab_cursor *p_cur);
+
+/* Inode index functions. */
+static struct inode_index* inode_index_create(apr_pool_t* pool);
+static void index_row(vtab_cursor *p_cur);
+static void index_walk(vtab_cursor *p_cur, int plain);
+static void index_walked(vtab_cursor *p_cur);
+static void lookup_inodes(vtab_cursor *p_cur);
+static int inode_index_covers( struct inode_index* ix, const char* list, 
+                               apr_pool_t* pool );
+
+/* Snapshot functions. */
+static int snapshot_open(vtab* p_vt, const char* file, char **pzErr);
+static sqlite3_int64 snapshot_root( vtab* p_vt, const char* path, int maxdepth,
+                                    double* level );
+static int snapshot_start( vtab_cursor *p_cur, int order, 
+                           int top_column, int top_desc, int* found );
+static int snapshot_next(vtab_cursor *p_cur);
+static void snapshot_destroy(vtab_cursor *p_cur);
+static int snapshot_refresh(vtab* p_vt, const char* list);
+
+/* Content hash functions. */
+static void hash_ahead( struct walker_worker* self, const apr_finfo_t* dirent, 
+                        const char* name, int name_len,
+                        const char* path, int path_len );
+static void hash_column( vtab_cursor *p_cur, const struct filerow* row, 
+                         const char* text, sqlite3_context* ctx, int col );
+
+/* Watcher functions. */
+struct watcher;
+struct refresh;
+static void watch_drop(struct watcher* w, sqlite3_int64 root, const char* path);
+static void watch_reset(struct watcher* w);
+static void watch_add( struct refresh* r, const char* path, int path_len, 
+                       sqlite3_int64 id, sqlite3_int64 parent, int depth,
+                       const struct filerow* row );
+static void watch_root(struct watcher* w, sqlite3_int64 id, const char* path);
+static int watch_serves(vtab* p_vt, const char* path);
+static int watch_update(vtab_cursor *p_cur);
+static void watch_destroy(vtab* p_vt);
+#ifdef LINUX
+static int watch_create(vtab* p_vt, char **pzErr);
+#endif
+
 /* DDL defining the structure of the virtual table. */
 static const char* ddl = "create table fs ("
   "name  text, "  /* col 0  : name             */
@@ -38,131 +211,132 @@ static const char* ddl = "create table fs ("
   "atime int,  "  /* col 9  : access time      */
   "dev   int,  "  /* col 10 : device           */
   "nlink int,  "  /* col 11 : number of links  */
-  "inode int   "  /* col 12 : dir inode        */
-  "dir   int   "  /* col 13 : dir inode        */
+  "inode int,  "  /* col 12 : inode            */
+  "dir   int,  "  /* col 13 : dir inode        */
+  "depth int hidden, "    /* col 14 : levels below the search path */
+  "maxdepth int hidden, " /* col 15 : deepest level searched       */
+  "prune text hidden, "   /* col 16 : directories left out         */
+  "refresh text hidden, " /* col 17 : search paths to refresh      */
+  "hash_xxh3 text hidden, "   /* col 18 : XXH3 of the content    */
+  "hash_sha256 text hidden "  /* col 19 : SHA-256 of the content */
 ")";
 
-/* TODO
-**
-** 1. Make constructor with recursive flag -- set to zero to create an ls
-**    implementation. Recursive will be find.
-**
-**      create virtual table find as using filesystem('recursive=true');
-**      create virtual table ls as using filesystem('recursive=false');
-**
-** 2. Add hidden field: prune or exclude. Then you can specify paths to ignore
-**
-** 3. Handle inode index case.
-**
-*/
-
-/* vtab: represents a virtual table. */
-struct vtab
-{
-    sqlite3_vtab base;
-    sqlite3 *db;
-    apr_pool_t* pool;
+/* How the rows of a sorted walk are ordered (idxNum, see vt_best_index()). */
+#define ORDER_PATH      (1 << 24) /* by path */
+#define ORDER_PATH_DESC (1 << 25) /* ... descending */
+#define ORDER_NAME      (1 << 26) /* and then by name */
+#define ORDER_NAME_DESC (1 << 27) /* ... descending */
+
+/* A row of a listing, by name. */
+struct sortkey
+{
+    const char* name;
+    int row;
 };
 
-/** filenode: represents a single file entry. It contains the APR machinery to
- *  point to a file entry (dirent), its encompassing directory (dir), and that
- *  directory's parent (parent). The full path of the directory is given by
- *  path.
+/** A directory in a sorted walk, and the rows that have its path: the
+ *  directory itself and its entries, other than its subdirectories, which
+ *  have listings of their own. A top-level file gets a listing too.
  */
-struct filenode
+struct listing
 {
-    struct filenode* parent;
+    /* The path of the rows is at the start of text, then their names. */
+    char* text;
+    apr_size_t text_used;
+    apr_size_t text_size;
+    int path_len;
+
+    /* Until it is opened, the directory's own row. */
+    int opened;
     apr_finfo_t dirent;
-    apr_dir_t *dir;    
-    char *path;
+    apr_ino_t dir_inode;
+    int depth;
+    apr_size_t name;
+    int name_len;
+
+    /* Its rows once it is opened, and the order they go in. */
+    struct filerow* rows;
+    int nrows;
+    int rows_size;
+    struct sortkey* keys;
+    int next;
 };
 
-/** vtab_cursor: represents a cursor used to iterate over a result set.
- *
- * The data structure arrangment is as follows: For any given SQL query on this
- * virtual table, we iterate over each value in the the search_paths
- * string. search_paths is a comma-delimited string of top-level directories to
- * search through.
-
- * root_path points to the current directory in search_paths that is being
- * searched. root_node is a filenode structure containing the APR stuff we need
- * to search root_path. root_node is potentially a linked list of subnodes --
- * one node for each child directory we descend into. As we descend into the
- * root_path, we add one filenode child for each directory level we descend into
- * (see diagram below).
- *
- * current_node points to the current directory we are searching (bottom of
- * filenode list).
- *
- * The search logic is simple: we start at the top directory (root_path) and
- * search entry by entry. When we find an entry that is a directory, we descend
- * into it and search it (add a child filenode, point current_node to it, and
- * keep searching). When we have searched through the directory, we pop the
- * filenode from the bottom of the list, point current_node to its parent, and
- * resume searching. We keep going until we have searched through all of
- * root_node. Then we update root_node to the next top-level directory in
- * search_path, and start over. We repeat for all directories in search_paths.
- *
- * For example, say we were handling the query:
- *
- *               SELECT * FROM filesystem 
- *               WHERE path match("/usr,/home,/var");
- *
- * Diagrammatically, the state of our cursor data structure when currently at
- * /usr/lib/firefox/icons/mozicon16.xpm would be as follows:
- *
- * "/usr,/home,/var" <== search_paths
- *    |
- *  root_path 
- *    |
- *  root_node --> filenode1<--+         -->     +- /usr
- *                            |                 |
- *                       filenode2<--+     -->   +--+- /lib
- *                                   |              |
- *                              filenode3<--+  -->   +--+- /firefox
- *                                          |           |
- *                    current_node --> filenode4  -->   +--+- /icons
- *                         |                               |
- *                         +-- dirent               -->    +-- mozicon16.xpm
- */
-
-struct vtab_cursor
-{
-    sqlite3_vtab_cursor base;
-    apr_pool_t* pool;
-    apr_pool_t* tmp_pool;
-    apr_status_t status;
-
-    /* String containing directories to search. This contains multiple values if
-     * SQL uses match operator on patch column -- SELECT * FROM fs WHERE path
-     * match '/home, /tmp'; Otherwise, this value is by default the root file
-     * system (/).
-     */
-    const char* search_paths; 
-
-    /* Points to the current path being searched in search_paths */
-    const char* root_path;
-
-    /* This filenode corresponds to the root_path*/
-    struct filenode* root_node;
+/** A walk that returns rows in order of path (see ORDER_PATH). Listings wait
+ *  in a heap, ordered by their path and next row. A directory is only opened
+ *  when it gets to the top, so the heap holds the directories still to come
+ *  next to the ones on the way down, not the whole tree.
+ */
+struct sortwalk
+{
+    int order;
+    struct listing** heap;
+    int nheap;
+    int heap_size;
 
-    /* This filenode corresponds to the child dir in root_path currently being
-     * searched.
-     */
-    struct filenode* current_node;
+    /* The listing the current row is from. */
+    struct listing* current;
+};
 
-    /* Number of rows searched. */
-    int count;
+/* A row kept by a top-K walk, with its own copy of its name and path. */
+struct toprow
+{
+    sqlite3_int64 key;
+    struct filerow row;
+    char* text;
+    apr_size_t text_size;
+};
 
-    /* Whether we have reached the end of the result set. */
-    int eof;
+/** The rows of a walk with the greatest (desc) or least values of a numeric
+ *  column, no more than limit of them (see vt_best_index()). While the walk
+ *  runs, they are kept in a heap with the row that would be dropped first at
+ *  the top. Once it is over, they are sorted into the order they are returned
+ *  in, and next is the current one.
+ */
+struct toprows
+{
+    int column;
+    int desc;
+    sqlite3_int64 limit;
+    struct toprow** heap;
+    int nheap;
+    int heap_size;
+    int next;
 };
 
 /*-------------------------------------------------------------------*/
 /* Virtual table functions                                           */
 /*-------------------------------------------------------------------*/
 
-static int vt_destructor(sqlite3_vtab *p_svt);
+/* A new vtab with every setting at its default. NULL if out of memory. */
+vtab* vt_new(sqlite3 *db)
+{
+    vtab* p_vt;
+
+    /* Allocate the sqlite3_vtab/vtab structure itself */
+    p_vt = (vtab*)sqlite3_malloc(sizeof(*p_vt));
+
+    if (p_vt == NULL)
+    {
+        return NULL;
+    }
+    
+    p_vt->db       = db;
+    p_vt->threads   = 0;
+    p_vt->readahead = 0;
+    p_vt->backend  = BACKEND_DEFAULT;
+    p_vt->maxdepth = -1;
+    p_vt->index    = NULL;
+    p_vt->stats    = NULL;
+    p_vt->cache    = NULL;
+    p_vt->rescan   = RESCAN_FULL;
+    p_vt->watcher  = NULL;
+    p_vt->hash_cache = NULL;
+    
+    apr_pool_create(&p_vt->pool, NULL);
+
+    return p_vt;
+}
 
 static int vt_create( sqlite3 *db,
                       void *pAux,
@@ -173,17 +347,18 @@ static int vt_create( sqlite3 *db,
     int rc = SQLITE_OK;
     vtab* p_vt;
 
-    /* Allocate the sqlite3_vtab/vtab structure itself */
-    p_vt = (vtab*)sqlite3_malloc(sizeof(*p_vt));
-
-    if (p_vt == NULL)
+    if ((p_vt = vt_new(db)) == NULL)
     {
         return SQLITE_NOMEM;
     }
-    
-    p_vt->db = db;
-    
-    apr_pool_create(&p_vt->pool, NULL);
+
+    /* Apply constructor arguments, if any. */
+    if (parse_arguments(p_vt, argc, argv, pzErr) != SQLITE_OK)
+    {
+        vt_destructor(&p_vt->base);
+
+        return SQLITE_ERROR;
+    }
 
     /* Declare the vtable's structure */
     rc = sqlite3_declare_vtab(db, ddl);
@@ -194,10 +369,18 @@ static int vt_create( sqlite3 *db,
     return SQLITE_OK;
 }
 
-static int vt_destructor(sqlite3_vtab *p_svt)
+int vt_destructor(sqlite3_vtab *p_svt)
 {
     vtab *p_vt = (vtab*)p_svt;
 
+    /* Stop watching, and close the snapshot, if there is one. */
+    watch_destroy(p_vt);
+
+    if (p_vt->cache != NULL)
+    {
+        sqlite3_close(p_vt->cache);
+    }
+
     /* Free the APR pool */
     apr_pool_destroy(p_vt->pool);
 
@@ -214,17 +397,17 @@ static int vt_connect( sqlite3 *db, void *p_aux,
     return vt_create(db, p_aux, argc, argv, pp_vt, pzErr);
 }
 
-static int vt_disconnect(sqlite3_vtab *pVtab)
+int vt_disconnect(sqlite3_vtab *pVtab)
 {
     return vt_destructor(pVtab);
 }
 
-static int vt_destroy(sqlite3_vtab *p_vt)
+int vt_destroy(sqlite3_vtab *p_vt)
 {
     return vt_destructor(p_vt);
 }
 
-static int vt_open(sqlite3_vtab *p_svt, sqlite3_vtab_cursor **pp_cursor)
+int vt_open(sqlite3_vtab *p_svt, sqlite3_vtab_cursor **pp_cursor)
 {
     vtab* p_vt         = (vtab*)p_svt;
     p_vt->base.zErrMsg = NULL;
@@ -236,24 +419,72 @@ static int vt_open(sqlite3_vtab *p_svt, sqlite3_vtab_cursor **pp_cursor)
 
     /* Initialize the root node */
 
-    p_cur->root_node         = malloc(sizeof(struct filenode));
-    p_cur->root_node->parent = NULL;
-    p_cur->root_node->path   = NULL;
-    p_cur->current_node      = p_cur->root_node;
+    p_cur->spare_nodes         = NULL;
+    p_cur->root_node           = allocate_filenode(p_cur);
+    p_cur->root_node->parent   = NULL;
+    p_cur->root_node->path_len = 0;
+    p_cur->root_node->dir      = NULL;
+    p_cur->root_node->depth    = 0;
+    p_cur->current_node        = p_cur->root_node;
+    p_cur->path                = NULL;
+    p_cur->path_size           = 0;
+    p_cur->path_text           = NULL;
     p_cur->search_paths      = NULL;
     p_cur->root_path         = 0;
+    p_cur->walker            = NULL;
+    p_cur->batch             = NULL;
+    p_cur->ring              = NULL;
+    p_cur->row               = 0;
+    p_cur->sorted            = NULL;
+    p_cur->top               = NULL;
+    p_cur->snapshot          = NULL;
+    p_cur->du                = NULL;
+    p_cur->dupes             = NULL;
+    p_cur->hashes            = 0;
+    p_cur->left              = -1;
+    p_cur->index_all         = 0;
+    p_cur->index_generation  = -1;
+
+    p_cur->query.names      = NULL;
+    p_cur->query.nnames     = 0;
+    p_cur->query.patterns   = NULL;
+    p_cur->query.npatterns  = 0;
+    p_cur->query.predicates = NULL;
+    p_cur->query.prune      = NULL;
+    p_cur->query.nprune     = 0;
+    p_cur->query.prune_list = NULL;
+    p_cur->query.inodes     = NULL;
+    query_reset(&p_cur->query);
 
     *pp_cursor = (sqlite3_vtab_cursor*)p_cur;
 
     return (p_cur ? SQLITE_OK : SQLITE_NOMEM);
 }
 
-static int vt_close(sqlite3_vtab_cursor *cur)
+int vt_close(sqlite3_vtab_cursor *cur)
 {
     vtab_cursor *p_cur = (vtab_cursor*)cur;
 
-    /* Free all filenodes, if any exist. */
+    /* Stop the walker threads, if any are running. */
+    walker_destroy(p_cur);
+    sorted_destroy(p_cur);
+    top_destroy(p_cur);
+    snapshot_destroy(p_cur);
+
+    /* Rows looked up by inode or read from the snapshot, if that's where they
+     * came from. */
+    if (p_cur->batch != NULL)
+    {
+        rowbatch_free(p_cur->batch);
+    }
+
+    /* Free all filenodes, if any exist, and the path. */
     deallocate_dirpath(p_cur);
+    forget_path_text(p_cur);
+    free(p_cur->path);
+
+    statring_destroy(p_cur->ring);
+    query_reset(&p_cur->query);
 
     /* Free the APR pools */
     apr_pool_destroy(p_cur->pool);
@@ -272,16 +503,205 @@ static int vt_close(sqlite3_vtab_cursor *cur)
     return SQLITE_OK;
 }
 
-static int vt_eof(sqlite3_vtab_cursor *cur)
+int vt_eof(sqlite3_vtab_cursor *cur)
 {
     return ((vtab_cursor*)cur)->eof;
 }
 
+/** The inode of the directory the current row is in (0 for top-level
+ *  rows). The row is either current_node's directory itself, or one of its
+ *  entries, one level deeper.
+ */
+static apr_ino_t row_dir_inode(vtab_cursor *p_cur)
+{
+    const struct filenode* d = p_cur->current_node;
+
+    if (p_cur->depth > d->depth)
+    {
+        return d->inode;
+    }
+
+    return d->parent != NULL ? d->parent->inode : 0;
+}
+
+/** The current row, when it is a copy (from the parallel walker, an inode
+ *  lookup, the snapshot, a sorted walk or a top-K walk) rather than the
+ *  serial walk's current_node. Its name and path are in text. NULL for the
+ *  serial walk.
+ */
+static struct filerow* cursor_row(vtab_cursor *p_cur, const char** text)
+{
+    if (p_cur->top != NULL)
+    {
+        return top_row(p_cur, text);
+    }
+
+    if (p_cur->batch != NULL)
+    {
+        *text = p_cur->batch->text;
+
+        return &p_cur->batch->rows[p_cur->row];
+    }
+
+    if (p_cur->sorted != NULL)
+    {
+        return sorted_row(p_cur, text);
+    }
+
+    return NULL;
+}
+
+/* Whether the current row gets past the query's constraints. */
+static int row_matches(vtab_cursor *p_cur)
+{
+    const apr_finfo_t* dirent = &p_cur->current_node->dirent;
+
+    return query_row_ok( &p_cur->query, 
+                         dirent->name != NULL ? dirent->name : dirent->fname,
+                         dirent, row_dir_inode(p_cur) );
+}
+
+/** row_matches(), for the serial walk. A row it steps over still goes in the
+ *  inode index, if the walk is filling that in (see lookup_inodes()).
+ */
+static int row_passes(vtab_cursor *p_cur)
+{
+    if (p_cur->index_all != 0)
+    {
+        index_row(p_cur);
+    }
+
+    return row_matches(p_cur);
+}
+
+/** The query the serial walk's directories leave entries out for, as they are
+ *  read: none, while the walk fills the inode index in.
+ */
+static const struct query* walk_query(vtab_cursor *p_cur)
+{
+    return p_cur->index_all != 0 ? NULL : &p_cur->query;
+}
+
+/* Moves the cursor to the next row of the walk that gets past the query. */
+static int walk_next(vtab_cursor *p_cur)
+{
+    int rc;
+
+    /* The parallel walker does its own traversal. We just take its rows. */
+    if (p_cur->walker != NULL)
+    {
+        return walker_next(p_cur);
+    }
+
+    /* So does the snapshot. */
+    if (p_cur->snapshot != NULL)
+    {
+        return snapshot_next(p_cur);
+    }
+
+    /* Step over the rows the query rules out. */
+    do
+    {
+        rc = next_entry(p_cur);
+    }
+    while (rc == SQLITE_OK && p_cur->eof == 0 && row_passes(p_cur) == 0);
+
+    return rc;
+}
+
+/** Stop the walk before it is over, once the LIMIT is reached: the workers
+ *  are stopped and the directories still open are closed, rather than when
+ *  the cursor is.
+ */
+static void walk_stop(vtab_cursor *p_cur)
+{
+    walker_destroy(p_cur);
+    sorted_destroy(p_cur);
+    snapshot_destroy(p_cur);
+
+    while (p_cur->current_node != p_cur->root_node)
+    {
+        move_up_directory(p_cur);
+    }
+
+    if (p_cur->root_node->dir != NULL)
+    {
+        close_directory(p_cur->root_node->dir);
+        p_cur->root_node->dir = NULL;
+    }
+}
+
 static int vt_next(sqlite3_vtab_cursor *cur)
 {
     vtab_cursor *p_cur = (vtab_cursor*)cur;
-    vtab* p_vt         = (vtab*)cur->pVtab;
+    int rc;
+
+    /* That was the last row the LIMIT lets through. */
+    if (p_cur->left > 0 && --p_cur->left == 0)
+    {
+        p_cur->eof = 1;
+        walk_stop(p_cur);
+
+        return SQLITE_OK;
+    }
+
+    /* The top rows of a walk that is already over. */
+    if (p_cur->top != NULL)
+    {
+        if (++p_cur->top->next < p_cur->top->nheap)
+        {
+            p_cur->count += 1;
+            index_row(p_cur);
+        }
+        else
+        {
+            p_cur->eof = 1;
+        }
+
+        return SQLITE_OK;
+    }
+
+    /* Rows in order of path. */
+    if (p_cur->sorted != NULL)
+    {
+        if ((rc = sorted_next(p_cur)) == SQLITE_OK)
+        {
+            index_row(p_cur);
+        }
+
+        return rc;
+    }
+
+    /* Rows looked up by inode (see lookup_inodes()). */
+    if (p_cur->walker == NULL && p_cur->snapshot == NULL && p_cur->batch != NULL)
+    {
+        if (++p_cur->row < p_cur->batch->count)
+        {
+            p_cur->count += 1;
+        }
+        else
+        {
+            p_cur->eof = 1;
+        }
+
+        return SQLITE_OK;
+    }
+
+    rc = walk_next(p_cur);
+    index_row(p_cur);
+
+    /* The walk is over: the index may have all of it now. */
+    if (rc == SQLITE_OK && p_cur->eof != 0)
+    {
+        index_walked(p_cur);
+    }
 
+    return rc;
+}
+
+/* Moves the cursor to the next row of the walk. */
+static int next_entry(vtab_cursor *p_cur)
+{
     /** This is a rather involved function. It is the core of this virtual
      *  table. This function recursively reads down into a directory. It
      *  automatically decends into a directory when it finds one, and
@@ -319,6 +739,14 @@ read_next_entry:
 
     if (p_cur->current_node->dir == NULL)
     {
+        /* Unless it is a subdirectory we didn't descend into (see below). */
+        if (p_cur->current_node->parent != NULL)
+        {
+            move_up_directory(p_cur);
+
+            goto read_next_entry;
+        }
+
         return next_directory(p_cur);
     }
 
@@ -332,11 +760,15 @@ read_next_entry:
 
 reread_next_entry:
 
-    /* Read the next entry in the directory (d->dir). Fills the d->dirent member. */
-    if ( apr_dir_read( &d->dirent, 
-                      APR_FINFO_DIRENT|APR_FINFO_PROT|APR_FINFO_TYPE|
-                      APR_FINFO_NAME|APR_FINFO_SIZE, 
-                      d->dir) != APR_SUCCESS )
+    /** Read the next entry in the directory (d->dir). Fills the d->dirent
+     *  member. Only the fields in p_cur->wanted are filled in: when those all
+     *  come with the directory entry itself (name, and usually type and inode),
+     *  APR does not stat the file at all. APR_INCOMPLETE means it tried and
+     *  the stat failed, which is no reason to stop reading the directory.
+     */
+    p_cur->status = read_directory(d->dir, &d->dirent, p_cur->wanted);
+
+    if (p_cur->status != APR_SUCCESS && p_cur->status != APR_INCOMPLETE)
     {
         /** If we get here, the call failed. There are no more entries in
          *  directory. 
@@ -368,6 +800,8 @@ reread_next_entry:
         }        
     }
 
+    p_cur->depth = d->depth + 1;
+
     /* If the current dirent is a directory, then descend into it. */
     if (d->dirent.filetype == APR_DIR)
     {     
@@ -383,49 +817,69 @@ reread_next_entry:
         /* Create a new child directory node */
 
         /* Combine the path and file names to get full path */
+        apr_size_t path_len = append_path(p_cur, d->path_len, d->dirent.name);
+
+        if (path_len == 0)
+        {
+            return SQLITE_NOMEM;
+        }
+
+        /* Leave out pruned directories, and all that's in them. */
+        if (query_pruned(&p_cur->query, p_cur->path, d->dirent.name))
+        {
+            p_cur->path[d->path_len] = '\0';
 
-        char path[1024];
-        sprintf(&path[0], "%s/%s", d->path, d->dirent.name);
+            goto read_next_entry;
+        }
+
+        /* Take a filenode (one we are done with, if there is one). */
+        if ((d = allocate_filenode(p_cur)) == NULL)
+        {
+            p_cur->path[prev_d->path_len] = '\0';
 
-        /* Allocate space for new filenode and initlialize members. */
-        d              = malloc(sizeof(struct filenode));
-        d->path        = strdup(path);
+            return SQLITE_NOMEM;
+        }
+
+        d->path_len    = path_len;
         d->parent      = p_cur->current_node;
+        d->dir         = NULL;
+        d->depth       = prev_d->depth + 1;
+        d->inode       = prev_d->dirent.inode;
 
-        /* See note ZERO-FILL DIRENT below. */
-        memset(&d->dirent, 0, sizeof(apr_finfo_t));
+        /** The row for the directory is the entry we just read from its
+         *  parent, so there is no need to stat the directory again.
+         */
+        d->dirent      = prev_d->dirent;
 
         /* Set current pointer to it. */
         p_cur->current_node = d;
 
-        /* Clear the pool memory associated with the path string allocated above. */
-        apr_pool_clear(p_cur->tmp_pool);
+        /* Just the row, if the walk goes no deeper. */
+        if (p_cur->query.maxdepth >= 0 && d->depth >= p_cur->query.maxdepth)
+        {
+            return SQLITE_OK;
+        }
         
-        /* Open the directory */
-        if ((p_cur->status = apr_dir_open(&d->dir, d->path, p_cur->pool)) != APR_SUCCESS)
+        /* Open the directory (relative to its parent, where possible) */
+        p_cur->status = open_directory( &d->handle, prev_d->dir, 
+                                        p_cur->path, d->dirent.name,
+                                        p_cur->backend, p_cur->ring, 
+                                        walk_query(p_cur), d->depth, d->pool );
+
+        if (p_cur->status != APR_SUCCESS)
         {
             /* Problem. Couldn't open directory. */
 
-            fprintf( stderr, "Failed to open directory: %s\n", 
-                     p_cur->current_node->path );
-
-            /* Set this to null to move_up_directory() doesn't try to
-             * apr_close() it (->core dump) */
-            p_cur->current_node->dir = NULL;
+            fprintf(stderr, "Failed to open directory: %s\n", p_cur->path);
 
             /* Skip to next entry */
-            deallocate_filenode(d);
+            release_filenode(p_cur, d);
             p_cur->current_node = d = prev_d;
+            p_cur->path[d->path_len] = '\0';
             goto reread_next_entry;
         }
 
-        /* Else we were able to open directory. Update the currnet dirent info
-        ** to that of the opened directory. This is our next row in the result
-        ** set.
-        */
-        apr_stat( &d->dirent, d->path, 
-                  APR_FINFO_DIRENT|APR_FINFO_TYPE|APR_FINFO_NAME, 
-                  p_cur->pool );
+        d->dir = &d->handle;
     }
 
     return SQLITE_OK;
@@ -435,6 +889,9 @@ static int vt_column(sqlite3_vtab_cursor *cur, sqlite3_context *ctx, int col)
 {
     vtab_cursor *p_cur = (vtab_cursor*)cur;
     struct filenode* d = p_cur->current_node;
+    const apr_finfo_t* dirent = &d->dirent;
+    const char* text    = NULL;
+    struct filerow* row = cursor_row(p_cur, &text);
 
     /* Just return the ordinal of the column requested. */
     switch(col)
@@ -442,13 +899,23 @@ static int vt_column(sqlite3_vtab_cursor *cur, sqlite3_context *ctx, int col)
         /* col 0: file name */
         case 0:
         {
+            if (row != NULL)
+            {
+                sqlite3_result_text( ctx, 
+                                     text + row->name,
+                                     row->name_len,
+                                     SQLITE_TRANSIENT );
+
+                break;
+            }
+
             /* Will be present if entry is a file */
             if (d->dirent.name != NULL)
             {
                 sqlite3_result_text( ctx, 
                                      d->dirent.name,
                                      strlen(d->dirent.name),
-                                     SQLITE_STATIC );
+                                     SQLITE_TRANSIENT );
 
                 break;
             }
@@ -459,7 +926,7 @@ static int vt_column(sqlite3_vtab_cursor *cur, sqlite3_context *ctx, int col)
                 sqlite3_result_text( ctx, 
                                      d->dirent.fname,
                                      strlen(d->dirent.fname),
-                                     SQLITE_STATIC );
+                                     SQLITE_TRANSIENT );
 
                 break;
             }
@@ -473,33 +940,34 @@ static int vt_column(sqlite3_vtab_cursor *cur, sqlite3_context *ctx, int col)
         /* col 1: file path */
         case 1:
         {
-            if (d->path != NULL)
+            if (row != NULL)
+            {
+                /* The batch's text is reused once the cursor moves on. */
+                sqlite3_result_text( ctx, 
+                                     text + row->path,
+                                     row->path_len,
+                                     SQLITE_TRANSIENT );
+            }
+            else if (p_cur->path != NULL)
             {
-                int  len = 0;
-                char path[PATH_MAX];
+                struct pathtext* t = cursor_path_text(p_cur);
 
-                /* If this entry is a top-level file */
-                if (d->dir == NULL)
-                {
-                    /** Then the full path is the path of the file name. Get
-                     *  length of path up to the filename. The -1 strips
-                     *  trailing separator
-                     */
-                    len = (int)apr_filepath_name_get(d->path) - (int)d->path - 1;
-                }
-                else
+                if (t == NULL)
                 {
-                    /* Copy the entire path as it is the full directory */
-                    len = strlen(d->path);
+                    sqlite3_result_error_nomem(ctx);
+
+                    break;
                 }
 
-                strncpy(path, d->path, len);
-                path[len] = '\0';
+                /* SQLite's value holds on to the text until it is done with it. */
+                t->refs++;
 
-                sqlite3_result_text( ctx, 
-                                     path,
-                                     strlen(path),
-                                     SQLITE_STATIC );
+#if SQLITE_VERSION_NUMBER >= 3008007
+                sqlite3_result_text64( ctx, t->text, t->len, 
+                                       release_path_text, SQLITE_UTF8 );
+#else
+                sqlite3_result_text(ctx, t->text, (int)t->len, release_path_text);
+#endif
             }
             else
             {
@@ -510,112 +978,84 @@ static int vt_column(sqlite3_vtab_cursor *cur, sqlite3_context *ctx, int col)
             break;
         }
 
-        /* col 2: file type */
-        case 2:
-        {
-            sqlite3_result_int(ctx, d->dirent.filetype);
-
-            break;
-        }
-
-        /* col 3: file size */
-        case 3:
-        {
-            sqlite3_result_int(ctx, d->dirent.size);
-
-            break;
-        }
-
-        /* col 4: uid */
-        case 4:
-        {
-            sqlite3_result_int(ctx, d->dirent.user);
-
-            break;
-        }
-
-        /* col 5: gid */
-        case 5:
-        {
-            sqlite3_result_int(ctx, d->dirent.group);
-
-            break;
-        }
-
-        /* col 6: protection bits */
-        case 6:
-        {
-            sqlite3_result_int(ctx, d->dirent.protection);
-
-            break;
-        }
-
-        /* col 7: modified time */
-        case 7:
+        /* col 14: depth */
+        case COLUMN_DEPTH:
         {
-            sqlite3_result_int64(ctx, d->dirent.mtime);
+            sqlite3_result_int(ctx, row != NULL ? row->depth : p_cur->depth);
 
             break;
         }
 
-        /* col 8: create time */
-        case 8:
+        /* col 15: the depth limit, if there is one */
+        case COLUMN_MAXDEPTH:
         {
-            sqlite3_result_int64(ctx, d->dirent.ctime);
+            if (p_cur->query.maxdepth >= 0)
+            {
+                sqlite3_result_int(ctx, p_cur->query.maxdepth);
+            }
+            else
+            {
+                sqlite3_result_null(ctx);
+            }
 
             break;
         }
 
-        /* col 9: access time */
-        case 9:
+        /* col 16: the directories pruned, if any */
+        case COLUMN_PRUNE:
         {
-            sqlite3_result_int64(ctx, d->dirent.atime);
+            if (p_cur->query.prune_list != NULL)
+            {
+                sqlite3_result_text( ctx, p_cur->query.prune_list, -1, 
+                                     SQLITE_TRANSIENT );
+            }
+            else
+            {
+                sqlite3_result_null(ctx);
+            }
 
             break;
         }
 
-        /* col 10: device */
-        case 10:
+        /* col 17: only ever inserted into, see vt_update() */
+        case COLUMN_REFRESH:
         {
-            sqlite3_result_int(ctx, d->dirent.device);
+            sqlite3_result_null(ctx);
 
             break;
         }
 
-        /* col 11: number of links */
-        case 11:
+        /* cols 18-19: hashes of the file's content */
+        case COLUMN_XXH3:
+        case COLUMN_SHA256:
         {
-            sqlite3_result_int(ctx, d->dirent.nlink);
+            hash_column(p_cur, row, text, ctx, col);
 
             break;
         }
 
-        /* col 12: inode */
-        case 12:
+        /* cols 2-13: type, size, uid, ... See column_value(). */
+        default:
         {
-            sqlite3_result_int(ctx, d->dirent.inode);
+            if (col >= NUM_COLUMNS)
+            {
+                sqlite3_result_text(ctx, "", 0, SQLITE_STATIC);
 
-            break;
-        }
+                break;
+            }
 
-        /* col 13: dir inode */
-        case 13:
-        {
-            if (p_cur->current_node->parent != NULL)
+            /* Rows from the parallel walker, an inode lookup, a sorted or
+             * top-K walk carry their values with them. */
+            if (row != NULL)
             {
-                sqlite3_result_int(ctx, p_cur->current_node->parent->dirent.inode);
+                sqlite3_result_int64(ctx, ROW_VALUE(row, col));
             }
             else
             {
-                sqlite3_result_int(ctx, 0);
+                sqlite3_result_int64( ctx, column_value( dirent, 
+                                                         row_dir_inode(p_cur), 
+                                                         col ) );
             }
-
-            break;
-        }
-
-        default:
-        {
-            sqlite3_result_text(ctx, "", 0, SQLITE_STATIC);
         }
     }
 
@@ -624,13 +1064,22 @@ static int vt_column(sqlite3_vtab_cursor *cur, sqlite3_context *ctx, int col)
 
 static int vt_rowid(sqlite3_vtab_cursor *cur, sqlite_int64 *p_rowid)
 {
-    vtab_cursor *p_cur = (vtab_cursor*)cur;
-    struct filenode* d = p_cur->current_node;
+    vtab_cursor *p_cur  = (vtab_cursor*)cur;
+    struct filenode* d  = p_cur->current_node;
+    const char* text    = NULL;
+    struct filerow* row = cursor_row(p_cur, &text);
 
     /* Use the inode as the rowid. */
-    *p_rowid = d->dirent.inode;
-
-    return SQLITE_OK;
+    if (row != NULL)
+    {
+        *p_rowid = ROW_VALUE(row, COLUMN_INODE);
+    }
+    else
+    {
+        *p_rowid = d->dirent.inode;
+    }
+
+    return SQLITE_OK;
 }
 
 static int vt_filter( sqlite3_vtab_cursor *p_vtc, 
@@ -641,11 +1090,301 @@ static int vt_filter( sqlite3_vtab_cursor *p_vtc,
     vtab_cursor *p_cur = (vtab_cursor*)p_vtc;
     vtab *p_vt         = (vtab*)p_vtc->pVtab;
 
-    if (argc > 0)
+    const char* code = idxStr;
+    int i;
+    int rc;
+
+    /* ORDER BY column LIMIT limit OFFSET offset, if we were given it. */
+    int top_column       = 0;
+    int top_desc         = 0;
+    sqlite3_int64 limit  = -1;
+    sqlite3_int64 offset = 0;
+
+    /* Stop any walk left over from a previous xFilter() on this cursor. */
+    walker_destroy(p_cur);
+    sorted_destroy(p_cur);
+    top_destroy(p_cur);
+    snapshot_destroy(p_cur);
+
+    if (p_cur->batch != NULL)
     {
-        p_cur->search_paths = strdup(sqlite3_value_text(argv[0]));
+        rowbatch_free(p_cur->batch);
+        p_cur->batch = NULL;
     }
-    else
+
+    while (p_cur->current_node != p_cur->root_node)
+    {
+        move_up_directory(p_cur);
+    }
+
+    if (p_cur->search_paths != NULL)
+    {
+        free((void*)p_cur->search_paths);
+        p_cur->search_paths = NULL;
+    }
+
+    query_reset(&p_cur->query);
+    p_cur->query.maxdepth = p_vt->maxdepth;
+
+    /* Have not reached end of set. */
+    p_cur->eof  = 0;
+    p_cur->left = -1;
+
+    p_cur->index_all        = 0;
+    p_cur->index_generation = -1;
+
+    /** idxStr says which constraint each argument is for (see
+     *  vt_best_index()). A NULL value matches nothing.
+     */
+    for (i = 0; i < argc; i++, code++)
+    {
+        const char* value = (const char*)sqlite3_value_text(argv[i]);
+
+        switch (*code)
+        {
+            /* path = x: just list x. */
+            case 'P':
+            {
+                query_limit_depth(&p_cur->query, 1);
+            }
+            /* Fall through */
+
+            /* path match 'x, y, z': search x, y and z. */
+            case 'p':
+            {
+                p_cur->search_paths = strdup(value != NULL ? value : "");
+
+                if (value == NULL)
+                {
+                    p_cur->eof = 1;
+                }
+
+                break;
+            }
+
+            /* name = x */
+            case 'n':
+            {
+                p_cur->query.by_name = 1;
+
+                if (value != NULL && query_add_name(&p_cur->query, value) == 0)
+                {
+                    return SQLITE_NOMEM;
+                }
+
+                break;
+            }
+
+#if SQLITE_VERSION_NUMBER >= 3038000
+            /* name in (x, y, z), all at once. */
+            case 'N':
+            {
+                sqlite3_value* v;
+
+                p_cur->query.by_name = 1;
+
+                for ( rc = sqlite3_vtab_in_first(argv[i], &v); 
+                      rc == SQLITE_OK && v != NULL; 
+                      rc = sqlite3_vtab_in_next(argv[i], &v) )
+                {
+                    value = (const char*)sqlite3_value_text(v);
+
+                    if (value != NULL && query_add_name(&p_cur->query, value) == 0)
+                    {
+                        return SQLITE_NOMEM;
+                    }
+                }
+
+                if (rc != SQLITE_OK && rc != SQLITE_DONE)
+                {
+                    return rc;
+                }
+
+                break;
+            }
+#endif
+
+#if SQLITE_VERSION_NUMBER >= 3010000
+            /* name glob, like or regexp '...' */
+            case 'g':
+            case 'l':
+            case 'r':
+            {
+                char* error = NULL;
+                int op = ( *code == 'g' ? SQLITE_INDEX_CONSTRAINT_GLOB 
+                         : *code == 'l' ? SQLITE_INDEX_CONSTRAINT_LIKE
+                                        : SQLITE_INDEX_CONSTRAINT_REGEXP );
+
+                if (value == NULL)
+                {
+                    /* Matches nothing: no names are allowed. */
+                    p_cur->query.by_name = 1;
+
+                    break;
+                }
+
+                if ((rc = query_add_pattern(&p_cur->query, op, value, &error)) != SQLITE_OK)
+                {
+                    if (error != NULL)
+                    {
+                        if (p_vt->base.zErrMsg != NULL)
+                        {
+                            sqlite3_free(p_vt->base.zErrMsg);
+                        }
+
+                        p_vt->base.zErrMsg = error;
+                    }
+
+                    return rc;
+                }
+
+                break;
+            }
+#endif
+
+            /* depth <= n, depth < n, depth = n and maxdepth = n */
+            case 'd':
+            case 'D':
+            {
+                int op = SQLITE_INDEX_CONSTRAINT_EQ;
+                int depth;
+
+                /* depth is followed by its operator. */
+                if (*code == 'd')
+                {
+                    op = predicate_op(*++code);
+                }
+
+                if ((depth = depth_bound(op, argv[i])) < 0)
+                {
+                    p_cur->eof = 1;
+                }
+                else
+                {
+                    query_limit_depth(&p_cur->query, depth);
+                }
+
+                break;
+            }
+
+            /* inode = n, or rowid = n */
+            case 'i':
+            {
+                if (query_add_inode(&p_cur->query, argv[i]) == 0)
+                {
+                    return SQLITE_NOMEM;
+                }
+
+                break;
+            }
+
+#if SQLITE_VERSION_NUMBER >= 3038000
+            /* inode in (x, y, z), all at once. */
+            case 'I':
+            {
+                sqlite3_value* v;
+
+                p_cur->query.by_inode = 1;
+
+                for ( rc = sqlite3_vtab_in_first(argv[i], &v); 
+                      rc == SQLITE_OK && v != NULL; 
+                      rc = sqlite3_vtab_in_next(argv[i], &v) )
+                {
+                    if (query_add_inode(&p_cur->query, v) == 0)
+                    {
+                        return SQLITE_NOMEM;
+                    }
+                }
+
+                if (rc != SQLITE_OK && rc != SQLITE_DONE)
+                {
+                    return rc;
+                }
+
+                break;
+            }
+#endif
+
+            /* prune = 'x, y' */
+            case 'x':
+            {
+                if (value == NULL)
+                {
+                    p_cur->eof = 1;
+                }
+                else if (query_add_prune(&p_cur->query, value) == 0)
+                {
+                    return SQLITE_NOMEM;
+                }
+
+                break;
+            }
+
+            /* A numeric column compared with a value (size > 1000). */
+            case '#':
+            {
+                if (sqlite3_value_type(argv[i]) == SQLITE_NULL)
+                {
+                    /* Nothing compares with NULL. */
+                    p_cur->eof = 1;
+                }
+                else if (query_add_predicate( &p_cur->query, code[1] - 'a', 
+                                              predicate_op(code[2]), 
+                                              argv[i] ) == 0)
+                {
+                    return SQLITE_NOMEM;
+                }
+
+                code += 2;
+
+                break;
+            }
+
+            /* LIMIT n, for ORDER BY column c, ascending or descending. */
+            case 'k':
+            {
+                top_column = code[1] - 'a';
+                top_desc   = code[2] == 'd';
+                limit      = sqlite3_value_int64(argv[i]);
+                code      += 2;
+
+                break;
+            }
+
+            /* LIMIT n, otherwise. */
+            case 'L':
+            {
+                limit = sqlite3_value_int64(argv[i]);
+
+                break;
+            }
+
+            /* OFFSET n. SQLite still skips the rows itself. */
+            case 'o':
+            {
+                offset = sqlite3_value_int64(argv[i]);
+
+                break;
+            }
+        }
+    }
+
+    query_finish(&p_cur->query);
+
+    /* The rows SQLite skips come first: keep those too. A negative LIMIT is
+     * none at all. */
+    if (limit >= 0 && offset > 0)
+    {
+        limit = offset < LLONG_MAX - limit ? limit + offset : -1;
+    }
+
+    /* A top-K walk has to see every row. Any other stops at the LIMIT. */
+    if (top_column == 0)
+    {
+        p_cur->left = limit;
+    }
+
+    if (p_cur->search_paths == NULL)
     {
         /* Start search at root file system. */
         p_cur->search_paths = strdup("/");
@@ -660,432 +1399,9227 @@ static int vt_filter( sqlite3_vtab_cursor *p_vtc,
     /* Place root_path to beginning of search path string. */
     p_cur->root_path = p_cur->search_paths;
 
+    /* Only ask the file system for what the query needs (see vt_best_index) */
+    p_cur->wanted  = wanted_fields(idxNum);
+    p_cur->backend = p_vt->backend;
+
+    /* Only read the files if the query uses their hashes. */
+    p_cur->hashes = ((idxNum & (1 << COLUMN_XXH3)) != 0 ? HASH_XXH3 : 0)
+                    | ((idxNum & (1 << COLUMN_SHA256)) != 0 ? HASH_SHA256 : 0);
+
+    if (p_cur->hashes != 0 && hash_cache(p_vt) == NULL)
+    {
+        return SQLITE_NOMEM;
+    }
+
+    /* The serial (or sorted) walk's ring. Kept for the life of the cursor. */
+    if ( p_cur->backend == BACKEND_URING && p_cur->ring == NULL 
+         && ( (p_vt->threads == 0 && p_vt->readahead == 0) 
+              || (idxNum & ORDER_PATH) != 0 ) )
+    {
+        p_cur->ring = statring_create();
+    }
+
     /* Zero rows returned thus far. */
     p_cur->count = 0;
 
-    /* Have not reached end of set. */
-    p_cur->eof = 0;
+    /* No inode at all: inode = NULL, or in () */
+    if (p_cur->query.by_inode != 0 && p_cur->query.ninodes == 0)
+    {
+        p_cur->eof = 1;
+    }
 
-    /* Load first directory to search. */
-    return next_directory(p_cur);
+    /* LIMIT 0 */
+    if (limit == 0)
+    {
+        p_cur->eof = 1;
+    }
 
+    if (p_cur->eof != 0)
+    {
+        return SQLITE_OK;
+    }
 
-    return SQLITE_OK;
-}
+    /* Read the rows from the snapshot, if it has all the search paths. It
+     * returns them in whatever order the walk would have. */
+    if (p_vt->cache != NULL)
+    {
+        int found = 0;
 
-/** Returns the index of the constraint that matches the input specifications, if
- * any. Returns -1 otherwise. 
- *
- * Input specification:
+        if (p_vt->watcher != NULL && (rc = watch_update(p_cur)) != SQLITE_OK)
+        {
+            return rc;
+        }
 
- * col: index of column (as defined in virtual table schema).
- * opmask: a bitmask of constraint operations.
+        rc = snapshot_start(p_cur, idxNum, top_column, top_desc, &found);
 
- * if there is an input constraint for column col which uses any of the
- * constraint operations in opmaks, then the function will return the index of
- * the input constraint, or -1 otherwise.
- */
-int has_constraint(sqlite3_index_info *p_info, int col, int opmask)
-{
-    int i;
-    for (i = 0; i < p_info->nConstraint; i++)
-    {
-        if (p_info->aConstraint[i].iColumn == col)
+        if (rc != SQLITE_OK)
         {
-            /* If specific operations are specified */
-            if (opmask != 0)
-            {
-                /* Check that at least one is satisfied */
-                if (p_info->aConstraint[i].op & opmask)
-                {
-                    /*
-                    printf( "col=%i op=%i\n", 
-                            p_info->aConstraint[i].iColumn, 
-                            p_info->aConstraint[i].op );
-                    */
+            return rc;
+        }
 
-                    return i;
-                }
+        if (found != 0)
+        {
+            /* Already in order, so ORDER BY ... LIMIT is just a LIMIT. */
+            if (top_column > 0)
+            {
+                p_cur->left = limit;
             }
 
-            return i;
+            index_row(p_cur);
+
+            return SQLITE_OK;
         }
     }
-    
-    return -1;
-}
 
-static int vt_best_index(sqlite3_vtab *tab, sqlite3_index_info *p_info)
-{
-    /** Here we specify what index constraints we want to handle. That is, there
-     *  might be some columns with particular constraints in which we can help 
-     *  SQLite narrow down the result set.
-     
-     *  For example, take the "path match(x,y,z)" where x, y, and z are
-     *  directories. In this case, we can narrow our search to just these
-     *  directories instead of the entire file system. This can be a significant
-     *  optimization. So, we want to handle that constraint. To do so, we would
-     *  look for two specific input conditions:
+    /* Go straight to the inodes asked for, if we know where they all are. */
+    if (p_cur->query.by_inode != 0 && p_vt->index != NULL)
+    {
+        lookup_inodes(p_cur);
 
-     *    1. p_info->aConstraint[i].iColumn == 1
-     *    2. p_info->aConstraint[i].op == SQLITE_INDEX_CONSTRAINT_MATCH 
-      
-     *  The first states that the path column is being used in one of the input
-     *  constraints and the second states that the constraint involves the match
-     *  operator.
+        if (p_cur->batch != NULL || p_cur->eof != 0)
+        {
+            return SQLITE_OK;
+        }
 
-     *  An even more specific search would be for name='xxx', in which case we
-     *  can limit the search to a single file, it it exists.
+        /* Fill the index in on the way, for next time. */
+        p_cur->index_all = 1;
+    }
 
-     *  What we have to do here is look for all of our index searches and select
-     *  the narrowest. We can only pick one, so obviously we want the one that
-     *  is the most specific, which leads to the smallest result set.
+    index_walk(p_cur, (idxNum & ORDER_PATH) == 0 && top_column == 0);
 
-     #define SQLITE_INDEX_CONSTRAINT_EQ    2
-     #define SQLITE_INDEX_CONSTRAINT_GT    4
-     #define SQLITE_INDEX_CONSTRAINT_LE    8
-     #define SQLITE_INDEX_CONSTRAINT_LT    16
-     #define SQLITE_INDEX_CONSTRAINT_GE    32
-     #define SQLITE_INDEX_CONSTRAINT_MATCH 64
-     */
+    /* Rows in order of path, if SQLite counts on us for that. */
+    if ((idxNum & ORDER_PATH) != 0)
+    {
+        if ((rc = sorted_start(p_cur, idxNum)) == SQLITE_OK)
+        {
+            index_row(p_cur);
+        }
 
-    int i = 0;
-    int ops = SQLITE_INDEX_CONSTRAINT_MATCH | SQLITE_INDEX_CONSTRAINT_EQ;
+        return rc;
+    }
 
-    /** If their is a name (column 0) constraint in the WHERE clause 
-     *  and it uses the match or equals operator
-     */
-    if ((i = has_constraint(p_info, 0, ops)) > -1)
+    /* Hand the search paths to the worker threads, if the table has them,
+     * or to the one that reads ahead. A walk that fills the inode index in
+     * sees every row, so it is left to this thread. */
+    if ((p_vt->threads > 0 || p_vt->readahead > 0) && p_cur->index_all == 0)
     {
-        /* Then we want the value to be passed to xFilter() */
-        p_info->aConstraintUsage[i].argvIndex = 1;
+        rc = walker_start(p_cur);
+    }
+    /* Otherwise load the first directory to search. The top-level row is the
+     * first one, if the query lets it through. */
+    else if ( (rc = next_directory(p_cur)) == SQLITE_OK && p_cur->eof == 0 
+              && row_passes(p_cur) == 0 )
+    {
+        rc = walk_next(p_cur);
     }
 
-    /** If their is a path constraint in the WHERE clause (column 1 is
-     *  specified) and it uses the match operator
-     */
-    if ((i = has_constraint(p_info, 1, ops)) > -1)
+    if (rc != SQLITE_OK)
     {
-        /* Then we want the value to be passed to xFilter() */
-        p_info->aConstraintUsage[i].argvIndex = 1;
+        return rc;
     }
 
-    return SQLITE_OK;
-}
+    /* ORDER BY column LIMIT n: the walk is run to the end here, and only the
+     * rows that make the cut are returned. */
+    if (top_column > 0)
+    {
+        struct toprows* t = top_create(top_column, top_desc, limit);
 
-void vt_match_function(sqlite3_context* ctx, int argc, sqlite3_value** argv)
-{
-    /* Debugging:
-    printf("Match function: %i\n", argc);
+        if (t == NULL)
+        {
+            return SQLITE_NOMEM;
+        }
 
-    int i;
-    for (i = 0; i < argc; i++)
-    {
-        printf("  arg=%s\n", sqlite3_value_text(argv[i]));
+        return top_collect(p_cur, t);
     }
-    */
 
-    /* By our implementation, everything matches. The only time match() should
-     * be called on this table is in conjunction with the path column. When that
-     * happens, we catch the value in xFilter() (if/when they are run through
-     * xBestIndex()), which then collects all of the values and constructs the
-     * directory list to search for this query (p_cursor->search_paths).
+    index_row(p_cur);
 
-     * If match is applied to any other columns in this table, then it will
-     * always succeed, no matter what.
-     */
+    /* The walk may be over already, with nothing to show for it. */
+    if (p_cur->eof != 0)
+    {
+        index_walked(p_cur);
+    }
 
-    sqlite3_result_int(ctx, 1);
+    return SQLITE_OK;
 }
 
-int vt_find_function( sqlite3_vtab *pVtab,
-                      int nArg,
-                      const char *zName,
+/** Returns the index of the first usable constraint on column col with
+ *  operator op, if any. Returns -1 otherwise. 
+ *
+ * Input specification:
+
+ * col: index of column (as defined in virtual table schema).
+ * op: a constraint operator (SQLITE_INDEX_CONSTRAINT_*).
+ */
+int has_constraint(sqlite3_index_info *p_info, int col, int op)
+{
+    int i;
+    for (i = 0; i < p_info->nConstraint; i++)
+    {
+        if ( p_info->aConstraint[i].iColumn == col 
+             && p_info->aConstraint[i].op == op
+             && p_info->aConstraint[i].usable )
+        {
+            return i;
+        }
+    }
+    
+    return -1;
+}
+
+/* Levels below a search path the planner statistics keep track of. */
+#define PATH_LEVELS 32
+
+/* Cost of looking an inode up (see lookup_inodes()), next to a row of a walk. */
+#define LOOKUP_COST 10.0
+
+/* The cost of reading a row from the snapshot, next to walking one. */
+#define SNAPSHOT_ROW_COST 0.05
+
+/* Fraction of rows thought to get past a numeric constraint, by operator. */
+#define SELECT_EQ    0.01
+#define SELECT_RANGE 0.25
+#define SELECT_NE    0.9
+
+/** Hands constraint i to xFilter() as its next argument. code is appended to
+ *  idxStr, to tell vt_filter() what the argument is.
+ */
+static void use_constraint( sqlite3_index_info *p_info, int i, 
+                            char* plan, int* argc, const char* code, int omit )
+{
+    p_info->aConstraintUsage[i].argvIndex = ++(*argc);
+    p_info->aConstraintUsage[i].omit      = omit;
+
+    strcat(plan, code);
+}
+
+/** walk_rows() of the search paths that path constraint i gives, if SQLite
+ *  knows them at this point: only from 3.38 on, and only if they are in the
+ *  statement, not bound, or from another table in a join. 0 if it doesn't.
+ */
+static double constraint_rows( vtab* p_vt, sqlite3_index_info *p_info, int i,
+                               double* level, int* cached )
+{
+#if SQLITE_VERSION_NUMBER >= 3038000
+    sqlite3_value* value;
+
+    if ( sqlite3_libversion_number() >= 3038000 
+         && sqlite3_vtab_rhs_value(p_info, i, &value) == SQLITE_OK
+         && sqlite3_value_type(value) == SQLITE_TEXT )
+    {
+        return walk_rows( p_vt, (const char*)sqlite3_value_text(value), 
+                          level, cached );
+    }
+#endif
+
+    return 0;
+}
+
+/** Whether the inode index has every row under the search paths that path
+ *  constraint i gives (-1 for none, which walks /), as far as SQLite lets us
+ *  know them here (see constraint_rows()), so that it can look inodes up by
+ *  itself.
+ */
+static int index_plan_covers(vtab* p_vt, sqlite3_index_info *p_info, int i)
+{
+    const char* list = "/";
+    apr_pool_t* pool;
+    int covers;
+
+    if (p_vt->index == NULL)
+    {
+        return 0;
+    }
+
+    if (i >= 0)
+    {
+#if SQLITE_VERSION_NUMBER >= 3038000
+        sqlite3_value* value;
+
+        if ( sqlite3_libversion_number() < 3038000 
+             || sqlite3_vtab_rhs_value(p_info, i, &value) != SQLITE_OK
+             || sqlite3_value_type(value) != SQLITE_TEXT )
+        {
+            return 0;
+        }
+
+        list = (const char*)sqlite3_value_text(value);
+#else
+        return 0;
+#endif
+    }
+
+    if (apr_pool_create(&pool, p_vt->pool) != APR_SUCCESS)
+    {
+        return 0;
+    }
+
+    covers = inode_index_covers(p_vt->index, list, pool);
+    apr_pool_destroy(pool);
+
+    return covers;
+}
+
+/* The letter idxStr gives a numeric constraint's operator. 0 if we can't take it. */
+static char predicate_code(int op)
+{
+    switch (op)
+    {
+        case SQLITE_INDEX_CONSTRAINT_EQ: return '=';
+        case SQLITE_INDEX_CONSTRAINT_GT: return '>';
+        case SQLITE_INDEX_CONSTRAINT_GE: return 'g';
+        case SQLITE_INDEX_CONSTRAINT_LT: return '<';
+        case SQLITE_INDEX_CONSTRAINT_LE: return 'l';
+#if SQLITE_VERSION_NUMBER >= 3021000
+        case SQLITE_INDEX_CONSTRAINT_NE: return '!';
+#endif
+    }
+
+    return 0;
+}
+
+/* The operator for a letter from predicate_code(). */
+static int predicate_op(char code)
+{
+    switch (code)
+    {
+        case '>': return SQLITE_INDEX_CONSTRAINT_GT;
+        case 'g': return SQLITE_INDEX_CONSTRAINT_GE;
+        case '<': return SQLITE_INDEX_CONSTRAINT_LT;
+        case 'l': return SQLITE_INDEX_CONSTRAINT_LE;
+#if SQLITE_VERSION_NUMBER >= 3021000
+        case '!': return SQLITE_INDEX_CONSTRAINT_NE;
+#endif
+    }
+
+    return SQLITE_INDEX_CONSTRAINT_EQ;
+}
+
+/** The ORDER_* flags for an ORDER BY the sorted walk can produce: path, or
+ *  path then name, each either way. 0 if it can't.
+ */
+static int path_order(sqlite3_index_info *p_info)
+{
+    int order;
+
+    if (p_info->nOrderBy < 1 || p_info->nOrderBy > 2 || p_info->aOrderBy[0].iColumn != 1)
+    {
+        return 0;
+    }
+
+    order = ORDER_PATH | (p_info->aOrderBy[0].desc ? ORDER_PATH_DESC : 0);
+
+    if (p_info->nOrderBy == 2)
+    {
+        if (p_info->aOrderBy[1].iColumn != 0)
+        {
+            return 0;
+        }
+
+        order |= ORDER_NAME | (p_info->aOrderBy[1].desc ? ORDER_NAME_DESC : 0);
+    }
+
+    return order;
+}
+
+#if SQLITE_VERSION_NUMBER >= 3038000
+/** Hands the LIMIT to xFilter() with code (see vt_best_index()), and the
+ *  OFFSET, if there is one, as "o". Only when SQLite won't drop any of the
+ *  rows we return: every other constraint has to be ours, and checked
+ *  exactly. Otherwise fewer rows than the LIMIT would come out. SQLite still
+ *  skips the OFFSET rows itself. Returns the LIMIT plus the OFFSET, if SQLite
+ *  knows them yet, 0 if it doesn't, -1 if we can't take the LIMIT.
+
+ *  SQLite only offers the LIMIT at all if it thinks the same, and before
+ *  3.45 or so (3.40 doesn't, 3.45 does) it doesn't with path match or regexp
+ *  in the WHERE clause: those queries walk to the end.
+ */
+static sqlite3_int64 use_limit( sqlite3_index_info *p_info, 
+                                char* plan, int* argc, const char* code )
+{
+    sqlite3_int64 rows = 0;
+    sqlite3_value* value;
+    int limit  = -1;
+    int offset = -1;
+    int i;
+
+    for (i = 0; i < p_info->nConstraint; i++)
+    {
+        int op = p_info->aConstraint[i].op;
+
+        if (op == SQLITE_INDEX_CONSTRAINT_LIMIT)
+        {
+            limit = p_info->aConstraint[i].usable ? i : -1;
+        }
+        else if (op == SQLITE_INDEX_CONSTRAINT_OFFSET)
+        {
+            offset = p_info->aConstraint[i].usable ? i : -1;
+        }
+        /* path match is only ever true, whoever checks it. */
+        else if ( p_info->aConstraintUsage[i].argvIndex == 0
+                  || ( p_info->aConstraintUsage[i].omit == 0 
+                       && op != SQLITE_INDEX_CONSTRAINT_MATCH ) )
+        {
+            return -1;
+        }
+    }
+
+    if (limit < 0)
+    {
+        return -1;
+    }
+
+    use_constraint(p_info, limit, plan, argc, code, 0);
+
+    if (sqlite3_vtab_rhs_value(p_info, limit, &value) == SQLITE_OK)
+    {
+        /* A negative LIMIT is none at all. */
+        rows = sqlite3_value_int64(value) > 0 ? sqlite3_value_int64(value) : 0;
+    }
+
+    if (offset >= 0)
+    {
+        use_constraint(p_info, offset, plan, argc, "o", 0);
+
+        if ( rows > 0 
+             && sqlite3_vtab_rhs_value(p_info, offset, &value) == SQLITE_OK
+             && sqlite3_value_int64(value) > 0 )
+        {
+            rows += sqlite3_value_int64(value);
+        }
+    }
+
+    return rows;
+}
+
+/** ORDER BY a numeric column with a LIMIT (and maybe an OFFSET): hands the
+ *  LIMIT to xFilter() as "k" with the column and the direction after it. The
+ *  walk then keeps just that many rows as it goes (see struct toprows).
+ *  Returns what use_limit() does, and only gets the chance when it would:
+ *  with path match in the WHERE clause, not before SQLite 3.45 or so.
+ */
+static sqlite3_int64 top_order( sqlite3_index_info *p_info, 
+                                char* plan, int* argc )
+{
+    int col;
+    char code[4];
+
+    if (p_info->nOrderBy != 1)
+    {
+        return -1;
+    }
+
+    if ((col = p_info->aOrderBy[0].iColumn) < 2 || col >= COLUMN_DEPTH)
+    {
+        return -1;
+    }
+
+    code[0] = 'k';
+    code[1] = 'a' + col;
+    code[2] = p_info->aOrderBy[0].desc ? 'd' : 'a';
+    code[3] = '\0';
+
+    return use_limit(p_info, plan, argc, code);
+}
+#endif
+
+static int vt_best_index(sqlite3_vtab *tab, sqlite3_index_info *p_info)
+{
+    vtab *p_vt = (vtab*)tab;
+
+    /** Here we specify what index constraints we want to handle. That is, there
+     *  might be some columns with particular constraints in which we can help 
+     *  SQLite narrow down the result set.
+     
+     *  For example, take the "path match(x,y,z)" where x, y, and z are
+     *  directories. In this case, we can narrow our search to just these
+     *  directories instead of the entire file system. This can be a significant
+     *  optimization. So, we want to handle that constraint. To do so, we would
+     *  look for two specific input conditions:
+
+     *    1. p_info->aConstraint[i].iColumn == 1
+     *    2. p_info->aConstraint[i].op == SQLITE_INDEX_CONSTRAINT_MATCH 
+      
+     *  The first states that the path column is being used in one of the input
+     *  constraints and the second states that the constraint involves the match
+     *  operator.
+
+     *  path = 'x' narrows it further still: only x's own entries (and x) have
+     *  that path, so x is listed without descending into its subdirectories.
+
+     *  An even more specific search would be for name='xxx' (or name in (...)),
+     *  in which case we can skip every entry by any other name without even
+     *  stat'ing it. Together with path = 'x', there is no need to read x at
+     *  all: each name is looked up in it directly.
+
+     *  Each constraint we take becomes an argument to xFilter(). We tell
+     *  xFilter() which is which with a string in idxStr with a letter for each
+     *  argument:
+
+     *    p: path match, a list of directories to search
+     *    P: path =, a directory to list
+     *    n: name =
+     *    N: name in (...), as a list (see sqlite3_vtab_in())
+     *    g, l, r: name glob, like, regexp
+     *    #co: numeric column c ('a' + its number) compared with operator o,
+     *         one of = ! > g < l (=, !=, >, >=, <, <=)
+     *    do: depth compared with operator o, one of = < l
+     *    D: maxdepth =
+     *    x: prune =, directories to leave out
+     *    i: inode = or rowid =
+     *    I: inode in (...) or rowid in (...), as a list
+     *    kcd: LIMIT, with ORDER BY numeric column c, direction d (a or d)
+     *    L: LIMIT, otherwise
+     *    o: OFFSET
+
+     *  An inode is looked up where the table has seen it before, and stat'ed
+     *  there to make sure it still is (see lookup_inodes()). That is what makes
+     *  joining fs with itself on inode = dir cheap. SQLite is only let count
+     *  on the lookup if the index has every row under the search paths:
+     *  otherwise one it doesn't know is a walk of them.
+
+     *  The depth constraints stop the walk from descending any further than
+     *  they allow. depth = n still leaves it to SQLite to drop the rows above
+     *  n.
+
+     *  The patterns are matched against each entry's name as it is read, so
+     *  entries that don't match never become rows, and are never stat'ed.
+     *  SQLite still checks LIKE itself: it may have been made case sensitive
+     *  (PRAGMA case_sensitive_like), and our check ignores case.
+     */
+
+    char* plan;
+    int argc = 0;
+    int i;
+    double rows    = ROWS_FILE_SYSTEM;
+    double inodes  = 0;
+    int listing    = 0;
+    int sampled    = 0;
+    int cached     = 0;
+    int pruned     = 0;
+    int indexed    = 0;
+    int path       = -1;
+    double level[PATH_LEVELS];
+    double scanned;
+    double cost;
+
+    /** Pass the set of columns the statement uses to xFilter() in idxNum, so
+     *  the cursor only stats files when a column needs it.
+     */
+    p_info->idxNum = used_columns(p_info);
+
+    /* Up to three letters per constraint, see below. */
+    if ((plan = sqlite3_malloc(3 * p_info->nConstraint + 1)) == NULL)
+    {
+        return SQLITE_NOMEM;
+    }
+
+    plan[0] = '\0';
+
+    /** If there is a path constraint in the WHERE clause (column 1 is
+     *  specified) and it uses the equals or match operator. path = x is
+     *  still checked by SQLite: x itself may be given with a trailing slash.
+     */
+    if ((i = has_constraint(p_info, 1, SQLITE_INDEX_CONSTRAINT_EQ)) > -1)
+    {
+        use_constraint(p_info, i, plan, &argc, "P", 0);
+        rows    = ROWS_DIRECTORY;
+        listing = 1;
+        path    = i;
+
+        if (constraint_rows(p_vt, p_info, i, level, &cached) > 0)
+        {
+            /* The paths and their entries */
+            rows    = shallow_rows(level, 1);
+            sampled = 1;
+        }
+    }
+    else if ((i = has_constraint(p_info, 1, SQLITE_INDEX_CONSTRAINT_MATCH)) > -1)
+    {
+        use_constraint(p_info, i, plan, &argc, "p", 0);
+        rows = ROWS_TREE;
+        path = i;
+
+        if (constraint_rows(p_vt, p_info, i, level, &cached) > 0)
+        {
+            rows    = shallow_rows(level, PATH_LEVELS);
+            sampled = 1;
+        }
+    }
+    else if (walk_rows(p_vt, "/", level, &cached) > 0)
+    {
+        /* Everything, from / down. */
+        rows    = shallow_rows(level, PATH_LEVELS);
+        sampled = 1;
+    }
+
+    /* inode = n, or the rowid, which is the inode. */
+    if ( (i = has_constraint(p_info, 12, SQLITE_INDEX_CONSTRAINT_EQ)) > -1
+         || (i = has_constraint(p_info, -1, SQLITE_INDEX_CONSTRAINT_EQ)) > -1 )
+    {
+        const char* code = "i";
+
+        inodes = 1;
+
+#if SQLITE_VERSION_NUMBER >= 3038000
+        if ( sqlite3_libversion_number() >= 3038000 
+             && sqlite3_vtab_in(p_info, i, -1) )
+        {
+            sqlite3_vtab_in(p_info, i, 1);
+            code   = "I";
+            inodes = ROWS_PER_NAME;
+        }
+#endif
+
+        use_constraint(p_info, i, plan, &argc, code, 1);
+
+        /* Start keeping track of where inodes are. */
+        if (p_vt->index == NULL)
+        {
+            p_vt->index = inode_index_create(p_vt->pool);
+        }
+    }
+
+    /* Limits on how much of the tree is walked: depth and prune. */
+    for (i = 0; i < p_info->nConstraint; i++)
+    {
+        int op = p_info->aConstraint[i].op;
+        double shallow = ROWS_SHALLOW;
+        char code[3];
+
+        if (p_info->aConstraint[i].usable == 0)
+        {
+            continue;
+        }
+
+        if ( p_info->aConstraint[i].iColumn == COLUMN_DEPTH
+             && ( op == SQLITE_INDEX_CONSTRAINT_EQ 
+                  || op == SQLITE_INDEX_CONSTRAINT_LT
+                  || op == SQLITE_INDEX_CONSTRAINT_LE ) )
+        {
+            code[0] = 'd';
+            code[1] = predicate_code(op);
+            code[2] = '\0';
+
+            use_constraint( p_info, i, plan, &argc, code, 
+                            op != SQLITE_INDEX_CONSTRAINT_EQ );
+        }
+        else if ( p_info->aConstraint[i].iColumn == COLUMN_MAXDEPTH
+                  && op == SQLITE_INDEX_CONSTRAINT_EQ )
+        {
+            use_constraint(p_info, i, plan, &argc, "D", 1);
+        }
+        else if ( p_info->aConstraint[i].iColumn == COLUMN_PRUNE
+                  && op == SQLITE_INDEX_CONSTRAINT_EQ )
+        {
+            /* Some of the tree is left out, we can't tell how much. */
+            use_constraint(p_info, i, plan, &argc, "x", 1);
+            rows  /= 2;
+            pruned = 1;
+
+            continue;
+        }
+        else
+        {
+            continue;
+        }
+
+#if SQLITE_VERSION_NUMBER >= 3038000
+        /* As many rows as the search paths have down to that depth. */
+        if (sampled != 0 && sqlite3_libversion_number() >= 3038000)
+        {
+            sqlite3_value* value;
+
+            if (sqlite3_vtab_rhs_value(p_info, i, &value) == SQLITE_OK)
+            {
+                int depth = depth_bound(op, value);
+
+                shallow = depth < 0 ? 1 : shallow_rows(level, depth);
+            }
+        }
+#endif
+
+        if (rows > shallow)
+        {
+            rows = shallow;
+        }
+    }
+
+    /* A table that doesn't recurse lists a directory. */
+    if (p_vt->maxdepth >= 0)
+    {
+        double shallow = rows;
+
+        if (sampled != 0)
+        {
+            shallow = shallow_rows(level, p_vt->maxdepth);
+        }
+        else if (p_vt->maxdepth <= 1)
+        {
+            shallow = ROWS_DIRECTORY;
+        }
+
+        if (rows > shallow)
+        {
+            rows = shallow;
+        }
+    }
+
+    /* The whole walk is the cost, however few rows come out of it. */
+    cost    = rows;
+    scanned = rows;
+
+    /* If there is a name (column 0) constraint that uses the equals operator */
+    if ((i = has_constraint(p_info, 0, SQLITE_INDEX_CONSTRAINT_EQ)) > -1)
+    {
+        const char* code = "n";
+        double names     = 1;
+
+#if SQLITE_VERSION_NUMBER >= 3038000
+        /* Take name in (...) all at once, rather than a name at a time. */
+        if ( sqlite3_libversion_number() >= 3038000 
+             && sqlite3_vtab_in(p_info, i, -1) )
+        {
+            sqlite3_vtab_in(p_info, i, 1);
+            code  = "N";
+            names = ROWS_PER_NAME;
+        }
+#endif
+
+        /* The walk checks the names itself, exactly, so SQLite needn't. */
+        use_constraint(p_info, i, plan, &argc, code, 1);
+
+        if (listing != 0)
+        {
+            /* A lookup per name */
+            rows = cost = names;
+        }
+        else
+        {
+            /* Still a walk, but only directories need more than a glance. */
+            rows  = names * ROWS_PER_NAME;
+            cost /= ROWS_PER_NAME;
+        }
+    }
+
+#if SQLITE_VERSION_NUMBER >= 3010000
+    /* Patterns on name (column 0). SQLite didn't offer these before 3.10. */
+    for (i = 0; i < p_info->nConstraint; i++)
+    {
+        int op = p_info->aConstraint[i].op;
+
+        if ( p_info->aConstraint[i].iColumn != 0 
+             || p_info->aConstraint[i].usable == 0 )
+        {
+            continue;
+        }
+
+        if (op == SQLITE_INDEX_CONSTRAINT_GLOB)
+        {
+            use_constraint(p_info, i, plan, &argc, "g", 1);
+        }
+        else if (op == SQLITE_INDEX_CONSTRAINT_LIKE)
+        {
+            use_constraint(p_info, i, plan, &argc, "l", 0);
+        }
+#ifdef UNIX
+        else if (op == SQLITE_INDEX_CONSTRAINT_REGEXP)
+        {
+            /* Only matched our way, see vt_find_function() */
+            use_constraint(p_info, i, plan, &argc, "r", 1);
+        }
+#endif
+        else
+        {
+            continue;
+        }
+
+        /* Few rows, and those that don't match aren't stat'ed. */
+        rows /= ROWS_PER_NAME;
+        cost *= 0.9;
+    }
+#endif
+
+    /** Numeric constraints (size > 1000). These are checked as soon as an
+     *  entry is stat'ed, exactly as SQLite would, so it needn't check them
+     *  again. The walk is no shorter, but fewer rows come out of it.
+     */
+    for (i = 0; i < p_info->nConstraint; i++)
+    {
+        int col = p_info->aConstraint[i].iColumn;
+        char code[4];
+
+        if ( col < 2 || col >= COLUMN_DEPTH || p_info->aConstraint[i].usable == 0
+             || p_info->aConstraintUsage[i].argvIndex > 0
+             || (code[2] = predicate_code(p_info->aConstraint[i].op)) == 0 )
+        {
+            continue;
+        }
+
+        code[0] = '#';
+        code[1] = 'a' + col;
+        code[3] = '\0';
+
+        use_constraint(p_info, i, plan, &argc, code, 1);
+
+        switch (code[2])
+        {
+            case '=': rows *= SELECT_EQ;    break;
+            case '!': rows *= SELECT_NE;    break;
+            default:  rows *= SELECT_RANGE; break;
+        }
+
+        /* The snapshot has an index for these. */
+        if ((col == 3 || col == 7) && code[2] != '!')
+        {
+            indexed = 1;
+        }
+
+        cost *= 0.9;
+    }
+
+    /** A stat or two per inode, and no more rows than there are inodes. That
+     *  is, if the index has every row under the search paths. Otherwise an
+     *  inode it doesn't know means a walk of them. There's no telling how
+     *  often that is, so say half the time: still less than the walk that
+     *  checks dir = n, which is what a self-join would do instead.
+     */
+    if (inodes > 0)
+    {
+        cost    = inodes * LOOKUP_COST;
+        indexed = 1;
+
+        if (index_plan_covers(p_vt, p_info, path) == 0)
+        {
+            cost += scanned / 2;
+        }
+
+        if (rows > inodes)
+        {
+            rows = inodes;
+        }
+    }
+
+    /** Rows from the snapshot (see snapshot_start()) take no system calls at
+     *  all, just a read of the search paths' rows in it, down to the depth
+     *  the walk would go, or of the few an index on inode, size or mtime
+     *  narrows them to. A query with prune is left to the walk.
+     */
+    if (cached != 0 && pruned == 0)
+    {
+        cost = (indexed != 0 ? rows : scanned) * SNAPSHOT_ROW_COST;
+    }
+
+    /** ORDER BY path, or path and name, either way: the walk takes directories
+     *  in order and sorts the entries of each as it reads them (see struct
+     *  sortwalk), so SQLite needn't sort the lot. An inode lookup is too few
+     *  rows to bother.
+     */
+    if (inodes == 0 && (i = path_order(p_info)) != 0)
+    {
+        p_info->idxNum         |= i;
+        p_info->orderByConsumed = 1;
+    }
+
+#if SQLITE_VERSION_NUMBER >= 3038000
+    if (sqlite3_libversion_number() >= 3038000)
+    {
+        sqlite3_int64 limit = -1;
+
+        /** ORDER BY size DESC LIMIT 100 (or any other numeric column, either
+         *  way): the walk keeps the top 100 rows as it goes, and returns them
+         *  sorted, rather than SQLite sorting all of them.
+         */
+        if ( inodes == 0 && p_info->orderByConsumed == 0
+             && (limit = top_order(p_info, plan, &argc)) >= 0 )
+        {
+            p_info->orderByConsumed = 1;
+        }
+        /** Any other LIMIT, as long as SQLite has nothing to sort: the walk
+         *  stops as soon as it has found that many rows, rather than when
+         *  SQLite stops asking for them.
+         */
+        else if (p_info->nOrderBy == 0 || p_info->orderByConsumed != 0)
+        {
+            limit = use_limit(p_info, plan, &argc, "L");
+        }
+
+        if (limit > 0 && rows > limit)
+        {
+            rows = (double)limit;
+        }
+    }
+#endif
+
+    /* Never below a row. */
+    if (rows < 1)
+    {
+        rows = 1;
+    }
+
+    p_info->estimatedCost = cost;
+
+#if SQLITE_VERSION_NUMBER >= 3008002
+    if (sqlite3_libversion_number() >= 3008002)
+    {
+        p_info->estimatedRows = (sqlite3_int64)rows;
+    }
+#endif
+
+    if (argc > 0)
+    {
+        p_info->idxStr           = plan;
+        p_info->needToFreeIdxStr = 1;
+    }
+    else
+    {
+        sqlite3_free(plan);
+    }
+
+    return SQLITE_OK;
+}
+
+void vt_match_function(sqlite3_context* ctx, int argc, sqlite3_value** argv)
+{
+    /* Debugging:
+    printf("Match function: %i\n", argc);
+
+    int i;
+    for (i = 0; i < argc; i++)
+    {
+        printf("  arg=%s\n", sqlite3_value_text(argv[i]));
+    }
+    */
+
+    /* By our implementation, everything matches. The only time match() should
+     * be called on this table is in conjunction with the path column. When that
+     * happens, we catch the value in xFilter() (if/when they are run through
+     * xBestIndex()), which then collects all of the values and constructs the
+     * directory list to search for this query (p_cursor->search_paths).
+
+     * If match is applied to any other columns in this table, then it will
+     * always succeed, no matter what.
+     */
+
+    sqlite3_result_int(ctx, 1);
+}
+
+#ifdef UNIX
+/* Frees a regular expression cached by vt_regexp_function(). */
+static void free_regex(void* p)
+{
+    regfree((regex_t*)p);
+    sqlite3_free(p);
+}
+
+/** regexp(pattern, text): the function behind text regexp 'pattern', using
+ *  POSIX extended regular expressions. This is what name regexp '...' means on
+ *  this table (the walk matches it itself, see vt_best_index()), and it is
+ *  registered for the whole connection if the connection doesn't have a
+ *  regexp() already. The compiled pattern is kept between rows.
+ */
+void vt_regexp_function(sqlite3_context* ctx, int argc, sqlite3_value** argv)
+{
+    const char* pattern = (const char*)sqlite3_value_text(argv[0]);
+    const char* text    = (const char*)sqlite3_value_text(argv[1]);
+    regex_t* regex;
+
+    if (pattern == NULL || text == NULL)
+    {
+        return;
+    }
+
+    if ((regex = sqlite3_get_auxdata(ctx, 0)) == NULL)
+    {
+        int rc;
+
+        if ((regex = sqlite3_malloc(sizeof(regex_t))) == NULL)
+        {
+            sqlite3_result_error_nomem(ctx);
+
+            return;
+        }
+
+        if ((rc = regcomp(regex, pattern, REG_EXTENDED|REG_NOSUB)) != 0)
+        {
+            char error[256];
+
+            regerror(rc, regex, error, sizeof(error));
+            sqlite3_free(regex);
+            sqlite3_result_error(ctx, error, -1);
+
+            return;
+        }
+
+        sqlite3_result_int(ctx, regexec(regex, text, 0, NULL, 0) == 0);
+
+        /* Keep it for the next row, if SQLite will. */
+        sqlite3_set_auxdata(ctx, 0, regex, free_regex);
+
+        return;
+    }
+
+    sqlite3_result_int(ctx, regexec(regex, text, 0, NULL, 0) == 0);
+}
+#endif
+
+int vt_find_function( sqlite3_vtab *pVtab,
+                      int nArg,
+                      const char *zName,
                       void (**pxFunc)(sqlite3_context*,int,sqlite3_value**),
                       void **ppArg )
 {
-    /* Register the match function */
-    if (strcmp(zName, "match") == 0)
+    /* Register the match function */
+    if (strcmp(zName, "match") == 0)
+    {
+        *pxFunc = vt_match_function;
+
+        return 1;
+    }
+
+#ifdef UNIX
+    /* So that regexp means the same thing whether or not we match it. */
+    if (sqlite3_stricmp(zName, "regexp") == 0 && nArg == 2)
+    {
+        *pxFunc = vt_regexp_function;
+
+        return 1;
+    }
+#endif
+
+    return SQLITE_OK;
+}
+
+/** The file system can't be changed through the table. The only thing that
+ *  can be inserted is a list of search paths to refresh in the snapshot, if
+ *  the table keeps one (see snapshot_refresh()):
+ *
+ *    insert into f(refresh) values ('/usr/lib, /var/log');
+ */
+static int vt_update( sqlite3_vtab *p_svt, int argc, sqlite3_value **argv,
+                      sqlite_int64 *p_rowid )
+{
+    vtab* p_vt = (vtab*)p_svt;
+    const char* list;
+
+    if (p_vt->base.zErrMsg != NULL)
+    {
+        sqlite3_free(p_vt->base.zErrMsg);
+        p_vt->base.zErrMsg = NULL;
+    }
+
+    /* A delete (argc 1) or an update (argv[0] is the rowid). */
+    if ( argc < 2 + NUM_COLUMNS || sqlite3_value_type(argv[0]) != SQLITE_NULL
+         || (list = (const char*)sqlite3_value_text(argv[2 + COLUMN_REFRESH])) == NULL )
+    {
+        p_vt->base.zErrMsg = sqlite3_mprintf( "Only refresh can be inserted "
+                                              "into a filesystem table" );
+
+        return SQLITE_ERROR;
+    }
+
+    if (p_vt->cache == NULL)
+    {
+        p_vt->base.zErrMsg = sqlite3_mprintf( "Nothing to refresh: the table "
+                                              "was created without a cache" );
+
+        return SQLITE_ERROR;
+    }
+
+    *p_rowid = 0;
+
+    return snapshot_refresh(p_vt, list);
+}
+
+/* Structure to map virtual table functions to sqlite core. */
+static sqlite3_module fs_module = 
+{
+    0,                /* iVersion */
+    vt_create,        /* xCreate       - create a vtable */
+    vt_connect,       /* xConnect      - associate a vtable with a connection */
+    vt_best_index,    /* xBestIndex    - best index */
+    vt_disconnect,    /* xDisconnect   - disassociate a vtable with a connection */
+    vt_destroy,       /* xDestroy      - destroy a vtable */
+    vt_open,          /* xOpen         - open a cursor */
+    vt_close,         /* xClose        - close a cursor */
+    vt_filter,        /* xFilter       - configure scan constraints */
+    vt_next,          /* xNext         - advance a cursor */
+    vt_eof,           /* xEof          - inidicate end of result set*/
+    vt_column,        /* xColumn       - read data */
+    vt_rowid,         /* xRowid        - read data */
+    vt_update,        /* xUpdate       - write data */
+    NULL,             /* xBegin        - begin transaction */
+    NULL,             /* xSync         - sync transaction */
+    NULL,             /* xCommit       - commit transaction */
+    NULL,             /* xRollback     - rollback transaction */
+    vt_find_function, /* xFindFunction - function overloading */
+    NULL,             /* xRename       - function overloading */
+    NULL,             /* xSavepoint    - function overloading */
+    NULL,             /* xRelease      - function overloading */
+    NULL              /* xRollbackto   - function overloading */
+};
+
+/* Used to register virtual table module. */
+int fs_register( sqlite3* db, 
+                 char **pzErrMsg, 
+                 const sqlite3_api_routines* pApi )
+{
+    SQLITE_EXTENSION_INIT2(pApi);
+
+    /* Initliaze the Apache Portable Runtime. */
+    apr_initialize();
+
+    /* Arrange to have it cleaned up at exit. */
+    atexit(apr_terminate);
+
+#ifdef UNIX
+    /* SQLite has no regexp() of its own. Supply one, unless somebody has. */
+    {
+        sqlite3_stmt* stmt;
+
+        if (sqlite3_prepare_v2(db, "select regexp('', '')", -1, &stmt, NULL) == SQLITE_OK)
+        {
+            sqlite3_finalize(stmt);
+        }
+        else
+        {
+            sqlite3_create_function( db, "regexp", 2, SQLITE_UTF8, NULL, 
+                                     vt_regexp_function, NULL, NULL );
+        }
+    }
+#endif
+
+    if (du_register(db) != SQLITE_OK || dupes_register(db) != SQLITE_OK)
+    {
+        return SQLITE_ERROR;
+    }
+
+    return sqlite3_create_module(db, "filesystem", &fs_module, NULL);
+}
+
+/*-------------------------------------------------------------------*/
+/* Support functions                                                 */
+/*-------------------------------------------------------------------*/
+
+/* Maps an APR file type to a name. */
+static const char* file_type_name(int type)
+{
+    switch(type)
+    {
+        case APR_REG:
+            return "regfile";
+        case APR_DIR:
+            return "dir";
+        case APR_CHR:
+            return "character device";
+        case APR_BLK:
+            return "block device";
+        case APR_PIPE:
+            return "pipe";
+        case APR_LNK:
+            return "link";
+        case APR_SOCK:
+            return "socket";
+        default:
+            return "unknown";
+    }
+}
+
+/** Returns a bitmask of the columns (bit n for column n) that the statement
+ *  being planned uses. That is sqlite3_index_info.colUsed, when SQLite is new
+ *  enough to provide it. Otherwise it's all of them but the hashes, which
+ *  would read every file (vt_column() works them out anyway, if asked).
+ */
+static int used_columns(sqlite3_index_info *p_info)
+{
+#if SQLITE_VERSION_NUMBER >= 3010000
+    if (sqlite3_libversion_number() >= 3010000)
+    {
+        return (int)(p_info->colUsed & ALL_COLUMNS);
+    }
+#endif
+
+    return ALL_COLUMNS & ~HASH_COLUMNS;
+}
+
+/** Maps a bitmask of columns to the APR_FINFO_* fields needed to produce
+ *  them. The name, type and inode are always asked for: the cursor needs the
+ *  name and type to walk the tree, the inode is the rowid, and on most systems
+ *  all three come with the directory entry for free. Everything else takes a
+ *  stat() call per file.
+ */
+static apr_int32_t wanted_fields(int columns)
+{
+    static const apr_int32_t fields[NUM_COLUMNS] = 
+    {
+        0,                /* col 0  : name             */
+        0,                /* col 1  : path             */
+        0,                /* col 2  : type             */
+        APR_FINFO_SIZE,   /* col 3  : size             */
+        APR_FINFO_USER,   /* col 4  : uid              */
+        APR_FINFO_GROUP,  /* col 5  : gid              */
+        APR_FINFO_PROT,   /* col 6  : protection bits  */
+        APR_FINFO_MTIME,  /* col 7  : modified time    */
+        APR_FINFO_CTIME,  /* col 8  : create time      */
+        APR_FINFO_ATIME,  /* col 9  : access time      */
+        APR_FINFO_DEV,    /* col 10 : device           */
+        APR_FINFO_NLINK,  /* col 11 : number of links  */
+        0,                /* col 12 : inode            */
+        0,                /* col 13 : dir inode        */
+        0,                /* col 14 : depth            */
+        0,                /* col 15 : maxdepth         */
+        0,                /* col 16 : prune            */
+        0,                /* col 17 : refresh          */
+        APR_FINFO_SIZE|APR_FINFO_MTIME|APR_FINFO_DEV, /* col 18 : hash_xxh3   */
+        APR_FINFO_SIZE|APR_FINFO_MTIME|APR_FINFO_DEV  /* col 19 : hash_sha256 */
+    };
+
+    apr_int32_t wanted = APR_FINFO_DIRENT|APR_FINFO_NAME|
+                         APR_FINFO_TYPE|APR_FINFO_INODE;
+    int i;
+
+    for (i = 0; i < NUM_COLUMNS; i++)
+    {
+        if (columns & (1 << i))
+        {
+            wanted |= fields[i];
+        }
+    }
+
+    return wanted;
+}
+
+/** The value of numeric column col (2 and up) of a row. finfo is its entry,
+ *  and dir_inode the inode of the directory it is in. vt_column() returns
+ *  these, and query_row_ok() checks them, so the two always agree.
+ */
+static sqlite3_int64 column_value( const apr_finfo_t* finfo, apr_ino_t dir_inode,
+                                   int col )
+{
+    switch (col)
+    {
+        case 2:  return finfo->filetype;   /* type             */
+        case 3:  return finfo->size;       /* size             */
+        case 4:  return finfo->user;       /* uid              */
+        case 5:  return finfo->group;      /* gid              */
+        case 6:  return finfo->protection; /* protection bits  */
+        case 7:  return finfo->mtime;      /* modified time    */
+        case 8:  return finfo->ctime;      /* create time      */
+        case 9:  return finfo->atime;      /* access time      */
+        case 10: return finfo->device;     /* device           */
+        case 11: return finfo->nlink;      /* number of links  */
+        case 12: return finfo->inode;      /* inode            */
+        case 13: return dir_inode;         /* dir inode        */
+    }
+
+    return 0;
+}
+
+/* Work out the values of row's numeric columns, see struct filerow. */
+static void row_values( struct filerow* row, const apr_finfo_t* finfo, 
+                        apr_ino_t dir_inode )
+{
+    int col;
+
+    for (col = COLUMN_TYPE; col < COLUMN_TYPE + ROW_VALUES; col++)
+    {
+        ROW_VALUE(row, col) = column_value(finfo, dir_inode, col);
+    }
+}
+
+/** The next path in the comma-delimited list of search paths *list, trimmed
+ *  the way next_path() trims it, and copied into pool. Moves *list on to the
+ *  path after it. Returns NULL at the end of the list.
+ */
+static char* next_search_path(const char** list, apr_pool_t* pool)
+{
+    const char* start = *list;
+    const char* end;
+    int len;
+
+    if (start == NULL)
+    {
+        return NULL;
+    }
+
+    end = strchr(start, ',');
+
+    while (isblank(*start))
+    {
+        start++;
+    }
+
+    len   = end != NULL ? (int)(end - start) : (int)strlen(start);
+    *list = end != NULL ? end + 1 : NULL;
+
+    while (len > 0 && isspace((unsigned char)start[len - 1]))
+    {
+        len--;
+    }
+
+    return apr_pstrmemdup(pool, start, len);
+}
+
+/* What goes between the path of directory dir and the name of an entry. */
+static const char* path_separator(const char* dir)
+{
+    int len = strlen(dir);
+
+    return len > 0 && dir[len - 1] == '/' ? "" : "/";
+}
+
+/** The name column of a search path's own row: the last part of path, like
+ *  any other row's name. A path that is nothing but separators ("/") is its
+ *  own name.
+ */
+static const char* root_name(const char* path, int path_len, int* name_len)
+{
+    int end = path_len;
+    int start;
+
+    while (end > 1 && path[end - 1] == '/')
+    {
+        end--;
+    }
+
+    for (start = end; start > 0 && path[start - 1] != '/'; start--);
+
+    if (start == end)
+    {
+        *name_len = end;
+
+        return path;
+    }
+
+    *name_len = end - start;
+
+    return path + start;
+}
+
+/** The length of the path column of a top-level file: the part of path that
+ *  is the directory it is in, which is "/" for a file in the root directory
+ *  and nothing for a relative path with no directory in it.
+ */
+static int root_dir_len(const char* path, int path_len)
+{
+    int name_len;
+    int len = root_name(path, path_len, &name_len) - path;
+
+    while (len > 1 && path[len - 1] == '/')
+    {
+        len--;
+    }
+
+    return len;
+}
+
+/* Cleanup filenode */
+static void deallocate_filenode(struct filenode* p)
+{
+    /* Close the directory, if it is open */
+    if (p->dir != NULL)
+    {
+        close_directory(p->dir);
+        p->dir = NULL;
+    }
+
+    apr_pool_destroy(p->pool);
+    free(p);
+}
+
+/** A filenode for a directory the walk descends into, with its own pool.
+ *  NULL when out of memory.
+ */
+static struct filenode* allocate_filenode(vtab_cursor *p_cur)
+{
+    struct filenode* p = p_cur->spare_nodes;
+
+    if (p != NULL)
+    {
+        p_cur->spare_nodes = p->parent;
+
+        return p;
+    }
+
+    if ((p = malloc(sizeof(struct filenode))) == NULL)
+    {
+        return NULL;
+    }
+
+    if (apr_pool_create(&p->pool, p_cur->pool) != APR_SUCCESS)
+    {
+        free(p);
+
+        return NULL;
+    }
+
+    return p;
+}
+
+/** Close filenode p's directory, free what was allocated for it, and keep p
+ *  for allocate_filenode().
+ */
+static void release_filenode(vtab_cursor *p_cur, struct filenode* p)
+{
+    if (p->dir != NULL)
+    {
+        close_directory(p->dir);
+        p->dir = NULL;
+    }
+
+    apr_pool_clear(p->pool);
+
+    p->parent          = p_cur->spare_nodes;
+    p_cur->spare_nodes = p;
+}
+
+/* Make room for a path len characters long in p_cur->path. 0 when out of memory. */
+static int reserve_path(vtab_cursor *p_cur, apr_size_t len)
+{
+    apr_size_t size = p_cur->path_size == 0 ? 256 : p_cur->path_size;
+    char* path;
+
+    if (len < p_cur->path_size)
+    {
+        return 1;
+    }
+
+    while (size <= len)
+    {
+        size *= 2;
+    }
+
+    if ((path = realloc(p_cur->path, size)) == NULL)
+    {
+        return 0;
+    }
+
+    p_cur->path      = path;
+    p_cur->path_size = size;
+
+    return 1;
+}
+
+/** Append entry name to the directory path in p_cur->path, which is len
+ *  characters long. Returns the length of the entry's path, 0 when out of
+ *  memory.
+ */
+static apr_size_t append_path(vtab_cursor *p_cur, apr_size_t len, const char* name)
+{
+    apr_size_t name_len = strlen(name);
+    int slash           = len == 0 || p_cur->path[len - 1] != '/';
+
+    if (reserve_path(p_cur, len + slash + name_len) == 0)
+    {
+        return 0;
+    }
+
+    if (slash != 0)
+    {
+        p_cur->path[len++] = '/';
+    }
+
+    memcpy(p_cur->path + len, name, name_len + 1);
+
+    forget_path_text(p_cur);
+
+    return len + name_len;
+}
+
+/** The path column of the current row of the serial walk: current_node's path,
+ *  or for a top-level file, the directory it is in. It is copied out of
+ *  p_cur->path once per directory, the first time it is asked for. NULL when
+ *  out of memory.
+ */
+static struct pathtext* cursor_path_text(vtab_cursor *p_cur)
+{
+    struct pathtext* t;
+    int len;
+
+    if (p_cur->path_text != NULL)
+    {
+        return p_cur->path_text;
+    }
+
+    len = walk_path_len(p_cur);
+
+    if ((t = malloc(sizeof(struct pathtext) + len)) == NULL)
+    {
+        return NULL;
+    }
+
+    memcpy(t->text, p_cur->path, len);
+    t->text[len] = '\0';
+    t->len       = len;
+    t->refs      = 1;
+
+    return p_cur->path_text = t;
+}
+
+/** The length of the path column of the serial walk's current row, which is
+ *  the start of p_cur->path: current_node's path, or for a top-level file,
+ *  the directory it is in.
+ */
+static int walk_path_len(vtab_cursor *p_cur)
+{
+    const struct filenode* d = p_cur->current_node;
+    if (p_cur->path == NULL)
+    {
+        return 0;
+    }
+
+    /* If this entry is a top-level file, its path is the directory it is in. */
+    if (d->dir == NULL && d->parent == NULL && d->dirent.filetype != APR_DIR)
+    {
+        return root_dir_len(p_cur->path, strlen(p_cur->path));
+    }
+
+    return d->path_len;
+}
+
+/* The name and path columns of the serial walk's current row (see vt_column()). */
+static void walk_row_text( vtab_cursor *p_cur, const char** name, int* name_len,
+                           const char** path, int* path_len )
+{
+    const apr_finfo_t* dirent = &p_cur->current_node->dirent;
+
+    *name     = dirent->name != NULL ? dirent->name : dirent->fname;
+    *path     = p_cur->path != NULL ? p_cur->path : "";
+    *path_len = walk_path_len(p_cur);
+
+    if (*name == NULL)
+    {
+        *name = "";
+    }
+
+    *name_len = strlen(*name);
+}
+
+/* Let go of the current directory's path column: the walk has left it. */
+static void forget_path_text(vtab_cursor *p_cur)
+{
+    if (p_cur->path_text != NULL)
+    {
+        release_path_text(p_cur->path_text->text);
+        p_cur->path_text = NULL;
+    }
+}
+
+/* The destructor SQLite is given with a pathtext's text. */
+static void release_path_text(void* text)
+{
+    struct pathtext* t = (struct pathtext*)
+                         ((char*)text - offsetof(struct pathtext, text));
+
+    if (--t->refs == 0)
+    {
+        free(t);
+    }
+}
+
+/* Cleanup a filenode list -- only happens in error conditions where we have to
+ * abort a search. */
+static void deallocate_dirpath(vtab_cursor *p_cur)
+{
+    if (p_cur->current_node == NULL)
+    {
+        return;
+    }
+
+    struct filenode* current_node = p_cur->current_node;
+
+    while (current_node != p_cur->root_node)
+    {
+        current_node = p_cur->current_node->parent;
+        deallocate_filenode(p_cur->current_node);
+        p_cur->current_node = current_node;
+    }
+
+    deallocate_filenode(p_cur->root_node);
+
+    while (p_cur->spare_nodes != NULL)
+    {
+        current_node       = p_cur->spare_nodes;
+        p_cur->spare_nodes = current_node->parent;
+        free(current_node);
+    }
+
+    p_cur->current_node = NULL;
+    p_cur->root_node    = NULL;
+}
+
+/* Move current_node to point to parent node */
+static struct filenode* move_up_directory(vtab_cursor *p_cur)
+{
+    struct filenode* d = p_cur->current_node;
+ 
+    /* Get current pointer to parent */
+    p_cur->current_node = d->parent;
+
+    /* Close current directory, and cut the path back to the parent's. */
+    release_filenode(p_cur, d);
+    p_cur->path[p_cur->current_node->path_len] = '\0';
+    forget_path_text(p_cur);
+
+    /* Update d to point to parent (now current directory) */
+    return p_cur->current_node;
+}
+
+/* Update root_dir to point to the next top-level directory in
+ * search_paths. Update cursor accordingly (p_cur->path is set to it). Returns
+ * 0 when there is none, or no memory for it.
+ */
+static next_path(vtab_cursor* p_cur)
+{
+    int len = 0;
+
+    /* Clear the path value of the current filenode */
+    p_cur->current_node->path_len = 0;
+    forget_path_text(p_cur);
+
+    if (reserve_path(p_cur, 0) == 0)
+    {
+        return 0;
+    }
+
+    p_cur->path[0] = '\0';
+
+    /* If root_path is empty */
+    if (p_cur->root_path == NULL)
+    {
+        /* There is nothing more to get. */
+        return 0;
+    }
+
+    /* Find the next delimiter */
+    const char* ptr = strchr(p_cur->root_path, ',');
+
+    /* Eat blank spaces */
+    while (isblank(*p_cur->root_path)) {p_cur->root_path++;}
+
+    /* If we have another delimiter */
+    if (ptr != NULL)
+    {
+        /* Then extract the string between root_path and delimiter */
+        len = (ptr - p_cur->root_path);
+
+        if (reserve_path(p_cur, len) == 0)
+        {
+            return 0;
+        }
+
+        memcpy(p_cur->path, p_cur->root_path, len);
+        p_cur->path[len] = '\0';
+
+        /* Move root_path past delimiter (start of next value) */
+        p_cur->root_path += len + 1;
+    }
+    else
+    {
+        /* This is the last match. If there is anything left, use it. */
+        len = strlen(p_cur->root_path);
+
+        if (reserve_path(p_cur, len) == 0)
+        {
+            return 0;
+        }
+
+        memcpy(p_cur->path, p_cur->root_path, len + 1);
+
+        p_cur->root_path = NULL;
+    }
+
+    /* Trim right space */
+    rtrim(p_cur->path);
+
+    p_cur->current_node->path_len = strlen(p_cur->path);
+
+    return 1;
+}
+
+/* Update cursor to point to next top-level directory to search, if any. */
+static int next_directory(vtab_cursor *p_cur)
+{
+    vtab *p_vt = (vtab*)((sqlite3_vtab_cursor*)p_cur)->pVtab;
+
+    /* Close the previous top-level directory, if there was one. */
+    if (p_cur->current_node->dir != NULL)
+    {
+        close_directory(p_cur->current_node->dir);
+        p_cur->current_node->dir = NULL;
+    }
+
+    apr_pool_clear(p_cur->current_node->pool);
+
+    /* Get the next path name in the search list. If there isn't next_path()
+     * will return 0, as do we. */
+    if (next_path(p_cur) == 0)
+    {
+        /* No more directories to search. End of result set. */
+        p_cur->eof = 1;
+
+        return SQLITE_OK;
+    }
+
+    /* Now try to open the directory. If it can be opended, set up the dirent to
+    ** return as a row in the rowset.
+    */
+
+    /* ZERO-FILL DIRENT: Very important to zero-fill here, otherwise we may have
+    ** dirent.fname and/or dirent.name members pointing to invalid addresses
+    ** after apr_stat(). Our code depends in being able to check NULL status of
+    ** these members, so all pointers must be NULL by default.
+    */
+    memset(&p_cur->current_node->dirent, 0, sizeof(apr_finfo_t));
+
+    p_cur->current_node->depth = 0;
+    p_cur->depth               = 0;
+
+    /** Check to see if the directory exists. This also gets the information
+     *  for the first row: the top level directory itself. (APR_INCOMPLETE just
+     *  means that apr_stat() doesn't do APR_FINFO_NAME.)
+     */
+    p_cur->status = apr_stat( &p_cur->current_node->dirent, 
+                              p_cur->path, p_cur->wanted, 
+                              p_cur->current_node->pool );
+
+    p_cur->current_node->inode = p_cur->current_node->dirent.inode;
+
+    /* The row of a search path is named like any other, by its last part. */
+    if (p_cur->status == APR_SUCCESS || p_cur->status == APR_INCOMPLETE)
+    {
+        int name_len;
+        const char* name = root_name(p_cur->path, strlen(p_cur->path), &name_len);
+
+        p_cur->current_node->dirent.name = apr_pstrmemdup( p_cur->current_node->pool,
+                                                           name, name_len );
+    }
+
+    if (p_cur->status != APR_SUCCESS && p_cur->status != APR_INCOMPLETE)
+    {
+        /* Directory does not exist */
+        p_cur->eof = 1;
+
+        if (p_vt->base.zErrMsg != NULL)
+        {
+            sqlite3_free(p_vt->base.zErrMsg);
+        }
+
+        printf( "Invalid directory: %s\n", p_cur->path );
+
+        p_vt->base.zErrMsg = sqlite3_mprintf("Invalid directory: %s", p_cur->path);
+
+        return SQLITE_ERROR;
+    }
+    else 
+    {
+        /* A pruned search path is left out altogether. */
+        if ( p_cur->current_node->dirent.filetype == APR_DIR
+             && query_pruned( &p_cur->query, p_cur->path, 
+                              apr_filepath_name_get(p_cur->path) ) )
+        {
+            return next_directory(p_cur);
+        }
+
+        /* If this entry is a directory, then open it (unless maxdepth = 0) */
+        if ( p_cur->current_node->dirent.filetype == APR_DIR 
+             && p_cur->query.maxdepth != 0 )
+        {
+            p_cur->status = open_directory( &p_cur->current_node->handle, NULL,
+                                            p_cur->path, NULL,
+                                            p_cur->backend, p_cur->ring, 
+                                            walk_query(p_cur), 0, 
+                                            p_cur->current_node->pool );
+
+            if (p_cur->status == APR_SUCCESS)
+            {
+                p_cur->current_node->dir = &p_cur->current_node->handle;
+            }
+            else
+            {
+                /* Could not open directory */
+                p_cur->eof = 1;
+                
+                if (p_vt->base.zErrMsg != NULL)
+                {
+                    sqlite3_free(p_vt->base.zErrMsg);
+                }
+                
+                printf("Could not open directory: %s\n", p_cur->path );
+                
+                p_vt->base.zErrMsg = sqlite3_mprintf( "Could not open directory: %s", 
+                                                      p_cur->path );
+                
+                return SQLITE_ERROR;
+            }
+        }
+        else
+        {
+            /** Set dir to NULL to indicate that this entry is NOT a
+             *  directory. In this case, we have a top-level file, not a
+             *  top-level directory (or one we don't search). vt_next() will
+             *  pick up on this and do the Right Thing.
+             */
+            p_cur->current_node->dir = NULL;
+        }
+    }
+
+    return SQLITE_OK;
+}
+
+/** Applies the arguments given to the constructor, e.g.
+ *
+ *    create virtual table f using filesystem('threads=16');
+ *
+ *  argv[0] through argv[2] are the module, database and table names. Every
+ *  argument after that is a comma-delimited list of name=value pairs, quoted
+ *  or not.
+ */
+int parse_arguments( vtab* p_vt, int argc, const char *const*argv,
+                     char **pzErr )
+{
+    int i;
+
+    for (i = 3; i < argc; i++)
+    {
+        char* args = strdup(argv[i]);
+        char* arg  = args;
+        char* end;
+
+        /* Strip the quotes SQLite leaves on string arguments. */
+        if (*arg == '\'' || *arg == '"')
+        {
+            arg++;
+
+            if (strlen(arg) > 0)
+            {
+                arg[strlen(arg) - 1] = '\0';
+            }
+        }
+
+        while (arg != NULL && *arg != '\0')
+        {
+            char* name;
+            char* value;
+
+            /* Split off the next pair */
+            if ((end = strchr(arg, ',')) != NULL)
+            {
+                *end++ = '\0';
+            }
+
+            /* Eat blank spaces */
+            while (isblank(*arg)) {arg++;}
+            rtrim(arg);
+
+            name = arg;
+            arg  = end;
+
+            if (*name == '\0')
+            {
+                continue;
+            }
+
+            if ((value = strchr(name, '=')) == NULL)
+            {
+                *pzErr = sqlite3_mprintf("Missing value for argument: %s", name);
+                free(args);
+
+                return SQLITE_ERROR;
+            }
+
+            *value++ = '\0';
+            rtrim(name);
+            while (isblank(*value)) {value++;}
+
+            if (strcmp(name, "backend") == 0)
+            {
+                if (strcmp(value, "apr") == 0)
+                {
+                    p_vt->backend = BACKEND_APR;
+                }
+#ifdef LINUX
+                else if (strcmp(value, "native") == 0)
+                {
+                    p_vt->backend = BACKEND_NATIVE;
+                }
+#endif
+#ifdef HAVE_IO_URING
+                else if (strcmp(value, "uring") == 0)
+                {
+                    p_vt->backend = BACKEND_URING;
+                }
+#endif
+                else
+                {
+                    *pzErr = sqlite3_mprintf("Unsupported backend: %s", value);
+                    free(args);
+
+                    return SQLITE_ERROR;
+                }
+            }
+            else if (strcmp(name, "threads") == 0)
+            {
+                p_vt->threads = atoi(value);
+
+                if (p_vt->threads < 0 || p_vt->threads > WALKER_MAX_THREADS)
+                {
+                    *pzErr = sqlite3_mprintf( "threads must be between 0 and %i",
+                                              WALKER_MAX_THREADS );
+                    free(args);
+
+                    return SQLITE_ERROR;
+                }
+            }
+            else if (strcmp(name, "readahead") == 0)
+            {
+                p_vt->readahead = atoi(value);
+
+                if (p_vt->readahead < 0)
+                {
+                    *pzErr = sqlite3_mprintf("readahead must be 0 or more");
+                    free(args);
+
+                    return SQLITE_ERROR;
+                }
+            }
+            else if (strcmp(name, "cache") == 0)
+            {
+                if (snapshot_open(p_vt, value, pzErr) != SQLITE_OK)
+                {
+                    free(args);
+
+                    return SQLITE_ERROR;
+                }
+            }
+            else if (strcmp(name, "rescan") == 0)
+            {
+                if (strcmp(value, "full") == 0)
+                {
+                    p_vt->rescan = RESCAN_FULL;
+                }
+                else if (strcmp(value, "changed") == 0)
+                {
+                    p_vt->rescan = RESCAN_CHANGED;
+                }
+                else
+                {
+                    *pzErr = sqlite3_mprintf( "rescan must be full or changed: %s", 
+                                              value );
+                    free(args);
+
+                    return SQLITE_ERROR;
+                }
+            }
+#ifdef LINUX
+            else if (strcmp(name, "watch") == 0)
+            {
+                if (strcmp(value, "true") == 0 || strcmp(value, "1") == 0)
+                {
+                    if (watch_create(p_vt, pzErr) != SQLITE_OK)
+                    {
+                        free(args);
+
+                        return SQLITE_ERROR;
+                    }
+                }
+                else if (strcmp(value, "false") != 0 && strcmp(value, "0") != 0)
+                {
+                    *pzErr = sqlite3_mprintf( "watch must be true or false: %s", 
+                                              value );
+                    free(args);
+
+                    return SQLITE_ERROR;
+                }
+            }
+#endif
+            else if (strcmp(name, "recursive") == 0)
+            {
+                if (strcmp(value, "true") == 0 || strcmp(value, "1") == 0)
+                {
+                    p_vt->maxdepth = -1;
+                }
+                else if (strcmp(value, "false") == 0 || strcmp(value, "0") == 0)
+                {
+                    p_vt->maxdepth = 1;
+                }
+                else
+                {
+                    *pzErr = sqlite3_mprintf( "recursive must be true or false: %s", 
+                                              value );
+                    free(args);
+
+                    return SQLITE_ERROR;
+                }
+            }
+            else
+            {
+                *pzErr = sqlite3_mprintf("Unknown argument: %s", name);
+                free(args);
+
+                return SQLITE_ERROR;
+            }
+        }
+
+        free(args);
+    }
+
+    return SQLITE_OK;
+}
+
+/*-------------------------------------------------------------------*/
+/* Planner statistics                                                */
+/*-------------------------------------------------------------------*/
+
+/** vt_best_index() prices a plan by the rows its walk goes through. When
+ *  SQLite knows the search paths at planning time (they are literals in the
+ *  statement, say), those are estimated from the file system itself, and
+ *  kept until the search path's mtime changes, or for PATH_STATS_TTL
+ *  seconds. Otherwise the ROWS_* guesses stand.
+ *
+ *  The estimate is Knuth's: go down the tree from the search path, into a
+ *  subdirectory at random at a time, and have each directory on the way
+ *  stand in for all of its siblings. A few of these descents are averaged,
+ *  level by level, so that a walk that stops at some depth can be priced
+ *  too. No more files than the file system has in use (statvfs()) can be in
+ *  a tree on it, and a tree at the root of a file system is all of them.
+ */
+
+/* Most search paths the table keeps statistics on. It starts over after. */
+#define PATH_STATS_MAX 1024
+
+/* Seconds the statistics on a search path are kept. */
+#define PATH_STATS_TTL 60
+
+/* Number of descents averaged. They go PATH_LEVELS deep at most. */
+#define PATH_SAMPLES 16
+
+/* Most entries read from a directory on the way. A bigger one is taken to
+ * have this many. */
+#define PATH_SAMPLE_ENTRIES 100000
+
+/* What the planner knows about a search path. */
+struct pathstats
+{
+    /* When it was sampled, and its mtime then. */
+    apr_time_t checked;
+    apr_time_t mtime;
+
+    /* The number of rows no deeper than each level below it (level[0] is the
+     * search path itself, always 1). */
+    double level[PATH_LEVELS];
+};
+
+/* The next number from a simple linear congruential generator. */
+static unsigned int sample_random(unsigned int* seed)
+{
+    *seed = *seed * 1103515245 + 12345;
+
+    return (*seed >> 16) & 0x7fff;
+}
+
+/** Reads directory path (up to PATH_SAMPLE_ENTRIES entries) for a descent:
+ *  sets *entries and *subdirs to the number of entries and subdirectories in
+ *  it, and returns the full path of one of the subdirectories, picked at
+ *  random, or NULL if it has none.
+ */
+static char* sample_directory( const char* path, unsigned int* seed,
+                               double* entries, double* subdirs, 
+                               apr_pool_t* pool )
+{
+    apr_dir_t* dir;
+    apr_pool_t* dir_pool;
+    apr_finfo_t finfo;
+    apr_status_t rv;
+    char* pick = NULL;
+
+    *entries = 0;
+    *subdirs = 0;
+
+    /* APR copies every name it reads into the directory's pool. Only the pick
+     * is kept. */
+    if (apr_pool_create(&dir_pool, pool) != APR_SUCCESS)
+    {
+        return NULL;
+    }
+
+    if (apr_dir_open(&dir, path, dir_pool) != APR_SUCCESS)
+    {
+        apr_pool_destroy(dir_pool);
+
+        return NULL;
+    }
+
+    while ( *entries < PATH_SAMPLE_ENTRIES
+            && ( (rv = apr_dir_read(&finfo, APR_FINFO_NAME|APR_FINFO_TYPE, dir)) 
+                 == APR_SUCCESS || rv == APR_INCOMPLETE ) )
+    {
+        if (strcmp(finfo.name, ".") == 0 || strcmp(finfo.name, "..") == 0)
+        {
+            continue;
+        }
+
+        *entries += 1;
+
+        if (finfo.filetype != APR_DIR)
+        {
+            continue;
+        }
+
+        /* Each subdirectory so far is as likely to be the one picked. */
+        *subdirs += 1;
+
+        if (sample_random(seed) % (unsigned int)*subdirs == 0)
+        {
+            pick = apr_pstrcat(pool, path, path_separator(path), finfo.name, NULL);
+        }
+    }
+
+    apr_dir_close(dir);
+    apr_pool_destroy(dir_pool);
+
+    return pick;
+}
+
+/* Files in use on the file system path is on, 0 if that isn't known. */
+static double files_in_use(const char* path)
+{
+#ifdef UNIX
+    struct statvfs sv;
+
+    if (statvfs(path, &sv) == 0 && sv.f_files > sv.f_ffree)
+    {
+        return (double)(sv.f_files - sv.f_ffree);
+    }
+#endif
+
+    return 0;
+}
+
+/* Estimate s->level for directory path, which is on device. */
+static void sample_tree( struct pathstats* s, const char* path, 
+                         apr_dev_t device, apr_pool_t* pool )
+{
+    unsigned int seed = 1;
+    double files      = files_in_use(path);
+    apr_finfo_t parent;
+    apr_status_t rv;
+    int mount;
+    int i;
+    int j;
+
+    /* A mount point is on another device than its parent. / is its own. */
+    rv = apr_stat( &parent, apr_pstrcat(pool, path, "/..", NULL), 
+                   APR_FINFO_IDENT, pool );
+
+    mount = ( (rv == APR_SUCCESS || rv == APR_INCOMPLETE)
+              && (parent.device != device || strcmp(path, "/") == 0) );
+
+    for (i = 0; i < PATH_LEVELS; i++)
+    {
+        s->level[i] = 0;
+    }
+
+    for (j = 0; j < PATH_SAMPLES; j++)
+    {
+        char* dir     = (char*)path;
+        double weight = 1;
+
+        for (i = 1; i < PATH_LEVELS && dir != NULL; i++)
+        {
+            double entries;
+            double subdirs;
+
+            dir = sample_directory(dir, &seed, &entries, &subdirs, pool);
+
+            /* Each of the directories at this level has as many entries. */
+            s->level[i] += weight * entries / PATH_SAMPLES;
+            weight      *= subdirs;
+        }
+    }
+
+    /* From rows at each level to rows down to it. */
+    s->level[0] = 1;
+
+    for (i = 1; i < PATH_LEVELS; i++)
+    {
+        s->level[i] += s->level[i - 1];
+
+        if (files > 0 && s->level[i] > files)
+        {
+            s->level[i] = files;
+        }
+    }
+
+    /* The whole file system is below its root, however the descents went. */
+    if (mount != 0 && files > s->level[PATH_LEVELS - 1])
+    {
+        s->level[PATH_LEVELS - 1] = files;
+    }
+}
+
+/** What the planner knows about search path path, brought up to date. NULL
+ *  if it can't be stat'ed.
+ */
+static const struct pathstats* path_stats(vtab* p_vt, const char* path)
+{
+    struct pathstats* s;
+    apr_finfo_t finfo;
+    apr_pool_t* pool;
+    apr_status_t rv;
+    apr_time_t now = apr_time_now();
+    int i;
+
+    if (p_vt->stats == NULL || apr_hash_count(p_vt->stats) >= PATH_STATS_MAX)
+    {
+        if (p_vt->stats != NULL)
+        {
+            apr_pool_clear(p_vt->stats_pool);
+        }
+        else if (apr_pool_create(&p_vt->stats_pool, p_vt->pool) != APR_SUCCESS)
+        {
+            return NULL;
+        }
+
+        p_vt->stats = apr_hash_make(p_vt->stats_pool);
+    }
+
+    /* Scratch memory for the descents. */
+    if (apr_pool_create(&pool, p_vt->pool) != APR_SUCCESS)
+    {
+        return NULL;
+    }
+
+    rv = apr_stat(&finfo, path, APR_FINFO_TYPE|APR_FINFO_MTIME|APR_FINFO_IDENT, pool);
+
+    if (rv != APR_SUCCESS && rv != APR_INCOMPLETE)
+    {
+        apr_pool_destroy(pool);
+
+        return NULL;
+    }
+
+    if ((s = apr_hash_get(p_vt->stats, path, APR_HASH_KEY_STRING)) == NULL)
+    {
+        s = apr_pcalloc(p_vt->stats_pool, sizeof(struct pathstats));
+
+        apr_hash_set( p_vt->stats, apr_pstrdup(p_vt->stats_pool, path),
+                      APR_HASH_KEY_STRING, s );
+    }
+    else if ( s->mtime == finfo.mtime 
+              && now - s->checked < PATH_STATS_TTL * APR_USEC_PER_SEC )
+    {
+        apr_pool_destroy(pool);
+
+        return s;
+    }
+
+    s->checked = now;
+    s->mtime   = finfo.mtime;
+
+    if (finfo.filetype == APR_DIR)
+    {
+        sample_tree(s, path, finfo.device, pool);
+    }
+    else
+    {
+        /* A file is a row of its own, at any depth. */
+        for (i = 0; i < PATH_LEVELS; i++)
+        {
+            s->level[i] = 1;
+        }
+    }
+
+    apr_pool_destroy(pool);
+
+    return s;
+}
+
+/** Estimates the rows in a walk of the search paths in list (as path match
+ *  takes them), level by level: level[i] is set to the number of rows no
+ *  deeper than i. Returns the number of rows in the whole walk, 0 if none
+ *  of the paths can be stat'ed. *cached is set if the snapshot has all of
+ *  them, in which case the numbers are its own.
+ */
+static double walk_rows(vtab* p_vt, const char* list, double* level, int* cached)
+{
+    const struct pathstats* s;
+    apr_pool_t* pool;
+    char* path;
+    int snapshots = 0;
+    int walks     = 0;
+    int i;
+
+    *cached = 0;
+
+    for (i = 0; i < PATH_LEVELS; i++)
+    {
+        level[i] = 0;
+    }
+
+    if (apr_pool_create(&pool, p_vt->pool) != APR_SUCCESS)
+    {
+        return 0;
+    }
+
+    while ((path = next_search_path(&list, pool)) != NULL)
+    {
+        if ( *path != '\0' && p_vt->cache != NULL
+             && snapshot_root(p_vt, path, p_vt->maxdepth, level) != 0 )
+        {
+            snapshots++;
+
+            continue;
+        }
+
+        walks++;
+
+        if (*path == '\0' || (s = path_stats(p_vt, path)) == NULL)
+        {
+            continue;
+        }
+
+        for (i = 0; i < PATH_LEVELS; i++)
+        {
+            level[i] += s->level[i];
+        }
+    }
+
+    apr_pool_destroy(pool);
+
+    *cached = snapshots > 0 && walks == 0;
+
+    return level[PATH_LEVELS - 1];
+}
+
+/* The rows in a walk no deeper than depth, from what walk_rows() set level to. */
+static double shallow_rows(const double* level, int depth)
+{
+    return level[depth < PATH_LEVELS ? depth : PATH_LEVELS - 1];
+}
+
+/*-------------------------------------------------------------------*/
+/* Query constraints                                                 */
+/*-------------------------------------------------------------------*/
+
+/* Clear q, back to walking everything. */
+void query_reset(struct query* q)
+{
+    int i;
+
+    for (i = 0; i < q->nnames; i++)
+    {
+        free(q->names[i]);
+    }
+
+    free(q->names);
+
+    for (i = 0; i < q->npatterns; i++)
+    {
+#ifdef UNIX
+        if (q->patterns[i].type == PATTERN_REGEXP)
+        {
+            regfree(&q->patterns[i].regex);
+        }
+#endif
+
+        free(q->patterns[i].text);
+    }
+
+    free(q->patterns);
+    free(q->predicates);
+
+    for (i = 0; i < q->nprune; i++)
+    {
+        free(q->prune[i]);
+    }
+
+    free(q->prune);
+    free(q->prune_list);
+    free(q->inodes);
+
+    q->maxdepth        = -1;
+    q->by_name         = 0;
+    q->names           = NULL;
+    q->nnames          = 0;
+    q->names_size      = 0;
+    q->patterns        = NULL;
+    q->npatterns       = 0;
+    q->patterns_size   = 0;
+    q->predicates      = NULL;
+    q->npredicates     = 0;
+    q->predicates_size = 0;
+    q->prune           = NULL;
+    q->nprune          = 0;
+    q->prune_size      = 0;
+    q->prune_list      = NULL;
+    q->by_inode        = 0;
+    q->inodes          = NULL;
+    q->ninodes         = 0;
+    q->inodes_size     = 0;
+}
+
+/** Add a name a row may have. Returns 0 when out of memory. A name that no
+ *  entry could have (it has a slash in it, say) is still added: the name of
+ *  a top-level row is the path it was given as.
+ */
+static int query_add_name(struct query* q, const char* name)
+{
+    q->by_name = 1;
+
+    if (q->nnames == q->names_size)
+    {
+        int size     = q->names_size == 0 ? 8 : q->names_size * 2;
+        char** names = realloc(q->names, size * sizeof(char*));
+
+        if (names == NULL)
+        {
+            return 0;
+        }
+
+        q->names      = names;
+        q->names_size = size;
+    }
+
+    if ((q->names[q->nnames] = strdup(name)) == NULL)
+    {
+        return 0;
+    }
+
+    q->nnames++;
+
+    return 1;
+}
+
+static int compare_names(const void* a, const void* b)
+{
+    return strcmp(*(const char**)a, *(const char**)b);
+}
+
+static int compare_inodes(const void* a, const void* b)
+{
+    sqlite3_int64 x = *(const sqlite3_int64*)a;
+    sqlite3_int64 y = *(const sqlite3_int64*)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* Sort the names and inodes (and drop duplicates) once they are all in. */
+static void query_finish(struct query* q)
+{
+    int i;
+    int n = 0;
+
+    if (q->ninodes > 1)
+    {
+        qsort(q->inodes, q->ninodes, sizeof(sqlite3_int64), compare_inodes);
+
+        for (i = 0; i < q->ninodes; i++)
+        {
+            if (n == 0 || q->inodes[n - 1] != q->inodes[i])
+            {
+                q->inodes[n++] = q->inodes[i];
+            }
+        }
+
+        q->ninodes = n;
+        n          = 0;
+    }
+
+    if (q->nnames < 2)
+    {
+        return;
+    }
+
+    qsort(q->names, q->nnames, sizeof(char*), compare_names);
+
+    for (i = 0; i < q->nnames; i++)
+    {
+        if (n > 0 && strcmp(q->names[n - 1], q->names[i]) == 0)
+        {
+            free(q->names[i]);
+            continue;
+        }
+
+        q->names[n++] = q->names[i];
+    }
+
+    q->nnames = n;
+}
+
+#if SQLITE_VERSION_NUMBER >= 3010000
+/** Add a pattern the name of a row must match: op is one of the
+ *  SQLITE_INDEX_CONSTRAINT_GLOB, _LIKE or _REGEXP operators. Patterns that
+ *  are just a literal with a wildcard at one end or both (*.so, lib%) are
+ *  matched without the general matchers. Returns an SQLite error code, with
+ *  the message in *pzErr for a bad regular expression.
+ */
+static int query_add_pattern( struct query* q, int op, const char* text, 
+                              char** pzErr )
+{
+    struct pattern* p;
+    int len = strlen(text);
+    int lead;
+    int trail;
+    int i;
+
+    if (q->npatterns == q->patterns_size)
+    {
+        int size = q->patterns_size == 0 ? 4 : q->patterns_size * 2;
+        struct pattern* patterns = realloc( q->patterns, 
+                                            size * sizeof(struct pattern) );
+
+        if (patterns == NULL)
+        {
+            return SQLITE_NOMEM;
+        }
+
+        q->patterns      = patterns;
+        q->patterns_size = size;
+    }
+
+    p = &q->patterns[q->npatterns];
+
+    p->type   = PATTERN_GLOB;
+    p->nocase = 0;
+
+    if ((p->text = strdup(text)) == NULL)
+    {
+        return SQLITE_NOMEM;
+    }
+
+    p->len = len;
+
+    if (op == SQLITE_INDEX_CONSTRAINT_REGEXP)
+    {
+#ifdef UNIX
+        int rc = regcomp(&p->regex, text, REG_EXTENDED|REG_NOSUB);
+
+        if (rc != 0)
+        {
+            char error[256];
+
+            regerror(rc, &p->regex, error, sizeof(error));
+            *pzErr = sqlite3_mprintf("Invalid regular expression: %s", error);
+            free(p->text);
+
+            return SQLITE_ERROR;
+        }
+
+        p->type = PATTERN_REGEXP;
+        q->npatterns++;
+
+        return SQLITE_OK;
+#else
+        *pzErr = sqlite3_mprintf("regexp is not supported on this platform");
+        free(p->text);
+
+        return SQLITE_ERROR;
+#endif
+    }
+
+    if (op == SQLITE_INDEX_CONSTRAINT_LIKE)
+    {
+        p->type   = PATTERN_LIKE;
+        p->nocase = 1;
+    }
+
+    q->npatterns++;
+
+    /* Look for a literal between leading and/or trailing wildcards. */
+    lead  = len > 0 && text[0] == (p->nocase ? '%' : '*');
+    trail = len > lead && text[len - 1] == (p->nocase ? '%' : '*');
+
+    for (i = lead; i < len - trail; i++)
+    {
+        if (p->nocase ? strchr("%_", text[i]) != NULL 
+                      : strchr("*?[", text[i]) != NULL)
+        {
+            /* A general pattern. */
+            return SQLITE_OK;
+        }
+    }
+
+    memmove(p->text, p->text + lead, len - lead - trail);
+    p->len = len - lead - trail;
+    p->text[p->len] = '\0';
+
+    if (lead && trail)
+    {
+        p->type = PATTERN_CONTAINS;
+    }
+    else if (lead)
+    {
+        p->type = PATTERN_SUFFIX;
+    }
+    else if (trail)
+    {
+        p->type = PATTERN_PREFIX;
+    }
+    else
+    {
+        p->type = PATTERN_EXACT;
+    }
+
+    return SQLITE_OK;
+}
+#endif
+
+/* Compares n bytes, ignoring ASCII case if nocase, as LIKE does. */
+static int same_text(const char* a, const char* b, int n, int nocase)
+{
+    int i;
+
+    if (nocase == 0)
+    {
+        return memcmp(a, b, n) == 0;
+    }
+
+    for (i = 0; i < n; i++)
+    {
+        if ( a[i] != b[i] 
+             && tolower((unsigned char)a[i]) != tolower((unsigned char)b[i]) )
+        {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/* Whether name matches pattern p. */
+static int pattern_matches(const struct pattern* p, const char* name)
+{
+    int len = strlen(name);
+    int i;
+
+    switch (p->type)
+    {
+        case PATTERN_EXACT:
+            return len == p->len && same_text(name, p->text, len, p->nocase);
+
+        case PATTERN_PREFIX:
+            return len >= p->len && same_text(name, p->text, p->len, p->nocase);
+
+        case PATTERN_SUFFIX:
+            return ( len >= p->len 
+                     && same_text(name + len - p->len, p->text, p->len, p->nocase) );
+
+        case PATTERN_CONTAINS:
+        {
+            for (i = 0; i + p->len <= len; i++)
+            {
+                if (same_text(name + i, p->text, p->len, p->nocase))
+                {
+                    return 1;
+                }
+            }
+
+            return 0;
+        }
+
+        case PATTERN_GLOB:
+            return sqlite3_strglob(p->text, name) == 0;
+
+#if SQLITE_VERSION_NUMBER >= 3010000
+        case PATTERN_LIKE:
+            return sqlite3_strlike(p->text, name, 0) == 0;
+#endif
+
+#ifdef UNIX
+        case PATTERN_REGEXP:
+            return regexec(&p->regex, name, 0, NULL, 0) == 0;
+#endif
+    }
+
+    return 0;
+}
+
+/* Whether a row named name gets past q. */
+static int query_name_ok(const struct query* q, const char* name)
+{
+    int i;
+
+    if (q->by_name == 0 && q->npatterns == 0)
+    {
+        return 1;
+    }
+
+    if (name == NULL)
+    {
+        return 0;
+    }
+
+    if ( q->by_name != 0 
+         && ( q->nnames == 0 
+              || bsearch( &name, q->names, q->nnames, 
+                          sizeof(char*), compare_names ) == NULL ) )
+    {
+        return 0;
+    }
+
+    for (i = 0; i < q->npatterns; i++)
+    {
+        if (pattern_matches(&q->patterns[i], name) == 0)
+        {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/* Go no deeper than depth (see struct query). */
+static void query_limit_depth(struct query* q, int depth)
+{
+    if (q->maxdepth < 0 || depth < q->maxdepth)
+    {
+        q->maxdepth = depth;
+    }
+}
+
+/** Add a comma-separated list of directories to prune (see struct query).
+ *  Returns 0 when out of memory.
+ */
+static int query_add_prune(struct query* q, const char* list)
+{
+    const char* item = list;
+    char* text;
+
+    /* Keep the lists as given, joined up. */
+    if (q->prune_list == NULL)
+    {
+        text = strdup(list);
+    }
+    else if ((text = malloc(strlen(q->prune_list) + strlen(list) + 3)) != NULL)
+    {
+        sprintf(text, "%s, %s", q->prune_list, list);
+    }
+
+    if (text == NULL)
+    {
+        return 0;
+    }
+
+    free(q->prune_list);
+    q->prune_list = text;
+
+    while (item != NULL)
+    {
+        const char* end = strchr(item, ',');
+        int len;
+
+        while (isblank(*item)) {item++;}
+
+        len = end != NULL ? end - item : (int)strlen(item);
+
+        /* Trailing blanks, and slashes: /proc/ is /proc. */
+        while (len > 1 && (isblank(item[len - 1]) || item[len - 1] == '/'))
+        {
+            len--;
+        }
+
+        if (len > 0 && !isblank(item[0]))
+        {
+            if (q->nprune == q->prune_size)
+            {
+                int size     = q->prune_size == 0 ? 4 : q->prune_size * 2;
+                char** prune = realloc(q->prune, size * sizeof(char*));
+
+                if (prune == NULL)
+                {
+                    return 0;
+                }
+
+                q->prune      = prune;
+                q->prune_size = size;
+            }
+
+            if ((q->prune[q->nprune] = strndup(item, len)) == NULL)
+            {
+                return 0;
+            }
+
+            q->nprune++;
+        }
+
+        item = end != NULL ? end + 1 : NULL;
+    }
+
+    return 1;
+}
+
+/** Whether the directory at path, named name, is pruned: left out of the walk
+ *  altogether.
+ */
+static int query_pruned(const struct query* q, const char* path, const char* name)
+{
+    int i;
+
+    for (i = 0; i < q->nprune; i++)
+    {
+        const char* p = q->prune[i];
+
+        if (sqlite3_strglob(p, strchr(p, '/') != NULL ? path : name) == 0)
+        {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/** The deepest a row can be and meet depth <op> value, where op is one of
+ *  SQLITE_INDEX_CONSTRAINT_EQ, _LE or _LT: -1 if no row can, and INT_MAX if
+ *  they all can.
+ */
+static int depth_bound(int op, sqlite3_value* value)
+{
+    double bound;
+
+    switch (sqlite3_value_numeric_type(value))
+    {
+        case SQLITE_INTEGER:
+        case SQLITE_FLOAT:
+        {
+            bound = sqlite3_value_double(value);
+
+            if (bound < 0 || bound >= INT_MAX)
+            {
+                return bound < 0 ? -1 : INT_MAX;
+            }
+
+            /* depth < 2.5 is depth <= 2, as is depth < 3. */
+            if (op == SQLITE_INDEX_CONSTRAINT_LT && bound == (int)bound)
+            {
+                bound -= 1;
+            }
+
+            break;
+        }
+
+        case SQLITE_NULL:
+        {
+            return -1;
+        }
+
+        default:
+        {
+            /* Text comes after every number. */
+            return op == SQLITE_INDEX_CONSTRAINT_EQ ? -1 : INT_MAX;
+        }
+    }
+
+    return bound < 0 ? -1 : (int)bound;
+}
+
+/** Add a numeric constraint: column compared by op (SQLITE_INDEX_CONSTRAINT_EQ,
+ *  _GT, ...) with value, which must not be NULL. Returns 0 when out of
+ *  memory.
+ */
+static int query_add_predicate( struct query* q, int column, int op, 
+                                sqlite3_value* value )
+{
+    struct predicate* p;
+
+    if (q->npredicates == q->predicates_size)
+    {
+        int size = q->predicates_size == 0 ? 4 : q->predicates_size * 2;
+        struct predicate* predicates = realloc( q->predicates, 
+                                                size * sizeof(struct predicate) );
+
+        if (predicates == NULL)
+        {
+            return 0;
+        }
+
+        q->predicates      = predicates;
+        q->predicates_size = size;
+    }
+
+    p = &q->predicates[q->npredicates++];
+
+    p->column = column;
+    p->op     = op;
+
+    /** The columns are declared int, so SQLite compares them with text that
+     *  looks like a number (size > '100') as that number. The rest of the text,
+     *  and blobs, come after every number.
+     */
+    switch (sqlite3_value_numeric_type(value))
+    {
+        case SQLITE_INTEGER:
+        {
+            p->type = SQLITE_INTEGER;
+            p->i    = sqlite3_value_int64(value);
+
+            break;
+        }
+
+        case SQLITE_FLOAT:
+        {
+            p->type = SQLITE_FLOAT;
+            p->r    = sqlite3_value_double(value);
+
+            break;
+        }
+
+        default:
+        {
+            p->type = SQLITE_TEXT;
+        }
+    }
+
+    return 1;
+}
+
+/* Compares x with the value of p, the way SQLite does: -1, 0 or 1. */
+static int predicate_compare(const struct predicate* p, sqlite3_int64 x)
+{
+    sqlite3_int64 y;
+
+    switch (p->type)
+    {
+        case SQLITE_INTEGER:
+        {
+            return x < p->i ? -1 : x > p->i;
+        }
+
+        case SQLITE_FLOAT:
+        {
+            /** Outside the range of an int64, the real is bigger or smaller
+             *  than any column. Inside it, compare with its integer part
+             *  first, so large integers don't lose precision as doubles.
+             */
+            if (p->r < -9223372036854775808.0)
+            {
+                return 1;
+            }
+
+            if (p->r >= 9223372036854775808.0)
+            {
+                return -1;
+            }
+
+            y = (sqlite3_int64)p->r;
+
+            if (x != y)
+            {
+                return x < y ? -1 : 1;
+            }
+
+            return (double)y < p->r ? -1 : (double)y > p->r;
+        }
+
+        default:
+        {
+            return -1;
+        }
+    }
+}
+
+/* Whether the value x of p's column meets p. */
+static int predicate_holds(const struct predicate* p, sqlite3_int64 x)
+{
+    int c = predicate_compare(p, x);
+
+    switch (p->op)
+    {
+        case SQLITE_INDEX_CONSTRAINT_EQ: return c == 0;
+        case SQLITE_INDEX_CONSTRAINT_GT: return c > 0;
+        case SQLITE_INDEX_CONSTRAINT_GE: return c >= 0;
+        case SQLITE_INDEX_CONSTRAINT_LT: return c < 0;
+        case SQLITE_INDEX_CONSTRAINT_LE: return c <= 0;
+#if SQLITE_VERSION_NUMBER >= 3021000
+        case SQLITE_INDEX_CONSTRAINT_NE: return c != 0;
+#endif
+    }
+
+    return 0;
+}
+
+/** Add an inode a row may have: the value of inode = n or rowid = n. Returns
+ *  0 when out of memory. The value is compared as an integer would be, so
+ *  inode = '12' finds inode 12, while 12.5 and 'abc' (or NULL) find nothing.
+ *  Neither does 0, the dir column of a search path's own row: no file has it.
+ */
+static int query_add_inode(struct query* q, sqlite3_value* value)
+{
+    sqlite3_int64 inode;
+
+    q->by_inode = 1;
+
+    switch (sqlite3_value_numeric_type(value))
+    {
+        case SQLITE_INTEGER:
+        {
+            inode = sqlite3_value_int64(value);
+
+            break;
+        }
+
+        case SQLITE_FLOAT:
+        {
+            double r = sqlite3_value_double(value);
+
+            if (r < -9.2e18 || r > 9.2e18 || r != (double)(sqlite3_int64)r)
+            {
+                return 1;
+            }
+
+            inode = (sqlite3_int64)r;
+
+            break;
+        }
+
+        default:
+        {
+            return 1;
+        }
+    }
+
+    if (inode == 0)
+    {
+        return 1;
+    }
+
+    if (q->ninodes == q->inodes_size)
+    {
+        int size              = q->inodes_size == 0 ? 8 : q->inodes_size * 2;
+        sqlite3_int64* inodes = realloc(q->inodes, size * sizeof(sqlite3_int64));
+
+        if (inodes == NULL)
+        {
+            return 0;
+        }
+
+        q->inodes      = inodes;
+        q->inodes_size = size;
+    }
+
+    q->inodes[q->ninodes++] = inode;
+
+    return 1;
+}
+
+/* Whether a row with the given inode gets past q. */
+static int query_inode_ok(const struct query* q, apr_ino_t inode)
+{
+    sqlite3_int64 x = (sqlite3_int64)inode;
+
+    if (q->by_inode == 0)
+    {
+        return 1;
+    }
+
+    return bsearch( &x, q->inodes, q->ninodes, 
+                    sizeof(sqlite3_int64), compare_inodes ) != NULL;
+}
+
+/** Whether a row gets past q: its name, and its entry finfo, which has been
+ *  stat'ed for the columns the query uses. dir_inode is the inode of the
+ *  directory it is in (column 13).
+ */
+static int query_row_ok( const struct query* q, const char* name, 
+                         const apr_finfo_t* finfo, apr_ino_t dir_inode )
+{
+    int i;
+
+    if (query_name_ok(q, name) == 0 || query_inode_ok(q, finfo->inode) == 0)
+    {
+        return 0;
+    }
+
+    for (i = 0; i < q->npredicates; i++)
+    {
+        const struct predicate* p = &q->predicates[i];
+
+        if (predicate_holds(p, column_value(finfo, dir_inode, p->column)) == 0)
+        {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/** query_row_ok() for a row whose values have been worked out already, as
+ *  they are for a row read from the snapshot.
+ */
+static int query_values_ok( const struct query* q, const char* name, 
+                            const struct filerow* row )
+{
+    int i;
+
+    if ( query_name_ok(q, name) == 0 
+         || query_inode_ok(q, (apr_ino_t)ROW_VALUE(row, COLUMN_INODE)) == 0 )
+    {
+        return 0;
+    }
+
+    for (i = 0; i < q->npredicates; i++)
+    {
+        const struct predicate* p = &q->predicates[i];
+
+        if (predicate_holds(p, ROW_VALUE(row, p->column)) == 0)
+        {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/* Whether name could be an entry in a directory. */
+static int is_entry_name(const char* name)
+{
+    return ( name[0] != '\0' && strchr(name, '/') == NULL
+             && strcmp(name, ".") != 0 && strcmp(name, "..") != 0 );
+}
+
+/*-------------------------------------------------------------------*/
+/* Directory access                                                  */
+/*-------------------------------------------------------------------*/
+
+/** Directories are read through open_directory(), read_directory() and
+ *  close_directory(), which hide the backend. The APR backend is
+ *  apr_dir_open() and friends, which stat every entry by its full path. The
+ *  native backend (Linux only) reads the raw entries with getdents64() and
+ *  stats them with statx() relative to the directory's file descriptor, so
+ *  the kernel never walks the path again. Subdirectories are opened with
+ *  openat() relative to their parent for the same reason.
+ */
+
+#ifdef LINUX
+
+/* The record getdents64() fills its buffer with. */
+struct linux_dirent64
+{
+    apr_uint64_t d_ino;
+    apr_int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+/* Set once statx() turns out not to exist (kernels before 4.11). */
+static int no_statx = 0;
+
+/* Maps a file mode to the APR file type. */
+static apr_filetype_e mode_filetype(mode_t mode)
+{
+    switch (mode & S_IFMT)
+    {
+        case S_IFREG:  return APR_REG;
+        case S_IFDIR:  return APR_DIR;
+        case S_IFLNK:  return APR_LNK;
+        case S_IFCHR:  return APR_CHR;
+        case S_IFBLK:  return APR_BLK;
+        case S_IFIFO:  return APR_PIPE;
+        case S_IFSOCK: return APR_SOCK;
+        default:       return APR_UNKFILE;
+    }
+}
+
+/* Maps a directory entry type (d_type) to the APR file type. */
+static apr_filetype_e dirent_filetype(unsigned char type)
+{
+    switch (type)
+    {
+        case DT_REG:  return APR_REG;
+        case DT_DIR:  return APR_DIR;
+        case DT_LNK:  return APR_LNK;
+        case DT_CHR:  return APR_CHR;
+        case DT_BLK:  return APR_BLK;
+        case DT_FIFO: return APR_PIPE;
+        case DT_SOCK: return APR_SOCK;
+        default:      return APR_UNKFILE;
+    }
+}
+
+/* Maps file mode bits to APR permissions, the same way apr_stat() does. */
+static apr_fileperms_t mode_perms(mode_t mode)
+{
+    apr_fileperms_t perms = 0;
+
+    if (mode & S_ISUID) perms |= APR_USETID;
+    if (mode & S_IRUSR) perms |= APR_UREAD;
+    if (mode & S_IWUSR) perms |= APR_UWRITE;
+    if (mode & S_IXUSR) perms |= APR_UEXECUTE;
+    if (mode & S_ISGID) perms |= APR_GSETID;
+    if (mode & S_IRGRP) perms |= APR_GREAD;
+    if (mode & S_IWGRP) perms |= APR_GWRITE;
+    if (mode & S_IXGRP) perms |= APR_GEXECUTE;
+    if (mode & S_ISVTX) perms |= APR_WSTICKY;
+    if (mode & S_IROTH) perms |= APR_WREAD;
+    if (mode & S_IWOTH) perms |= APR_WWRITE;
+    if (mode & S_IXOTH) perms |= APR_WEXECUTE;
+
+    return perms;
+}
+
+#ifdef STATX_BASIC_STATS
+
+/* The statx() mask for the APR_FINFO_* fields in wanted. */
+static unsigned int statx_mask(apr_int32_t wanted)
+{
+    unsigned int mask = STATX_TYPE;
+
+    if (wanted & APR_FINFO_SIZE)  mask |= STATX_SIZE;
+    if (wanted & APR_FINFO_CSIZE) mask |= STATX_BLOCKS;
+    if (wanted & APR_FINFO_USER)  mask |= STATX_UID;
+    if (wanted & APR_FINFO_GROUP) mask |= STATX_GID;
+    if (wanted & APR_FINFO_PROT)  mask |= STATX_MODE;
+    if (wanted & APR_FINFO_MTIME) mask |= STATX_MTIME;
+    if (wanted & APR_FINFO_CTIME) mask |= STATX_CTIME;
+    if (wanted & APR_FINFO_ATIME) mask |= STATX_ATIME;
+    if (wanted & APR_FINFO_NLINK) mask |= STATX_NLINK;
+    if (wanted & APR_FINFO_INODE) mask |= STATX_INO;
+
+    return mask;
+}
+
+/* Fills in finfo from what statx() returned, as apr_stat() would. */
+static void statx_finfo(const struct statx* stx, apr_finfo_t* finfo)
+{
+    finfo->valid      = APR_FINFO_MIN|APR_FINFO_IDENT|APR_FINFO_NLINK|
+                        APR_FINFO_OWNER|APR_FINFO_PROT|APR_FINFO_CSIZE;
+    finfo->filetype   = mode_filetype(stx->stx_mode);
+    finfo->protection = mode_perms(stx->stx_mode);
+    finfo->user       = stx->stx_uid;
+    finfo->group      = stx->stx_gid;
+    finfo->size       = stx->stx_size;
+    finfo->csize      = stx->stx_blocks * 512;
+    finfo->device     = makedev(stx->stx_dev_major, stx->stx_dev_minor);
+    finfo->nlink      = stx->stx_nlink;
+    finfo->inode      = stx->stx_ino;
+    finfo->atime      = (apr_time_t)stx->stx_atime.tv_sec * APR_USEC_PER_SEC
+                        + stx->stx_atime.tv_nsec / 1000;
+    finfo->mtime      = (apr_time_t)stx->stx_mtime.tv_sec * APR_USEC_PER_SEC
+                        + stx->stx_mtime.tv_nsec / 1000;
+    finfo->ctime      = (apr_time_t)stx->stx_ctime.tv_sec * APR_USEC_PER_SEC
+                        + stx->stx_ctime.tv_nsec / 1000;
+}
+
+#endif
+
+/** Stat the entry name in the directory open on fd, filling in the same
+ *  fields of finfo that apr_stat() does. Uses statx() where the kernel has
+ *  it, so only the fields in wanted are asked for. Returns an errno on
+ *  failure.
+ */
+static apr_status_t stat_entry( int fd, const char* name,
+                                apr_finfo_t* finfo, apr_int32_t wanted )
+{
+    struct stat st;
+
+#ifdef STATX_BASIC_STATS
+    if (no_statx == 0)
+    {
+        struct statx stx;
+
+        if (statx( fd, name, AT_SYMLINK_NOFOLLOW|AT_NO_AUTOMOUNT,
+                   statx_mask(wanted), &stx ) == 0)
+        {
+            statx_finfo(&stx, finfo);
+
+            return APR_SUCCESS;
+        }
+
+        if (errno != ENOSYS)
+        {
+            return errno;
+        }
+
+        no_statx = 1;
+    }
+#endif
+
+    if (fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+    {
+        return errno;
+    }
+
+    finfo->valid      = APR_FINFO_MIN|APR_FINFO_IDENT|APR_FINFO_NLINK|
+                        APR_FINFO_OWNER|APR_FINFO_PROT|APR_FINFO_CSIZE;
+    finfo->filetype   = mode_filetype(st.st_mode);
+    finfo->protection = mode_perms(st.st_mode);
+    finfo->user       = st.st_uid;
+    finfo->group      = st.st_gid;
+    finfo->size       = st.st_size;
+    finfo->csize      = st.st_blocks * 512;
+    finfo->device     = st.st_dev;
+    finfo->nlink      = st.st_nlink;
+    finfo->inode      = st.st_ino;
+    finfo->atime      = (apr_time_t)st.st_atim.tv_sec * APR_USEC_PER_SEC
+                        + st.st_atim.tv_nsec / 1000;
+    finfo->mtime      = (apr_time_t)st.st_mtim.tv_sec * APR_USEC_PER_SEC
+                        + st.st_mtim.tv_nsec / 1000;
+    finfo->ctime      = (apr_time_t)st.st_ctim.tv_sec * APR_USEC_PER_SEC
+                        + st.st_ctim.tv_nsec / 1000;
+
+    return APR_SUCCESS;
+}
+
+/** Point entry at the next entry in the directory, reading more from the
+ *  kernel when the buffer is used up. Returns APR_ENOENT at the end of the
+ *  directory.
+ */
+static apr_status_t next_dirent(struct dirhandle* h, struct linux_dirent64** entry)
+{
+    if (h->offset >= h->size)
+    {
+        long n = syscall(SYS_getdents64, h->fd, h->buffer, DIRENT_BUFFER_SIZE);
+
+        if (n < 0)
+        {
+            return errno;
+        }
+
+        if (n == 0)
+        {
+            return APR_ENOENT;
+        }
+
+        h->size   = (int)n;
+        h->offset = 0;
+    }
+
+    *entry     = (struct linux_dirent64*)(h->buffer + h->offset);
+    h->offset += (*entry)->d_reclen;
+
+    return APR_SUCCESS;
+}
+
+/* The fields in wanted that entry doesn't already tell us, i.e. that need a
+ * stat. Zero if none do. */
+static apr_int32_t entry_wanted(const struct linux_dirent64* entry, apr_int32_t wanted)
+{
+    wanted &= ~(APR_FINFO_NAME|APR_FINFO_LINK);
+
+    if (dirent_filetype(entry->d_type) != APR_UNKFILE)
+    {
+        wanted &= ~APR_FINFO_TYPE;
+    }
+
+    if (entry->d_ino != 0)
+    {
+        wanted &= ~APR_FINFO_INODE;
+    }
+
+    return wanted;
+}
+
+/** What to stat entry for: entry_wanted(), or -1 to skip the entry altogether
+ *  because the query rules it out. The walk still needs the directories it
+ *  descends into, but only to know that they are directories.
+ */
+static apr_int32_t entry_need( const struct dirhandle* h, 
+                               const struct linux_dirent64* entry, 
+                               apr_int32_t wanted )
+{
+    apr_int32_t need = entry_wanted(entry, wanted);
+    apr_filetype_e type;
+
+    if ( h->query == NULL 
+         || ( query_name_ok(h->query, entry->d_name)
+              && (entry->d_ino == 0 || query_inode_ok(h->query, entry->d_ino)) ) )
+    {
+        return need;
+    }
+
+    type = dirent_filetype(entry->d_type);
+
+    if (h->descend == 0 || (type != APR_UNKFILE && type != APR_DIR))
+    {
+        return -1;
+    }
+
+    return need & APR_FINFO_TYPE;
+}
+
+/** Finish filling in finfo for entry. need is what entry_wanted() returned
+ *  for it, and rv how stat'ing it went (if it needed a stat). If it failed,
+ *  finfo gets what the entry itself tells us and we return APR_INCOMPLETE, as
+ *  apr_dir_read() does.
+ */
+static apr_status_t finish_entry( struct linux_dirent64* entry, apr_finfo_t* finfo,
+                                  apr_int32_t need, apr_status_t rv )
+{
+    apr_filetype_e type = dirent_filetype(entry->d_type);
+
+    finfo->pool  = NULL;
+    finfo->fname = NULL;
+    finfo->name  = entry->d_name;
+
+    if (need != 0 && rv == APR_SUCCESS)
+    {
+        finfo->valid |= APR_FINFO_NAME;
+
+        return APR_SUCCESS;
+    }
+
+    finfo->valid = APR_FINFO_NAME;
+
+    if (type != APR_UNKFILE)
+    {
+        finfo->filetype = type;
+        finfo->valid   |= APR_FINFO_TYPE;
+    }
+
+    if (entry->d_ino != 0)
+    {
+        finfo->inode  = entry->d_ino;
+        finfo->valid |= APR_FINFO_INODE;
+    }
+
+    return need == 0 ? APR_SUCCESS : APR_INCOMPLETE;
+}
+
+#ifdef HAVE_IO_URING
+
+/* Number of statx() calls kept in flight at once, and the size of the ring. */
+#define STATRING_DEPTH 64
+
+/* Status of a batched stat that has to be redone with stat_entry(). */
+#define STAT_AGAIN (-1)
+
+/** statring: an io_uring, used to stat the entries of a directory in batches.
+ *  Its submission and completion queues are shared with the kernel through
+ *  mmap(). We talk to the kernel with the raw system calls rather than pull
+ *  in liburing for the three things we need. A ring belongs to one thread.
+ */
+struct statring
+{
+    int fd;
+
+    /* Set if the ring stops working (or the kernel can't do IORING_OP_STATX),
+     * after which we stat synchronously. */
+    int broken;
+
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    struct io_uring_sqe* sqes;
+
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    struct io_uring_cqe* cqes;
+
+    void* sq_ring;
+    size_t sq_ring_size;
+    void* cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+};
+
+/** statbatch: directory entries stat'ed together. entries point into the
+ *  dirhandle's buffer, so a batch never spans two getdents64() reads.
+ */
+struct statbatch
+{
+    int count;
+    int next;
+    struct linux_dirent64* entries[STATRING_DEPTH];
+    apr_int32_t need[STATRING_DEPTH];
+    apr_status_t status[STATRING_DEPTH];
+    struct statx stats[STATRING_DEPTH];
+};
+
+/* Set up an io_uring. Returns NULL if the kernel won't give us one. */
+static struct statring* statring_create()
+{
+    struct io_uring_params p;
+    struct statring* r;
+    char* sq;
+    char* cq;
+    int fd;
+
+    memset(&p, 0, sizeof(p));
+
+    if ((fd = syscall(__NR_io_uring_setup, STATRING_DEPTH, &p)) < 0)
+    {
+        return NULL;
+    }
+
+    if ((r = calloc(1, sizeof(struct statring))) == NULL)
+    {
+        close(fd);
+
+        return NULL;
+    }
+
+    r->fd           = fd;
+    r->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    r->sqes_size    = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    /* Newer kernels map both queues with one mmap(). */
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (r->cq_ring_size > r->sq_ring_size)
+        {
+            r->sq_ring_size = r->cq_ring_size;
+        }
+
+        r->cq_ring_size = r->sq_ring_size;
+    }
+
+    r->sq_ring = mmap( NULL, r->sq_ring_size, PROT_READ|PROT_WRITE,
+                       MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQ_RING );
+
+    if (r->sq_ring == MAP_FAILED)
+    {
+        close(fd);
+        free(r);
+
+        return NULL;
+    }
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        r->cq_ring = r->sq_ring;
+    }
+    else
+    {
+        r->cq_ring = mmap( NULL, r->cq_ring_size, PROT_READ|PROT_WRITE,
+                           MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_CQ_RING );
+    }
+
+    r->sqes = mmap( NULL, r->sqes_size, PROT_READ|PROT_WRITE,
+                    MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQES );
+
+    if (r->cq_ring == MAP_FAILED || r->sqes == MAP_FAILED)
+    {
+        if (r->cq_ring != MAP_FAILED && r->cq_ring != r->sq_ring)
+        {
+            munmap(r->cq_ring, r->cq_ring_size);
+        }
+
+        if (r->sqes != MAP_FAILED)
+        {
+            munmap(r->sqes, r->sqes_size);
+        }
+
+        munmap(r->sq_ring, r->sq_ring_size);
+        close(fd);
+        free(r);
+
+        return NULL;
+    }
+
+    sq = (char*)r->sq_ring;
+    cq = (char*)r->cq_ring;
+
+    r->sq_head  = (unsigned*)(sq + p.sq_off.head);
+    r->sq_tail  = (unsigned*)(sq + p.sq_off.tail);
+    r->sq_mask  = (unsigned*)(sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned*)(sq + p.sq_off.array);
+    r->cq_head  = (unsigned*)(cq + p.cq_off.head);
+    r->cq_tail  = (unsigned*)(cq + p.cq_off.tail);
+    r->cq_mask  = (unsigned*)(cq + p.cq_off.ring_mask);
+    r->cqes     = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+
+    return r;
+}
+
+static void statring_destroy(struct statring* r)
+{
+    if (r == NULL)
+    {
+        return;
+    }
+
+    munmap(r->sqes, r->sqes_size);
+
+    if (r->cq_ring != r->sq_ring)
+    {
+        munmap(r->cq_ring, r->cq_ring_size);
+    }
+
+    munmap(r->sq_ring, r->sq_ring_size);
+    close(r->fd);
+    free(r);
+}
+
+/** Stat every entry in b that needs it, relative to the directory open on fd,
+ *  all at once, and wait for the lot. Each entry's status is set to
+ *  APR_SUCCESS, an errno, or STAT_AGAIN if the ring couldn't do it.
+ */
+static void statring_run(struct statring* r, int fd, struct statbatch* b)
+{
+    unsigned tail = *r->sq_tail;
+    int submitted = 0;
+    int completed = 0;
+    int to_submit;
+    int i;
+
+    for (i = 0; i < b->count; i++)
+    {
+        unsigned index = tail & *r->sq_mask;
+        struct io_uring_sqe* sqe = &r->sqes[index];
+
+        b->status[i] = STAT_AGAIN;
+
+        if (b->need[i] == 0)
+        {
+            continue;
+        }
+
+        memset(sqe, 0, sizeof(struct io_uring_sqe));
+
+        sqe->opcode      = IORING_OP_STATX;
+        sqe->fd          = fd;
+        sqe->addr        = (unsigned long)b->entries[i]->d_name;
+        sqe->len         = statx_mask(b->need[i]);
+        sqe->off         = (unsigned long)&b->stats[i];
+        sqe->statx_flags = AT_SYMLINK_NOFOLLOW|AT_NO_AUTOMOUNT;
+        sqe->user_data   = i;
+
+        r->sq_array[index] = index;
+
+        tail++;
+        submitted++;
+    }
+
+    if (submitted == 0 || r->broken != 0)
+    {
+        return;
+    }
+
+    /* Publish the new entries before the kernel sees the new tail. */
+    __atomic_store_n(r->sq_tail, tail, __ATOMIC_RELEASE);
+
+    to_submit = submitted;
+
+    while (completed < submitted)
+    {
+        unsigned head;
+        long n = syscall( __NR_io_uring_enter, r->fd, to_submit,
+                          submitted - completed, IORING_ENTER_GETEVENTS,
+                          NULL, 0 );
+
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+
+            /* Whatever is left is stat'ed synchronously. The ring can't be
+             * trusted with another batch now. */
+            r->broken = 1;
+
+            break;
+        }
+
+        to_submit -= n;
+
+        head = *r->cq_head;
+
+        while (head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE))
+        {
+            struct io_uring_cqe* cqe = &r->cqes[head & *r->cq_mask];
+
+            i = (int)cqe->user_data;
+
+            if (cqe->res == 0)
+            {
+                b->status[i] = APR_SUCCESS;
+            }
+            else if (cqe->res == -EINVAL || cqe->res == -EOPNOTSUPP)
+            {
+                /* Kernels before 5.6 have no IORING_OP_STATX. */
+                r->broken = 1;
+            }
+            else if (cqe->res != -EAGAIN && cqe->res != -ECANCELED)
+            {
+                b->status[i] = -cqe->res;
+            }
+
+            head++;
+            completed++;
+        }
+
+        __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+    }
+}
+
+/** read_directory() for the io_uring backend. Reads the directory a batch of
+ *  entries at a time, stat'ing each batch through the ring.
+ */
+static apr_status_t read_batched( struct dirhandle* h, apr_finfo_t* finfo,
+                                  apr_int32_t wanted )
+{
+    struct statbatch* b = h->batch;
+    struct linux_dirent64* entry;
+    apr_int32_t need;
+    apr_status_t rv;
+
+    if (b == NULL)
+    {
+        if ((b = h->batch = malloc(sizeof(struct statbatch))) == NULL)
+        {
+            return APR_ENOMEM;
+        }
+
+        b->count = 0;
+        b->next  = 0;
+    }
+
+    if (b->next == b->count)
+    {
+        b->count = 0;
+        b->next  = 0;
+
+        /* Stop at the end of the buffer: reading more would overwrite the
+         * entries already in the batch. */
+        while ( b->count < STATRING_DEPTH
+                && (b->count == 0 || h->offset < h->size) )
+        {
+            if ((rv = next_dirent(h, &entry)) != APR_SUCCESS)
+            {
+                return rv;
+            }
+
+            if ((need = entry_need(h, entry, wanted)) < 0)
+            {
+                continue;
+            }
+
+            b->entries[b->count] = entry;
+            b->need[b->count]    = need;
+            b->count++;
+        }
+
+        statring_run(h->ring, h->fd, b);
+    }
+
+    entry = b->entries[b->next];
+    need  = b->need[b->next];
+    rv    = b->status[b->next];
+
+    if (need != 0)
+    {
+        if (rv == APR_SUCCESS)
+        {
+            statx_finfo(&b->stats[b->next], finfo);
+        }
+        else if (rv == STAT_AGAIN)
+        {
+            rv = stat_entry(h->fd, entry->d_name, finfo, need);
+        }
+    }
+
+    b->next++;
+
+    return finish_entry(entry, finfo, need, rv);
+}
+
+#else
+
+static struct statring* statring_create()
+{
+    return NULL;
+}
+
+static void statring_destroy(struct statring* r)
+{
+}
+
+#endif /* HAVE_IO_URING */
+
+#else
+
+static struct statring* statring_create()
+{
+    return NULL;
+}
+
+static void statring_destroy(struct statring* r)
+{
+}
+
+#endif /* LINUX */
+
+/** Open a directory. path is always the full path. If parent is given, name
+ *  is the directory's name in parent, and the native backends open it
+ *  relative to parent. ring is the io_uring to stat entries through, or NULL.
+ *  q is the query to check entries against, or NULL to read them all. depth
+ *  is the directory's depth in the walk.
+ */
+apr_status_t open_directory( struct dirhandle* h,
+                             const struct dirhandle* parent,
+                             const char* path, const char* name,
+                             int backend, struct statring* ring,
+                             const struct query* q, int depth,
+                             apr_pool_t* pool )
+{
+    h->dir     = NULL;
+    h->path    = path;
+    h->pool    = pool;
+    h->query   = q;
+    h->lookup  = 0;
+    h->descend = q == NULL || q->maxdepth < 0 || depth + 1 < q->maxdepth;
+
+#ifdef LINUX
+    h->fd     = -1;
+    h->buffer = NULL;
+    h->size   = 0;
+    h->offset = 0;
+    h->ring   = ring;
+    h->batch  = NULL;
+
+    if (backend == BACKEND_NATIVE || backend == BACKEND_URING)
+    {
+        if (parent != NULL && parent->fd >= 0 && name != NULL)
+        {
+            h->fd = openat( parent->fd, name,
+                            O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC );
+        }
+        else
+        {
+            h->fd = open(path, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+        }
+
+        if (h->fd < 0)
+        {
+            return errno;
+        }
+
+        /* Looking names up doesn't read the directory. */
+        if (q != NULL && q->by_name != 0 && h->descend == 0)
+        {
+            return APR_SUCCESS;
+        }
+
+        if ((h->buffer = malloc(DIRENT_BUFFER_SIZE)) == NULL)
+        {
+            close(h->fd);
+            h->fd = -1;
+
+            return APR_ENOMEM;
+        }
+
+        return APR_SUCCESS;
+    }
+#endif
+
+    return apr_dir_open(&h->dir, path, pool);
+}
+
+/** Stat the entry name in the directory, filling in finfo as read_directory()
+ *  would. On failure finfo is left as it was.
+ */
+static apr_status_t stat_name( struct dirhandle* h, const char* name,
+                               apr_finfo_t* finfo, apr_int32_t wanted )
+{
+    apr_finfo_t info;
+    apr_status_t rv;
+
+#ifdef LINUX
+    if (h->dir == NULL)
+    {
+        if ((rv = stat_entry(h->fd, name, &info, wanted)) != APR_SUCCESS)
+        {
+            return rv;
+        }
+    }
+    else
+#endif
+    {
+        char path[PATH_MAX];
+        int n = snprintf(path, sizeof(path), "%s/%s", h->path, name);
+
+        if (n < 0 || (size_t)n >= sizeof(path))
+        {
+            return APR_ENAMETOOLONG;
+        }
+
+        /* Like apr_dir_read(), describe links rather than what they point to. */
+        rv = apr_stat(&info, path, (wanted & ~APR_FINFO_NAME)|APR_FINFO_LINK, h->pool);
+
+        if (rv != APR_SUCCESS && rv != APR_INCOMPLETE)
+        {
+            return rv;
+        }
+    }
+
+    *finfo        = info;
+    finfo->pool   = NULL;
+    finfo->fname  = NULL;
+    finfo->name   = name;
+    finfo->valid |= APR_FINFO_NAME;
+
+    return APR_SUCCESS;
+}
+
+/** read_directory() when the query gives the names and the walk doesn't
+ *  recurse: rather than read the directory, look each name up in it. A name
+ *  that isn't there is just skipped.
+ */
+static apr_status_t lookup_directory( struct dirhandle* h, apr_finfo_t* finfo,
+                                      apr_int32_t wanted )
+{
+    const struct query* q = h->query;
+
+    while (h->lookup < q->nnames)
+    {
+        const char* name = q->names[h->lookup++];
+
+        if ( is_entry_name(name)
+             && stat_name(h, name, finfo, wanted|DIRENT_FIELDS) == APR_SUCCESS )
+        {
+            return APR_SUCCESS;
+        }
+    }
+
+    return APR_ENOENT;
+}
+
+/** Read the next entry of a directory into finfo. Works like apr_dir_read():
+ *  the name, type and inode come from the directory entry, and the entry is
+ *  only stat'ed if more than that is wanted (or the file system doesn't
+ *  report the type). Returns APR_INCOMPLETE if that stat failed, and
+ *  APR_ENOENT at the end of the directory. finfo->name is valid until the
+ *  next read.
+ *
+ *  Entries the query rules out are skipped, except for directories when the
+ *  walk has to descend into them. Those come back without being stat'ed.
+ */
+apr_status_t read_directory( struct dirhandle* h, apr_finfo_t* finfo,
+                             apr_int32_t wanted )
+{
+    const struct query* q = h->query;
+    apr_status_t rv;
+
+    if (q != NULL && q->by_name != 0 && h->descend == 0)
+    {
+        return lookup_directory(h, finfo, wanted);
+    }
+
+#ifdef LINUX
+    if (h->dir == NULL)
+    {
+        struct linux_dirent64* entry = NULL;
+        apr_int32_t need;
+
+#ifdef HAVE_IO_URING
+        /* Only worth it if (nearly) every entry needs a stat. */
+        if (h->ring != NULL && (wanted & ~DIRENT_FIELDS) != 0)
+        {
+            return read_batched(h, finfo, wanted);
+        }
+#endif
+
+        do
+        {
+            if ((rv = next_dirent(h, &entry)) != APR_SUCCESS)
+            {
+                return rv;
+            }
+        }
+        while ((need = entry_need(h, entry, wanted)) < 0);
+
+        rv = need == 0 ? APR_SUCCESS : stat_entry(h->fd, entry->d_name, finfo, need);
+
+        return finish_entry(entry, finfo, need, rv);
+    }
+#endif
+
+    if (q == NULL || (q->by_name == 0 && q->npatterns == 0))
+    {
+        return apr_dir_read(finfo, wanted, h->dir);
+    }
+
+    /* Check the name before asking APR to stat the entry. */
+    for (;;)
+    {
+        rv = apr_dir_read(finfo, APR_FINFO_NAME|APR_FINFO_TYPE, h->dir);
+
+        if (rv != APR_SUCCESS && rv != APR_INCOMPLETE)
+        {
+            return rv;
+        }
+
+        if (query_name_ok(q, finfo->name))
+        {
+            if ((wanted & ~DIRENT_FIELDS) == 0)
+            {
+                return rv;
+            }
+
+            return stat_name(h, finfo->name, finfo, wanted) == APR_SUCCESS 
+                   ? APR_SUCCESS : APR_INCOMPLETE;
+        }
+
+        if (h->descend != 0 && finfo->filetype == APR_DIR)
+        {
+            return rv;
+        }
+    }
+}
+
+/* Close a directory opened with open_directory(). */
+void close_directory(struct dirhandle* h)
+{
+#ifdef LINUX
+    if (h->dir == NULL)
+    {
+        close(h->fd);
+        free(h->buffer);
+        free(h->batch);
+
+        h->fd     = -1;
+        h->buffer = NULL;
+        h->batch  = NULL;
+
+        return;
+    }
+#endif
+
+    apr_dir_close(h->dir);
+    h->dir = NULL;
+}
+
+/*-------------------------------------------------------------------*/
+/* Parallel walker                                                   */
+/*-------------------------------------------------------------------*/
+
+/** The parallel walker searches the directories in search_paths with a pool of
+ *  worker threads. Each directory is a task. A worker reads every entry of its
+ *  directory, turns the entries into rows and queues each subdirectory it
+ *  finds as a new task on its own deque. Workers take tasks from the bottom of
+ *  their own deque (depth first, so they stay close to what they just read)
+ *  and, when it runs dry, steal from the top of the other workers' deques
+ *  (those are the shallowest directories, i.e. the biggest pieces of work).
+ *
+ *  Rows are handed to the cursor in batches through a bounded queue. When the
+ *  queue is full the workers wait for the cursor to catch up, so memory stays
+ *  bounded no matter how big the tree is. Rows come out in no particular
+ *  order.
+ *
+ *  All of the state shared between threads lives in the walker struct and is
+ *  guarded by walker->lock, except for the task deques, which each have their
+ *  own lock. When both are needed, walker->lock is always taken first.
+ *
+ *  With readahead and no threads, there is a single worker, and it doesn't
+ *  take tasks at all: it runs the serial walk, on a cursor of its own, and
+ *  queues its rows the same way. The query gets them in the same order as
+ *  without readahead, but the directories are read (and their entries
+ *  stat'ed) while the query works on the rows before them.
+ */
+
+/* Number of batches queued per worker before the workers have to wait. */
+#define WALKER_QUEUE_DEPTH 4
+
+/* A new, empty batch. NULL if out of memory. */
+static struct rowbatch* rowbatch_create()
+{
+    struct rowbatch* b;
+
+    if ((b = malloc(sizeof(struct rowbatch))) == NULL)
+    {
+        return NULL;
+    }
+
+    if ((b->text = malloc(WALKER_BATCH_TEXT)) == NULL)
+    {
+        free(b);
+
+        return NULL;
+    }
+
+    b->text_size     = WALKER_BATCH_TEXT;
+    b->next          = NULL;
+    b->count         = 0;
+    b->text_used     = 0;
+    b->last_path     = 0;
+    b->last_path_len = -1;
+
+    return b;
+}
+
+/** Append a row to batch b, with the given name and path, and leave its
+ *  values to the caller. The path is only copied when it differs from that
+ *  of the previous row in the batch. Returns NULL if the row doesn't fit.
+ */
+static struct filerow* rowbatch_append( struct rowbatch* b, int depth, 
+                                        const char* name, int name_len,
+                                        const char* path, int path_len )
+{
+    struct filerow* row;
+    apr_size_t need;
+    int same_path;
+
+    same_path = ( b->last_path_len == path_len
+                  && memcmp(b->text + b->last_path, path, path_len) == 0 );
+
+    need = name_len + 1 + (same_path ? 0 : path_len + 1);
+
+    if (b->count == WALKER_BATCH_ROWS)
+    {
+        return NULL;
+    }
+
+    if (b->text_used + need > b->text_size)
+    {
+        char* text;
+
+        /* Only the first row of a batch can be bigger than the batch. */
+        if (b->count > 0 || (text = realloc(b->text, need)) == NULL)
+        {
+            return NULL;
+        }
+
+        b->text      = text;
+        b->text_size = need;
+    }
+
+    row        = &b->rows[b->count++];
+    row->depth = depth;
+
+    if (same_path == 0)
+    {
+        b->last_path     = b->text_used;
+        b->last_path_len = path_len;
+
+        memcpy(b->text + b->text_used, path, path_len);
+        b->text[b->text_used + path_len] = '\0';
+        b->text_used += path_len + 1;
+    }
+
+    row->path     = b->last_path;
+    row->path_len = path_len;
+
+    row->name     = b->text_used;
+    row->name_len = name_len;
+    memcpy(b->text + b->text_used, name, name_len);
+    b->text[b->text_used + name_len] = '\0';
+    b->text_used += name_len + 1;
+
+    return row;
+}
+
+/** Append a row to batch b. dirent supplies everything but the name and path
+ *  strings (see rowbatch_append()). Returns 0 if the row doesn't fit.
+ */
+static int rowbatch_add( struct rowbatch* b, const apr_finfo_t* dirent, 
+                         apr_ino_t dir_inode, int depth, 
+                         const char* name, int name_len,
+                         const char* path, int path_len )
+{
+    struct filerow* row = rowbatch_append(b, depth, name, name_len, path, path_len);
+
+    if (row == NULL)
+    {
+        return 0;
+    }
+
+    row_values(row, dirent, dir_inode);
+
+    return 1;
+}
+
+static void rowbatch_free(struct rowbatch* b)
+{
+    free(b->text);
+    free(b);
+}
+
+static struct rowbatch* walker_new_batch(struct walker* w)
+{
+    struct rowbatch* b = NULL;
+
+    apr_thread_mutex_lock(w->lock);
+
+    if (w->free_batches != NULL)
+    {
+        b = w->free_batches;
+        w->free_batches = b->next;
+    }
+
+    apr_thread_mutex_unlock(w->lock);
+
+    if (b == NULL)
+    {
+        return rowbatch_create();
+    }
+
+    b->next          = NULL;
+    b->count         = 0;
+    b->text_used     = 0;
+    b->last_path     = 0;
+    b->last_path_len = -1;
+
+    return b;
+}
+
+/* Queue a full batch for the cursor. Waits while the queue is full. */
+static void walker_queue_batch(struct walker* w, struct rowbatch* b)
+{
+    apr_thread_mutex_lock(w->lock);
+
+    while (apr_atomic_read32(&w->stop) == 0 && w->queued >= w->max_queued)
+    {
+        apr_thread_cond_wait(w->not_full, w->lock);
+    }
+
+    if (apr_atomic_read32(&w->stop) != 0)
+    {
+        /* Nobody is going to read it. */
+        b->next = w->free_batches;
+        w->free_batches = b;
+    }
+    else
+    {
+        if (w->tail != NULL)
+        {
+            w->tail->next = b;
+        }
+        else
+        {
+            w->head = b;
+        }
+
+        w->tail = b;
+        w->queued += 1;
+
+        apr_thread_cond_signal(w->not_empty);
+    }
+
+    apr_thread_mutex_unlock(w->lock);
+}
+
+/* Queue the worker's batch if it has anything in it. */
+static void walker_flush(struct walker_worker* self)
+{
+    if (self->batch != NULL && self->batch->count > 0)
+    {
+        walker_queue_batch(self->w, self->batch);
+        self->batch = NULL;
+    }
+}
+
+/* Whether the workers should stop: they were told to, or the LIMIT is met. */
+int walker_stopped(struct walker* w)
+{
+    return ( apr_atomic_read32(&w->stop) != 0 
+             || (w->limited != 0 && apr_atomic_read32(&w->left) == 0) );
+}
+
+/** Count a row against the LIMIT. Returns -1 if it is past it, 1 if it is
+ *  the last row wanted, 0 otherwise.
+ */
+static int walker_count_row(struct walker* w)
+{
+    apr_uint32_t left;
+
+    do
+    {
+        if ((left = apr_atomic_read32(&w->left)) == 0)
+        {
+            return -1;
+        }
+    }
+    while (apr_atomic_cas32(&w->left, left - 1, left) != left);
+
+    return left == 1;
+}
+
+/** Append a row to the worker's batch, queueing it first if it is full. The
+ *  last row the LIMIT lets through is queued straight away, rather than
+ *  when the batch fills up.
+ */
+static void walker_add_row( struct walker_worker* self,
+                            const apr_finfo_t* dirent, apr_ino_t dir_inode,
+                            int depth, const char* name, int name_len,
+                            const char* path, int path_len )
+{
+    int last = 0;
+
+    if (self->w->limited != 0 && (last = walker_count_row(self->w)) < 0)
+    {
+        return;
+    }
+
+    /* Read the file here, on the worker's thread, rather than in vt_column(). */
+    if (self->w->hashes != 0 && dirent->filetype == APR_REG)
+    {
+        hash_ahead(self, dirent, name, name_len, path, path_len);
+    }
+
+    if ( self->batch == NULL 
+         || rowbatch_add( self->batch, dirent, dir_inode, depth, 
+                          name, name_len, path, path_len ) == 0 )
+    {
+        walker_flush(self);
+
+        if (self->batch == NULL && (self->batch = walker_new_batch(self->w)) == NULL)
+        {
+            return;
+        }
+
+        rowbatch_add( self->batch, dirent, dir_inode, depth, 
+                      name, name_len, path, path_len );
+    }
+
+    if (last != 0)
+    {
+        walker_flush(self);
+    }
+}
+
+/* Push a task on the bottom of the worker's deque. */
+int walker_push_task(struct walker_worker* self, struct walker_task* task)
+{
+    struct walker* w = self->w;
+
+    /* Count the task first, so pending cannot reach zero while it is being
+     * handed around. */
+    apr_thread_mutex_lock(w->lock);
+    w->pending += 1;
+    apr_thread_mutex_unlock(w->lock);
+
+    apr_thread_mutex_lock(self->lock);
+
+    if (self->bottom - self->top == self->capacity)
+    {
+        /* Grow the ring. */
+        int n = self->capacity * 2;
+        int i;
+        struct walker_task** tasks = malloc(n * sizeof(struct walker_task*));
+
+        if (tasks == NULL)
+        {
+            apr_thread_mutex_unlock(self->lock);
+
+            apr_thread_mutex_lock(w->lock);
+            w->pending -= 1;
+            apr_thread_mutex_unlock(w->lock);
+
+            return 0;
+        }
+
+        for (i = self->top; i < self->bottom; i++)
+        {
+            tasks[i & (n - 1)] = self->tasks[i & (self->capacity - 1)];
+        }
+
+        free(self->tasks);
+        self->tasks    = tasks;
+        self->capacity = n;
+    }
+
+    self->tasks[self->bottom & (self->capacity - 1)] = task;
+    self->bottom += 1;
+
+    apr_thread_mutex_unlock(self->lock);
+
+    /* Wake up an idle worker to steal it. */
+    apr_thread_mutex_lock(w->lock);
+
+    if (w->idle > 0)
+    {
+        apr_thread_cond_signal(w->work);
+    }
+
+    apr_thread_mutex_unlock(w->lock);
+
+    return 1;
+}
+
+/* Take a task from the bottom (own == 1) or top (own == 0) of a deque. */
+static struct walker_task* walker_take_task(struct walker_worker* worker, int own)
+{
+    struct walker_task* task = NULL;
+
+    apr_thread_mutex_lock(worker->lock);
+
+    if (worker->bottom > worker->top)
+    {
+        if (own != 0)
+        {
+            worker->bottom -= 1;
+            task = worker->tasks[worker->bottom & (worker->capacity - 1)];
+        }
+        else
+        {
+            task = worker->tasks[worker->top & (worker->capacity - 1)];
+            worker->top += 1;
+        }
+    }
+
+    apr_thread_mutex_unlock(worker->lock);
+
+    return task;
+}
+
+/* Try to steal a task from any of the other workers. */
+static struct walker_task* walker_steal_task(struct walker_worker* self)
+{
+    struct walker* w = self->w;
+    struct walker_task* task;
+    int start = (int)(self - w->workers);
+    int i;
+
+    for (i = 1; i < w->nworkers; i++)
+    {
+        struct walker_worker* victim = &w->workers[(start + i) % w->nworkers];
+
+        if ((task = walker_take_task(victim, 0)) != NULL)
+        {
+            return task;
+        }
+    }
+
+    return NULL;
+}
+
+/* Get the next task for a worker. Returns NULL when the walk is over. */
+static struct walker_task* walker_next_task(struct walker_worker* self)
+{
+    struct walker* w = self->w;
+    struct walker_task* task;
+
+    if ((task = walker_take_task(self, 1)) != NULL)
+    {
+        return task;
+    }
+
+    if ((task = walker_steal_task(self)) != NULL)
+    {
+        return task;
+    }
+
+    /* Nothing to do. Don't sit on rows while we wait. */
+    walker_flush(self);
+
+    apr_thread_mutex_lock(w->lock);
+
+    while (apr_atomic_read32(&w->stop) == 0 && w->pending > 0)
+    {
+        /* Look again with the lock held: a task pushed after this check
+         * signals w->work only once we are waiting on it. */
+        if ((task = walker_steal_task(self)) != NULL)
+        {
+            break;
+        }
+
+        w->idle += 1;
+        apr_thread_cond_wait(w->work, w->lock);
+        w->idle -= 1;
+    }
+
+    apr_thread_mutex_unlock(w->lock);
+
+    return task;
+}
+
+/* Mark a task as finished. */
+static void walker_task_done(struct walker* w, struct walker_task* task)
+{
+    free(task->path);
+    free(task);
+
+    apr_thread_mutex_lock(w->lock);
+
+    w->pending -= 1;
+
+    if (w->pending == 0)
+    {
+        /* That was the last one. Let the idle workers go. */
+        apr_thread_cond_broadcast(w->work);
+    }
+
+    apr_thread_mutex_unlock(w->lock);
+}
+
+/* Make a task for the entry name in directory path. */
+struct walker_task* walker_new_task( const char* path, int path_len,
+                                     const apr_finfo_t* entry,
+                                     apr_ino_t dir_inode, int depth )
+{
+    struct walker_task* task = malloc(sizeof(struct walker_task));
+    const char* name = entry->name;
+    int name_len = strlen(name);
+
+    if (task == NULL)
+    {
+        return NULL;
+    }
+
+    if ((task->path = malloc(path_len + name_len + 2)) == NULL)
+    {
+        free(task);
+
+        return NULL;
+    }
+
+    memcpy(task->path, path, path_len);
+
+    /* Don't double up the separator when searching the root directory. */
+    if (path_len == 0 || path[path_len - 1] != '/')
+    {
+        task->path[path_len++] = '/';
+    }
+
+    memcpy(task->path + path_len, name, name_len + 1);
+
+    task->root      = 0;
+    task->dir_inode = dir_inode;
+    task->depth     = depth;
+    task->dirent    = *entry;
+    task->du_parent = NULL;
+
+    /* The strings in entry belong to the parent's pool. */
+    task->dirent.name  = NULL;
+    task->dirent.fname = NULL;
+    task->dirent.pool  = NULL;
+
+    return task;
+}
+
+/** Search one directory: emit a row for the directory itself and one for every
+ *  file in it, and queue a task for every subdirectory. A task can also be a
+ *  top-level file named in search_paths, in which case that is the only row.
+ *  
+ *  Rows look exactly like the ones vt_next() makes.
+ */
+static void walker_scan(struct walker_worker* self, struct walker_task* task)
+{
+    struct walker* w = self->w;
+    apr_finfo_t dirent;
+    apr_finfo_t entry;
+    struct dirhandle dir;
+    apr_status_t rv;
+    int path_len = strlen(task->path);
+    const char* name;
+    int name_len;
+
+    if (task->root != 0)
+    {
+        /* See note ZERO-FILL DIRENT in next_directory(). */
+        memset(&dirent, 0, sizeof(apr_finfo_t));
+
+        apr_stat(&dirent, task->path, w->wanted, self->pool);
+
+        name = root_name(task->path, path_len, &name_len);
+    }
+    else
+    {
+        /* What the parent directory read for this one. */
+        dirent   = task->dirent;
+        name     = apr_filepath_name_get(task->path);
+        name_len = path_len - (int)(name - task->path);
+    }
+
+    /* A pruned search path. Subdirectories are pruned before they get here. */
+    if ( task->root != 0 && dirent.filetype == APR_DIR
+         && query_pruned( w->query, task->path, 
+                          apr_filepath_name_get(task->path) ) )
+    {
+        apr_pool_clear(self->pool);
+
+        return;
+    }
+
+    if (dirent.filetype != APR_DIR)
+    {
+        /* A top-level file. Its path is that of the directory it is in. */
+        if ( task->root != 0 && dirent.filetype != APR_NOFILE 
+             && query_row_ok(w->query, name, &dirent, 0) )
+        {
+            walker_add_row( self, &dirent, 0, 0, name, name_len, task->path, 
+                            root_dir_len(task->path, path_len) );
+        }
+
+        apr_pool_clear(self->pool);
+
+        return;
+    }
+
+    /* Only a search path can be too deep to open: maxdepth = 0. */
+    if (w->query->maxdepth >= 0 && task->depth >= w->query->maxdepth)
+    {
+        if (query_row_ok(w->query, name, &dirent, task->dir_inode))
+        {
+            walker_add_row( self, &dirent, task->dir_inode, task->depth,
+                            name, name_len, task->path, path_len );
+        }
+
+        apr_pool_clear(self->pool);
+
+        return;
+    }
+
+    /* The parent is long closed by now, so open it by its full path. */
+    if (open_directory( &dir, NULL, task->path, NULL, w->backend, self->ring,
+                        w->query, task->depth, self->pool ) != APR_SUCCESS)
+    {
+        fprintf(stderr, "Failed to open directory: %s\n", task->path);
+        apr_pool_clear(self->pool);
+
+        return;
+    }
+
+    /* The directory itself. */
+    if (query_row_ok(w->query, name, &dirent, task->dir_inode))
+    {
+        walker_add_row( self, &dirent, task->dir_inode, task->depth,
+                        name, name_len, task->path, path_len );
+    }
+
+    memset(&entry, 0, sizeof(apr_finfo_t));
+
+    /* See vt_next() about APR_INCOMPLETE. */
+    while ( walker_stopped(w) == 0 
+            && ( (rv = read_directory(&dir, &entry, w->wanted)) == APR_SUCCESS 
+                 || rv == APR_INCOMPLETE ) )
+    {
+        if (entry.filetype == APR_DIR)
+        {
+            struct walker_task* child;
+
+            /* Skip . and .. entries */
+            if ( strcmp(entry.name, ".") == 0 || strcmp(entry.name, "..") == 0 )
+            {
+                continue;
+            }
+
+            /* Leave out pruned directories, and all that's in them. */
+            if (w->query->nprune > 0)
+            {
+                const char* sub = apr_pstrcat( self->pool, task->path, 
+                                               path_separator(task->path),
+                                               entry.name, NULL );
+
+                if (query_pruned(w->query, sub, entry.name))
+                {
+                    continue;
+                }
+            }
+
+            /* Just the row, if the walk goes no deeper. */
+            if (dir.descend == 0)
+            {
+                if (query_row_ok(w->query, entry.name, &entry, dirent.inode))
+                {
+                    const char* sub = apr_pstrcat( self->pool, task->path, 
+                                                   path_separator(task->path), 
+                                                   entry.name, NULL );
+
+                    walker_add_row( self, &entry, dirent.inode, task->depth + 1,
+                                    entry.name, strlen(entry.name), 
+                                    sub, strlen(sub) );
+                }
+
+                continue;
+            }
+
+            /* The subdirectory makes its own row when it is searched. */
+            child = walker_new_task( task->path, path_len, &entry, 
+                                     dirent.inode, task->depth + 1 );
+
+            if (child == NULL || walker_push_task(self, child) == 0)
+            {
+                fprintf(stderr, "Out of memory, skipping: %s/%s\n",
+                        task->path, entry.name);
+
+                if (child != NULL)
+                {
+                    free(child->path);
+                    free(child);
+                }
+            }
+
+            continue;
+        }
+
+        if (query_row_ok(w->query, entry.name, &entry, dirent.inode))
+        {
+            walker_add_row( self, &entry, dirent.inode, task->depth + 1,
+                            entry.name, strlen(entry.name), 
+                            task->path, path_len );
+        }
+    }
+
+    close_directory(&dir);
+
+    /* Frees the dir handle and every entry name read from it. */
+    apr_pool_clear(self->pool);
+}
+
+/** The readahead worker: the serial walk of w->serial, from its first row to
+ *  its last, each row queued for the cursor as it comes.
+ */
+static void walker_serial(struct walker_worker* self)
+{
+    struct walker* w = self->w;
+    vtab_cursor* s   = w->serial;
+    const char* name;
+    const char* path;
+    int name_len;
+    int path_len;
+    int rc;
+
+    s->ring = self->ring;
+
+    /* The top-level row is the first one, if the query lets it through. */
+    if ( (rc = next_directory(s)) == SQLITE_OK && s->eof == 0 
+         && row_matches(s) == 0 )
+    {
+        rc = walk_next(s);
+    }
+
+    while (rc == SQLITE_OK && s->eof == 0 && walker_stopped(w) == 0)
+    {
+        walk_row_text(s, &name, &name_len, &path, &path_len);
+
+        walker_add_row( self, &s->current_node->dirent, row_dir_inode(s), 
+                        s->depth, name, name_len, path, path_len );
+
+        rc = walk_next(s);
+    }
+
+    /* Close what is still open while the ring is still there. */
+    walk_stop(s);
+
+    s->ring = NULL;
+}
+
+/** Set up the cursor the readahead worker walks search_paths on: a copy of
+ *  p_cur, as vt_filter() left it.
+ */
+static int walker_serial_open(vtab_cursor *p_cur, struct walker* w)
+{
+    sqlite3_vtab_cursor* cur;
+    vtab_cursor* s;
+
+    if (vt_open(p_cur->base.pVtab, &cur) != SQLITE_OK || cur == NULL)
+    {
+        return SQLITE_NOMEM;
+    }
+
+    s = (vtab_cursor*)cur;
+    s->base.pVtab = p_cur->base.pVtab;
+
+    if ((s->search_paths = strdup(p_cur->search_paths)) == NULL)
+    {
+        vt_close(cur);
+
+        return SQLITE_NOMEM;
+    }
+
+    /* The constraints are p_cur's. s's own are put back before it is closed. */
+    w->serial_query = s->query;
+    s->query        = p_cur->query;
+
+    s->root_path = s->search_paths;
+    s->wanted    = p_cur->wanted;
+    s->backend   = p_cur->backend;
+    s->count     = 0;
+    s->eof       = 0;
+    s->depth     = 0;
+
+    w->serial = s;
+
+    return SQLITE_OK;
+}
+
+/* Free the readahead worker's cursor, once the worker is done with it. */
+static void walker_serial_close(struct walker* w)
+{
+    if (w->serial != NULL)
+    {
+        w->serial->query = w->serial_query;
+        vt_close((sqlite3_vtab_cursor*)w->serial);
+        w->serial = NULL;
+    }
+}
+
+static void* APR_THREAD_FUNC walker_thread(apr_thread_t* thread, void* data)
+{
+    struct walker_worker* self = (struct walker_worker*)data;
+    struct walker* w = self->w;
+    struct walker_task* task;
+
+    if (w->backend == BACKEND_URING)
+    {
+        self->ring = statring_create();
+    }
+
+    if (w->serial != NULL)
+    {
+        walker_serial(self);
+    }
+
+    while ((task = walker_next_task(self)) != NULL)
+    {
+        if (walker_stopped(w) == 0 && w->du != NULL)
+        {
+            du_scan(self, task);
+        }
+        else if (walker_stopped(w) == 0)
+        {
+            walker_scan(self, task);
+        }
+
+        walker_task_done(w, task);
+    }
+
+    walker_flush(self);
+    statring_destroy(self->ring);
+
+    apr_thread_mutex_lock(w->lock);
+
+    w->running -= 1;
+
+    if (w->running == 0)
+    {
+        /* Tell the cursor there is nothing more coming. */
+        apr_thread_cond_broadcast(w->not_empty);
+    }
+
+    apr_thread_mutex_unlock(w->lock);
+
+    apr_thread_exit(thread, APR_SUCCESS);
+
+    return NULL;
+}
+
+/** Start walking search_paths. Every path is checked up front, so that a bad
+ *  one is reported by xFilter() the same way next_directory() does it.
+ */
+int walker_start(vtab_cursor *p_cur)
+{
+    vtab *p_vt = (vtab*)((sqlite3_vtab_cursor*)p_cur)->pVtab;
+    struct walker* w;
+    apr_pool_t* pool;
+    int i;
+    int n = 0;
+    int started = 0;
+
+    if (apr_pool_create(&pool, p_cur->pool) != APR_SUCCESS)
+    {
+        return SQLITE_NOMEM;
+    }
+
+    w = apr_pcalloc(pool, sizeof(struct walker));
+    w->pool       = pool;
+    w->nworkers   = p_vt->threads;
+    w->wanted     = p_cur->wanted;
+    w->backend    = p_cur->backend;
+    w->query      = &p_cur->query;
+    w->du         = p_cur->du;
+    w->hashes     = p_cur->hashes;
+    w->hash_cache = p_vt->hash_cache;
+    w->max_queued = p_vt->threads * WALKER_QUEUE_DEPTH;
+
+    /* Readahead: one worker, as many batches ahead as make up the rows. */
+    if (p_vt->threads == 0)
+    {
+        w->nworkers   = 1;
+        w->max_queued = (p_vt->readahead + WALKER_BATCH_ROWS - 1) / WALKER_BATCH_ROWS;
+    }
+
+    /* No more rows than the LIMIT, if it is one we can count down from. */
+    if (p_cur->left > 0 && p_cur->left <= 0x7fffffff)
+    {
+        w->limited = 1;
+        w->left    = (apr_uint32_t)p_cur->left;
+    }
+    w->workers    = apr_pcalloc(w->pool, w->nworkers * sizeof(struct walker_worker));
+
+    apr_thread_mutex_create(&w->lock, APR_THREAD_MUTEX_DEFAULT, w->pool);
+    apr_thread_cond_create(&w->work, w->pool);
+    apr_thread_cond_create(&w->not_empty, w->pool);
+    apr_thread_cond_create(&w->not_full, w->pool);
+
+    for (i = 0; i < w->nworkers; i++)
+    {
+        struct walker_worker* worker = &w->workers[i];
+
+        worker->w        = w;
+        worker->capacity = 64;
+        worker->tasks    = malloc(worker->capacity * sizeof(struct walker_task*));
+
+        apr_pool_create(&worker->pool, w->pool);
+        apr_thread_mutex_create(&worker->lock, APR_THREAD_MUTEX_DEFAULT, w->pool);
+    }
+
+    p_cur->walker = w;
+    p_cur->batch  = NULL;
+    p_cur->row    = 0;
+
+    /* Seed the deques with the search paths, round robin. */
+    while (next_path(p_cur) != 0)
+    {
+        struct walker_task* task;
+        const char* path = p_cur->path;
+        apr_finfo_t finfo;
+
+        if (path == NULL || *path == '\0')
+        {
+            continue;
+        }
+
+        if (apr_stat(&finfo, path, APR_FINFO_TYPE, w->pool) != APR_SUCCESS)
+        {
+            if (p_vt->base.zErrMsg != NULL)
+            {
+                sqlite3_free(p_vt->base.zErrMsg);
+            }
+
+            p_vt->base.zErrMsg = sqlite3_mprintf("Invalid directory: %s", path);
+            p_cur->eof = 1;
+
+            return SQLITE_ERROR;
+        }
+
+        if (finfo.filetype == APR_DIR && p_cur->query.maxdepth != 0)
+        {
+            struct dirhandle dir;
+
+            if (open_directory( &dir, NULL, path, NULL, w->backend, 
+                                NULL, NULL, 0, w->pool ) != APR_SUCCESS)
+            {
+                if (p_vt->base.zErrMsg != NULL)
+                {
+                    sqlite3_free(p_vt->base.zErrMsg);
+                }
+
+                p_vt->base.zErrMsg = sqlite3_mprintf( "Could not open directory: %s", 
+                                                      path );
+                p_cur->eof = 1;
+
+                return SQLITE_ERROR;
+            }
+
+            close_directory(&dir);
+        }
+
+        /* The readahead worker goes through the search paths itself. */
+        if (p_vt->threads == 0)
+        {
+            continue;
+        }
+
+        if ((task = malloc(sizeof(struct walker_task))) == NULL)
+        {
+            return SQLITE_NOMEM;
+        }
+
+        task->path      = strdup(path);
+        task->root      = 1;
+        task->dir_inode = 0;
+        task->depth     = 0;
+        task->du_parent = NULL;
+
+        walker_push_task(&w->workers[n++ % w->nworkers], task);
+    }
+
+    if (p_vt->threads == 0 && (i = walker_serial_open(p_cur, w)) != SQLITE_OK)
+    {
+        return i;
+    }
+
+    /* Start the workers. They are counted in first, as a worker with little
+     * to do may well be done before the next one starts. */
+    w->running = w->nworkers;
+
+    for (i = 0; i < w->nworkers; i++)
+    {
+        struct walker_worker* worker = &w->workers[i];
+
+        if (apr_thread_create( &worker->thread, NULL, 
+                               walker_thread, worker, w->pool ) != APR_SUCCESS)
+        {
+            worker->thread = NULL;
+
+            apr_thread_mutex_lock(w->lock);
+            w->running -= 1;
+            apr_thread_mutex_unlock(w->lock);
+
+            continue;
+        }
+
+        started += 1;
+    }
+
+    if (started == 0)
+    {
+        if (p_vt->base.zErrMsg != NULL)
+        {
+            sqlite3_free(p_vt->base.zErrMsg);
+        }
+
+        p_vt->base.zErrMsg = sqlite3_mprintf("Could not start walker threads");
+        p_cur->eof = 1;
+
+        return SQLITE_ERROR;
+    }
+
+    /* Move to the first row. */
+    return walker_next(p_cur);
+}
+
+/* Move the cursor to the next row from the walker. */
+int walker_next(vtab_cursor *p_cur)
+{
+    struct walker* w = p_cur->walker;
+
+    /* Next row in the current batch */
+    if (p_cur->batch != NULL && ++p_cur->row < p_cur->batch->count)
+    {
+        p_cur->count += 1;
+
+        return SQLITE_OK;
+    }
+
+    apr_thread_mutex_lock(w->lock);
+
+    /* Give the current batch back to the workers. */
+    if (p_cur->batch != NULL)
+    {
+        p_cur->batch->next = w->free_batches;
+        w->free_batches = p_cur->batch;
+        p_cur->batch = NULL;
+    }
+
+    /* Wait for the next one. */
+    while (w->head == NULL && w->running > 0)
+    {
+        apr_thread_cond_wait(w->not_empty, w->lock);
+    }
+
+    if (w->head != NULL)
+    {
+        p_cur->batch = w->head;
+        w->head      = p_cur->batch->next;
+        w->queued   -= 1;
+
+        if (w->head == NULL)
+        {
+            w->tail = NULL;
+        }
+
+        apr_thread_cond_signal(w->not_full);
+    }
+
+    apr_thread_mutex_unlock(w->lock);
+
+    if (p_cur->batch == NULL)
+    {
+        /* The workers are done. End of result set. */
+        p_cur->eof = 1;
+
+        return SQLITE_OK;
+    }
+
+    p_cur->row    = 0;
+    p_cur->count += 1;
+
+    return SQLITE_OK;
+}
+
+/* Stop the walker, wait for the workers and free everything. */
+void walker_destroy(vtab_cursor *p_cur)
+{
+    struct walker* w = p_cur->walker;
+    struct walker_task* task;
+    struct rowbatch* b;
+    int i;
+
+    if (w == NULL)
+    {
+        return;
+    }
+
+    apr_thread_mutex_lock(w->lock);
+    apr_atomic_set32(&w->stop, 1);
+    apr_thread_cond_broadcast(w->work);
+    apr_thread_cond_broadcast(w->not_full);
+    apr_thread_mutex_unlock(w->lock);
+
+    for (i = 0; i < w->nworkers; i++)
+    {
+        struct walker_worker* worker = &w->workers[i];
+        apr_status_t rv;
+
+        if (worker->thread != NULL)
+        {
+            apr_thread_join(&rv, worker->thread);
+        }
+
+        /* Tasks nobody got to */
+        while ((task = walker_take_task(worker, 1)) != NULL)
+        {
+            free(task->path);
+            free(task);
+        }
+
+        if (worker->batch != NULL)
+        {
+            rowbatch_free(worker->batch);
+        }
+
+        free(worker->tasks);
+    }
+
+    walker_serial_close(w);
+
+    if (p_cur->batch != NULL)
+    {
+        rowbatch_free(p_cur->batch);
+    }
+
+    while ((b = w->head) != NULL)
+    {
+        w->head = b->next;
+        rowbatch_free(b);
+    }
+
+    while ((b = w->free_batches) != NULL)
+    {
+        w->free_batches = b->next;
+        rowbatch_free(b);
+    }
+
+    /* Frees the walker itself, along with its locks and worker pools. */
+    apr_pool_destroy(w->pool);
+
+    p_cur->walker = NULL;
+    p_cur->batch  = NULL;
+}
+
+/*-------------------------------------------------------------------*/
+/* Sorted walk                                                       */
+/*-------------------------------------------------------------------*/
+
+/** ORDER BY path (and name) would otherwise have SQLite collect every row of
+ *  the walk and sort them. The sorted walk gives them to it in order instead.
+ *
+ *  The rows with a given path are those of a single directory: the directory
+ *  itself and its entries, other than its subdirectories (a subdirectory's
+ *  path is its own). So each directory is read in full, its rows are sorted
+ *  by name, and its subdirectories go into a heap, by path, to be read when
+ *  their turn comes. Paths don't sort the way the tree nests ('/a-b' comes
+ *  between '/a' and '/a/b'), which is why it is a heap rather than a stack.
+ *  Either way, what's in memory is the directories on the way down and their
+ *  subdirectories still to come, never the whole tree.
+ *
+ *  The walk runs on the cursor's thread, whatever the threads argument says.
+ */
+
+/* Initial size of the text of a listing. */
+#define LISTING_TEXT 1024
+
+/* Append len bytes of text to l, and a nul. Returns 0 if out of memory. */
+static int listing_append( struct listing* l, const char* text, int len, 
+                           apr_size_t* offset )
+{
+    if (l->text_used + len + 1 > l->text_size)
+    {
+        apr_size_t size = l->text_size * 2;
+        char* bigger;
+
+        while (size < l->text_used + len + 1)
+        {
+            size *= 2;
+        }
+
+        if ((bigger = realloc(l->text, size)) == NULL)
+        {
+            return 0;
+        }
+
+        l->text      = bigger;
+        l->text_size = size;
+    }
+
+    *offset = l->text_used;
+
+    memcpy(l->text + l->text_used, text, len);
+    l->text[l->text_used + len] = '\0';
+    l->text_used += len + 1;
+
+    return 1;
+}
+
+/** A listing for the directory (or top-level file) at path, not yet opened.
+ *  dirent, dir_inode, depth and name are for its own row. NULL if out of
+ *  memory.
+ */
+static struct listing* listing_create( const char* path, int path_len,
+                                       const char* name, int name_len,
+                                       const apr_finfo_t* dirent, 
+                                       apr_ino_t dir_inode, int depth )
+{
+    struct listing* l = malloc(sizeof(struct listing));
+    apr_size_t offset;
+
+    if (l == NULL)
+    {
+        return NULL;
+    }
+
+    if ((l->text = malloc(LISTING_TEXT)) == NULL)
+    {
+        free(l);
+
+        return NULL;
+    }
+
+    l->text_size = LISTING_TEXT;
+    l->text_used = 0;
+    l->path_len  = path_len;
+    l->opened    = 0;
+    l->dirent    = *dirent;
+    l->dir_inode = dir_inode;
+    l->depth     = depth;
+    l->name_len  = name_len;
+    l->rows      = NULL;
+    l->nrows     = 0;
+    l->rows_size = 0;
+    l->keys      = NULL;
+    l->next      = 0;
+
+    /* The strings in dirent belong to someone else's pool. */
+    l->dirent.name  = NULL;
+    l->dirent.fname = NULL;
+    l->dirent.pool  = NULL;
+
+    if ( listing_append(l, path, path_len, &offset) == 0
+         || listing_append(l, name, name_len, &l->name) == 0 )
+    {
+        free(l->text);
+        free(l);
+
+        return NULL;
+    }
+
+    return l;
+}
+
+/* Add a row to l. Returns 0 if out of memory. */
+static int listing_add_row( struct listing* l, const apr_finfo_t* dirent, 
+                            apr_ino_t dir_inode, int depth,
+                            const char* name, int name_len )
+{
+    struct filerow* row;
+    apr_size_t offset;
+
+    if (l->nrows == l->rows_size)
+    {
+        int size             = l->rows_size == 0 ? 16 : l->rows_size * 2;
+        struct filerow* rows = realloc(l->rows, size * sizeof(struct filerow));
+
+        if (rows == NULL)
+        {
+            return 0;
+        }
+
+        l->rows      = rows;
+        l->rows_size = size;
+    }
+
+    if (listing_append(l, name, name_len, &offset) == 0)
+    {
+        return 0;
+    }
+
+    row           = &l->rows[l->nrows++];
+    row->depth    = depth;
+    row->name     = offset;
+    row->name_len = name_len;
+    row->path     = 0;
+    row->path_len = l->path_len;
+
+    row_values(row, dirent, dir_inode);
+
+    return 1;
+}
+
+static int compare_keys(const void* a, const void* b)
+{
+    return strcmp( ((const struct sortkey*)a)->name, 
+                   ((const struct sortkey*)b)->name );
+}
+
+/** Put the rows of l in order, by name if order says so. The rows stay where
+ *  they are: it's their keys, a name and an index each, that get sorted,
+ *  which keeps the sort to a small, contiguous array. Returns 0 if out of
+ *  memory.
+ */
+static int listing_sort(struct listing* l, int order)
+{
+    int i;
+
+    if (l->nrows == 0)
+    {
+        return 1;
+    }
+
+    if ((l->keys = malloc(l->nrows * sizeof(struct sortkey))) == NULL)
+    {
+        return 0;
+    }
+
+    /* The text doesn't move any more, so the keys can point into it. */
+    for (i = 0; i < l->nrows; i++)
+    {
+        l->keys[i].name = l->text + l->rows[i].name;
+        l->keys[i].row  = i;
+    }
+
+    if ((order & ORDER_NAME) != 0)
+    {
+        qsort(l->keys, l->nrows, sizeof(struct sortkey), compare_keys);
+    }
+
+    if ((order & ORDER_NAME_DESC) != 0)
+    {
+        for (i = 0; i < l->nrows / 2; i++)
+        {
+            struct sortkey key        = l->keys[i];
+            l->keys[i]                = l->keys[l->nrows - 1 - i];
+            l->keys[l->nrows - 1 - i] = key;
+        }
+    }
+
+    l->next = 0;
+
+    return 1;
+}
+
+static void listing_free(struct listing* l)
+{
+    free(l->keys);
+    free(l->rows);
+    free(l->text);
+    free(l);
+}
+
+/** The byte at i of the path of l, or if below is set, of l's path followed
+ *  by a separator and then something greater than any byte (-1 past the end).
+ */
+static int path_byte(const struct listing* l, int below, int i)
+{
+    if (i < l->path_len)
+    {
+        return (unsigned char)l->text[i];
+    }
+
+    if (below == 0)
+    {
+        return -1;
+    }
+
+    if (i == l->path_len && (l->path_len == 0 || l->text[i - 1] != '/'))
+    {
+        return '/';
+    }
+
+    return 256;
+}
+
+/** Compares the paths of a and b, as strcmp() would. A listing with below set
+ *  stands for the greatest path below it instead of its own.
+ */
+static int compare_paths( const struct listing* a, int a_below, 
+                          const struct listing* b, int b_below )
+{
+    int n = a->path_len < b->path_len ? a->path_len : b->path_len;
+    int c = memcmp(a->text, b->text, n);
+    int i;
+
+    if (c != 0)
+    {
+        return c;
+    }
+
+    /* One is a prefix of the other. What comes after it decides. */
+    for (i = n; i <= n + 2; i++)
+    {
+        int x = path_byte(a, a_below, i);
+        int y = path_byte(b, b_below, i);
+
+        if (x != y || x == -1 || x == 256)
+        {
+            return x - y;
+        }
+    }
+
+    return 0;
+}
+
+/** Whether the next row of a comes before (< 0) or after (> 0) that of b. A
+ *  listing that isn't open yet has to be opened before any row of its
+ *  subtree is due: in ascending order, that is before any other with its
+ *  path. In descending order, the rows below it come first, so it stands for
+ *  the greatest path below it.
+ */
+static int listing_compare( const struct sortwalk* s, 
+                            const struct listing* a, const struct listing* b )
+{
+    int desc = (s->order & ORDER_PATH_DESC) != 0;
+    int c    = compare_paths(a, desc && a->opened == 0, b, desc && b->opened == 0);
+
+    if (c != 0)
+    {
+        return desc ? -c : c;
+    }
+
+    if (a->opened != b->opened)
+    {
+        return a->opened - b->opened;
+    }
+
+    if (a->opened == 0 || (s->order & ORDER_NAME) == 0)
+    {
+        return 0;
+    }
+
+    c = strcmp(a->keys[a->next].name, b->keys[b->next].name);
+
+    return (s->order & ORDER_NAME_DESC) != 0 ? -c : c;
+}
+
+/* Add l to the heap. Returns 0 if out of memory. */
+static int sorted_push(struct sortwalk* s, struct listing* l)
+{
+    int i;
+
+    if (s->nheap == s->heap_size)
+    {
+        int size              = s->heap_size == 0 ? 64 : s->heap_size * 2;
+        struct listing** heap = realloc(s->heap, size * sizeof(struct listing*));
+
+        if (heap == NULL)
+        {
+            return 0;
+        }
+
+        s->heap      = heap;
+        s->heap_size = size;
+    }
+
+    /* Up from the bottom, past everything that comes after it. */
+    for (i = s->nheap++; i > 0; i = (i - 1) / 2)
+    {
+        struct listing* parent = s->heap[(i - 1) / 2];
+
+        if (listing_compare(s, parent, l) <= 0)
+        {
+            break;
+        }
+
+        s->heap[i] = parent;
+    }
+
+    s->heap[i] = l;
+
+    return 1;
+}
+
+/* Take the listing that comes first off the heap. */
+static struct listing* sorted_pop(struct sortwalk* s)
+{
+    struct listing* top  = s->heap[0];
+    struct listing* last = s->heap[--s->nheap];
+    int i = 0;
+
+    /* Down from the top, past everything that comes before it. */
+    while (2 * i + 1 < s->nheap)
+    {
+        int child = 2 * i + 1;
+
+        if ( child + 1 < s->nheap 
+             && listing_compare(s, s->heap[child + 1], s->heap[child]) < 0 )
+        {
+            child++;
+        }
+
+        if (listing_compare(s, last, s->heap[child]) <= 0)
+        {
+            break;
+        }
+
+        s->heap[i] = s->heap[child];
+        i          = child;
+    }
+
+    if (s->nheap > 0)
+    {
+        s->heap[i] = last;
+    }
+
+    return top;
+}
+
+/** Read the directory of listing l: its own row and those of its entries go
+ *  into l, in order, and its subdirectories into the heap. If it can't be
+ *  read, l is left with no rows.
+ */
+static int sorted_open(vtab_cursor *p_cur, struct listing* l)
+{
+    vtab *p_vt            = (vtab*)((sqlite3_vtab_cursor*)p_cur)->pVtab;
+    struct sortwalk* s    = p_cur->sorted;
+    const struct query* q = &p_cur->query;
+    apr_pool_t* pool      = p_cur->tmp_pool;
+    struct dirhandle dir;
+    apr_finfo_t entry;
+    apr_status_t rv;
+
+    /* Copies: l->text moves as rows are added. */
+    const char* path = apr_pstrmemdup(pool, l->text, l->path_len);
+    const char* name = apr_pstrmemdup(pool, l->text + l->name, l->name_len);
+
+    l->opened = 1;
+
+    /* A directory at maxdepth is listed but not opened. */
+    if (q->maxdepth < 0 || l->depth < q->maxdepth)
+    {
+        if (open_directory( &dir, NULL, path, NULL, p_cur->backend, p_cur->ring,
+                            &p_cur->query, l->depth, pool ) != APR_SUCCESS)
+        {
+            apr_pool_clear(pool);
+
+            /* A search path that can't be opened is an error, as it is for
+             * the other walks. Anything below it is just skipped. */
+            if (l->depth == 0)
+            {
+                if (p_vt->base.zErrMsg != NULL)
+                {
+                    sqlite3_free(p_vt->base.zErrMsg);
+                }
+
+                p_vt->base.zErrMsg = sqlite3_mprintf( "Could not open directory: %s", 
+                                                      l->text );
+                p_cur->eof = 1;
+
+                return SQLITE_ERROR;
+            }
+
+            fprintf(stderr, "Failed to open directory: %s\n", l->text);
+
+            return SQLITE_OK;
+        }
+
+        memset(&entry, 0, sizeof(apr_finfo_t));
+
+        /* See vt_next() about APR_INCOMPLETE. */
+        while ( (rv = read_directory(&dir, &entry, p_cur->wanted)) == APR_SUCCESS 
+                || rv == APR_INCOMPLETE )
+        {
+            if (entry.filetype == APR_DIR)
+            {
+                struct listing* child;
+                const char* sub;
+
+                /* Skip . and .. entries */
+                if (strcmp(entry.name, ".") == 0 || strcmp(entry.name, "..") == 0)
+                {
+                    continue;
+                }
+
+                sub = apr_pstrcat(pool, path, path_separator(path), entry.name, NULL);
+
+                /* Leave out pruned directories, and all that's in them. */
+                if (query_pruned(q, sub, entry.name))
+                {
+                    continue;
+                }
+
+                /* The subdirectory makes its own row when its turn comes. */
+                child = listing_create( sub, strlen(sub), 
+                                        entry.name, strlen(entry.name),
+                                        &entry, l->dirent.inode, l->depth + 1 );
+
+                if (child == NULL || sorted_push(s, child) == 0)
+                {
+                    fprintf(stderr, "Out of memory, skipping: %s\n", sub);
+
+                    if (child != NULL)
+                    {
+                        listing_free(child);
+                    }
+                }
+
+                continue;
+            }
+
+            if ( query_row_ok(q, entry.name, &entry, l->dirent.inode)
+                 && listing_add_row( l, &entry, l->dirent.inode, l->depth + 1,
+                                     entry.name, strlen(entry.name) ) == 0 )
+            {
+                fprintf(stderr, "Out of memory, skipping: %s/%s\n", path, entry.name);
+            }
+        }
+
+        close_directory(&dir);
+    }
+
+    /* The directory itself. */
+    if ( query_row_ok(q, name, &l->dirent, l->dir_inode)
+         && listing_add_row( l, &l->dirent, l->dir_inode, l->depth,
+                             name, l->name_len ) == 0 )
+    {
+        fprintf(stderr, "Out of memory, skipping: %s\n", path);
+    }
+
+    /* Frees the dir handle and every entry name read from it. */
+    apr_pool_clear(pool);
+
+    if (listing_sort(l, s->order) == 0)
+    {
+        return SQLITE_NOMEM;
+    }
+
+    return SQLITE_OK;
+}
+
+/* Start a sorted walk of the search paths, in order, and move to its first row. */
+static int sorted_start(vtab_cursor *p_cur, int order)
+{
+    vtab *p_vt = (vtab*)((sqlite3_vtab_cursor*)p_cur)->pVtab;
+    struct sortwalk* s;
+
+    if ((s = calloc(1, sizeof(struct sortwalk))) == NULL)
+    {
+        return SQLITE_NOMEM;
+    }
+
+    s->order      = order;
+    p_cur->sorted = s;
+
+    while (next_path(p_cur) != 0)
+    {
+        const char* path = p_cur->path;
+        const char* name;
+        int path_len;
+        int name_len;
+        struct listing* l;
+        apr_finfo_t dirent;
+        apr_status_t rv;
+
+        if (path == NULL || *path == '\0')
+        {
+            continue;
+        }
+
+        path_len = strlen(path);
+        name     = root_name(path, path_len, &name_len);
+
+        /* See note ZERO-FILL DIRENT in next_directory(). */
+        memset(&dirent, 0, sizeof(apr_finfo_t));
+
+        rv = apr_stat(&dirent, path, p_cur->wanted, p_cur->tmp_pool);
+
+        if (rv != APR_SUCCESS && rv != APR_INCOMPLETE)
+        {
+            if (p_vt->base.zErrMsg != NULL)
+            {
+                sqlite3_free(p_vt->base.zErrMsg);
+            }
+
+            p_vt->base.zErrMsg = sqlite3_mprintf("Invalid directory: %s", path);
+            p_cur->eof = 1;
+
+            return SQLITE_ERROR;
+        }
+
+        if (dirent.filetype == APR_DIR)
+        {
+            /* A pruned search path is left out altogether. */
+            if (query_pruned(&p_cur->query, path, apr_filepath_name_get(path)))
+            {
+                continue;
+            }
+
+            l = listing_create(path, path_len, name, name_len, &dirent, 0, 0);
+        }
+        else
+        {
+            /* A top-level file. Its path is that of the directory it is in. */
+            l = listing_create( path, root_dir_len(path, path_len), 
+                                name, name_len, &dirent, 0, 0 );
+
+            if (l != NULL)
+            {
+                l->opened = 1;
+
+                if ( query_row_ok(&p_cur->query, name, &dirent, 0) == 0
+                     || listing_add_row(l, &dirent, 0, 0, name, name_len) == 0
+                     || listing_sort(l, order) == 0 )
+                {
+                    listing_free(l);
+
+                    continue;
+                }
+            }
+        }
+
+        if (l == NULL || sorted_push(s, l) == 0)
+        {
+            if (l != NULL)
+            {
+                listing_free(l);
+            }
+
+            return SQLITE_NOMEM;
+        }
+    }
+
+    apr_pool_clear(p_cur->tmp_pool);
+
+    return sorted_next(p_cur);
+}
+
+/* Move the cursor to the next row of the sorted walk. */
+static int sorted_next(vtab_cursor *p_cur)
+{
+    struct sortwalk* s = p_cur->sorted;
+    struct listing* l  = s->current;
+    int rc;
+
+    s->current = NULL;
+
+    /* The next row of the current listing, unless another comes first. */
+    if (l != NULL)
+    {
+        if (++l->next < l->nrows)
+        {
+            if (s->nheap == 0 || listing_compare(s, l, s->heap[0]) <= 0)
+            {
+                s->current    = l;
+                p_cur->count += 1;
+
+                return SQLITE_OK;
+            }
+
+            if (sorted_push(s, l) == 0)
+            {
+                listing_free(l);
+
+                return SQLITE_NOMEM;
+            }
+        }
+        else
+        {
+            listing_free(l);
+        }
+    }
+
+    while (s->nheap > 0)
+    {
+        l = sorted_pop(s);
+
+        if (l->opened != 0)
+        {
+            s->current    = l;
+            p_cur->count += 1;
+
+            return SQLITE_OK;
+        }
+
+        /* Its turn: read it, and put it back by its first row. */
+        if ((rc = sorted_open(p_cur, l)) != SQLITE_OK)
+        {
+            listing_free(l);
+
+            return rc;
+        }
+
+        if (l->nrows == 0)
+        {
+            listing_free(l);
+        }
+        else if (sorted_push(s, l) == 0)
+        {
+            listing_free(l);
+
+            return SQLITE_NOMEM;
+        }
+    }
+
+    /* Nothing left. End of result set. */
+    p_cur->eof = 1;
+
+    return SQLITE_OK;
+}
+
+/* The current row of the sorted walk. Its name and path are in text. */
+static struct filerow* sorted_row(vtab_cursor *p_cur, const char** text)
+{
+    struct listing* l = p_cur->sorted->current;
+
+    if (l == NULL)
+    {
+        return NULL;
+    }
+
+    *text = l->text;
+
+    return &l->rows[l->keys[l->next].row];
+}
+
+/* Free the sorted walk, if there is one. */
+static void sorted_destroy(vtab_cursor *p_cur)
+{
+    struct sortwalk* s = p_cur->sorted;
+    int i;
+
+    if (s == NULL)
+    {
+        return;
+    }
+
+    if (s->current != NULL)
+    {
+        listing_free(s->current);
+    }
+
+    for (i = 0; i < s->nheap; i++)
+    {
+        listing_free(s->heap[i]);
+    }
+
+    free(s->heap);
+    free(s);
+
+    p_cur->sorted = NULL;
+}
+
+/*-------------------------------------------------------------------*/
+/* Top rows                                                          */
+/*-------------------------------------------------------------------*/
+
+/** ORDER BY size DESC LIMIT 100 is the walk as usual, but each row that
+ *  comes out of it is only kept if it is one of the 100 biggest so far. The
+ *  rest are never copied, and SQLite never sees them, so there is nothing for
+ *  it to sort but those 100. They are sorted once the walk is over, and only
+ *  then returned.
+ */
+
+/* A new, empty set of top rows. NULL if out of memory. */
+static struct toprows* top_create(int column, int desc, sqlite3_int64 limit)
+{
+    struct toprows* t = calloc(1, sizeof(struct toprows));
+
+    if (t == NULL)
+    {
+        return NULL;
+    }
+
+    t->column = column;
+    t->desc   = desc;
+    t->limit  = limit;
+
+    return t;
+}
+
+/* Whether a row with key a goes before one with key b. */
+static int top_before(const struct toprows* t, sqlite3_int64 a, sqlite3_int64 b)
+{
+    return t->desc ? a > b : a < b;
+}
+
+/* Swap two rows of the heap. */
+static void top_swap(struct toprows* t, int i, int j)
+{
+    struct toprow* r = t->heap[i];
+
+    t->heap[i] = t->heap[j];
+    t->heap[j] = r;
+}
+
+/* Move heap[i] down to where it belongs among the first n rows. */
+static void top_sift_down(struct toprows* t, int i, int n)
+{
+    while (1)
+    {
+        int last  = i;
+        int child = 2 * i + 1;
+
+        if (child < n && top_before(t, t->heap[last]->key, t->heap[child]->key))
+        {
+            last = child;
+        }
+
+        if ( child + 1 < n 
+             && top_before(t, t->heap[last]->key, t->heap[child + 1]->key) )
+        {
+            last = child + 1;
+        }
+
+        if (last == i)
+        {
+            return;
+        }
+
+        top_swap(t, i, last);
+        i = last;
+    }
+}
+
+/** Offer the walk's current row to t. It is kept if there is still room, or
+ *  if it goes before the last of the rows kept so far, which it then takes
+ *  the place of. Returns 0 when out of memory.
+ */
+static int top_add(vtab_cursor *p_cur, struct toprows* t)
+{
+    const struct filenode* d = p_cur->current_node;
+    const char* text         = NULL;
+    struct filerow* row      = cursor_row(p_cur, &text);
+    const apr_finfo_t* dirent;
+    apr_ino_t dir_inode      = 0;
+    const char* name;
+    const char* path;
+    int name_len;
+    int path_len;
+    int depth;
+    sqlite3_int64 key;
+    struct toprow* r;
+    apr_size_t need;
+    int full = t->limit >= 0 && t->nheap >= t->limit;
+
+    if (row != NULL)
+    {
+        key       = ROW_VALUE(row, t->column);
+        depth     = row->depth;
+        name      = text + row->name;
+        name_len  = row->name_len;
+        path      = text + row->path;
+        path_len  = row->path_len;
+    }
+    else
+    {
+        dirent    = &d->dirent;
+        dir_inode = row_dir_inode(p_cur);
+        key       = column_value(dirent, dir_inode, t->column);
+        depth     = p_cur->depth;
+
+        walk_row_text(p_cur, &name, &name_len, &path, &path_len);
+    }
+
+    need = name_len + path_len + 2;
+
+    /* Full up: this row has to beat the last one, and takes its place. */
+    if (full)
+    {
+        if (top_before(t, key, t->heap[0]->key) == 0)
+        {
+            return 1;
+        }
+
+        r = t->heap[0];
+
+        if (r->text_size < need)
+        {
+            char* text = realloc(r->text, need);
+
+            if (text == NULL)
+            {
+                return 0;
+            }
+
+            r->text      = text;
+            r->text_size = need;
+        }
+    }
+    else
+    {
+        if (t->nheap == t->heap_size)
+        {
+            int size = t->heap_size == 0 ? 64 : t->heap_size * 2;
+            struct toprow** heap = realloc(t->heap, size * sizeof(struct toprow*));
+
+            if (heap == NULL)
+            {
+                return 0;
+            }
+
+            t->heap      = heap;
+            t->heap_size = size;
+        }
+
+        if ((r = calloc(1, sizeof(struct toprow))) == NULL)
+        {
+            return 0;
+        }
+
+        if ((r->text = malloc(need)) == NULL)
+        {
+            free(r);
+
+            return 0;
+        }
+
+        r->text_size = need;
+    }
+
+    r->key          = key;
+    r->row.depth    = depth;
+    r->row.name     = 0;
+    r->row.name_len = name_len;
+    r->row.path     = name_len + 1;
+    r->row.path_len = path_len;
+
+    if (row != NULL)
+    {
+        memcpy(r->row.value, row->value, sizeof(row->value));
+    }
+    else
+    {
+        row_values(&r->row, dirent, dir_inode);
+    }
+
+    memcpy(r->text, name, name_len);
+    r->text[name_len] = '\0';
+    memcpy(r->text + name_len + 1, path, path_len);
+    r->text[name_len + 1 + path_len] = '\0';
+
+    if (full)
+    {
+        top_sift_down(t, 0, t->nheap);
+    }
+    else
+    {
+        /* A new row, at the bottom of the heap, moving up past better ones. */
+        int i = t->nheap++;
+
+        t->heap[i] = r;
+
+        while (i > 0 && top_before(t, t->heap[(i - 1) / 2]->key, key))
+        {
+            top_swap(t, i, (i - 1) / 2);
+            i = (i - 1) / 2;
+        }
+    }
+
+    return 1;
+}
+
+/** Run the rest of the walk, offering each of its rows to t, then sort the
+ *  rows t kept and make them the cursor's. The walk is freed as soon as it
+ *  is over.
+ */
+static int top_collect(vtab_cursor *p_cur, struct toprows* t)
+{
+    int rc = SQLITE_OK;
+    int n;
+
+    while (rc == SQLITE_OK && p_cur->eof == 0)
+    {
+        if (top_add(p_cur, t) == 0)
+        {
+            rc = SQLITE_NOMEM;
+        }
+        else
+        {
+            rc = walk_next(p_cur);
+        }
+    }
+
+    walker_destroy(p_cur);
+    p_cur->top = t;
+
+    if (rc != SQLITE_OK)
+    {
+        return rc;
+    }
+
+    /* The row at the top goes after all the others left. */
+    for (n = t->nheap - 1; n > 0; n--)
+    {
+        top_swap(t, 0, n);
+        top_sift_down(t, 0, n);
+    }
+
+    t->next    = 0;
+    p_cur->eof = t->nheap == 0;
+
+    index_row(p_cur);
+
+    return SQLITE_OK;
+}
+
+/* The current row of the top rows. Its name and path are in text. */
+static struct filerow* top_row(vtab_cursor *p_cur, const char** text)
+{
+    struct toprows* t = p_cur->top;
+
+    if (t->next >= t->nheap)
+    {
+        return NULL;
+    }
+
+    *text = t->heap[t->next]->text;
+
+    return &t->heap[t->next]->row;
+}
+
+/* Free the top rows, if there are any. */
+static void top_destroy(vtab_cursor *p_cur)
+{
+    struct toprows* t = p_cur->top;
+    int i;
+
+    if (t == NULL)
+    {
+        return;
+    }
+
+    for (i = 0; i < t->nheap; i++)
+    {
+        free(t->heap[i]->text);
+        free(t->heap[i]);
+    }
+
+    free(t->heap);
+    free(t);
+
+    p_cur->top = NULL;
+}
+
+/*-------------------------------------------------------------------*/
+/* Inode index                                                       */
+/*-------------------------------------------------------------------*/
+
+/** There is no way to get from an inode to a file short of a walk. Linux has
+ *  open_by_handle_at(), but the handle it takes comes from a path in the
+ *  first place, and it needs CAP_DAC_READ_SEARCH. So once a query on the table
+ *  looks an inode up (inode = n, or the rowid), the table keeps the full path
+ *  of every row it returns from then on, by inode, and looks inodes up there.
+ *  A path is only taken at its word once a stat says the inode is still there.
+ *
+ *  The index only knows what the table has seen. An inode that isn't in it,
+ *  or whose hard links aren't all in it, is looked for by a walk of the
+ *  query's search paths, which adds every row it passes to the index, not
+ *  just the ones it returns. Once a walk has been all the way down a search
+ *  path like that, or has returned every row under it, the index has all of
+ *  it: an inode under it that the index doesn't know wasn't there at the time
+ *  of that walk, and no walk is needed to tell. Without a path constraint,
+ *  an inode is looked for under the search paths the table has walked, not
+ *  all of / (unless the table hasn't walked any yet).
+ *
+ *  The index keeps two generations of up to INODE_INDEX_MAX paths each. Once
+ *  the newer one is full, the older one goes, so the paths seen last, such as
+ *  the directories of the rows a self-join is going through, stay. So does
+ *  knowing which search paths the index has all of: it no longer does.
+ *
+ *  An inode number is only unique within a device: one on a device the table
+ *  hasn't seen it on yet is missed.
+ */
+
+/* Most paths in a generation of the index. */
+#define INODE_INDEX_MAX (1 << 18)
+
+/* A path an inode was seen at. The first of the chain holds the hash key. */
+struct indexed_path
+{
+    struct indexed_path* next;
+    apr_ino_t inode;
+    char path[1];
+};
+
+/* The paths of inodes, for the life of the table. */
+struct inode_index
+{
+    apr_pool_t* pool;
+
+    /* The paths added since the older generation filled up, and those added
+     * before that, by inode. Each generation has its own pool. */
+    apr_pool_t* paths_pool;
+    apr_hash_t* paths;
+    apr_pool_t* older_pool;
+    apr_hash_t* older;
+    int count;
+
+    /* Number of generations dropped so far. */
+    int generation;
+
+    /* The search paths of the walks that rows came from, and those of them
+     * that the index has every row under (see index_walked()). */
+    apr_hash_t* roots;
+    apr_hash_t* walked;
+};
+
+static struct inode_index* inode_index_create(apr_pool_t* pool)
+{
+    struct inode_index* ix = apr_palloc(pool, sizeof(struct inode_index));
+
+    apr_pool_create(&ix->pool, pool);
+    apr_pool_create(&ix->paths_pool, ix->pool);
+    apr_pool_create(&ix->older_pool, ix->pool);
+
+    ix->paths      = apr_hash_make(ix->paths_pool);
+    ix->older      = apr_hash_make(ix->older_pool);
+    ix->count      = 0;
+    ix->generation = 0;
+    ix->roots      = apr_hash_make(ix->pool);
+    ix->walked     = apr_hash_make(ix->pool);
+
+    return ix;
+}
+
+/* Note that inode was seen at dir/name, or at dir if name is NULL. */
+static void inode_index_add( struct inode_index* ix, apr_ino_t inode,
+                             const char* dir, const char* name )
+{
+    struct indexed_path* head;
+    struct indexed_path* p;
+    const char* sep = name != NULL ? path_separator(dir) : "";
+    apr_size_t dir_len;
+    apr_size_t sep_len;
+
+    if (name == NULL)
+    {
+        name = "";
+    }
+
+    dir_len = strlen(dir);
+    sep_len = strlen(sep);
+    head    = apr_hash_get(ix->paths, &inode, sizeof(apr_ino_t));
+
+    for (p = head; p != NULL; p = p->next)
+    {
+        if ( strncmp(p->path, dir, dir_len) == 0
+             && strncmp(p->path + dir_len, sep, sep_len) == 0
+             && strcmp(p->path + dir_len + sep_len, name) == 0 )
+        {
+            return;
+        }
+    }
+
+    /* The newer generation is full: it becomes the older one. */
+    if (ix->count >= INODE_INDEX_MAX)
+    {
+        apr_pool_t* pool = ix->older_pool;
+
+        apr_pool_clear(pool);
+
+        ix->older_pool = ix->paths_pool;
+        ix->older      = ix->paths;
+        ix->paths_pool = pool;
+        ix->paths      = apr_hash_make(pool);
+        ix->count      = 0;
+        head           = NULL;
+
+        ix->generation += 1;
+        apr_hash_clear(ix->walked);
+    }
+
+    p = apr_palloc( ix->paths_pool, 
+                    sizeof(struct indexed_path) + dir_len + sep_len + strlen(name) );
+
+    p->next  = head;
+    p->inode = inode;
+
+    memcpy(p->path, dir, dir_len);
+    memcpy(p->path + dir_len, sep, sep_len);
+    strcpy(p->path + dir_len + sep_len, name);
+
+    apr_hash_set(ix->paths, &p->inode, sizeof(apr_ino_t), p);
+    ix->count += 1;
+}
+
+/* Whether the index has every row under each of the search paths in list. */
+static int inode_index_covers( struct inode_index* ix, const char* list, 
+                               apr_pool_t* pool )
+{
+    const char* path;
+    int n = 0;
+
+    while ((path = next_search_path(&list, pool)) != NULL)
+    {
+        if (*path == '\0')
+        {
+            continue;
+        }
+
+        if (apr_hash_get(ix->walked, path, APR_HASH_KEY_STRING) == NULL)
+        {
+            return 0;
+        }
+
+        n++;
+    }
+
+    return n > 0;
+}
+
+/** Before a walk: note its search paths in the index, and whether it will have
+ *  added every row under them by the time it is over (see index_walked()). It
+ *  will if it goes all the way down each one, and either returns every row or
+ *  adds them all as it goes (index_all). plain says the rows come straight
+ *  from the walk, not sorted or cut down to the top ones.
+ */
+static void index_walk(vtab_cursor *p_cur, int plain)
+{
+    vtab* p_vt             = (vtab*)((sqlite3_vtab_cursor*)p_cur)->pVtab;
+    struct inode_index* ix = p_vt->index;
+    const struct query* q  = &p_cur->query;
+    const char* list       = p_cur->search_paths;
+    const char* path;
+
+    p_cur->index_generation = -1;
+
+    if (ix == NULL)
+    {
+        return;
+    }
+
+    while ((path = next_search_path(&list, p_cur->tmp_pool)) != NULL)
+    {
+        if ( *path != '\0' 
+             && apr_hash_get(ix->roots, path, APR_HASH_KEY_STRING) == NULL )
+        {
+            path = apr_pstrdup(ix->pool, path);
+            apr_hash_set(ix->roots, path, APR_HASH_KEY_STRING, path);
+        }
+    }
+
+    apr_pool_clear(p_cur->tmp_pool);
+
+    if ( plain != 0 && q->nnames == 0 && q->npatterns == 0 && q->nprune == 0
+         && q->maxdepth == p_vt->maxdepth
+         && ( p_cur->index_all != 0 
+              || (q->npredicates == 0 && q->by_inode == 0) ) )
+    {
+        p_cur->index_generation = ix->generation;
+    }
+}
+
+/** After a walk has come to its end: if index_walk() said it would add every
+ *  row under its search paths, and none of them have been dropped since, note
+ *  that the index has all of them.
+ */
+static void index_walked(vtab_cursor *p_cur)
+{
+    vtab* p_vt             = (vtab*)((sqlite3_vtab_cursor*)p_cur)->pVtab;
+    struct inode_index* ix = p_vt->index;
+    const char* list       = p_cur->search_paths;
+    const char* path;
+
+    if ( ix == NULL || p_cur->index_generation < 0 
+         || p_cur->index_generation != ix->generation )
+    {
+        return;
+    }
+
+    p_cur->index_generation = -1;
+
+    while ((path = next_search_path(&list, p_cur->tmp_pool)) != NULL)
+    {
+        const char* root = apr_hash_get(ix->roots, path, APR_HASH_KEY_STRING);
+
+        if (root != NULL)
+        {
+            apr_hash_set(ix->walked, root, APR_HASH_KEY_STRING, root);
+        }
+    }
+
+    apr_pool_clear(p_cur->tmp_pool);
+}
+
+/* Add the cursor's current row to the table's index, if it keeps one. */
+static void index_row(vtab_cursor *p_cur)
+{
+    vtab* p_vt               = (vtab*)((sqlite3_vtab_cursor*)p_cur)->pVtab;
+    struct inode_index* ix   = p_vt->index;
+    const struct filenode* d = p_cur->current_node;
+    const struct filerow* row;
+    const char* text;
+
+    if (ix == NULL || p_cur->eof != 0)
+    {
+        return;
+    }
+
+    if ((row = cursor_row(p_cur, &text)) != NULL)
+    {
+        const char* name = text + row->name;
+        const char* path = text + row->path;
+
+        /* A directory's path is its own. A top-level file with no directory
+         * in its path is just its name. */
+        if (ROW_VALUE(row, COLUMN_TYPE) == APR_DIR)
+        {
+            inode_index_add(ix, ROW_VALUE(row, COLUMN_INODE), path, NULL);
+        }
+        else if (row->path_len == 0)
+        {
+            inode_index_add(ix, ROW_VALUE(row, COLUMN_INODE), name, NULL);
+        }
+        else
+        {
+            inode_index_add(ix, ROW_VALUE(row, COLUMN_INODE), path, name);
+        }
+
+        return;
+    }
+
+    if (p_cur->path == NULL)
+    {
+        return;
+    }
+
+    /* The row is either d itself, or an entry in it (see row_dir_inode()). */
+    if (p_cur->depth == d->depth)
+    {
+        inode_index_add(ix, d->dirent.inode, p_cur->path, NULL);
+    }
+    else if (d->dirent.name != NULL)
+    {
+        inode_index_add(ix, d->dirent.inode, p_cur->path, d->dirent.name);
+    }
+}
+
+/** Whether the query prunes the file at path, which is rest below the search
+ *  path root (rest is NULL for root itself), or a directory it is in.
+ */
+static int lookup_pruned( const struct query* q, const char* root, 
+                          const char* path, const char* rest, 
+                          const apr_finfo_t* finfo, apr_pool_t* pool )
+{
+    if (q->nprune == 0)
+    {
+        return 0;
+    }
+
+    /* The search path, unless it is a file. */
+    if ( (rest != NULL || finfo->filetype == APR_DIR)
+         && query_pruned(q, root, apr_filepath_name_get(root)) )
+    {
+        return 1;
+    }
+
+    if (rest == NULL)
+    {
+        return 0;
+    }
+
+    /* Each directory on the way down to it, and it, if it is one. */
+    while (1)
+    {
+        const char* slash = strchr(rest, '/');
+
+        if (slash == NULL)
+        {
+            return finfo->filetype == APR_DIR && query_pruned(q, path, rest);
+        }
+
+        if (query_pruned( q, apr_pstrmemdup(pool, path, slash - path),
+                          apr_pstrmemdup(pool, rest, slash - rest) ))
+        {
+            return 1;
+        }
+
+        rest = slash + 1;
+    }
+}
+
+/** Add the rows for the file at path to *b: one for each search path it is
+ *  under, as the walk would have found it, if the query lets it through.
+ *  finfo is the file, lstat'ed. Returns 0 if the rows don't fit in one batch.
+ */
+static int lookup_rows( vtab_cursor *p_cur, struct rowbatch** b,
+                        const char* path, const apr_finfo_t* finfo )
+{
+    const struct query* q = &p_cur->query;
+    apr_pool_t* pool      = p_cur->tmp_pool;
+    const char* list      = p_cur->search_paths;
+    int path_len          = strlen(path);
+
+    const char* root;
+
+    while ((root = next_search_path(&list, pool)) != NULL)
+    {
+        const char* rest = NULL;
+        const char* name;
+        const char* dir;
+        int root_len        = strlen(root);
+        int name_len;
+        int dir_len;
+        int depth           = 0;
+        apr_ino_t dir_inode = 0;
+
+        if (root_len == 0)
+        {
+            continue;
+        }
+
+        /* Is it under this search path, and how far? */
+        if (strcmp(path, root) != 0)
+        {
+            const char* sep = path_separator(root);
+            int sep_len     = strlen(sep);
+
+            if ( strncmp(path, root, root_len) != 0
+                 || strncmp(path + root_len, sep, sep_len) != 0
+                 || path[root_len + sep_len] == '\0' )
+            {
+                continue;
+            }
+
+            rest  = path + root_len + sep_len;
+            depth = 1;
+
+            for (name = rest; (name = strchr(name, '/')) != NULL; name++)
+            {
+                depth++;
+            }
+        }
+
+        if ( (q->maxdepth >= 0 && depth > q->maxdepth)
+             || lookup_pruned(q, root, path, rest, finfo, pool) )
+        {
+            continue;
+        }
+
+        if (rest == NULL)
+        {
+            /* A top-level file's path is that of the directory it is in. */
+            name    = root_name(root, root_len, &name_len);
+            dir     = root;
+            dir_len = root_len;
+
+            if (finfo->filetype != APR_DIR)
+            {
+                dir_len = root_dir_len(root, root_len);
+            }
+        }
+        else
+        {
+            const char* slash = strrchr(rest, '/');
+            apr_finfo_t parent;
+
+            name     = slash != NULL ? slash + 1 : rest;
+            name_len = path_len - (int)(name - path);
+            dir      = slash != NULL ? path : root;
+            dir_len  = slash != NULL ? (int)(slash - path) : root_len;
+
+            memset(&parent, 0, sizeof(apr_finfo_t));
+
+            if (apr_stat( &parent, apr_pstrmemdup(pool, dir, dir_len), 
+                          APR_FINFO_INODE, pool ) == APR_SUCCESS)
+            {
+                dir_inode = parent.inode;
+            }
+
+            /* A directory's path is its own. */
+            if (finfo->filetype == APR_DIR)
+            {
+                dir     = path;
+                dir_len = path_len;
+            }
+        }
+
+        if (query_row_ok(q, name, finfo, dir_inode) == 0)
+        {
+            continue;
+        }
+
+        if (*b == NULL && (*b = rowbatch_create()) == NULL)
+        {
+            return 0;
+        }
+
+        if (rowbatch_add( *b, finfo, dir_inode, depth, 
+                          name, name_len, dir, dir_len ) == 0)
+        {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/** Find the inodes the query asks for where the index says they are, and put
+ *  their rows in p_cur->batch, or set eof if none of them get through. If
+ *  some inode can't be accounted for, the batch is left NULL, for the walk to
+ *  find them instead. It can be if the index has every row under the search
+ *  paths (see index_walked()): then an inode it doesn't know isn't there, and
+ *  neither are any links of one that it does know but hasn't seen.
+ */
+static void lookup_inodes(vtab_cursor *p_cur)
+{
+    vtab* p_vt             = (vtab*)((sqlite3_vtab_cursor*)p_cur)->pVtab;
+    struct inode_index* ix = p_vt->index;
+    const struct query* q  = &p_cur->query;
+    apr_pool_t* pool       = p_cur->tmp_pool;
+    struct rowbatch* b     = NULL;
+    int walked             = inode_index_covers(ix, p_cur->search_paths, pool);
+    int i;
+
+    for (i = 0; i < q->ninodes; i++)
+    {
+        apr_ino_t inode = (apr_ino_t)q->inodes[i];
+        struct indexed_path* chain[2];
+        struct indexed_path* p;
+        apr_int32_t nlink = 0;
+        int found         = 0;
+        int is_dir        = 0;
+        int g;
+
+        /* Its paths in the newer generation, and in the older one. */
+        chain[0] = apr_hash_get(ix->paths, &inode, sizeof(apr_ino_t));
+        chain[1] = apr_hash_get(ix->older, &inode, sizeof(apr_ino_t));
+
+        for (g = 0; g < 2; g++)
+        {
+            for (p = chain[g]; p != NULL; p = p->next)
+            {
+                const struct indexed_path* seen = NULL;
+                apr_finfo_t finfo;
+                apr_status_t rv;
+
+                /* Already stat'ed, if the newer generation has it too. */
+                if (g > 0)
+                {
+                    for (seen = chain[0]; seen != NULL; seen = seen->next)
+                    {
+                        if (strcmp(seen->path, p->path) == 0)
+                        {
+                            break;
+                        }
+                    }
+                }
+
+                if (seen != NULL)
+                {
+                    continue;
+                }
+
+                memset(&finfo, 0, sizeof(apr_finfo_t));
+
+                rv = apr_stat( &finfo, p->path, 
+                               p_cur->wanted|APR_FINFO_LINK|APR_FINFO_NLINK, pool );
+
+                /* Gone, or something else is there now. */
+                if ((rv != APR_SUCCESS && rv != APR_INCOMPLETE) || finfo.inode != inode)
+                {
+                    continue;
+                }
+
+                found += 1;
+                nlink  = finfo.nlink;
+                is_dir = finfo.filetype == APR_DIR;
+
+                if (lookup_rows(p_cur, &b, p->path, &finfo) == 0)
+                {
+                    goto walk;
+                }
+            }
+        }
+
+        if (walked != 0)
+        {
+            /* Not where it was: it may have moved since the walk. */
+            if (found == 0 && (chain[0] != NULL || chain[1] != NULL))
+            {
+                goto walk;
+            }
+
+            continue;
+        }
+
+        /* A file may have links we haven't seen. A directory has just one. */
+        if (found == 0 || (is_dir == 0 && nlink > found))
+        {
+            goto walk;
+        }
+    }
+
+    apr_pool_clear(pool);
+
+    if (b == NULL)
+    {
+        p_cur->eof = 1;
+
+        return;
+    }
+
+    p_cur->batch = b;
+    p_cur->row   = 0;
+    p_cur->count = 1;
+
+    return;
+
+walk:
+
+    apr_pool_clear(pool);
+
+    if (b != NULL)
+    {
+        rowbatch_free(b);
+    }
+}
+
+/*-------------------------------------------------------------------*/
+/* Snapshot                                                          */
+/*-------------------------------------------------------------------*/
+
+/** A table created with cache=file keeps a snapshot of its walks in file, a
+ *  SQLite database of its own:
+ *
+ *    create virtual table f using filesystem('cache=/var/lib/fsidx.db');
+ *    insert into f(refresh) values ('/usr/lib, /var/log');
+ *
+ *  Inserting a list of search paths into the refresh column walks them and
+ *  brings their rows in the snapshot up to date; inserting '' does that for
+ *  every search path already in it. From then on, a query whose search paths
+ *  are all in the snapshot, as deep as it goes, reads its rows from there
+ *  instead of from the file system, as of the last refresh.
+ *
+ *  fs_roots has a row for each search path. fs_files has the rows of their
+ *  walks, keyed by (parent, name), where parent is the id of the directory's
+ *  own row (0 for the search path itself), and indexed on (inode, dev), size
+ *  and mtime. The constraints the walk checks are handed on to the snapshot's
+ *  own query, so those indexes can be used, and are checked again on each
+ *  row as it comes, just as the walk would. prune is left to the walk.
+ */
+
+/* Milliseconds to wait for another connection's refresh to finish. */
+#define SNAPSHOT_BUSY_TIMEOUT 5000
+
+/* Most names or inodes handed on to the snapshot's query. With more, they
+ * are only checked on the rows it returns. */
+#define SNAPSHOT_MAX_IN 512
+
+static const char* snapshot_ddl = 
+  "pragma journal_mode = wal;"
+  "create table if not exists fs_roots ("
+  "  id        integer primary key,"
+  "  path      text not null unique,"
+  "  maxdepth  int not null default -1,"
+  "  rows      int not null default 0,"
+  "  levels    text,"
+  "  refreshed int );"
+  "create table if not exists fs_files ("
+  "  id     integer primary key,"
+  "  root   int not null,"
+  "  parent int not null,"
+  "  name   text not null,"
+  "  path   text not null,"
+  "  depth  int not null,"
+  "  type int, size int, uid int, gid int, prot int, mtime int,"
+  "  ctime int, atime int, dev int, nlink int, inode int, dir int );"
+  "create unique index if not exists fs_files_parent on fs_files(parent, name);"
+  "create index if not exists fs_files_root on fs_files(root, depth);"
+  "create index if not exists fs_files_inode on fs_files(inode, dev);"
+  "create index if not exists fs_files_size on fs_files(size);"
+  "create index if not exists fs_files_mtime on fs_files(mtime);";
+
+/* The numeric columns 2 to 13, as the snapshot names them. */
+#define SNAPSHOT_VALUES \
+  "type, size, uid, gid, prot, mtime, ctime, atime, dev, nlink, inode, dir"
+
+/** The name column of a row of the snapshot. A search path's row is kept under
+ *  the whole path, and named by its last part, as root_name() does.
+ */
+#define SNAPSHOT_NAME \
+  "(case when depth > 0 then name when rtrim(name, '/') = '' then '/' " \
+  "else substr(rtrim(name, '/'), length(rtrim(rtrim(name, '/'), " \
+  "replace(rtrim(name, '/'), '/', ''))) + 1) end)"
+
+static const char* snapshot_columns[ROW_VALUES] = 
+{
+    "type", "size", "uid", "gid", "prot", "mtime",
+    "ctime", "atime", "dev", "nlink", "inode", "dir"
+};
+
+/* Append to *sql, an sqlite3_malloc()'ed string. It is NULL once out of memory. */
+static void snapshot_append(char** sql, const char* format, ...)
+{
+    va_list ap;
+    char* more;
+    char* both = NULL;
+
+    if (*sql == NULL)
+    {
+        return;
+    }
+
+    va_start(ap, format);
+    more = sqlite3_vmprintf(format, ap);
+    va_end(ap);
+
+    if (more != NULL)
+    {
+        both = sqlite3_mprintf("%s%s", *sql, more);
+    }
+
+    sqlite3_free(more);
+    sqlite3_free(*sql);
+
+    *sql = both;
+}
+
+/* Open (and if need be create) the snapshot in file, for the cache argument. */
+static int snapshot_open(vtab* p_vt, const char* file, char **pzErr)
+{
+    char* error = NULL;
+
+    if (p_vt->cache != NULL)
+    {
+        sqlite3_close(p_vt->cache);
+        p_vt->cache = NULL;
+    }
+
+    if ( sqlite3_open_v2( file, &p_vt->cache, 
+                          SQLITE_OPEN_READWRITE|SQLITE_OPEN_CREATE, 
+                          NULL ) != SQLITE_OK
+         || sqlite3_busy_timeout(p_vt->cache, SNAPSHOT_BUSY_TIMEOUT) != SQLITE_OK
+         || sqlite3_exec(p_vt->cache, snapshot_ddl, NULL, NULL, &error) != SQLITE_OK )
+    {
+        *pzErr = sqlite3_mprintf( "Could not open cache %s: %s", file, 
+                                  error != NULL ? error 
+                                                : sqlite3_errmsg(p_vt->cache) );
+
+        sqlite3_free(error);
+        sqlite3_close(p_vt->cache);
+        p_vt->cache = NULL;
+
+        return SQLITE_ERROR;
+    }
+
+    return SQLITE_OK;
+}
+
+/** The id of search path path in the snapshot, if it is there, and its walk
+ *  went as deep as maxdepth (-1 for all the way). 0 if not. If level isn't
+ *  NULL, the snapshot's rows are added to it the way walk_rows() counts
+ *  them.
+ */
+static sqlite3_int64 snapshot_root( vtab* p_vt, const char* path, int maxdepth,
+                                    double* level )
+{
+    sqlite3_stmt* stmt;
+    sqlite3_int64 id = 0;
+
+    if (sqlite3_prepare_v2( p_vt->cache, 
+                            "select id, maxdepth, levels from fs_roots "
+                            "where path = ?", 
+                            -1, &stmt, NULL ) != SQLITE_OK)
+    {
+        return 0;
+    }
+
+    sqlite3_bind_text(stmt, 1, path, -1, SQLITE_STATIC);
+
+    if (sqlite3_step(stmt) == SQLITE_ROW)
+    {
+        int depth = sqlite3_column_int(stmt, 1);
+
+        if (depth < 0 || (maxdepth >= 0 && maxdepth <= depth))
+        {
+            id = sqlite3_column_int64(stmt, 0);
+        }
+
+        /* levels is the number of rows at each depth, in order. */
+        if (id != 0 && level != NULL)
+        {
+            const char* counts = (const char*)sqlite3_column_text(stmt, 2);
+            char* end;
+            int i;
+
+            for (depth = 0; counts != NULL; depth++, counts = end)
+            {
+                double rows = strtod(counts, &end);
+
+                if (end == counts)
+                {
+                    break;
+                }
+
+                for (i = depth < PATH_LEVELS ? depth : PATH_LEVELS - 1; i < PATH_LEVELS; i++)
+                {
+                    level[i] += rows;
+                }
+            }
+        }
+    }
+
+    sqlite3_finalize(stmt);
+
+    return id;
+}
+
+/* The SQL operator for a predicate's. NULL if there isn't one. */
+static const char* snapshot_operator(int op)
+{
+    switch (op)
+    {
+        case SQLITE_INDEX_CONSTRAINT_EQ: return "=";
+        case SQLITE_INDEX_CONSTRAINT_GT: return ">";
+        case SQLITE_INDEX_CONSTRAINT_GE: return ">=";
+        case SQLITE_INDEX_CONSTRAINT_LT: return "<";
+        case SQLITE_INDEX_CONSTRAINT_LE: return "<=";
+#if SQLITE_VERSION_NUMBER >= 3021000
+        case SQLITE_INDEX_CONSTRAINT_NE: return "<>";
+#endif
+    }
+
+    return NULL;
+}
+
+/** The snapshot's query for the rows of the roots (a list of ids) that the
+ *  cursor's constraints don't rule out, in the order the walk would return
+ *  them (see snapshot_start()). NULL if out of memory.
+ */
+static char* snapshot_query( const struct query* q, const char* roots, 
+                             int order, int top_column, int top_desc )
+{
+    char* sql = sqlite3_mprintf( "select name, path, depth, " SNAPSHOT_VALUES 
+                                 " from fs_files where root in (%s)", roots );
+    int i;
+
+    if (q->maxdepth >= 0)
+    {
+        snapshot_append(&sql, " and depth <= %d", q->maxdepth);
+    }
+
+    /* A search path's row is there by its path, so it is checked by name
+     * once it is read. */
+    if (q->by_name != 0 && q->nnames > 0 && q->nnames <= SNAPSHOT_MAX_IN)
+    {
+        for (i = 0; i < q->nnames; i++)
+        {
+            snapshot_append( &sql, "%s%Q", 
+                             i == 0 ? " and (depth = 0 or name in (" : ", ", 
+                             q->names[i] );
+        }
+
+        snapshot_append(&sql, "))");
+    }
+
+    if (q->by_inode != 0 && q->ninodes > 0 && q->ninodes <= SNAPSHOT_MAX_IN)
+    {
+        for (i = 0; i < q->ninodes; i++)
+        {
+            snapshot_append(&sql, "%s%lld", i == 0 ? " and inode in (" : ", ", q->inodes[i]);
+        }
+
+        snapshot_append(&sql, ")");
+    }
+
+    /* Only numbers: text compares differently in SQL (see struct predicate). */
+    for (i = 0; i < q->npredicates; i++)
+    {
+        const struct predicate* p = &q->predicates[i];
+        const char* column        = snapshot_columns[p->column - COLUMN_TYPE];
+        const char* op            = snapshot_operator(p->op);
+
+        if (op == NULL)
+        {
+            continue;
+        }
+
+        if (p->type == SQLITE_INTEGER)
+        {
+            snapshot_append(&sql, " and %s %s %lld", column, op, p->i);
+        }
+        else if (p->type == SQLITE_FLOAT && p->r > -1e300 && p->r < 1e300)
+        {
+            snapshot_append(&sql, " and %s %s %!.17g", column, op, p->r);
+        }
+    }
+
+    if (top_column > 0)
+    {
+        snapshot_append( &sql, " order by %s%s", 
+                         snapshot_columns[top_column - COLUMN_TYPE],
+                         top_desc ? " desc" : "" );
+    }
+    else if ((order & ORDER_PATH) != 0)
+    {
+        snapshot_append( &sql, " order by path%s", 
+                         (order & ORDER_PATH_DESC) != 0 ? " desc" : "" );
+
+        if ((order & ORDER_NAME) != 0)
+        {
+            snapshot_append( &sql, ", " SNAPSHOT_NAME "%s", 
+                             (order & ORDER_NAME_DESC) != 0 ? " desc" : "" );
+        }
+    }
+
+    return sql;
+}
+
+/** Read the snapshot's next rows into the cursor's batch, as many as fit,
+ *  leaving out those the query rules out. Sets eof if there are none left.
+ */
+static int snapshot_fill(vtab_cursor *p_cur)
+{
+    vtab* p_vt         = (vtab*)((sqlite3_vtab_cursor*)p_cur)->pVtab;
+    sqlite3_stmt* stmt = p_cur->snapshot;
+    struct rowbatch* b = p_cur->batch;
+    int rc;
+
+    if (b == NULL && (b = p_cur->batch = rowbatch_create()) == NULL)
+    {
+        return SQLITE_NOMEM;
+    }
+
+    b->count         = 0;
+    b->text_used     = 0;
+    b->last_path     = 0;
+    b->last_path_len = -1;
+
+    while (b->count < WALKER_BATCH_ROWS && (rc = sqlite3_step(stmt)) == SQLITE_ROW)
+    {
+        const char* name = (const char*)sqlite3_column_text(stmt, 0);
+        int name_len     = sqlite3_column_bytes(stmt, 0);
+        const char* path = (const char*)sqlite3_column_text(stmt, 1);
+        int path_len     = sqlite3_column_bytes(stmt, 1);
+        int depth        = sqlite3_column_int(stmt, 2);
+        apr_size_t need  = name_len + path_len + 2;
+        struct filerow values;
+        struct filerow* row;
+        int col;
+
+        /* The snapshot keeps a search path's row under the whole path (see
+         * refresh_row()). Its name is the last part, as the walk's is. */
+        if (name != NULL && depth == 0)
+        {
+            name = root_name(name, name_len, &name_len);
+        }
+
+        for (col = COLUMN_TYPE; col < COLUMN_TYPE + ROW_VALUES; col++)
+        {
+            ROW_VALUE(&values, col) = sqlite3_column_int64(stmt, 3 + col - COLUMN_TYPE);
+        }
+
+        if (name == NULL || path == NULL || query_values_ok(&p_cur->query, name, &values) == 0)
+        {
+            continue;
+        }
+
+        /* The row has been read, so it has to fit. The rows keep offsets. */
+        if (b->text_used + need > b->text_size)
+        {
+            char* text = realloc(b->text, 2 * b->text_size + need);
+
+            if (text == NULL)
+            {
+                return SQLITE_NOMEM;
+            }
+
+            b->text       = text;
+            b->text_size  = 2 * b->text_size + need;
+        }
+
+        row = rowbatch_append(b, depth, name, name_len, path, path_len);
+
+        memcpy(row->value, values.value, sizeof(values.value));
+    }
+
+    if (b->count < WALKER_BATCH_ROWS)
+    {
+        if (rc != SQLITE_DONE)
+        {
+            if (p_vt->base.zErrMsg != NULL)
+            {
+                sqlite3_free(p_vt->base.zErrMsg);
+            }
+
+            p_vt->base.zErrMsg = sqlite3_mprintf( "Could not read the snapshot: %s", 
+                                                  sqlite3_errmsg(p_vt->cache) );
+
+            return SQLITE_ERROR;
+        }
+
+        /* That's all of them. What's left in the batch is returned like an
+         * inode lookup's rows are (see vt_next()). */
+        snapshot_destroy(p_cur);
+    }
+
+    p_cur->row = 0;
+
+    if (b->count == 0)
+    {
+        p_cur->eof = 1;
+    }
+    else
+    {
+        p_cur->count += 1;
+    }
+
+    return SQLITE_OK;
+}
+
+/** Start reading the cursor's rows from the snapshot, if it has all of the
+ *  search paths, and sets *found if so. Otherwise the walk finds them. order
+ *  is the ORDER_* flags of idxNum. If top_column isn't 0, the rows are
+ *  ordered by that column instead, for an ORDER BY ... LIMIT.
+ */
+static int snapshot_start( vtab_cursor *p_cur, int order, 
+                           int top_column, int top_desc, int* found )
+{
+    vtab* p_vt       = (vtab*)((sqlite3_vtab_cursor*)p_cur)->pVtab;
+    const char* list = p_cur->search_paths;
+    char* roots      = NULL;
+    char* sql;
+    char* path;
+
+    if (p_cur->query.nprune > 0)
+    {
+        return SQLITE_OK;
+    }
+
+    /* The same search path twice is only read once. */
+    while ((path = next_search_path(&list, p_cur->tmp_pool)) != NULL)
+    {
+        sqlite3_int64 id = 0;
+
+        if (*path != '\0')
+        {
+            id = snapshot_root(p_vt, path, p_cur->query.maxdepth, NULL);
+        }
+
+        /* The watcher's snapshot, only where it is watching. */
+        if (id != 0 && p_vt->watcher != NULL && watch_serves(p_vt, path) == 0)
+        {
+            id = 0;
+        }
+
+        if (id == 0)
+        {
+            sqlite3_free(roots);
+            apr_pool_clear(p_cur->tmp_pool);
+
+            return SQLITE_OK;
+        }
+
+        roots = roots == NULL ? sqlite3_mprintf("%lld", id)
+                              : sqlite3_mprintf("%z, %lld", roots, id);
+
+        if (roots == NULL)
+        {
+            apr_pool_clear(p_cur->tmp_pool);
+
+            return SQLITE_NOMEM;
+        }
+    }
+
+    apr_pool_clear(p_cur->tmp_pool);
+
+    if (roots == NULL)
+    {
+        return SQLITE_OK;
+    }
+
+    sql = snapshot_query(&p_cur->query, roots, order, top_column, top_desc);
+    sqlite3_free(roots);
+
+    if (sql == NULL)
+    {
+        return SQLITE_NOMEM;
+    }
+
+    if (sqlite3_prepare_v2(p_vt->cache, sql, -1, &p_cur->snapshot, NULL) != SQLITE_OK)
+    {
+        if (p_vt->base.zErrMsg != NULL)
+        {
+            sqlite3_free(p_vt->base.zErrMsg);
+        }
+
+        p_vt->base.zErrMsg = sqlite3_mprintf( "Could not read the snapshot: %s", 
+                                              sqlite3_errmsg(p_vt->cache) );
+        sqlite3_free(sql);
+
+        return SQLITE_ERROR;
+    }
+
+    sqlite3_free(sql);
+
+    *found = 1;
+
+    return snapshot_fill(p_cur);
+}
+
+/* Move to the snapshot's next row. */
+static int snapshot_next(vtab_cursor *p_cur)
+{
+    if (++p_cur->row < p_cur->batch->count)
+    {
+        p_cur->count += 1;
+
+        return SQLITE_OK;
+    }
+
+    return snapshot_fill(p_cur);
+}
+
+/* Finish with the snapshot's query, if there is one. */
+static void snapshot_destroy(vtab_cursor *p_cur)
+{
+    if (p_cur->snapshot != NULL)
+    {
+        sqlite3_finalize(p_cur->snapshot);
+        p_cur->snapshot = NULL;
+    }
+}
+
+/* What a refresh knows about each depth of the walk it is on. */
+struct refreshlevel
+{
+    /* The id of the directory the walk is in at this depth. */
+    sqlite3_int64 parent;
+
+    /* The rows at this depth so far. */
+    sqlite3_int64 rows;
+};
+
+/* A refresh of the snapshot, see snapshot_refresh(). */
+struct refresh
+{
+    sqlite3* db;
+    sqlite3_int64 root;
+    sqlite3_stmt* find;
+    sqlite3_stmt* insert;
+    sqlite3_stmt* update;
+    sqlite3_stmt* forget;
+
+    struct refreshlevel* levels;
+    int nlevels;
+    int levels_size;
+
+    /* The ids of the rows the walk has been through. The rest are gone. */
+    sqlite3_int64* seen;
+    int nseen;
+    int seen_size;
+
+    /* Where the walk's top row goes, when the walk is of a directory the
+     * watcher saw come in (see watch_event()) rather than of a search path:
+     * its parent's id, its depth, its name and the inode of its directory. */
+    sqlite3_int64 top_parent;
+    int top_depth;
+    const char* top_name;
+    sqlite3_int64 top_dir;
+
+    /* The table's watcher, which watches the directories the walk goes
+     * into. NULL if it hasn't one. */
+    struct watcher* watcher;
+};
+
+/** Bring the snapshot's row for name in directory parent up to date: add it,
+ *  if it isn't there, or change it, if it has changed. Sets *id to its id.
+ */
+static int refresh_entry( struct refresh* r, sqlite3_int64 parent, int depth,
+                          const char* name, int name_len, 
+                          const char* path, int path_len, 
+                          const struct filerow* row, sqlite3_int64* id )
+{
+    int changed = 1;
+    int col;
+    int rc;
+
+    *id = 0;
+
+    /* Is it there already, as it is now? */
+    sqlite3_bind_int64(r->find, 1, parent);
+    sqlite3_bind_text(r->find, 2, name, name_len, SQLITE_STATIC);
+
+    if ((rc = sqlite3_step(r->find)) == SQLITE_ROW)
+    {
+        *id     = sqlite3_column_int64(r->find, 0);
+        changed = ( sqlite3_column_int(r->find, 1) != depth
+                    || sqlite3_column_bytes(r->find, 2) != path_len
+                    || memcmp(sqlite3_column_text(r->find, 2), path, path_len) != 0 );
+
+        for (col = COLUMN_TYPE; changed == 0 && col < COLUMN_TYPE + ROW_VALUES; col++)
+        {
+            changed = ( sqlite3_column_int64(r->find, 3 + col - COLUMN_TYPE) 
+                        != ROW_VALUE(row, col) );
+        }
+    }
+
+    sqlite3_reset(r->find);
+
+    if (rc != SQLITE_ROW && rc != SQLITE_DONE)
+    {
+        return rc;
+    }
+
+    if (changed != 0)
+    {
+        sqlite3_stmt* stmt = *id != 0 ? r->update : r->insert;
+
+        sqlite3_bind_int64(stmt, 1, r->root);
+        sqlite3_bind_int64(stmt, 2, parent);
+        sqlite3_bind_text(stmt, 3, name, name_len, SQLITE_STATIC);
+        sqlite3_bind_text(stmt, 4, path, path_len, SQLITE_STATIC);
+        sqlite3_bind_int(stmt, 5, depth);
+
+        for (col = COLUMN_TYPE; col < COLUMN_TYPE + ROW_VALUES; col++)
+        {
+            sqlite3_bind_int64(stmt, 6 + col - COLUMN_TYPE, ROW_VALUE(row, col));
+        }
+
+        if (*id != 0)
+        {
+            sqlite3_bind_int64(stmt, 18, *id);
+        }
+
+        rc = sqlite3_step(stmt);
+        sqlite3_reset(stmt);
+
+        if (rc != SQLITE_DONE)
+        {
+            return rc;
+        }
+
+        if (*id == 0)
+        {
+            *id = sqlite3_last_insert_rowid(r->db);
+        }
+    }
+
+    return SQLITE_OK;
+}
+
+/** Bring the snapshot's copy of the serial walk's current row up to date (see
+ *  refresh_entry()).
+ */
+static int refresh_row(struct refresh* r, vtab_cursor *s)
+{
+    const apr_finfo_t* dirent = &s->current_node->dirent;
+    sqlite3_int64 parent      = r->top_parent;
+    int depth                 = r->top_depth + s->depth;
+    sqlite3_int64 id;
+    struct filerow row;
+    const char* name;
+    const char* path;
+    int name_len;
+    int path_len;
+    int rc;
+
+    walk_row_text(s, &name, &name_len, &path, &path_len);
+    row_values(&row, dirent, row_dir_inode(s));
+
+    if (s->depth == 0 && r->top_name != NULL)
+    {
+        name     = r->top_name;
+        name_len = strlen(name);
+
+        ROW_VALUE(&row, COLUMN_DIR) = r->top_dir;
+    }
+    else if (s->depth == 0)
+    {
+        /* The snapshot knows a search path's row by the whole search path
+         * (see snapshot_fill()). */
+        name     = s->path;
+        name_len = strlen(name);
+    }
+
+    if (s->depth >= r->levels_size)
+    {
+        int size = s->depth < 16 ? 32 : 2 * s->depth;
+        struct refreshlevel* levels = realloc( r->levels, 
+                                               size * sizeof(struct refreshlevel) );
+
+        if (levels == NULL)
+        {
+            return SQLITE_NOMEM;
+        }
+
+        r->levels      = levels;
+        r->levels_size = size;
+    }
+
+    while (r->nlevels <= s->depth)
+    {
+        r->levels[r->nlevels].parent = 0;
+        r->levels[r->nlevels].rows   = 0;
+        r->nlevels++;
+    }
+
+    if (s->depth > 0)
+    {
+        parent = r->levels[s->depth - 1].parent;
+    }
+
+    rc = refresh_entry(r, parent, depth, name, name_len, path, path_len, &row, &id);
+
+    if (rc != SQLITE_OK)
+    {
+        return rc;
+    }
+
+    /* Its entries come next. */
+    if (dirent->filetype == APR_DIR)
+    {
+        r->levels[s->depth].parent = id;
+
+        if ( r->watcher != NULL 
+             && (s->query.maxdepth < 0 || s->depth < s->query.maxdepth) )
+        {
+            watch_add(r, path, path_len, id, parent, depth, &row);
+        }
+    }
+
+    r->levels[s->depth].rows += 1;
+
+    if (r->nseen == r->seen_size)
+    {
+        int size             = r->seen_size == 0 ? 1024 : 2 * r->seen_size;
+        sqlite3_int64* seen  = realloc(r->seen, size * sizeof(sqlite3_int64));
+
+        if (seen == NULL)
+        {
+            return SQLITE_NOMEM;
+        }
+
+        r->seen      = seen;
+        r->seen_size = size;
+    }
+
+    r->seen[r->nseen++] = id;
+
+    return SQLITE_OK;
+}
+
+/* Delete the row for name in directory parent, and every row below it. */
+static int refresh_forget(struct refresh* r, sqlite3_int64 parent, const char* name)
+{
+    int rc;
+
+    sqlite3_bind_int64(r->forget, 1, parent);
+    sqlite3_bind_text(r->forget, 2, name, -1, SQLITE_STATIC);
+
+    rc = sqlite3_step(r->forget);
+    sqlite3_reset(r->forget);
+
+    return rc == SQLITE_DONE ? SQLITE_OK : rc;
+}
+
+/* Delete the rows of r's search path that its walk didn't go through. */
+static int refresh_sweep(struct refresh* r)
+{
+    sqlite3_stmt* stmt;
+    sqlite3_int64* gone = NULL;
+    int ngone           = 0;
+    int gone_size       = 0;
+    int rc;
+    int i;
+
+    qsort(r->seen, r->nseen, sizeof(sqlite3_int64), compare_inodes);
+
+    rc = sqlite3_prepare_v2( r->db, "select id from fs_files where root = ?",
+                             -1, &stmt, NULL );
+
+    if (rc != SQLITE_OK)
+    {
+        return rc;
+    }
+
+    sqlite3_bind_int64(stmt, 1, r->root);
+
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW)
+    {
+        sqlite3_int64 id = sqlite3_column_int64(stmt, 0);
+
+        if (bsearch( &id, r->seen, r->nseen, 
+                     sizeof(sqlite3_int64), compare_inodes ) != NULL)
+        {
+            continue;
+        }
+
+        if (ngone == gone_size)
+        {
+            int size              = gone_size == 0 ? 256 : 2 * gone_size;
+            sqlite3_int64* more   = realloc(gone, size * sizeof(sqlite3_int64));
+
+            if (more == NULL)
+            {
+                rc = SQLITE_NOMEM;
+
+                break;
+            }
+
+            gone      = more;
+            gone_size = size;
+        }
+
+        gone[ngone++] = id;
+    }
+
+    sqlite3_finalize(stmt);
+
+    if (rc == SQLITE_DONE)
+    {
+        rc = sqlite3_prepare_v2( r->db, "delete from fs_files where id = ?",
+                                 -1, &stmt, NULL );
+    }
+    else if (rc == SQLITE_ROW)
+    {
+        rc = SQLITE_NOMEM;
+    }
+
+    if (rc == SQLITE_OK)
+    {
+        for (i = 0; i < ngone && rc == SQLITE_OK; i++)
+        {
+            sqlite3_bind_int64(stmt, 1, gone[i]);
+
+            rc = sqlite3_step(stmt) == SQLITE_DONE ? SQLITE_OK : sqlite3_errcode(r->db);
+            sqlite3_reset(stmt);
+        }
+
+        sqlite3_finalize(stmt);
+    }
+
+    free(gone);
+
+    return rc;
+}
+
+/** Walk path, as the table would (serially, and maxdepth deep: -1 for all
+ *  the way), and bring its rows in the snapshot up to date, in r->root's
+ *  walk. path is a search path, or a directory below one (see r->top_name).
+ */
+static int refresh_walk( vtab* p_vt, struct refresh* r, const char* path, 
+                         int maxdepth )
+{
+    sqlite3_vtab_cursor* cur;
+    vtab_cursor* s;
+    int rc;
+
+    r->nlevels = 0;
+    r->nseen   = 0;
+
+    /* The walk, on a cursor of its own that takes every row. */
+    if (vt_open(&p_vt->base, &cur) != SQLITE_OK || cur == NULL)
+    {
+        return SQLITE_NOMEM;
+    }
+
+    s = (vtab_cursor*)cur;
+    s->base.pVtab = &p_vt->base;
+
+    if ((s->search_paths = strdup(path)) == NULL)
+    {
+        vt_close(cur);
+
+        return SQLITE_NOMEM;
+    }
+
+    s->root_path      = s->search_paths;
+    s->wanted         = wanted_fields(ALL_COLUMNS);
+    s->backend        = p_vt->backend;
+    s->query.maxdepth = maxdepth;
+    s->count          = 0;
+    s->eof            = 0;
+    s->depth          = 0;
+
+    if (s->backend == BACKEND_URING)
+    {
+        s->ring = statring_create();
+    }
+
+    rc = next_directory(s);
+
+    while (rc == SQLITE_OK && s->eof == 0)
+    {
+        if ((rc = refresh_row(r, s)) == SQLITE_OK)
+        {
+            rc = walk_next(s);
+        }
+    }
+
+    vt_close(cur);
+
+    return rc;
+}
+
+/* A directory a quick rescan has yet to go through, see refresh_quick(). */
+struct quickdir
+{
+    sqlite3_int64 id;
+    sqlite3_int64 parent;
+    int depth;
+
+    /* Its own dir column, and its inode, its entries' dir column. */
+    sqlite3_int64 dir;
+    sqlite3_int64 inode;
+
+    /* 1 if it has changed since the last refresh, 0 if not, -1 if it has to
+     * be stat'ed to tell: against was, its dev, inode, mtime and ctime then. */
+    int changed;
+    sqlite3_int64 was[4];
+
+    char* path;
+};
+
+/* The directories a quick rescan has yet to go through. */
+struct quickstack
+{
+    struct quickdir* dirs;
+    int count;
+    int size;
+};
+
+/* What the snapshot had for a subdirectory, before its parent was read again. */
+struct quickold
+{
+    sqlite3_int64 was[4];
+};
+
+/* Push a copy of d, with a copy of path, onto s. */
+static int quick_push(struct quickstack* s, const struct quickdir* d, const char* path)
+{
+    if (s->count == s->size)
+    {
+        int size               = s->size == 0 ? 64 : 2 * s->size;
+        struct quickdir* dirs  = realloc(s->dirs, size * sizeof(struct quickdir));
+
+        if (dirs == NULL)
+        {
+            return SQLITE_NOMEM;
+        }
+
+        s->dirs = dirs;
+        s->size = size;
+    }
+
+    s->dirs[s->count] = *d;
+
+    if ((s->dirs[s->count].path = strdup(path)) == NULL)
+    {
+        return SQLITE_NOMEM;
+    }
+
+    s->count++;
+
+    return SQLITE_OK;
+}
+
+/** Go through one directory of a quick rescan (see refresh_quick()): stat it
+ *  if need be, and read it again only if it has changed. Either way, its
+ *  subdirectories are pushed onto s. subdirs is the snapshot's query for a
+ *  directory's subdirectories, entries for all of its entries.
+ */
+static int quick_dir( vtab* p_vt, struct refresh* r, struct quickdir* d, 
+                      struct quickstack* s, sqlite3_stmt* subdirs, 
+                      sqlite3_stmt* entries, apr_pool_t* pool )
+{
+    const char* name = d->depth == 0 ? d->path : apr_filepath_name_get(d->path);
+    apr_hash_t* old;
+    struct filerow row;
+    int rc = SQLITE_OK;
+    int i;
+
+    /* Stat it, to tell whether it has changed, and bring its own row up to
+     * date. Only a file system that doesn't keep directory times up to date
+     * would get this wrong. */
+    if (d->changed < 0)
+    {
+        sqlite3_int64 id;
+        apr_finfo_t finfo;
+
+        if (apr_stat( &finfo, d->path, 
+                      (wanted_fields(ALL_COLUMNS) & ~APR_FINFO_NAME)|APR_FINFO_LINK, 
+                      pool ) != APR_SUCCESS || finfo.filetype != APR_DIR)
+        {
+            /* Its parent has changed too, since the walk: leave it to the
+             * next refresh. */
+            return SQLITE_OK;
+        }
+
+        row_values(&row, &finfo, d->dir);
+
+        d->inode   = ROW_VALUE(&row, COLUMN_INODE);
+        d->changed = ( ROW_VALUE(&row, 10) != d->was[0] || ROW_VALUE(&row, 12) != d->was[1]
+                       || ROW_VALUE(&row, 7) != d->was[2] || ROW_VALUE(&row, 8) != d->was[3] );
+
+        rc = refresh_entry( r, d->parent, d->depth, name, strlen(name), 
+                            d->path, strlen(d->path), &row, &id );
+
+        if (rc != SQLITE_OK)
+        {
+            return rc;
+        }
+    }
+
+    if (p_vt->maxdepth >= 0 && d->depth >= p_vt->maxdepth)
+    {
+        return SQLITE_OK;
+    }
+
+    /* Unchanged: it has the same entries, so just its subdirectories. */
+    if (d->changed == 0)
+    {
+        if (r->watcher != NULL)
+        {
+            ROW_VALUE(&row, COLUMN_INODE) = d->inode;
+            ROW_VALUE(&row, COLUMN_DIR)   = d->dir;
+
+            watch_add(r, d->path, strlen(d->path), d->id, d->parent, d->depth, &row);
+        }
+
+        sqlite3_bind_int64(subdirs, 1, d->id);
+        sqlite3_bind_int(subdirs, 2, APR_DIR);
+
+        while (rc == SQLITE_OK && sqlite3_step(subdirs) == SQLITE_ROW)
+        {
+            struct quickdir sub;
+
+            sub.id      = sqlite3_column_int64(subdirs, 0);
+            sub.parent  = d->id;
+            sub.depth   = d->depth + 1;
+            sub.dir     = d->inode;
+            sub.inode   = sqlite3_column_int64(subdirs, 5);
+            sub.changed = -1;
+
+            for (i = 0; i < 4; i++)
+            {
+                sub.was[i] = sqlite3_column_int64(subdirs, 4 + i);
+            }
+
+            rc = quick_push(s, &sub, (const char*)sqlite3_column_text(subdirs, 2));
+        }
+
+        sqlite3_reset(subdirs);
+
+        return rc;
+    }
+
+    /* Changed: remember what its subdirectories were, and read it again. */
+    old = apr_hash_make(pool);
+
+    sqlite3_bind_int64(subdirs, 1, d->id);
+    sqlite3_bind_int(subdirs, 2, APR_DIR);
+
+    while (sqlite3_step(subdirs) == SQLITE_ROW)
+    {
+        struct quickold* o = apr_palloc(pool, sizeof(struct quickold));
+
+        for (i = 0; i < 4; i++)
+        {
+            o->was[i] = sqlite3_column_int64(subdirs, 4 + i);
+        }
+
+        apr_hash_set( old, apr_pstrdup(pool, (const char*)sqlite3_column_text(subdirs, 1)),
+                      APR_HASH_KEY_STRING, o );
+    }
+
+    sqlite3_reset(subdirs);
+
+    r->top_parent = d->parent;
+    r->top_depth  = d->depth;
+    r->top_name   = d->depth == 0 ? NULL : name;
+    r->top_dir    = d->dir;
+
+    rc = refresh_walk(p_vt, r, d->path, 1);
+
+    r->top_name = NULL;
+
+    /* Gone since its parent was read: leave it to the next refresh. */
+    if (rc == SQLITE_ERROR && d->depth > 0 && p_vt->base.zErrMsg != NULL)
+    {
+        sqlite3_free(p_vt->base.zErrMsg);
+        p_vt->base.zErrMsg = NULL;
+
+        return SQLITE_OK;
+    }
+
+    if (rc != SQLITE_OK)
+    {
+        return rc;
+    }
+
+    /* Forget the entries it doesn't have any more, and everything below
+     * them. The walk's rows are the ones it has. */
+    qsort(r->seen, r->nseen, sizeof(sqlite3_int64), compare_inodes);
+
+    {
+        apr_array_header_t* gone = apr_array_make(pool, 8, sizeof(char*));
+
+        sqlite3_bind_int64(entries, 1, d->id);
+
+        while (sqlite3_step(entries) == SQLITE_ROW)
+        {
+            sqlite3_int64 id = sqlite3_column_int64(entries, 0);
+
+            if (bsearch( &id, r->seen, r->nseen, 
+                         sizeof(sqlite3_int64), compare_inodes ) == NULL)
+            {
+                *(char**)apr_array_push(gone) = 
+                    apr_pstrdup(pool, (const char*)sqlite3_column_text(entries, 1));
+            }
+        }
+
+        sqlite3_reset(entries);
+
+        for (i = 0; i < gone->nelts && rc == SQLITE_OK; i++)
+        {
+            rc = refresh_forget(r, d->id, ((char**)gone->elts)[i]);
+        }
+    }
+
+    /* Its subdirectories, each of which has changed if it is new, or isn't
+     * what it was. */
+    sqlite3_bind_int64(subdirs, 1, d->id);
+    sqlite3_bind_int(subdirs, 2, APR_DIR);
+
+    while (rc == SQLITE_OK && sqlite3_step(subdirs) == SQLITE_ROW)
+    {
+        const struct quickold* o = apr_hash_get( old, sqlite3_column_text(subdirs, 1),
+                                                 APR_HASH_KEY_STRING );
+        struct quickdir sub;
+
+        sub.id      = sqlite3_column_int64(subdirs, 0);
+        sub.parent  = d->id;
+        sub.depth   = d->depth + 1;
+        sub.dir     = sqlite3_column_int64(subdirs, 3);
+        sub.inode   = sqlite3_column_int64(subdirs, 5);
+        sub.changed = o == NULL;
+
+        for (i = 0; i < 4; i++)
+        {
+            sub.was[i] = sqlite3_column_int64(subdirs, 4 + i);
+            sub.changed |= o != NULL && o->was[i] != sub.was[i];
+        }
+
+        rc = quick_push(s, &sub, (const char*)sqlite3_column_text(subdirs, 2));
+    }
+
+    sqlite3_reset(subdirs);
+
+    return rc;
+}
+
+/** Rescan search path root (the row with that id), reading only the
+ *  directories that have changed since it was last refreshed: those whose
+ *  dev, inode, mtime or ctime aren't what the snapshot has. Any other
+ *  directory has the same entries, so only its subdirectories are looked
+ *  at. The rows of the files in it are kept as they are, so a file changed
+ *  in place (which doesn't change its directory) is only seen by a full
+ *  rescan. The search path itself is always read.
+ */
+static int refresh_quick(vtab* p_vt, struct refresh* r, const char* root, sqlite3_int64 id)
+{
+    struct quickstack s;
+    struct quickdir top;
+    sqlite3_stmt* subdirs = NULL;
+    sqlite3_stmt* entries = NULL;
+    apr_pool_t* pool;
+    int rc;
+
+    memset(&s, 0, sizeof(struct quickstack));
+    memset(&top, 0, sizeof(struct quickdir));
+
+    if (apr_pool_create(&pool, p_vt->pool) != APR_SUCCESS)
+    {
+        return SQLITE_NOMEM;
+    }
+
+    rc = sqlite3_prepare_v2( r->db, "select id, name, path, dir, dev, inode, mtime, "
+                             "ctime from fs_files where parent = ? and type = ?",
+                             -1, &subdirs, NULL );
+
+    if (rc == SQLITE_OK)
+    {
+        rc = sqlite3_prepare_v2( r->db, "select id, name from fs_files where parent = ?",
+                                 -1, &entries, NULL );
+    }
+
+    top.id      = id;
+    top.changed = 1;
+
+    if (rc == SQLITE_OK)
+    {
+        rc = quick_push(&s, &top, root);
+    }
+
+    /* Depth first, so the stack stays small. */
+    while (rc == SQLITE_OK && s.count > 0)
+    {
+        struct quickdir d = s.dirs[--s.count];
+
+        rc = quick_dir(p_vt, r, &d, &s, subdirs, entries, pool);
+
+        free(d.path);
+        apr_pool_clear(pool);
+    }
+
+    while (s.count > 0)
+    {
+        free(s.dirs[--s.count].path);
+    }
+
+    free(s.dirs);
+    sqlite3_finalize(subdirs);
+    sqlite3_finalize(entries);
+    apr_pool_destroy(pool);
+
+    return rc;
+}
+
+/** Walk search path root and bring its rows in the snapshot up to date (see
+ *  refresh_walk()), deleting those of files that are gone.
+ */
+static int refresh_root(vtab* p_vt, struct refresh* r, const char* root)
+{
+    sqlite3_stmt* stmt;
+    sqlite3_int64 top = 0;
+    sqlite3_int64 rows;
+    char* levels;
+    int rc;
+    int i;
+
+    /* Its id, adding it if it's new. */
+    rc = sqlite3_prepare_v2( r->db, "insert or ignore into fs_roots (path) values (?)",
+                             -1, &stmt, NULL );
+
+    if (rc != SQLITE_OK)
+    {
+        return rc;
+    }
+
+    sqlite3_bind_text(stmt, 1, root, -1, SQLITE_STATIC);
+    rc = sqlite3_step(stmt);
+    sqlite3_finalize(stmt);
+
+    if (rc != SQLITE_DONE)
+    {
+        return sqlite3_errcode(r->db);
+    }
+
+    rc = sqlite3_prepare_v2( r->db, "select id, maxdepth, refreshed from fs_roots "
+                             "where path = ?",
+                             -1, &stmt, NULL );
+
+    if (rc != SQLITE_OK)
+    {
+        return rc;
+    }
+
+    sqlite3_bind_text(stmt, 1, root, -1, SQLITE_STATIC);
+    r->root = 0;
+
+    if (sqlite3_step(stmt) == SQLITE_ROW)
+    {
+        r->root = sqlite3_column_int64(stmt, 0);
+
+        /* Only a walk as deep as this table's can be rescanned quickly. */
+        if ( p_vt->rescan == RESCAN_CHANGED 
+             && sqlite3_column_int(stmt, 1) == p_vt->maxdepth
+             && sqlite3_column_type(stmt, 2) != SQLITE_NULL )
+        {
+            top = -1;
+        }
+    }
+
+    sqlite3_finalize(stmt);
+
+    /* The row of the search path itself. */
+    if (top != 0)
+    {
+        sqlite3_bind_int64(r->find, 1, 0);
+        sqlite3_bind_text(r->find, 2, root, -1, SQLITE_STATIC);
+
+        top = sqlite3_step(r->find) == SQLITE_ROW ? sqlite3_column_int64(r->find, 0) : 0;
+        sqlite3_reset(r->find);
+    }
+
+    /* The walk watches its directories again, under the ids it gives them. */
+    if (r->watcher != NULL)
+    {
+        watch_drop(r->watcher, r->root, NULL);
+    }
+
+    r->top_parent = 0;
+    r->top_depth  = 0;
+    r->top_name   = NULL;
+    r->top_dir    = 0;
+
+    if (top != 0)
+    {
+        rc = refresh_quick(p_vt, r, root, top);
+    }
+    else if ((rc = refresh_walk(p_vt, r, root, p_vt->maxdepth)) == SQLITE_OK)
+    {
+        rc = refresh_sweep(r);
+    }
+
+    if (rc != SQLITE_OK)
+    {
+        return rc;
+    }
+
+    /* The rows at each depth, for the query planner (see snapshot_root()). A
+     * quick rescan hasn't seen them all, so the snapshot counts them. */
+    levels = sqlite3_mprintf("");
+    rows   = r->nseen;
+
+    if (top != 0)
+    {
+        rows = 0;
+
+        rc = sqlite3_prepare_v2( r->db, "select count(*) from fs_files where root = ? "
+                                 "group by depth order by depth",
+                                 -1, &stmt, NULL );
+
+        if (rc != SQLITE_OK)
+        {
+            sqlite3_free(levels);
+
+            return rc;
+        }
+
+        sqlite3_bind_int64(stmt, 1, r->root);
+
+        for (i = 0; sqlite3_step(stmt) == SQLITE_ROW; i++)
+        {
+            snapshot_append( &levels, i == 0 ? "%lld" : " %lld", 
+                             sqlite3_column_int64(stmt, 0) );
+            rows += sqlite3_column_int64(stmt, 0);
+        }
+
+        sqlite3_finalize(stmt);
+    }
+    else
+    {
+        for (i = 0; i < r->nlevels; i++)
+        {
+            snapshot_append(&levels, i == 0 ? "%lld" : " %lld", r->levels[i].rows);
+        }
+    }
+
+    if (levels == NULL)
+    {
+        return SQLITE_NOMEM;
+    }
+
+    rc = sqlite3_prepare_v2( r->db, "update fs_roots set maxdepth = ?, rows = ?, "
+                             "levels = ?, refreshed = ? where id = ?",
+                             -1, &stmt, NULL );
+
+    if (rc == SQLITE_OK)
+    {
+        sqlite3_bind_int(stmt, 1, p_vt->maxdepth);
+        sqlite3_bind_int64(stmt, 2, rows);
+        sqlite3_bind_text(stmt, 3, levels, -1, SQLITE_STATIC);
+        sqlite3_bind_int64(stmt, 4, apr_time_now());
+        sqlite3_bind_int64(stmt, 5, r->root);
+
+        rc = sqlite3_step(stmt) == SQLITE_DONE ? SQLITE_OK : sqlite3_errcode(r->db);
+        sqlite3_finalize(stmt);
+    }
+
+    sqlite3_free(levels);
+
+    if (rc == SQLITE_OK && r->watcher != NULL)
+    {
+        watch_root(r->watcher, r->root, root);
+    }
+
+    return rc;
+}
+
+/* Start a refresh of the snapshot: a transaction, and the statements it needs. */
+static int refresh_begin(vtab* p_vt, struct refresh* r)
+{
+    sqlite3* db = p_vt->cache;
+    int rc;
+
+    memset(r, 0, sizeof(struct refresh));
+    r->db      = db;
+    r->watcher = p_vt->watcher;
+
+    rc = sqlite3_exec(db, "begin immediate", NULL, NULL, NULL);
+
+    if (rc == SQLITE_OK)
+    {
+        rc = sqlite3_prepare_v2( db, "select id, depth, path, " SNAPSHOT_VALUES 
+                                 " from fs_files where parent = ? and name = ?",
+                                 -1, &r->find, NULL );
+    }
+
+    if (rc == SQLITE_OK)
+    {
+        rc = sqlite3_prepare_v2( db, "insert into fs_files (root, parent, name, "
+                                 "path, depth, " SNAPSHOT_VALUES ") values (?1, ?2, "
+                                 "?3, ?4, ?5, ?6, ?7, ?8, ?9, ?10, ?11, ?12, ?13, "
+                                 "?14, ?15, ?16, ?17)",
+                                 -1, &r->insert, NULL );
+    }
+
+    if (rc == SQLITE_OK)
+    {
+        rc = sqlite3_prepare_v2( db, "update fs_files set path = ?4, depth = ?5, "
+                                 "type = ?6, size = ?7, uid = ?8, gid = ?9, "
+                                 "prot = ?10, mtime = ?11, ctime = ?12, "
+                                 "atime = ?13, dev = ?14, nlink = ?15, "
+                                 "inode = ?16, dir = ?17 where id = ?18",
+                                 -1, &r->update, NULL );
+    }
+
+    if (rc == SQLITE_OK)
+    {
+        rc = sqlite3_prepare_v2( db, "with recursive gone(id) as ("
+                                 "select id from fs_files where parent = ? and name = ? "
+                                 "union all select fs_files.id from fs_files, gone "
+                                 "where fs_files.parent = gone.id) "
+                                 "delete from fs_files where id in gone",
+                                 -1, &r->forget, NULL );
+    }
+
+    return rc;
+}
+
+/** Finish a refresh of the snapshot that ended with rc: commit it if that is
+ *  SQLITE_OK, roll it back if not. Returns rc, or commit's.
+ */
+static int refresh_end(vtab* p_vt, struct refresh* r, int rc)
+{
+    sqlite3* db = r->db;
+
+    sqlite3_finalize(r->find);
+    sqlite3_finalize(r->insert);
+    sqlite3_finalize(r->update);
+    sqlite3_finalize(r->forget);
+    free(r->levels);
+    free(r->seen);
+
+    if (rc == SQLITE_OK)
+    {
+        rc = sqlite3_exec(db, "commit", NULL, NULL, NULL);
+    }
+
+    if (rc != SQLITE_OK)
+    {
+        /* The walk sets its own message, for a search path that isn't there. */
+        if (p_vt->base.zErrMsg == NULL)
+        {
+            p_vt->base.zErrMsg = sqlite3_mprintf( "Could not refresh the snapshot: %s",
+                                                  sqlite3_errmsg(db) );
+        }
+
+        if (sqlite3_get_autocommit(db) == 0)
+        {
+            sqlite3_exec(db, "rollback", NULL, NULL, NULL);
+        }
+
+        /* Its watches are for rows that aren't there any more. */
+        if (r->watcher != NULL)
+        {
+            watch_reset(r->watcher);
+        }
+    }
+
+    return rc;
+}
+
+/** Refresh the search paths in list in the snapshot, or all of those in it if
+ *  list is blank, in one transaction. A row that hasn't changed since the
+ *  last refresh is only looked up, not written.
+ */
+static int snapshot_refresh(vtab* p_vt, const char* list)
+{
+    char* all = NULL;
+    char* path;
+    apr_pool_t* pool;
+    struct refresh r;
+    int rc;
+
+    if (apr_pool_create(&pool, p_vt->pool) != APR_SUCCESS)
+    {
+        return SQLITE_NOMEM;
+    }
+
+    rc = refresh_begin(p_vt, &r);
+
+    /* '' is every search path the snapshot has. */
+    while (isspace(*list)) {list++;}
+
+    if (rc == SQLITE_OK && *list == '\0')
+    {
+        sqlite3_stmt* stmt;
+
+        rc = sqlite3_prepare_v2( r.db, "select group_concat(path, ',') from fs_roots",
+                                 -1, &stmt, NULL );
+
+        if (rc == SQLITE_OK)
+        {
+            if ( sqlite3_step(stmt) == SQLITE_ROW 
+                 && sqlite3_column_text(stmt, 0) != NULL )
+            {
+                all = apr_pstrdup(pool, (const char*)sqlite3_column_text(stmt, 0));
+            }
+
+            sqlite3_finalize(stmt);
+        }
+
+        list = all;
+    }
+
+    while (rc == SQLITE_OK && (path = next_search_path(&list, pool)) != NULL)
+    {
+        if (*path != '\0')
+        {
+            rc = refresh_root(p_vt, &r, path);
+        }
+    }
+
+    apr_pool_destroy(pool);
+
+    return refresh_end(p_vt, &r, rc);
+}
+
+/*-------------------------------------------------------------------*/
+/* Watcher                                                           */
+/*-------------------------------------------------------------------*/
+
+/** A table created with watch=true keeps its snapshot up to date itself, so
+ *  that its queries can always read the snapshot rather than walk:
+ *
+ *    create virtual table f using filesystem('watch=true');
+ *
+ *  The first query on a search path refreshes it into the snapshot (one in
+ *  memory, unless the table has a cache too), and the watcher has inotify
+ *  watch each directory that walk goes into. Before each query after that,
+ *  it reads the events the kernel has queued for them and changes just the
+ *  rows they are about: a file created, changed or deleted, a directory
+ *  moved in (walked) or out (forgotten, with everything below it). A query
+ *  then costs the rows it reads, plus the changes since the last one, however
+ *  big the tree is.
+ *
+ *  If the kernel's queue overflows, or a search path itself is moved or
+ *  deleted, each search path is refreshed again the next time a query asks
+ *  for it. One with more directories than inotify will watch for us
+ *  (fs.inotify.max_user_watches) is walked by every query instead. inotify
+ *  doesn't report reads, so atime is only as of the last change.
+ */
+
+#ifdef LINUX
+
+/* What each directory is watched for. */
+#define WATCH_EVENTS ( IN_CREATE|IN_DELETE|IN_MOVED_FROM|IN_MOVED_TO|IN_ATTRIB \
+                       |IN_MODIFY|IN_CLOSE_WRITE|IN_DELETE_SELF|IN_MOVE_SELF \
+                       |IN_ONLYDIR|IN_DONT_FOLLOW|IN_EXCL_UNLINK )
+
+/* Bytes of events read at a time. */
+#define WATCH_BUFFER 16384
+
+/* A search path's state, in struct watchroot. */
+#define WATCH_STALE     0 /* refresh it before a query reads it */
+#define WATCH_QUEUED    1 /* about to be refreshed */
+#define WATCH_WATCHED   2 /* the snapshot is up to date */
+#define WATCH_TOO_BIG   3 /* too many directories: walk it */
+
+/* A directory being watched, as a row of one search path's walk. */
+struct watchdir
+{
+    sqlite3_int64 root;
+    sqlite3_int64 id;
+    sqlite3_int64 parent;
+    int depth;
+
+    /* Its inode (its entries' dir column) and its own dir column. */
+    sqlite3_int64 inode;
+    sqlite3_int64 dir;
+
+    /* One of its entries came or went, so its own row has changed too. */
+    int changed;
+
+    /* Its full path, which is its path column. */
+    char* path;
+
+    /* The same directory in another walk: search paths can overlap. */
+    struct watchdir* next;
+};
+
+/* An inotify watch, and the rows of the directory it is on. */
+struct watch
+{
+    int wd;
+    struct watchdir* dirs;
+};
+
+/* A search path a query has asked for. */
+struct watchroot
+{
+    char* path;
+    int state;
+};
+
+struct watcher
+{
+    /* The inotify instance. */
+    int fd;
+
+    /* struct watch, by watch descriptor. */
+    apr_hash_t* watches;
+
+    /* struct watchroot, by search path. */
+    apr_hash_t* roots;
+
+    /* The kernel dropped events, or a search path went away: every search
+     * path has to be refreshed. */
+    int rescan;
+
+    /* A refresh ran out of watches (see watch_add()). */
+    int full;
+
+    apr_pool_t* pool;
+};
+
+/** Start watching, for the watch argument. The snapshot is kept in memory if
+ *  the table has no cache (yet: a later cache argument replaces it).
+ */
+static int watch_create(vtab* p_vt, char **pzErr)
+{
+    struct watcher* w;
+
+    if (p_vt->watcher != NULL)
+    {
+        return SQLITE_OK;
+    }
+
+    if (p_vt->cache == NULL && snapshot_open(p_vt, ":memory:", pzErr) != SQLITE_OK)
+    {
+        return SQLITE_ERROR;
+    }
+
+    w     = apr_pcalloc(p_vt->pool, sizeof(struct watcher));
+    w->fd = inotify_init1(IN_NONBLOCK|IN_CLOEXEC);
+
+    if (w->fd < 0)
+    {
+        *pzErr = sqlite3_mprintf( "Could not watch the file system: %s", 
+                                  strerror(errno) );
+
+        return SQLITE_ERROR;
+    }
+
+    apr_pool_create(&w->pool, p_vt->pool);
+
+    w->watches    = apr_hash_make(w->pool);
+    w->roots      = apr_hash_make(w->pool);
+    p_vt->watcher = w;
+
+    return SQLITE_OK;
+}
+
+/** Stop watching the directories at or below path in the walk of search path
+ *  root (the one with that id in the snapshot), or all of its directories if
+ *  path is NULL.
+ */
+static void watch_drop(struct watcher* w, sqlite3_int64 root, const char* path)
+{
+    apr_size_t len = path != NULL ? strlen(path) : 0;
+    apr_hash_index_t* hi;
+
+    for (hi = apr_hash_first(NULL, w->watches); hi != NULL; hi = apr_hash_next(hi))
     {
-        *pxFunc = vt_match_function;
+        struct watch* h;
+        struct watchdir** d;
 
-        return 1;
+        apr_hash_this(hi, NULL, NULL, (void**)&h);
+
+        for (d = &h->dirs; *d != NULL;)
+        {
+            const char* p = (*d)->path;
+
+            if ( (*d)->root == root
+                 && ( path == NULL 
+                      || ( strncmp(p, path, len) == 0
+                           && (p[len] == '\0' || p[len] == '/' || path[len - 1] == '/') ) ) )
+            {
+                struct watchdir* gone = *d;
+
+                *d = gone->next;
+                free(gone->path);
+                free(gone);
+            }
+            else
+            {
+                d = &(*d)->next;
+            }
+        }
+
+        /* Deleting the entry the iteration is on is allowed. */
+        if (h->dirs == NULL)
+        {
+            inotify_rm_watch(w->fd, h->wd);
+            apr_hash_set(w->watches, &h->wd, sizeof(int), NULL);
+            free(h);
+        }
+    }
+}
+
+/* Forget one watch, which the kernel has already dropped. */
+static void watch_forget(struct watcher* w, struct watch* h)
+{
+    while (h->dirs != NULL)
+    {
+        struct watchdir* gone = h->dirs;
+
+        h->dirs = gone->next;
+        free(gone->path);
+        free(gone);
+    }
+
+    apr_hash_set(w->watches, &h->wd, sizeof(int), NULL);
+    free(h);
+}
+
+/** Stop watching anything, and have every search path refreshed before it
+ *  is read again.
+ */
+static void watch_reset(struct watcher* w)
+{
+    apr_hash_index_t* hi;
+
+    for (hi = apr_hash_first(NULL, w->watches); hi != NULL; hi = apr_hash_next(hi))
+    {
+        struct watch* h;
+
+        apr_hash_this(hi, NULL, NULL, (void**)&h);
+
+        inotify_rm_watch(w->fd, h->wd);
+        watch_forget(w, h);
+    }
+
+    for (hi = apr_hash_first(NULL, w->roots); hi != NULL; hi = apr_hash_next(hi))
+    {
+        struct watchroot* root;
+
+        apr_hash_this(hi, NULL, NULL, (void**)&root);
+
+        root->state = WATCH_STALE;
+    }
+
+    w->full = 0;
+}
+
+/** Watch the directory a refresh's walk has just gone into: row, with the
+ *  given id, path, parent and depth, in the walk of search path r->root. If
+ *  inotify is out of watches, r->watcher->full is set.
+ */
+static void watch_add( struct refresh* r, const char* path, int path_len, 
+                       sqlite3_int64 id, sqlite3_int64 parent, int depth,
+                       const struct filerow* row )
+{
+    struct watcher* w = r->watcher;
+    struct watchdir* d;
+    struct watch* h;
+    char* copy;
+    int wd;
+
+    if ((copy = malloc(path_len + 1)) == NULL)
+    {
+        w->full = 1;
+
+        return;
+    }
+
+    memcpy(copy, path, path_len);
+    copy[path_len] = '\0';
+
+    if ((wd = inotify_add_watch(w->fd, copy, WATCH_EVENTS)) < 0)
+    {
+        /* Anything else means it can't be read, or is gone again. Either way
+         * its parent's events say so. */
+        if (errno == ENOSPC || errno == ENOMEM)
+        {
+            w->full = 1;
+        }
+
+        free(copy);
+
+        return;
+    }
+
+    /* The same directory gets the same descriptor, in any walk. */
+    if ((h = apr_hash_get(w->watches, &wd, sizeof(int))) == NULL)
+    {
+        if ((h = malloc(sizeof(struct watch))) == NULL)
+        {
+            inotify_rm_watch(w->fd, wd);
+            free(copy);
+            w->full = 1;
+
+            return;
+        }
+
+        h->wd   = wd;
+        h->dirs = NULL;
+
+        apr_hash_set(w->watches, &h->wd, sizeof(int), h);
+    }
+
+    for (d = h->dirs; d != NULL && d->id != id; d = d->next) {}
+
+    if (d == NULL)
+    {
+        if ((d = malloc(sizeof(struct watchdir))) == NULL)
+        {
+            free(copy);
+            w->full = 1;
+
+            return;
+        }
+
+        d->next = h->dirs;
+        h->dirs = d;
+    }
+    else
+    {
+        free(d->path);
+    }
+
+    d->root    = r->root;
+    d->id      = id;
+    d->parent  = parent;
+    d->depth   = depth;
+    d->inode   = ROW_VALUE(row, COLUMN_INODE);
+    d->dir     = ROW_VALUE(row, COLUMN_DIR);
+    d->changed = 0;
+    d->path    = copy;
+}
+
+/** A refresh of search path path (with that id in the snapshot) is done: if
+ *  the watcher could watch all of its directories, queries read it from the
+ *  snapshot from now on.
+ */
+static void watch_root(struct watcher* w, sqlite3_int64 id, const char* path)
+{
+    struct watchroot* root = apr_hash_get(w->roots, path, APR_HASH_KEY_STRING);
+
+    if (root == NULL)
+    {
+        root       = apr_pcalloc(w->pool, sizeof(struct watchroot));
+        root->path = apr_pstrdup(w->pool, path);
+
+        apr_hash_set(w->roots, root->path, APR_HASH_KEY_STRING, root);
+    }
+
+    root->state = WATCH_WATCHED;
+
+    if (w->full != 0)
+    {
+        fprintf(stderr, "Too many directories to watch, walking: %s\n", path);
+
+        watch_drop(w, id, NULL);
+
+        root->state = WATCH_TOO_BIG;
+        w->full     = 0;
+    }
+}
+
+/* Whether the snapshot is kept up to date for search path path. */
+static int watch_serves(vtab* p_vt, const char* path)
+{
+    struct watchroot* root = apr_hash_get( p_vt->watcher->roots, 
+                                           path, APR_HASH_KEY_STRING );
+
+    return root != NULL && root->state == WATCH_WATCHED;
+}
+
+/** Bring the snapshot up to date with one event, for one of the walks the
+ *  directory it is in is part of.
+ */
+static int watch_event( vtab* p_vt, struct refresh* r, struct watchdir* d,
+                        const struct inotify_event* ev, apr_pool_t* pool )
+{
+    const char* name = ev->name;
+    char* path;
+    sqlite3_int64 id;
+    struct filerow row;
+    apr_finfo_t finfo;
+    int rc = SQLITE_OK;
+
+    /* The directory itself. Its parent has an event of its own for it
+     * moving or going, unless it is the search path. */
+    if (ev->len == 0 || *name == '\0')
+    {
+        if ((ev->mask & (IN_DELETE_SELF|IN_MOVE_SELF)) != 0 && d->depth == 0)
+        {
+            r->watcher->rescan = 1;
+        }
+        else if ((ev->mask & IN_ATTRIB) != 0)
+        {
+            d->changed = 1;
+        }
+
+        return SQLITE_OK;
+    }
+
+    r->root = d->root;
+    path    = apr_pstrcat(pool, d->path, path_separator(d->path), name, NULL);
+
+    /* What was there by that name is gone, even if something else has come
+     * in its place. */
+    if ((ev->mask & (IN_CREATE|IN_DELETE|IN_MOVED_FROM|IN_MOVED_TO)) != 0)
+    {
+        d->changed = 1;
+
+        if ((rc = refresh_forget(r, d->id, name)) != SQLITE_OK)
+        {
+            return rc;
+        }
+
+        if ((ev->mask & IN_ISDIR) != 0)
+        {
+            watch_drop(r->watcher, d->root, path);
+        }
+
+        if ((ev->mask & (IN_DELETE|IN_MOVED_FROM)) != 0)
+        {
+            return SQLITE_OK;
+        }
+    }
+
+    /* Gone again already, if this fails: its own event is on the way. */
+    if (apr_stat( &finfo, path, 
+                  (wanted_fields(ALL_COLUMNS) & ~APR_FINFO_NAME)|APR_FINFO_LINK, 
+                  pool ) != APR_SUCCESS)
+    {
+        return SQLITE_OK;
+    }
+
+    finfo.name = name;
+    row_values(&row, &finfo, d->inode);
+
+    /* A directory that has come in is walked, if the table goes that deep. */
+    if ( finfo.filetype == APR_DIR 
+         && (ev->mask & (IN_CREATE|IN_MOVED_TO)) != 0
+         && (p_vt->maxdepth < 0 || d->depth + 1 < p_vt->maxdepth) )
+    {
+        r->top_parent = d->id;
+        r->top_depth  = d->depth + 1;
+        r->top_name   = name;
+        r->top_dir    = d->inode;
+
+        rc = refresh_walk( p_vt, r, path, 
+                           p_vt->maxdepth < 0 ? -1 : p_vt->maxdepth - r->top_depth );
+
+        /* The walk's own message, if it was gone again. */
+        if (rc == SQLITE_ERROR && p_vt->base.zErrMsg != NULL)
+        {
+            sqlite3_free(p_vt->base.zErrMsg);
+            p_vt->base.zErrMsg = NULL;
+
+            rc = SQLITE_OK;
+        }
+
+        return rc;
+    }
+
+    return refresh_entry( r, d->id, d->depth + 1, name, strlen(name),
+                          finfo.filetype == APR_DIR ? path : d->path,
+                          strlen(finfo.filetype == APR_DIR ? path : d->path),
+                          &row, &id );
+}
+
+/* Update the rows of the directories whose entries have come or gone. */
+static int watch_changed(vtab* p_vt, struct refresh* r, apr_pool_t* pool)
+{
+    apr_hash_index_t* hi;
+    int rc = SQLITE_OK;
+
+    for ( hi = apr_hash_first(NULL, r->watcher->watches); 
+          hi != NULL && rc == SQLITE_OK; hi = apr_hash_next(hi) )
+    {
+        struct watchdir* d;
+        struct watch* h;
+
+        apr_hash_this(hi, NULL, NULL, (void**)&h);
+
+        for (d = h->dirs; d != NULL && rc == SQLITE_OK; d = d->next)
+        {
+            const char* name = d->depth == 0 ? d->path 
+                                             : apr_filepath_name_get(d->path);
+            sqlite3_int64 id;
+            struct filerow row;
+            apr_finfo_t finfo;
+
+            if (d->changed == 0)
+            {
+                continue;
+            }
+
+            d->changed = 0;
+
+            if (apr_stat( &finfo, d->path, 
+                          (wanted_fields(ALL_COLUMNS) & ~APR_FINFO_NAME)|APR_FINFO_LINK, 
+                          pool ) != APR_SUCCESS)
+            {
+                continue;
+            }
+
+            row_values(&row, &finfo, d->dir);
+
+            r->root = d->root;
+            rc      = refresh_entry( r, d->parent, d->depth, name, strlen(name),
+                                     d->path, strlen(d->path), &row, &id );
+
+            apr_pool_clear(pool);
+        }
+    }
+
+    return rc;
+}
+
+/** Bring the snapshot up to date with the events the kernel has queued, in
+ *  one transaction. There is none if nothing has happened.
+ */
+static int watch_read(vtab* p_vt)
+{
+    struct watcher* w = p_vt->watcher;
+    union
+    {
+        struct inotify_event event;
+        char bytes[WATCH_BUFFER];
+    } buffer;
+    struct refresh r;
+    apr_pool_t* pool;
+    ssize_t n;
+    int started = 0;
+    int rc      = SQLITE_OK;
+
+    if (apr_pool_create(&pool, p_vt->pool) != APR_SUCCESS)
+    {
+        return SQLITE_NOMEM;
+    }
+
+    while (rc == SQLITE_OK && (n = read(w->fd, buffer.bytes, WATCH_BUFFER)) > 0)
+    {
+        ssize_t offset;
+
+        if (started == 0)
+        {
+            rc      = refresh_begin(p_vt, &r);
+            started = 1;
+        }
+
+        for (offset = 0; rc == SQLITE_OK && offset < n;)
+        {
+            const struct inotify_event* ev = (const struct inotify_event*)
+                                             (buffer.bytes + offset);
+            struct watch* h = apr_hash_get(w->watches, &ev->wd, sizeof(int));
+            struct watchdir* d;
+
+            offset += sizeof(struct inotify_event) + ev->len;
+
+            if ((ev->mask & IN_Q_OVERFLOW) != 0)
+            {
+                w->rescan = 1;
+            }
+
+            /* Old events for a watch that has been dropped since. */
+            if (h == NULL || w->rescan != 0)
+            {
+                continue;
+            }
+
+            if ((ev->mask & IN_IGNORED) != 0)
+            {
+                watch_forget(w, h);
+
+                continue;
+            }
+
+            for (d = h->dirs; d != NULL && rc == SQLITE_OK; d = d->next)
+            {
+                rc = watch_event(p_vt, &r, d, ev, pool);
+                apr_pool_clear(pool);
+            }
+        }
+    }
+
+    if (started != 0)
+    {
+        if (rc == SQLITE_OK && w->rescan == 0)
+        {
+            rc = watch_changed(p_vt, &r, pool);
+        }
+
+        rc = refresh_end(p_vt, &r, rc);
+    }
+
+    apr_pool_destroy(pool);
+
+    return rc;
+}
+
+/** Bring the snapshot up to date for the cursor's search paths, before
+ *  snapshot_start() reads it: apply the events since the last query, and
+ *  refresh the search paths that aren't being watched yet.
+ */
+static int watch_update(vtab_cursor *p_cur)
+{
+    vtab* p_vt        = (vtab*)((sqlite3_vtab_cursor*)p_cur)->pVtab;
+    struct watcher* w = p_vt->watcher;
+    const char* list  = p_cur->search_paths;
+    char* stale       = NULL;
+    char* path;
+    int rc;
+
+    /* A query with prune walks anyway (see snapshot_start()). */
+    if (p_cur->query.nprune > 0)
+    {
+        return SQLITE_OK;
+    }
+
+    if ((rc = watch_read(p_vt)) != SQLITE_OK)
+    {
+        return rc;
+    }
+
+    if (w->rescan != 0)
+    {
+        watch_reset(w);
+        w->rescan = 0;
+    }
+
+    while ((path = next_search_path(&list, p_cur->tmp_pool)) != NULL)
+    {
+        struct watchroot* root;
+
+        if (*path == '\0')
+        {
+            continue;
+        }
+
+        if ((root = apr_hash_get(w->roots, path, APR_HASH_KEY_STRING)) == NULL)
+        {
+            root       = apr_pcalloc(w->pool, sizeof(struct watchroot));
+            root->path = apr_pstrdup(w->pool, path);
+
+            apr_hash_set(w->roots, root->path, APR_HASH_KEY_STRING, root);
+        }
+
+        if (root->state == WATCH_STALE)
+        {
+            root->state = WATCH_QUEUED;
+            stale       = stale == NULL ? sqlite3_mprintf("%s", path)
+                                        : sqlite3_mprintf("%z,%s", stale, path);
+
+            if (stale == NULL)
+            {
+                rc = SQLITE_NOMEM;
+
+                break;
+            }
+        }
     }
 
-    return SQLITE_OK;
+    apr_pool_clear(p_cur->tmp_pool);
+
+    if (rc == SQLITE_OK && stale != NULL)
+    {
+        rc = snapshot_refresh(p_vt, stale);
+    }
+
+    sqlite3_free(stale);
+
+    return rc;
+}
+
+/* Stop watching, when the table goes. */
+static void watch_destroy(vtab* p_vt)
+{
+    if (p_vt->watcher != NULL)
+    {
+        watch_reset(p_vt->watcher);
+        close(p_vt->watcher->fd);
+        apr_pool_destroy(p_vt->watcher->pool);
+
+        p_vt->watcher = NULL;
+    }
+}
+
+#else
+
+static void watch_drop(struct watcher* w, sqlite3_int64 root, const char* path)
+{
+}
+
+static void watch_reset(struct watcher* w)
+{
 }
 
-/* Structure to map virtual table functions to sqlite core. */
-static sqlite3_module fs_module = 
+static void watch_add( struct refresh* r, const char* path, int path_len, 
+                       sqlite3_int64 id, sqlite3_int64 parent, int depth,
+                       const struct filerow* row )
 {
-    0,                /* iVersion */
-    vt_create,        /* xCreate       - create a vtable */
-    vt_connect,       /* xConnect      - associate a vtable with a connection */
-    vt_best_index,    /* xBestIndex    - best index */
-    vt_disconnect,    /* xDisconnect   - disassociate a vtable with a connection */
-    vt_destroy,       /* xDestroy      - destroy a vtable */
-    vt_open,          /* xOpen         - open a cursor */
-    vt_close,         /* xClose        - close a cursor */
-    vt_filter,        /* xFilter       - configure scan constraints */
-    vt_next,          /* xNext         - advance a cursor */
-    vt_eof,           /* xEof          - inidicate end of result set*/
-    vt_column,        /* xColumn       - read data */
-    vt_rowid,         /* xRowid        - read data */
-    NULL,             /* xUpdate       - write data */
-    NULL,             /* xBegin        - begin transaction */
-    NULL,             /* xSync         - sync transaction */
-    NULL,             /* xCommit       - commit transaction */
-    NULL,             /* xRollback     - rollback transaction */
-    vt_find_function, /* xFindFunction - function overloading */
-    NULL,             /* xRename       - function overloading */
-    NULL,             /* xSavepoint    - function overloading */
-    NULL,             /* xRelease      - function overloading */
-    NULL              /* xRollbackto   - function overloading */
-};
+}
 
-/* Used to register virtual table module. */
-int fs_register( sqlite3* db, 
-                 char **pzErrMsg, 
-                 const sqlite3_api_routines* pApi )
+static void watch_root(struct watcher* w, sqlite3_int64 id, const char* path)
 {
-    SQLITE_EXTENSION_INIT2(pApi);
+}
 
-    /* Initliaze the Apache Portable Runtime. */
-    apr_initialize();
+static int watch_serves(vtab* p_vt, const char* path)
+{
+    return 0;
+}
 
-    /* Arrange to have it cleaned up at exit. */
-    atexit(apr_terminate);
+static int watch_update(vtab_cursor *p_cur)
+{
+    return SQLITE_OK;
+}
 
-    return sqlite3_create_module(db, "filesystem", &fs_module, NULL);
+static void watch_destroy(vtab* p_vt)
+{
 }
 
+#endif /* LINUX */
+
 /*-------------------------------------------------------------------*/
-/* Support functions                                                 */
+/* Content hashes                                                    */
 /*-------------------------------------------------------------------*/
 
-/* Maps an APR file type to a name. */
-static const char* file_type_name(int type)
-{
-    switch(type)
-    {
-        case APR_REG:
-            return "regfile";
-        case APR_DIR:
-            return "dir";
-        case APR_CHR:
-            return "character device";
-        case APR_BLK:
-            return "block device";
-        case APR_PIPE:
-            return "pipe";
-        case APR_LNK:
-            return "link";
-        case APR_SOCK:
-            return "socket";
-        default:
-            return "unknown";
-    }
-}
+/** The hash_xxh3 and hash_sha256 columns: hashes of a regular file's content
+ *  (NULL for anything else, or a file that can't be read). Only a query that
+ *  names them reads any file. The file is read once, in large sequential
+ *  reads, for every hash the query uses.
+ *
+ *  The hashes are kept in the table's hash cache, by the file's (dev, inode,
+ *  mtime, size), so a file that hasn't changed isn't read again. With
+ *  threads (or readahead), the workers hash each file as they make its row
+ *  (see walker_add_row()), so the files are read in parallel, ahead of the
+ *  query, and vt_column() finds their hashes in the cache.
+ */
 
-/* Cleanup filenode */
-static void deallocate_filenode(struct filenode* p)
+/* Most files the hash cache holds. It starts over when it is full. */
+#define HASH_CACHE_FILES 65536
+
+/* Most bytes read from a file at a time. */
+#define HASH_READ_SIZE (1024 * 1024)
+
+/* The hashes of the files the table has read, by hashkey. */
+struct hashcache
 {
-    free(p->path);
-    free(p);
-}
+    /* lock lives in the table's pool. pool is cleared when the cache is. */
+    apr_thread_mutex_t* lock;
+    apr_pool_t* pool;
+    apr_hash_t* files;
+    int count;
+};
 
-/* Cleanup a filenode list -- only happens in error conditions where we have to
- * abort a search. */
-static void deallocate_dirpath(vtab_cursor *p_cur)
+/* The table's hash cache, made the first time a query uses a hash. NULL if
+ * out of memory. */
+struct hashcache* hash_cache(vtab* p_vt)
 {
-    if (p_cur->current_node == NULL)
+    struct hashcache* c;
+
+    if (p_vt->hash_cache != NULL)
     {
-        return;
+        return p_vt->hash_cache;
     }
 
-    struct filenode* current_node = p_cur->current_node;
+    c = apr_pcalloc(p_vt->pool, sizeof(struct hashcache));
 
-    while (current_node != p_cur->root_node)
+    if ( apr_thread_mutex_create( &c->lock, APR_THREAD_MUTEX_DEFAULT, 
+                                  p_vt->pool ) != APR_SUCCESS
+         || apr_pool_create(&c->pool, p_vt->pool) != APR_SUCCESS )
     {
-        current_node = p_cur->current_node->parent;
-        deallocate_filenode(p_cur->current_node);
-        p_cur->current_node = current_node;
+        return NULL;
     }
 
-    deallocate_filenode(p_cur->root_node);
+    c->files = apr_hash_make(c->pool);
 
-    p_cur->current_node = NULL;
-    p_cur->root_node    = NULL;
+    p_vt->hash_cache = c;
+
+    return c;
 }
 
-/* Move current_node to point to parent node */
-static struct filenode* move_up_directory(vtab_cursor *p_cur)
+/* The full path of a file's row: its name in its path, if it has one. 
+ * Returns NULL if out of memory, and otherwise a string to free(). */
+char* hash_path( const char* name, int name_len, 
+                 const char* path, int path_len )
 {
-    struct filenode* d = p_cur->current_node;
- 
-    /* Get current pointer to parent */
-    p_cur->current_node = d->parent;
+    const char* separator = path_len > 0 && path[path_len - 1] != '/' ? "/" : "";
+    int separator_len     = strlen(separator);
+    char* file;
 
-    /* Close current directory */
-    if (d->dir != NULL)
+    if ((file = malloc(path_len + separator_len + name_len + 1)) == NULL)
     {
-        if (d->dirent.pool != NULL)
-        {
-            apr_dir_close(d->dir);
-        }
+        return NULL;
     }
 
-    /* Free memory associated with current directory. */
-    deallocate_filenode(d);
+    memcpy(file, path, path_len);
+    memcpy(file + path_len, separator, separator_len);
+    memcpy(file + path_len + separator_len, name, name_len);
+    file[path_len + separator_len + name_len] = '\0';
 
-    /* Update d to point to parent (now current directory) */
-    return p_cur->current_node;
+    return file;
 }
 
-/* Update root_dir to point to the next top-level directory in
- * search_paths. Update cursor accordingly. 
+/** Put the hashes of the file at path in out, reading it if key (what the
+ *  walk saw of it) isn't in the cache with all of them. Returns 0 if the file
+ *  can't be read. pool is for the open file. Safe to call from any thread.
  */
-static next_path(vtab_cursor* p_cur)
+int hash_file( struct hashcache* c, const char* path, 
+               const struct hashkey* key, int hashes, 
+               struct filehash* out, apr_pool_t* pool )
 {
-    /* Free the path value of the current filenode */
-    if (p_cur->current_node->path != NULL)
+    struct filehash* f;
+    struct hashkey read;
+    struct xxh3 xxh3;
+    struct sha256 sha256;
+    unsigned char digest[32];
+    unsigned char* buffer;
+    apr_pool_t* file_pool;
+    apr_file_t* file;
+    apr_finfo_t finfo;
+    apr_size_t size;
+    apr_status_t rv;
+    int i;
+
+    apr_thread_mutex_lock(c->lock);
+
+    f = apr_hash_get(c->files, key, sizeof(struct hashkey));
+
+    if (f != NULL && (f->hashes & hashes) == hashes)
     {
-        free(p_cur->current_node->path);
-        p_cur->current_node->path = NULL;
+        *out = *f;
+        apr_thread_mutex_unlock(c->lock);
+
+        return 1;
     }
 
-    /* If root_path is empty */
-    if (p_cur->root_path == NULL)
+    apr_thread_mutex_unlock(c->lock);
+
+    if (apr_pool_create(&file_pool, pool) != APR_SUCCESS)
     {
-        /* There is nothing more to get. */
         return 0;
     }
 
-    /* Find the next delimiter */
-    const char* ptr = strchr(p_cur->root_path, ',');
+    if ( apr_file_open( &file, path, APR_FOPEN_READ, 
+                        APR_OS_DEFAULT, file_pool ) != APR_SUCCESS )
+    {
+        apr_pool_destroy(file_pool);
 
-    /* Eat blank spaces */
-    while (isblank(*p_cur->root_path)) {p_cur->root_path++;}
+        return 0;
+    }
 
-    /* If we have another delimiter */
-    if (ptr != NULL)
+    /* What is read is the file as it is now, which is what it is cached as. */
+    if ( apr_file_info_get( &finfo, APR_FINFO_SIZE|APR_FINFO_MTIME|
+                            APR_FINFO_DEV|APR_FINFO_INODE, file ) != APR_SUCCESS )
     {
-        /* Then extract the string between root_path and delimiter */
-        int len = (ptr - p_cur->root_path);
-        p_cur->current_node->path = strndup(p_cur->root_path, len);
+        apr_file_close(file);
+        apr_pool_destroy(file_pool);
 
-        /* Move root_path past delimiter (start of next value) */
-        p_cur->root_path += len + 1;
+        return 0;
     }
-    else
+
+#ifdef LINUX
     {
-        /* This is the last match. If there is anything left */
-        if (strlen(p_cur->root_path) > 0)
+        apr_os_file_t fd;
+
+        if (apr_os_file_get(&fd, file) == APR_SUCCESS)
         {
-            /* Use it. */
-            p_cur->current_node->path = strdup(p_cur->root_path);
+            posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
         }
-
-        p_cur->root_path = NULL;
     }
+#endif
 
-    /* Trim right space */
-    rtrim(p_cur->current_node->path);
-
-    return 1;
-}
+    memset(&read, 0, sizeof(read));
+    read.dev   = finfo.device;
+    read.inode = finfo.inode;
+    read.mtime = finfo.mtime;
+    read.size  = finfo.size;
 
-/* Update cursor to point to next top-level directory to search, if any. */
-static int next_directory(vtab_cursor *p_cur)
-{
-    vtab *p_vt = (vtab*)((sqlite3_vtab_cursor*)p_cur)->pVtab;
+    /* Small files don't need the whole buffer. */
+    size = finfo.size < HASH_READ_SIZE ? (apr_size_t)finfo.size + 1 : HASH_READ_SIZE;
 
-    /* Get the next path name in the search list. If there isn't next_path()
-     * will return 0, as do we. */
-    if (next_path(p_cur) == 0)
+    if ((buffer = malloc(size)) == NULL)
     {
-        /* No more directories to search. End of result set. */
-        p_cur->eof = 1;
+        apr_file_close(file);
+        apr_pool_destroy(file_pool);
 
-        return SQLITE_OK;
+        return 0;
     }
 
-    /* Now try to open the directory. If it can be opended, set up the dirent to
-    ** return as a row in the rowset.
-    */
+    xxh3_init(&xxh3);
+    sha256_init(&sha256);
 
-    /* ZERO-FILL DIRENT: Very important to zero-fill here, otherwise we may have
-    ** dirent.fname and/or dirent.name members pointing to invalid addresses
-    ** after apr_stat(). Our code depends in being able to check NULL status of
-    ** these members, so all pointers must be NULL by default.
-    */
-    memset(&p_cur->current_node->dirent, 0, sizeof(apr_finfo_t));
+    for (;;)
+    {
+        apr_size_t n = size;
 
-    /* Check to see if the directory exists */
-    p_cur->status = apr_stat( &p_cur->current_node->dirent, 
-                              p_cur->current_node->path, 
-                              APR_FINFO_TYPE, p_cur->pool );
+        rv = apr_file_read(file, buffer, &n);
 
-    if (p_cur->status != APR_SUCCESS)
-    {
-        /* Directory does not exist */
-        p_cur->eof = 1;
+        if (n > 0 && (hashes & HASH_XXH3) != 0)
+        {
+            xxh3_update(&xxh3, buffer, n);
+        }
 
-        if (p_vt->base.zErrMsg != NULL)
+        if (n > 0 && (hashes & HASH_SHA256) != 0)
         {
-            sqlite3_free(p_vt->base.zErrMsg);
+            sha256_update(&sha256, buffer, n);
         }
 
-        printf( "Invalid directory: %s\n", p_cur->current_node->path );
+        if (rv != APR_SUCCESS)
+        {
+            break;
+        }
+    }
 
-        p_vt->base.zErrMsg = sqlite3_mprintf( "Invalid directory: %s", 
-                                              p_cur->current_node->path );
+    free(buffer);
+    apr_file_close(file);
+    apr_pool_destroy(file_pool);
 
-        return SQLITE_ERROR;
+    if (rv != APR_EOF)
+    {
+        return 0;
     }
-    else 
+
+    apr_thread_mutex_lock(c->lock);
+
+    if ((f = apr_hash_get(c->files, &read, sizeof(struct hashkey))) == NULL)
     {
-        /* If this entry is a directory, then open it */
-        if (p_cur->current_node->dirent.filetype == APR_DIR)
+        if (c->count >= HASH_CACHE_FILES)
         {
-            p_cur->status = apr_dir_open( &p_cur->current_node->dir, 
-                                          p_cur->current_node->path, p_cur->pool);
-
-            if (p_cur->status != APR_SUCCESS)
-            {
-                /* Could not open directory */
-                p_cur->eof = 1;
-                
-                if (p_vt->base.zErrMsg != NULL)
-                {
-                    sqlite3_free(p_vt->base.zErrMsg);
-                }
-                
-                printf("Could not open directory: %s\n", p_cur->current_node->path );
-                
-                p_vt->base.zErrMsg = sqlite3_mprintf( "Could not open directory: %s", 
-                                                      p_cur->current_node->path );
-                
-                return SQLITE_ERROR;
-            }
+            apr_pool_clear(c->pool);
+            c->files = apr_hash_make(c->pool);
+            c->count = 0;
         }
-        else
+
+        f = apr_pcalloc(c->pool, sizeof(struct filehash));
+        f->key = read;
+        apr_hash_set(c->files, &f->key, sizeof(struct hashkey), f);
+        c->count += 1;
+    }
+
+    if ((hashes & HASH_XXH3) != 0)
+    {
+        sprintf(f->xxh3, "%016llx", (unsigned long long)xxh3_digest(&xxh3));
+    }
+
+    if ((hashes & HASH_SHA256) != 0)
+    {
+        sha256_digest(&sha256, digest);
+
+        for (i = 0; i < 32; i++)
         {
-            /** Set dir to NULL to indicate that this entry is NOT a
-             *  directory. In this case, we have a top-level file, not a
-             *  top-level directory. vt_next() will pick up on this and do the
-             *  Right Thing.
-             */
-            p_cur->current_node->dir = NULL;
+            sprintf(f->sha256 + 2 * i, "%02x", digest[i]);
         }
     }
 
-    /** Move cursor to first row: get the directory information on the top level
-     *  directory. 
-     */
-    apr_stat( &p_cur->current_node->dirent, 
-              p_cur->current_node->path, 
-              APR_FINFO_DIRENT|APR_FINFO_TYPE|APR_FINFO_NAME, p_cur->pool );
+    f->hashes |= hashes;
+    *out = *f;
 
-    return SQLITE_OK;
+    apr_thread_mutex_unlock(c->lock);
+
+    return 1;
+}
+
+/** A worker's row: hash its file now, if the query uses hashes, so that
+ *  vt_column() finds them in the cache. 
+ */
+static void hash_ahead( struct walker_worker* self, const apr_finfo_t* dirent, 
+                        const char* name, int name_len,
+                        const char* path, int path_len )
+{
+    struct walker* w = self->w;
+    struct filehash out;
+    struct hashkey key;
+    char* file;
+
+    if ((file = hash_path(name, name_len, path, path_len)) == NULL)
+    {
+        return;
+    }
+
+    memset(&key, 0, sizeof(key));
+    key.dev   = dirent->device;
+    key.inode = dirent->inode;
+    key.mtime = dirent->mtime;
+    key.size  = dirent->size;
+
+    hash_file(w->hash_cache, file, &key, w->hashes, &out, self->pool);
+
+    free(file);
+}
+
+/* Numeric column col (2 and up) of the current row. */
+static sqlite3_int64 hash_value( vtab_cursor *p_cur, const struct filerow* row, 
+                                 int col )
+{
+    if (row != NULL)
+    {
+        return ROW_VALUE(row, col);
+    }
+
+    return column_value( &p_cur->current_node->dirent, row_dir_inode(p_cur), 
+                         col );
+}
+
+/* col 18 or 19 of the current row: see vt_column(). */
+static void hash_column( vtab_cursor *p_cur, const struct filerow* row, 
+                         const char* text, sqlite3_context* ctx, int col )
+{
+    vtab* p_vt = (vtab*)((sqlite3_vtab_cursor*)p_cur)->pVtab;
+    int hash   = col == COLUMN_XXH3 ? HASH_XXH3 : HASH_SHA256;
+    struct hashcache* c;
+    struct filehash out;
+    struct hashkey key;
+    const char* name;
+    const char* path;
+    int name_len;
+    int path_len;
+    char* file;
+    int ok;
+
+    if (hash_value(p_cur, row, COLUMN_TYPE) != APR_REG)
+    {
+        sqlite3_result_null(ctx);
+
+        return;
+    }
+
+    memset(&key, 0, sizeof(key));
+    key.dev   = hash_value(p_cur, row, 10); /* dev   */
+    key.inode = hash_value(p_cur, row, 12); /* inode */
+    key.mtime = hash_value(p_cur, row, 7);  /* mtime */
+    key.size  = hash_value(p_cur, row, 3);  /* size  */
+
+    if (row != NULL)
+    {
+        name     = text + row->name;
+        name_len = row->name_len;
+        path     = text + row->path;
+        path_len = row->path_len;
+    }
+    else
+    {
+        walk_row_text(p_cur, &name, &name_len, &path, &path_len);
+    }
+
+    if ( (c = hash_cache(p_vt)) == NULL 
+         || (file = hash_path(name, name_len, path, path_len)) == NULL )
+    {
+        sqlite3_result_error_nomem(ctx);
+
+        return;
+    }
+
+    /* Every hash the query uses, while the file is being read anyway. */
+    ok = hash_file(c, file, &key, p_cur->hashes | hash, &out, p_cur->tmp_pool);
+
+    free(file);
+
+    if (ok == 0)
+    {
+        sqlite3_result_null(ctx);
+    }
+    else
+    {
+        sqlite3_result_text( ctx, hash == HASH_XXH3 ? out.xxh3 : out.sha256, 
+                             -1, SQLITE_TRANSIENT );
+    }
 }
@@ -0,0 +1,689 @@
+#ifndef FS_VTABLE_INTERNAL_DECL
+#define FS_VTABLE_INTERNAL_DECL
+
+/** The filesystem table's structures, and the functions in fs.c that the
+ *  tables built on its walker use too (fs_du in du.c, fs_dupes in dupes.c).
+ *  Include it after sqlite3ext.h, the APR headers and, on UNIX, regex.h.
+ */
+
+typedef struct vtab vtab;
+typedef struct vtab_cursor vtab_cursor;
+typedef struct filenode filenode;
+typedef struct dirhandle dirhandle;
+typedef struct statring statring;
+typedef struct walker walker;
+typedef struct walker_worker walker_worker;
+typedef struct walker_task walker_task;
+typedef struct rowbatch rowbatch;
+typedef struct filerow filerow;
+typedef struct query query;
+typedef struct pattern pattern;
+typedef struct predicate predicate;
+typedef struct inode_index inode_index;
+typedef struct toprows toprows;
+typedef struct pathstats pathstats;
+typedef struct pathtext pathtext;
+
+/* Number of columns in the DDL, and a mask with a bit set for each one. */
+#define NUM_COLUMNS 20
+#define ALL_COLUMNS ((1 << NUM_COLUMNS) - 1)
+
+/* Columns the code refers to by name. */
+#define COLUMN_TYPE  2
+#define COLUMN_INODE 12
+#define COLUMN_DIR   13
+
+/* The hidden columns. */
+#define COLUMN_DEPTH    14
+#define COLUMN_MAXDEPTH 15
+#define COLUMN_PRUNE    16
+#define COLUMN_REFRESH  17
+#define COLUMN_XXH3     18
+#define COLUMN_SHA256   19
+
+/* The columns that read the files' content. */
+#define HASH_COLUMNS ((1 << COLUMN_XXH3) | (1 << COLUMN_SHA256))
+
+/* The hashes a query uses, as bits (see hash_column()). */
+#define HASH_XXH3   1
+#define HASH_SHA256 2
+
+/* Maximum number of worker threads a table may ask for. */
+#define WALKER_MAX_THREADS 256
+
+/* Ways of reading directories. See struct dirhandle. */
+#define BACKEND_APR    0
+#define BACKEND_NATIVE 1
+#define BACKEND_URING  2
+
+#ifdef LINUX
+#define BACKEND_DEFAULT BACKEND_NATIVE
+#else
+#define BACKEND_DEFAULT BACKEND_APR
+#endif
+
+/* How a refresh goes through a search path it has been through before. See
+ * vtab.rescan. */
+#define RESCAN_FULL    0
+#define RESCAN_CHANGED 1
+
+/* Size of the buffer getdents64() reads directory entries into. */
+#define DIRENT_BUFFER_SIZE (32 * 1024)
+
+/* The fields a directory entry gives us without a stat. */
+#define DIRENT_FIELDS (APR_FINFO_NAME|APR_FINFO_LINK|APR_FINFO_TYPE|APR_FINFO_INODE)
+
+/* vtab: represents a virtual table. */
+struct vtab
+{
+    sqlite3_vtab base;
+    sqlite3 *db;
+    apr_pool_t* pool;
+
+    /* Number of worker threads used to walk the file system. Zero (the
+     * default) walks on the calling thread, one directory at a time. Set with
+     * the threads argument -- create virtual table f using
+     * filesystem('threads=16');
+     */
+    int threads;
+
+    /* Without threads, the number of rows the walk may read ahead of the
+     * query, on a thread of its own (see walker_serial()). Zero (the default)
+     * reads none ahead. Set with the readahead argument. */
+    int readahead;
+
+    /* How directories are read: BACKEND_NATIVE, BACKEND_URING or BACKEND_APR.
+     * Set with the backend argument -- filesystem('backend=apr'); */
+    int backend;
+
+    /* How deep every walk goes (see struct query), -1 for all the way. The
+     * recursive argument sets it to 1, which makes the table an ls rather than
+     * a find -- create virtual table ls using filesystem('recursive=false');
+     */
+    int maxdepth;
+
+    /* Where the rows the table has returned were, by inode, for inode = n
+     * (see lookup_inodes()). NULL until a query looks an inode up. */
+    struct inode_index* index;
+
+    /* What the query planner knows about search paths (see path_stats()),
+     * by path, and the pool that is in. NULL until a plan needs it. */
+    apr_hash_t* stats;
+    apr_pool_t* stats_pool;
+
+    /* The database the snapshot is kept in (see snapshot_open()), when the
+     * table was created with the cache argument. NULL otherwise. */
+    sqlite3* cache;
+
+    /* How a refresh goes through a search path that is in the snapshot
+     * already: RESCAN_FULL (the default) reads every directory and stats
+     * every entry; RESCAN_CHANGED only reads the directories that have
+     * changed since (see refresh_quick()). Set with the rescan argument. */
+    int rescan;
+
+    /* What keeps the snapshot up to date between queries (see
+     * watch_update()), when the table was created with watch=true. NULL
+     * otherwise. */
+    struct watcher* watcher;
+
+    /* The hashes of the files the table has read (see hash_file()). NULL
+     * until a query uses a hash column. */
+    struct hashcache* hash_cache;
+};
+
+/* How a pattern is matched. See query_add_pattern(). */
+#define PATTERN_EXACT    0 /* abc */
+#define PATTERN_PREFIX   1 /* abc* */
+#define PATTERN_SUFFIX   2 /* *abc */
+#define PATTERN_CONTAINS 3 /* *abc* */
+#define PATTERN_GLOB     4 /* anything else: sqlite3_strglob() */
+#define PATTERN_LIKE     5 /* anything else: sqlite3_strlike() */
+#define PATTERN_REGEXP   6 /* regexec() */
+
+/* pattern: name glob, like or regexp '...' */
+struct pattern
+{
+    int type;
+
+    /* Ignore ASCII case, as LIKE does. */
+    int nocase;
+
+    /* The pattern, or for the first four types, just the literal part. */
+    char* text;
+    int len;
+
+#ifdef UNIX
+    regex_t regex;
+#endif
+};
+
+/** predicate: a numeric column (2 and up) compared with a value, as in
+ *  size > 1000. The value is an integer or a real (type SQLITE_INTEGER or
+ *  SQLITE_FLOAT), or text or a blob (SQLITE_TEXT), which compares greater than
+ *  any number.
+ */
+struct predicate
+{
+    int column;
+
+    /* SQLITE_INDEX_CONSTRAINT_EQ, _GT, _LE, ... */
+    int op;
+
+    int type;
+    sqlite3_int64 i;
+    double r;
+};
+
+/** query: the constraints vt_best_index() hands to vt_filter() that the walk
+ *  checks itself, rather than leaving them to SQLite. The walk never turns an
+ *  entry into a row that they rule out, and skips the stat for it, too.
+ */
+struct query
+{
+    /* How deep to go, -1 for all the way. A search path is at depth 0, its
+     * entries at 1, theirs at 2, and so on; directories at maxdepth are listed
+     * but not opened. It is 1 when the path is given with = (path = '/etc'),
+     * since only the directory's own entries can have that path, and is set by
+     * depth <= n and maxdepth = n. */
+    int maxdepth;
+
+    /* name = 'x' or name in ('x', 'y'): the names a row may have, sorted. A
+     * directory whose subdirectories the walk won't open isn't read at all:
+     * each name is looked up in it directly. */
+    int by_name;
+    char** names;
+    int nnames;
+    int names_size;
+
+    /* Patterns the name must match, all of them. */
+    struct pattern* patterns;
+    int npatterns;
+    int patterns_size;
+
+    /* prune = '.git, node_modules, /proc': globs for directories to leave out,
+     * along with everything under them. One with a slash in it is matched
+     * with the directory's full path, any other with its name. prune_list is
+     * the lists as given, for the prune column. */
+    char** prune;
+    int nprune;
+    int prune_size;
+    char* prune_list;
+
+    /* Numeric constraints a row must meet, all of them. They are checked as
+     * soon as an entry is stat'ed. */
+    struct predicate* predicates;
+    int npredicates;
+    int predicates_size;
+
+    /* inode = n (or rowid = n) and inode in (...): the inodes a row may have,
+     * sorted. */
+    int by_inode;
+    sqlite3_int64* inodes;
+    int ninodes;
+    int inodes_size;
+};
+
+/** dirhandle: an open directory. 
+ *
+ *  With the native backend (Linux only), the directory is read with
+ *  getdents64() into a large buffer, and its entries are stat'ed with statx()
+ *  relative to the directory's file descriptor. Subdirectories are opened with
+ *  openat() relative to their parent. That saves the kernel from resolving the
+ *  full path again for every file, and reads many entries per system call.
+ *
+ *  With the io_uring backend, it works the same way, except that when the
+ *  entries have to be stat'ed, they are stat'ed a batch at a time through
+ *  ring, with many statx() calls in flight at once.
+ *
+ *  Otherwise it is just an APR directory (dir).
+ *
+ *  If query is given, entries it rules out are skipped without being stat'ed
+ *  (unless the walk has to descend into them), and if it gives the names
+ *  and the walk goes no deeper, they are looked up directly instead of read.
+ */
+struct dirhandle
+{
+    apr_dir_t* dir;
+    const char* path;
+    apr_pool_t* pool;
+    const struct query* query;
+
+    /* Whether the walk opens the subdirectories of this one. */
+    int descend;
+
+    /* Index of the next name to look up, when looking them up. */
+    int lookup;
+
+#ifdef LINUX
+    int fd;
+    char* buffer;
+    int size;
+    int offset;
+
+    /* io_uring backend only. batch is allocated on first use. */
+    struct statring* ring;
+    struct statbatch* batch;
+#endif
+};
+
+/** filenode: represents a single file entry. It contains the APR machinery to
+ *  point to a file entry (dirent), its encompassing directory (dir), and that
+ *  directory's parent (parent). The full path of the directory is the first
+ *  path_len characters of the cursor's path.
+ */
+struct filenode
+{
+    struct filenode* parent;
+    apr_finfo_t dirent;
+    struct dirhandle *dir;    
+    apr_size_t path_len;
+
+    /* Depth of the directory: 0 for the root node. */
+    int depth;
+
+    /* Inode of the directory. dirent is overwritten by its entries. */
+    apr_ino_t inode;
+
+    /* The open directory. dir points here while it is open, and is NULL
+     * otherwise (or when the node is a top-level file). */
+    struct dirhandle handle;
+
+    /* What APR allocates for the open directory (and stats in it). Cleared
+     * when the walk leaves the directory, so the walk's memory goes with its
+     * depth rather than with the number of directories it has been through. */
+    apr_pool_t* pool;
+};
+
+/** pathtext: the path column of the serial walk's rows. The rows in a
+ *  directory all share one copy of its path, which is handed to SQLite as it
+ *  is, along with release_path_text() to let go of it. It is freed once
+ *  neither the cursor nor any of SQLite's values holds on to it.
+ */
+struct pathtext
+{
+    int refs;
+    sqlite3_uint64 len;
+    char text[1];
+};
+
+/** vtab_cursor: represents a cursor used to iterate over a result set.
+ *
+ * The data structure arrangment is as follows: For any given SQL query on this
+ * virtual table, we iterate over each value in the the search_paths
+ * string. search_paths is a comma-delimited string of top-level directories to
+ * search through.
+
+ * root_path points to the current directory in search_paths that is being
+ * searched. root_node is a filenode structure containing the APR stuff we need
+ * to search root_path. root_node is potentially a linked list of subnodes --
+ * one node for each child directory we descend into. As we descend into the
+ * root_path, we add one filenode child for each directory level we descend into
+ * (see diagram below).
+ *
+ * current_node points to the current directory we are searching (bottom of
+ * filenode list).
+ *
+ * The search logic is simple: we start at the top directory (root_path) and
+ * search entry by entry. When we find an entry that is a directory, we descend
+ * into it and search it (add a child filenode, point current_node to it, and
+ * keep searching). When we have searched through the directory, we pop the
+ * filenode from the bottom of the list, point current_node to its parent, and
+ * resume searching. We keep going until we have searched through all of
+ * root_node. Then we update root_node to the next top-level directory in
+ * search_path, and start over. We repeat for all directories in search_paths.
+ *
+ * For example, say we were handling the query:
+ *
+ *               SELECT * FROM filesystem 
+ *               WHERE path match("/usr,/home,/var");
+ *
+ * Diagrammatically, the state of our cursor data structure when currently at
+ * /usr/lib/firefox/icons/mozicon16.xpm would be as follows:
+ *
+ * "/usr,/home,/var" <== search_paths
+ *    |
+ *  root_path 
+ *    |
+ *  root_node --> filenode1<--+         -->     +- /usr
+ *                            |                 |
+ *                       filenode2<--+     -->   +--+- /lib
+ *                                   |              |
+ *                              filenode3<--+  -->   +--+- /firefox
+ *                                          |           |
+ *                    current_node --> filenode4  -->   +--+- /icons
+ *                         |                               |
+ *                         +-- dirent               -->    +-- mozicon16.xpm
+ */
+
+struct vtab_cursor
+{
+    sqlite3_vtab_cursor base;
+    apr_pool_t* pool;
+    apr_pool_t* tmp_pool;
+    apr_status_t status;
+
+    /* String containing directories to search. This contains multiple values if
+     * SQL uses match operator on patch column -- SELECT * FROM fs WHERE path
+     * match '/home, /tmp'; Otherwise, this value is by default the root file
+     * system (/).
+     */
+    const char* search_paths; 
+
+    /* Points to the current path being searched in search_paths */
+    const char* root_path;
+
+    /* This filenode corresponds to the root_path*/
+    struct filenode* root_node;
+
+    /* This filenode corresponds to the child dir in root_path currently being
+     * searched.
+     */
+    struct filenode* current_node;
+
+    /** The full path of current_node's directory. It is appended to on the
+     *  way down, and cut back to the parent's path_len on the way up, so the
+     *  walk doesn't allocate a path per directory.
+     */
+    char* path;
+    apr_size_t path_size;
+
+    /* Filenodes the walk has come back up out of, kept for the next descent
+     * (linked through parent). */
+    struct filenode* spare_nodes;
+
+    /* The path column of the rows in the current directory, once asked for. */
+    struct pathtext* path_text;
+
+    /* The APR_FINFO_* fields needed for the columns the query uses. */
+    apr_int32_t wanted;
+
+    /* The table's backend (BACKEND_NATIVE, BACKEND_URING or BACKEND_APR) */
+    int backend;
+
+    /* The io_uring the io_uring backend stats files through. NULL otherwise,
+     * or if io_uring is not available, in which case files are stat'ed one at
+     * a time like the native backend does. */
+    struct statring* ring;
+
+    /* The constraints the walk checks itself. Set up by vt_filter(). */
+    struct query query;
+
+    /* Depth of the current row (see struct query). */
+    int depth;
+
+    /* Number of rows searched. */
+    int count;
+
+    /* Whether we have reached the end of the result set. */
+    int eof;
+
+    /* With a LIMIT (see vt_best_index()), the number of rows still to be
+     * returned, counting the current one. -1 without. */
+    sqlite3_int64 left;
+
+    /* The parallel walker, when the table was created with threads > 0. In
+     * that case the filenode list above is not used: rows arrive from the
+     * walker in batches and row is the index of the current row in batch.
+     */
+    struct walker* walker;
+    struct rowbatch* batch;
+    int row;
+
+    /* The sorted walk, when the rows have to come out in order of path. */
+    struct sortwalk* sorted;
+
+    /* The rows of a walk for ORDER BY ... LIMIT, once it is over. */
+    struct toprows* top;
+
+    /* The query on the snapshot, when the rows come from there instead (see
+     * snapshot_start()). They are read into batch a batch at a time. */
+    sqlite3_stmt* snapshot;
+
+    /* For fs_du, where the walker adds up what is under each directory
+     * instead of making rows (see du_scan()). NULL otherwise. */
+    struct du* du;
+
+    /* For fs_dupes, the files found to have copies (see dupes_filter()).
+     * NULL otherwise. */
+    struct dupes* dupes;
+
+    /* The HASH_* hashes the query uses, if any (see hash_column()). */
+    int hashes;
+
+    /* Whether the walk adds every row it passes to the inode index, not just
+     * those it returns: when it looks for inodes the index doesn't have (see
+     * lookup_inodes()). */
+    int index_all;
+
+    /* The generation of the inode index when the walk started, if it is to
+     * note that the index has all of its rows once it is over, -1 if not
+     * (see index_walk()). */
+    int index_generation;
+};
+
+/* Number of rows in a batch. */
+#define WALKER_BATCH_ROWS 256
+
+/* Initial size of the string storage of a batch. */
+#define WALKER_BATCH_TEXT (32 * 1024)
+
+/* The numeric columns a row keeps the values of: type (2) to dir (13). */
+#define ROW_VALUES 12
+
+/* The value of numeric column col of filerow row. */
+#define ROW_VALUE(row, col) ((row)->value[(col) - COLUMN_TYPE])
+
+/** A row. Strings are stored as offsets into the text of its batch. The
+ *  numeric columns are worked out once, when the row is made, so returning
+ *  one is just a matter of indexing value.
+ */
+struct filerow
+{
+    sqlite3_int64 value[ROW_VALUES];
+    apr_size_t name;
+    apr_size_t path;
+    int name_len;
+    int path_len;
+    int depth;
+};
+
+/* A batch of rows passed from a worker to the cursor. */
+struct rowbatch
+{
+    struct rowbatch* next;
+    int count;
+    struct filerow rows[WALKER_BATCH_ROWS];
+
+    /* Storage for the names and paths of the rows. Rows from the same directory
+     * share a single copy of the path. */
+    char* text;
+    apr_size_t text_used;
+    apr_size_t text_size;
+    apr_size_t last_path;
+    int last_path_len;
+};
+
+/* Rough sizes of walks, for the query planner. */
+#define ROWS_FILE_SYSTEM 100000000.0 /* everything under / */
+#define ROWS_TREE        1000000.0   /* a tree given with path match */
+#define ROWS_DIRECTORY   1000.0      /* a directory given with path = */
+#define ROWS_PER_NAME    10.0        /* entries with a given name in a tree */
+#define ROWS_SHALLOW     10000.0     /* a walk that stops at some depth */
+
+/* A directory (or top-level file) to search. */
+struct walker_task
+{
+    char* path;
+
+    /* Non-zero if this is one of the paths in search_paths. */
+    int root;
+
+    /* Inode of the directory the task was found in (0 for roots) */
+    apr_ino_t dir_inode;
+
+    /* Depth of the directory (0 for roots) */
+    int depth;
+
+    /* The entry for this directory as read from its parent. Not for roots. */
+    apr_finfo_t dirent;
+
+    /* For fs_du, the totals of the directory it was found in (NULL for
+     * roots). */
+    struct dunode* du_parent;
+};
+
+/* A worker thread and its deque of tasks. */
+struct walker_worker
+{
+    struct walker* w;
+    apr_thread_t* thread;
+
+    /* Per-directory scratch memory. Cleared after every directory. */
+    apr_pool_t* pool;
+
+    /* Task deque: a ring buffer. The owner pushes and pops at bottom, thieves
+     * take from top. */
+    apr_thread_mutex_t* lock;
+    struct walker_task** tasks;
+    int top;
+    int bottom;
+    int capacity;
+
+    /* The batch this worker is filling. */
+    struct rowbatch* batch;
+
+    /* This worker's io_uring (io_uring backend only). */
+    struct statring* ring;
+};
+
+struct walker
+{
+    apr_pool_t* pool;
+    apr_thread_mutex_t* lock;
+
+    /* Signalled when tasks are queued, or when there is no more work. */
+    apr_thread_cond_t* work;
+
+    /* Signalled when a batch is queued, or when the last worker exits. */
+    apr_thread_cond_t* not_empty;
+
+    /* Signalled when the cursor takes a batch off the queue. */
+    apr_thread_cond_t* not_full;
+
+    struct walker_worker* workers;
+    int nworkers;
+
+    /* The APR_FINFO_* fields to read, and how. Copied from the cursor. */
+    apr_int32_t wanted;
+    int backend;
+
+    /* The cursor's constraints. The cursor leaves them be until the walker is
+     * destroyed. */
+    const struct query* query;
+
+    /* Number of workers that have not exited yet. */
+    int running;
+
+    /* Number of workers waiting for work. */
+    int idle;
+
+    /* Number of tasks queued or in progress. The walk is over when this
+     * reaches zero. */
+    int pending;
+
+    /* Set when the cursor is closed or re-filtered before the walk is done.
+     * Workers check it without the lock, hence the atomics. */
+    volatile apr_uint32_t stop;
+
+    /* With a LIMIT, the number of rows still wanted. Once they have all been
+     * found, the workers stop as if they had been told to. */
+    int limited;
+    volatile apr_uint32_t left;
+
+    /* For fs_du, the totals the workers add up instead of making rows.
+     * Copied from the cursor. */
+    struct du* du;
+
+    /* The hashes the query uses, which the workers work out for every file
+     * they make a row for, and the cache they put them in. */
+    int hashes;
+    struct hashcache* hash_cache;
+
+    /* With readahead, the cursor the worker runs the serial walk on. */
+    vtab_cursor* serial;
+    struct query serial_query;
+
+    /* The queue of finished batches, and batches the cursor is done with. */
+    struct rowbatch* head;
+    struct rowbatch* tail;
+    int queued;
+    int max_queued;
+    struct rowbatch* free_batches;
+};
+
+/* What a file's hashes are good for: if any of it changes, so may they. */
+struct hashkey
+{
+    sqlite3_int64 dev;
+    sqlite3_int64 inode;
+    sqlite3_int64 mtime;
+    sqlite3_int64 size;
+};
+
+/* A file's hashes, in hex. hashes says which have been worked out. */
+struct filehash
+{
+    struct hashkey key;
+    int hashes;
+    char xxh3[17];
+    char sha256[65];
+};
+
+/* Virtual table functions. */
+vtab* vt_new(sqlite3 *db);
+int vt_destructor(sqlite3_vtab *p_svt);
+int parse_arguments( vtab* p_vt, int argc, const char *const*argv,
+                     char **pzErr );
+int vt_disconnect(sqlite3_vtab *pVtab);
+int vt_destroy(sqlite3_vtab *p_vt);
+int vt_open(sqlite3_vtab *p_svt, sqlite3_vtab_cursor **pp_cursor);
+int vt_close(sqlite3_vtab_cursor *cur);
+int vt_eof(sqlite3_vtab_cursor *cur);
+int has_constraint(sqlite3_index_info *p_info, int col, int op);
+void query_reset(struct query* q);
+
+/* Directory access functions. */
+apr_status_t open_directory( struct dirhandle* h, 
+                             const struct dirhandle* parent,
+                             const char* path, const char* name,
+                             int backend, struct statring* ring,
+                             const struct query* q, int depth,
+                             apr_pool_t* pool );
+apr_status_t read_directory( struct dirhandle* h, apr_finfo_t* finfo,
+                             apr_int32_t wanted );
+void close_directory(struct dirhandle* h);
+
+/* Parallel walker functions. */
+int walker_start(vtab_cursor *p_cur);
+int walker_next(vtab_cursor *p_cur);
+void walker_destroy(vtab_cursor *p_cur);
+int walker_stopped(struct walker* w);
+int walker_push_task(struct walker_worker* self, struct walker_task* task);
+struct walker_task* walker_new_task( const char* path, int path_len,
+                                     const apr_finfo_t* entry,
+                                     apr_ino_t dir_inode, int depth );
+
+/* Content hash functions. */
+struct hashcache* hash_cache(vtab* p_vt);
+char* hash_path( const char* name, int name_len, 
+                 const char* path, int path_len );
+int hash_file( struct hashcache* c, const char* path, 
+               const struct hashkey* key, int hashes, 
+               struct filehash* out, apr_pool_t* pool );
+
+/* Disk usage functions, in du.c. */
+void du_scan(struct walker_worker* self, struct walker_task* task);
+int du_create( sqlite3 *db, int argc, const char *const*argv,
+               sqlite3_vtab **pp_vt, char **pzErr, const char* ddl );
+
+#endif
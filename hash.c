@@ -0,0 +1,524 @@
+#include <stddef.h>
+#include <string.h>
+
+#include <sqlite3.h>
+
+#include "hash.h"
+
+/* XXH3 (64-bit, seed 0, default secret), as in xxHash 0.8. */
+
+#define XXH_PRIME32_1 0x9E3779B1U
+#define XXH_PRIME32_2 0x85EBCA77U
+#define XXH_PRIME32_3 0xC2B2AE3DU
+#define XXH_PRIME64_1 0x9E3779B185EBCA87ULL
+#define XXH_PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME64_3 0x165667B19E3779F9ULL
+#define XXH_PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME64_5 0x27D4EB2F165667C5ULL
+#define XXH_PRIME_MX1 0x165667919E3779F9ULL
+#define XXH_PRIME_MX2 0x9FB21C651E98DF25ULL
+
+#define XXH_STRIPE      64
+#define XXH_SECRET_SIZE 192
+
+/* Stripes per block: the secret is stepped through 8 bytes per stripe. */
+#define XXH_BLOCK_STRIPES ((XXH_SECRET_SIZE - XXH_STRIPE) / 8)
+
+static const unsigned char xxh3_secret[XXH_SECRET_SIZE] = 
+{
+    0xb8, 0xfe, 0x6c, 0x39, 0x23, 0xa4, 0x4b, 0xbe, 0x7c, 0x01, 0x81, 0x2c, 
+    0xf7, 0x21, 0xad, 0x1c, 0xde, 0xd4, 0x6d, 0xe9, 0x83, 0x90, 0x97, 0xdb, 
+    0x72, 0x40, 0xa4, 0xa4, 0xb7, 0xb3, 0x67, 0x1f, 0xcb, 0x79, 0xe6, 0x4e, 
+    0xcc, 0xc0, 0xe5, 0x78, 0x82, 0x5a, 0xd0, 0x7d, 0xcc, 0xff, 0x72, 0x21,
+    0xb8, 0x08, 0x46, 0x74, 0xf7, 0x43, 0x24, 0x8e, 0xe0, 0x35, 0x90, 0xe6, 
+    0x81, 0x3a, 0x26, 0x4c, 0x3c, 0x28, 0x52, 0xbb, 0x91, 0xc3, 0x00, 0xcb, 
+    0x88, 0xd0, 0x65, 0x8b, 0x1b, 0x53, 0x2e, 0xa3, 0x71, 0x64, 0x48, 0x97, 
+    0xa2, 0x0d, 0xf9, 0x4e, 0x38, 0x19, 0xef, 0x46, 0xa9, 0xde, 0xac, 0xd8,
+    0xa8, 0xfa, 0x76, 0x3f, 0xe3, 0x9c, 0x34, 0x3f, 0xf9, 0xdc, 0xbb, 0xc7, 
+    0xc7, 0x0b, 0x4f, 0x1d, 0x8a, 0x51, 0xe0, 0x4b, 0xcd, 0xb4, 0x59, 0x31, 
+    0xc8, 0x9f, 0x7e, 0xc9, 0xd9, 0x78, 0x73, 0x64, 0xea, 0xc5, 0xac, 0x83, 
+    0x34, 0xd3, 0xeb, 0xc3, 0xc5, 0x81, 0xa0, 0xff, 0xfa, 0x13, 0x63, 0xeb,
+    0x17, 0x0d, 0xdd, 0x51, 0xb7, 0xf0, 0xda, 0x49, 0xd3, 0x16, 0x55, 0x26, 
+    0x29, 0xd4, 0x68, 0x9e, 0x2b, 0x16, 0xbe, 0x58, 0x7d, 0x47, 0xa1, 0xfc, 
+    0x8f, 0xf8, 0xb8, 0xd1, 0x7a, 0xd0, 0x31, 0xce, 0x45, 0xcb, 0x3a, 0x8f, 
+    0x95, 0x16, 0x04, 0x28, 0xaf, 0xd7, 0xfb, 0xca, 0xbb, 0x4b, 0x40, 0x7e
+};
+
+static sqlite3_uint64 xxh_read64(const unsigned char* p)
+{
+    return (sqlite3_uint64)p[0]         | ((sqlite3_uint64)p[1] << 8) 
+         | ((sqlite3_uint64)p[2] << 16) | ((sqlite3_uint64)p[3] << 24)
+         | ((sqlite3_uint64)p[4] << 32) | ((sqlite3_uint64)p[5] << 40)
+         | ((sqlite3_uint64)p[6] << 48) | ((sqlite3_uint64)p[7] << 56);
+}
+
+static unsigned int xxh_read32(const unsigned char* p)
+{
+    return (unsigned int)p[0]         | ((unsigned int)p[1] << 8) 
+         | ((unsigned int)p[2] << 16) | ((unsigned int)p[3] << 24);
+}
+
+static sqlite3_uint64 xxh_rotl64(sqlite3_uint64 x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static sqlite3_uint64 xxh_swap64(sqlite3_uint64 x)
+{
+    x = ((x << 8) & 0xff00ff00ff00ff00ULL) | ((x >> 8) & 0x00ff00ff00ff00ffULL);
+    x = ((x << 16) & 0xffff0000ffff0000ULL) | ((x >> 16) & 0x0000ffff0000ffffULL);
+
+    return (x << 32) | (x >> 32);
+}
+
+/* The 128-bit product of a and b, its halves xor'ed together. */
+static sqlite3_uint64 xxh_mul128_fold64(sqlite3_uint64 a, sqlite3_uint64 b)
+{
+#if defined(__SIZEOF_INT128__)
+    unsigned __int128 p = (unsigned __int128)a * b;
+
+    return (sqlite3_uint64)p ^ (sqlite3_uint64)(p >> 64);
+#else
+    sqlite3_uint64 lo_lo = (a & 0xffffffff) * (b & 0xffffffff);
+    sqlite3_uint64 hi_lo = (a >> 32) * (b & 0xffffffff);
+    sqlite3_uint64 lo_hi = (a & 0xffffffff) * (b >> 32);
+    sqlite3_uint64 hi_hi = (a >> 32) * (b >> 32);
+    sqlite3_uint64 cross = (lo_lo >> 32) + (hi_lo & 0xffffffff) + lo_hi;
+    sqlite3_uint64 upper = (hi_lo >> 32) + (cross >> 32) + hi_hi;
+    sqlite3_uint64 lower = (cross << 32) | (lo_lo & 0xffffffff);
+
+    return lower ^ upper;
+#endif
+}
+
+static sqlite3_uint64 xxh64_avalanche(sqlite3_uint64 h)
+{
+    h ^= h >> 33;
+    h *= XXH_PRIME64_2;
+    h ^= h >> 29;
+    h *= XXH_PRIME64_3;
+
+    return h ^ (h >> 32);
+}
+
+static sqlite3_uint64 xxh3_avalanche(sqlite3_uint64 h)
+{
+    h ^= h >> 37;
+    h *= XXH_PRIME_MX1;
+
+    return h ^ (h >> 32);
+}
+
+static sqlite3_uint64 xxh3_mix16(const unsigned char* p, const unsigned char* secret)
+{
+    return xxh_mul128_fold64( xxh_read64(p) ^ xxh_read64(secret), 
+                              xxh_read64(p + 8) ^ xxh_read64(secret + 8) );
+}
+
+/* The hash of 240 bytes or less, all at once. */
+static sqlite3_uint64 xxh3_short(const unsigned char* p, size_t len)
+{
+    const unsigned char* s = xxh3_secret;
+    sqlite3_uint64 acc;
+    size_t i;
+
+    if (len == 0)
+    {
+        return xxh64_avalanche(xxh_read64(s + 56) ^ xxh_read64(s + 64));
+    }
+
+    if (len <= 3)
+    {
+        unsigned int combined = ((unsigned int)p[0] << 16) 
+                              | ((unsigned int)p[len >> 1] << 24)
+                              | (unsigned int)p[len - 1] 
+                              | ((unsigned int)len << 8);
+
+        return xxh64_avalanche( (sqlite3_uint64)combined 
+                                ^ (xxh_read32(s) ^ xxh_read32(s + 4)) );
+    }
+
+    if (len <= 8)
+    {
+        sqlite3_uint64 keyed = ( xxh_read32(p + len - 4) 
+                                 + ((sqlite3_uint64)xxh_read32(p) << 32) )
+                               ^ (xxh_read64(s + 8) ^ xxh_read64(s + 16));
+
+        keyed ^= xxh_rotl64(keyed, 49) ^ xxh_rotl64(keyed, 24);
+        keyed *= XXH_PRIME_MX2;
+        keyed ^= (keyed >> 35) + len;
+        keyed *= XXH_PRIME_MX2;
+
+        return keyed ^ (keyed >> 28);
+    }
+
+    if (len <= 16)
+    {
+        sqlite3_uint64 lo = xxh_read64(p) ^ (xxh_read64(s + 24) ^ xxh_read64(s + 32));
+        sqlite3_uint64 hi = xxh_read64(p + len - 8) 
+                            ^ (xxh_read64(s + 40) ^ xxh_read64(s + 48));
+
+        return xxh3_avalanche( len + xxh_swap64(lo) + hi 
+                               + xxh_mul128_fold64(lo, hi) );
+    }
+
+    acc = len * XXH_PRIME64_1;
+
+    if (len <= 128)
+    {
+        if (len > 32)
+        {
+            if (len > 64)
+            {
+                if (len > 96)
+                {
+                    acc += xxh3_mix16(p + 48, s + 96);
+                    acc += xxh3_mix16(p + len - 64, s + 112);
+                }
+
+                acc += xxh3_mix16(p + 32, s + 64);
+                acc += xxh3_mix16(p + len - 48, s + 80);
+            }
+
+            acc += xxh3_mix16(p + 16, s + 32);
+            acc += xxh3_mix16(p + len - 32, s + 48);
+        }
+
+        acc += xxh3_mix16(p, s);
+        acc += xxh3_mix16(p + len - 16, s + 16);
+
+        return xxh3_avalanche(acc);
+    }
+
+    for (i = 0; i < 8; i++)
+    {
+        acc += xxh3_mix16(p + 16 * i, s + 16 * i);
+    }
+
+    acc = xxh3_avalanche(acc);
+
+    for (i = 8; i < len / 16; i++)
+    {
+        acc += xxh3_mix16(p + 16 * i, s + 16 * (i - 8) + 3);
+    }
+
+    acc += xxh3_mix16(p + len - 16, s + 136 - 17);
+
+    return xxh3_avalanche(acc);
+}
+
+/** Mix n stripes of p into the accumulators. The loop is plain enough for
+ *  the compiler to vectorize: eight independent lanes, no branches.
+ */
+static void xxh3_accumulate( sqlite3_uint64* acc, const unsigned char* p,
+                             const unsigned char* secret, int n )
+{
+    int i;
+    int j;
+
+    for (j = 0; j < n; j++, p += XXH_STRIPE, secret += 8)
+    {
+        for (i = 0; i < 8; i++)
+        {
+            sqlite3_uint64 value = xxh_read64(p + 8 * i);
+            sqlite3_uint64 key   = value ^ xxh_read64(secret + 8 * i);
+
+            acc[i ^ 1] += value;
+            acc[i]     += (key & 0xffffffff) * (key >> 32);
+        }
+    }
+}
+
+static void xxh3_scramble(sqlite3_uint64* acc)
+{
+    const unsigned char* secret = xxh3_secret + XXH_SECRET_SIZE - XXH_STRIPE;
+    int i;
+
+    for (i = 0; i < 8; i++)
+    {
+        sqlite3_uint64 a = acc[i];
+
+        a ^= a >> 47;
+        a ^= xxh_read64(secret + 8 * i);
+        acc[i] = a * XXH_PRIME32_1;
+    }
+}
+
+/* Mix n stripes into h's accumulators, scrambling them at the end of each
+ * block. */
+static void xxh3_stripes(struct xxh3* h, const unsigned char* p, int n)
+{
+    if (XXH_BLOCK_STRIPES - h->stripes <= n)
+    {
+        int rest = XXH_BLOCK_STRIPES - h->stripes;
+
+        xxh3_accumulate(h->acc, p, xxh3_secret + h->stripes * 8, rest);
+        xxh3_scramble(h->acc);
+        xxh3_accumulate(h->acc, p + rest * XXH_STRIPE, xxh3_secret, n - rest);
+
+        h->stripes = n - rest;
+    }
+    else
+    {
+        xxh3_accumulate(h->acc, p, xxh3_secret + h->stripes * 8, n);
+
+        h->stripes += n;
+    }
+}
+
+void xxh3_init(struct xxh3* h)
+{
+    h->acc[0]   = XXH_PRIME32_3;
+    h->acc[1]   = XXH_PRIME64_1;
+    h->acc[2]   = XXH_PRIME64_2;
+    h->acc[3]   = XXH_PRIME64_3;
+    h->acc[4]   = XXH_PRIME64_4;
+    h->acc[5]   = XXH_PRIME32_2;
+    h->acc[6]   = XXH_PRIME64_5;
+    h->acc[7]   = XXH_PRIME32_1;
+    h->buffered = 0;
+    h->stripes  = 0;
+    h->length   = 0;
+}
+
+/** Add len bytes to the hash. Input is only mixed in once more is known to
+ *  follow it: the last stripe is mixed differently.
+ */
+void xxh3_update(struct xxh3* h, const unsigned char* p, size_t len)
+{
+    h->length += len;
+
+    if (h->buffered + len <= XXH_BUFFER)
+    {
+        memcpy(h->buffer + h->buffered, p, len);
+        h->buffered += (int)len;
+
+        return;
+    }
+
+    if (h->buffered > 0)
+    {
+        int fill = XXH_BUFFER - h->buffered;
+
+        memcpy(h->buffer + h->buffered, p, fill);
+        p   += fill;
+        len -= fill;
+
+        xxh3_stripes(h, h->buffer, XXH_BUFFER / XXH_STRIPE);
+        h->buffered = 0;
+    }
+
+    if (len > XXH_BUFFER)
+    {
+        do
+        {
+            xxh3_stripes(h, p, XXH_BUFFER / XXH_STRIPE);
+            p   += XXH_BUFFER;
+            len -= XXH_BUFFER;
+        }
+        while (len > XXH_BUFFER);
+
+        /* The last stripe may have to reach back into this. */
+        memcpy(h->buffer + XXH_BUFFER - XXH_STRIPE, p - XXH_STRIPE, XXH_STRIPE);
+    }
+
+    memcpy(h->buffer, p, len);
+    h->buffered = (int)len;
+}
+
+sqlite3_uint64 xxh3_digest(const struct xxh3* h)
+{
+    const unsigned char* s = xxh3_secret;
+    struct xxh3 last;
+    sqlite3_uint64 result;
+    int i;
+
+    if (h->length <= 240)
+    {
+        return xxh3_short(h->buffer, (size_t)h->length);
+    }
+
+    /* Finish on a copy, so h could go on. */
+    last = *h;
+
+    if (last.buffered >= XXH_STRIPE)
+    {
+        xxh3_stripes(&last, last.buffer, (last.buffered - 1) / XXH_STRIPE);
+        xxh3_accumulate( last.acc, last.buffer + last.buffered - XXH_STRIPE, 
+                         s + XXH_SECRET_SIZE - XXH_STRIPE - 7, 1 );
+    }
+    else
+    {
+        unsigned char stripe[XXH_STRIPE];
+        int before = XXH_STRIPE - last.buffered;
+
+        memcpy(stripe, last.buffer + XXH_BUFFER - before, before);
+        memcpy(stripe + before, last.buffer, last.buffered);
+        xxh3_accumulate(last.acc, stripe, s + XXH_SECRET_SIZE - XXH_STRIPE - 7, 1);
+    }
+
+    result = h->length * XXH_PRIME64_1;
+
+    for (i = 0; i < 4; i++)
+    {
+        result += xxh_mul128_fold64( last.acc[2 * i] ^ xxh_read64(s + 11 + 16 * i),
+                                     last.acc[2 * i + 1] ^ xxh_read64(s + 19 + 16 * i) );
+    }
+
+    return xxh3_avalanche(result);
+}
+
+/* SHA-256 (FIPS 180-4). */
+
+static const unsigned int sha256_k[64] = 
+{
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 
+    0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786, 
+    0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 
+    0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b, 
+    0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 
+    0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define SHA_ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+void sha256_init(struct sha256* h)
+{
+    h->state[0] = 0x6a09e667;
+    h->state[1] = 0xbb67ae85;
+    h->state[2] = 0x3c6ef372;
+    h->state[3] = 0xa54ff53a;
+    h->state[4] = 0x510e527f;
+    h->state[5] = 0x9b05688c;
+    h->state[6] = 0x1f83d9ab;
+    h->state[7] = 0x5be0cd19;
+    h->used     = 0;
+    h->length   = 0;
+}
+
+/* Mix a 64-byte block into the state. */
+static void sha256_block(struct sha256* h, const unsigned char* p)
+{
+    unsigned int w[64];
+    unsigned int a, b, c, d, e, f, g, x;
+    int i;
+
+    for (i = 0; i < 16; i++, p += 4)
+    {
+        w[i] = ((unsigned int)p[0] << 24) | ((unsigned int)p[1] << 16) 
+             | ((unsigned int)p[2] << 8) | (unsigned int)p[3];
+    }
+
+    for (i = 16; i < 64; i++)
+    {
+        unsigned int s0 = SHA_ROTR(w[i - 15], 7) ^ SHA_ROTR(w[i - 15], 18) 
+                          ^ (w[i - 15] >> 3);
+        unsigned int s1 = SHA_ROTR(w[i - 2], 17) ^ SHA_ROTR(w[i - 2], 19) 
+                          ^ (w[i - 2] >> 10);
+
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    a = h->state[0];
+    b = h->state[1];
+    c = h->state[2];
+    d = h->state[3];
+    e = h->state[4];
+    f = h->state[5];
+    g = h->state[6];
+    x = h->state[7];
+
+    for (i = 0; i < 64; i++)
+    {
+        unsigned int t1 = x + (SHA_ROTR(e, 6) ^ SHA_ROTR(e, 11) ^ SHA_ROTR(e, 25))
+                          + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+        unsigned int t2 = (SHA_ROTR(a, 2) ^ SHA_ROTR(a, 13) ^ SHA_ROTR(a, 22))
+                          + ((a & b) ^ (a & c) ^ (b & c));
+
+        x = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+
+    h->state[0] += a;
+    h->state[1] += b;
+    h->state[2] += c;
+    h->state[3] += d;
+    h->state[4] += e;
+    h->state[5] += f;
+    h->state[6] += g;
+    h->state[7] += x;
+}
+
+void sha256_update(struct sha256* h, const unsigned char* p, size_t len)
+{
+    h->length += len;
+
+    if (h->used > 0)
+    {
+        size_t fill = 64 - h->used;
+
+        if (len < fill)
+        {
+            memcpy(h->block + h->used, p, len);
+            h->used += (int)len;
+
+            return;
+        }
+
+        memcpy(h->block + h->used, p, fill);
+        sha256_block(h, h->block);
+
+        p      += fill;
+        len    -= fill;
+        h->used = 0;
+    }
+
+    for (; len >= 64; p += 64, len -= 64)
+    {
+        sha256_block(h, p);
+    }
+
+    memcpy(h->block, p, len);
+    h->used = (int)len;
+}
+
+/* Finish the hash: 32 bytes go in digest. */
+void sha256_digest(struct sha256* h, unsigned char* digest)
+{
+    sqlite3_uint64 bits = h->length * 8;
+    int i;
+
+    h->block[h->used++] = 0x80;
+
+    if (h->used > 56)
+    {
+        memset(h->block + h->used, 0, 64 - h->used);
+        sha256_block(h, h->block);
+        h->used = 0;
+    }
+
+    memset(h->block + h->used, 0, 56 - h->used);
+
+    for (i = 0; i < 8; i++)
+    {
+        h->block[63 - i] = (unsigned char)(bits >> (8 * i));
+    }
+
+    sha256_block(h, h->block);
+
+    for (i = 0; i < 32; i++)
+    {
+        digest[i] = (unsigned char)(h->state[i / 4] >> (24 - 8 * (i % 4)));
+    }
+}
@@ -0,0 +1,37 @@
+#ifndef SQLITE_VTABLE_HASH_DECL
+#define SQLITE_VTABLE_HASH_DECL
+
+/* XXH3 (64-bit, seed 0, default secret), as in xxHash 0.8. */
+
+#define XXH_BUFFER 256
+
+/* A streaming XXH3 hash. Input is kept in buffer until there is more than
+ * fits, so that short input can be hashed as a whole at the end. */
+struct xxh3
+{
+    sqlite3_uint64 acc[8];
+    unsigned char buffer[XXH_BUFFER];
+    int buffered;
+    int stripes;
+    sqlite3_uint64 length;
+};
+
+void xxh3_init(struct xxh3* h);
+void xxh3_update(struct xxh3* h, const unsigned char* p, size_t len);
+sqlite3_uint64 xxh3_digest(const struct xxh3* h);
+
+/* SHA-256 (FIPS 180-4). */
+
+struct sha256
+{
+    unsigned int state[8];
+    unsigned char block[64];
+    int used;
+    sqlite3_uint64 length;
+};
+
+void sha256_init(struct sha256* h);
+void sha256_update(struct sha256* h, const unsigned char* p, size_t len);
+void sha256_digest(struct sha256* h, unsigned char* digest);
+
+#endif